@@ -8,7 +8,10 @@
 #ifndef INC_APP_HPP_
 #define INC_APP_HPP_
 
+#include "can_port.h"
 #include "doser_controller.hpp"
+#include "histogram.h"
+#include "protocol.h"
 #include <cstring>
 #include <array>
 #include <cmath>
@@ -20,25 +23,62 @@ using Doser293KCZL = Doser<60>;
 
 constexpr uint32_t doserCount = 4;
 
+// Enumeration timing. The module listens this long for the master's answer
+// before repeating NewModule, and waits this long for the next module to
+// boot and announce itself before declaring itself the last node. Repeats
+// are harmless since the master recognizes them by attempt and uid. The
+// window stays at the original 500 ms: it passes once per enumeration, at the
+// end of the chain, and a module that boots late would otherwise be cut off
+// it. A module gives up after initializeTimeout, the 10000 listens of 500 ms
+// it always had.
+constexpr ez::Clock::duration initializeListen = 20ms;
+constexpr ez::Clock::duration nextNodeWindow = 500ms;
+constexpr ez::Clock::duration initializeTimeout = 10000 * 500ms;
+
+// Telemetry period until Sensei sets one. A current change smaller than the
+// deadband doesn't count as a change.
+constexpr ez::Clock::duration defaultTelemetryPeriod = 1s;
+constexpr uint16_t currentDeadband_mA = 20;
+
 class App
 {
 public:
-    App(CAN_HandleTypeDef& hcan, DRV8874& drv1, DRV8874& drv2);
+    App(ez::CanPort& can, DRV8874& drv1, DRV8874& drv2);
     void run();
 private:
-    void filterAll();
     bool initialize();
     bool nextNodeExists();
-    void handleRPC(CAN_RxHeaderTypeDef& header, uint8_t data[8]);
-    void finishDose(uint32_t doserID);
+    void handleRPC(const ez::RxFrame& frame);
+    void setFlowRates(const uint8_t data[8]);
+    void transmitLatencyHistogram(uint8_t seq);
+    void transmitAnnounce();
+    void transmitBitrateAck();
+    void transmit(uint32_t identifier, const void* data, uint8_t dlc);
+    void startDose(const can::protocol::DoseVolumeCommand& command, uint8_t seq);
+    void finishDose(uint32_t idx, can::protocol::DoseStatus status);
+    void transmitDoseResponse(uint16_t doserID, uint8_t seq, can::protocol::DoseStatus status, uint32_t delivered_uL);
+    void transmitTelemetry(ez::Clock::time_point now);
     void transmitLastNodeCommand();
 private:
-    CAN_HandleTypeDef& hcan;
+    ez::CanPort& can;
     uint32_t moduleID{}; // ID of the first doser. secondDoserID = firstDoserID + 1.
+    uint8_t address{}; // Position in the chain, used by module addressed RPCs
+    uint16_t uid;
+    std::optional<ez::Clock::time_point> announceAt;
+    uint8_t announceSeq{};
+    std::optional<ez::Clock::time_point> bitrateAckAt;
+    uint8_t bitrateAckSeq{};
+    std::optional<ez::Clock::time_point> bitrateSwitchAt; // Committed switch
+    uint32_t nextBitrate{};
     std::array<Doser293KCZL, doserCount> dosers;
+    std::array<uint8_t, doserCount> doseSeq{}; // Sequence number of each running dose
+    ez::Histogram<can::protocol::latencyBuckets> latency;
+    ez::Clock::duration telemetryPeriod{defaultTelemetryPeriod};
+    ez::Clock::time_point nextTelemetry;
+    std::array<std::optional<can::protocol::TelemetryCommand>, doserCount> lastTelemetry;
 };
 
-void app_main(CAN_HandleTypeDef& hcan);
+void app_main(CAN_HandleTypeDef& hcan, ADC_HandleTypeDef& hadc);
 
 
 #endif /* INC_APP_HPP_ */
@@ -0,0 +1,89 @@
+#ifndef NUTRIDOSERSOFTWARE_CAN_PORT_H
+#define NUTRIDOSERSOFTWARE_CAN_PORT_H
+
+#include "clock.h"
+#include "ring_buffer.h"
+#include <cstdint>
+
+
+namespace ez
+{
+
+    struct CanFrame
+    {
+        uint32_t id;
+        bool extended;
+        uint8_t dlc;
+        uint8_t data[8];
+    };
+
+    // Frame timestamped on arrival
+    struct RxFrame
+    {
+        CanFrame frame;
+        Clock::time_point receivedAt;
+    };
+
+    // CAN controller as seen by the App. The protocol code only deals in
+    // frames, so it doesn't depend on the controller or its driver.
+    class CanPort
+    {
+    public:
+        virtual ~CanPort() = default;
+
+        // Accepts every frame, used during enumeration
+        virtual void acceptAll() = 0;
+        // Accepts extended frames addressed to the module or broadcast
+        virtual void acceptAddressed(uint8_t address) = 0;
+        // Waits for the controller to take the frame, false if it refused it
+        virtual bool transmit(const CanFrame& frame) = 0;
+        // Takes the next received frame, false if none is queued
+        virtual bool receive(RxFrame& frame) = 0;
+        // Sleeps until something may have happened, returns right away if a
+        // frame is queued
+        virtual void waitForFrame() = 0;
+
+        virtual bool supports(uint32_t bitrate) const = 0;
+        // Restarts the controller at the bitrate, keeping the filters
+        virtual bool setBitrate(uint32_t bitrate) = 0;
+        virtual uint32_t bitrate() const = 0;
+        // Error passive or bus off
+        virtual bool errorPassive() const = 0;
+    };
+
+    // bxCAN through the STM32 HAL. Frames are moved from the hardware FIFOs
+    // to a queue by the RX interrupts, so only one instance may exist.
+    class BxCanPort : public CanPort
+    {
+    public:
+        explicit BxCanPort(CAN_HandleTypeDef& hcan);
+        ~BxCanPort() override;
+
+        void acceptAll() override;
+        void acceptAddressed(uint8_t address) override;
+        bool transmit(const CanFrame& frame) override;
+        bool receive(RxFrame& frame) override;
+        void waitForFrame() override;
+        bool supports(uint32_t bitrate) const override;
+        bool setBitrate(uint32_t bitrate) override;
+        uint32_t bitrate() const override { return currentBitrate; }
+        bool errorPassive() const override;
+
+        // Called from the RX interrupts
+        void drain(uint32_t fifo);
+
+        uint32_t dropped() const { return rxDropped; }
+
+    private:
+        void filterExtended(uint32_t bank, uint32_t id, uint32_t mask, uint32_t fifo);
+
+        CAN_HandleTypeDef& hcan;
+        uint32_t currentBitrate;
+        RingBuffer<RxFrame, 16> rxQueue;
+        volatile uint32_t rxDropped{0};
+    };
+
+}
+
+
+#endif //NUTRIDOSERSOFTWARE_CAN_PORT_H
@@ -11,6 +11,7 @@
 #include "stm32f1xx_hal.h"
 #include "clock.h"
 #include <functional>
+#include <optional>
 #include <utility>
 
 
@@ -44,12 +45,33 @@ public:
     {
         HAL_GPIO_TogglePin(GPIOx, pinNumber);
     }
+
+    bool read() const
+    {
+        return HAL_GPIO_ReadPin(GPIOx, pinNumber) == GPIO_PIN_SET;
+    }
 private:
 	GPIO_TypeDef* GPIOx;
 	uint16_t pinNumber;
 };
 
 
+class ADCPin
+{
+public:
+	ADCPin(ADC_HandleTypeDef& hadc, uint32_t channel)
+	: hadc{&hadc}, channel{channel}
+	{}
+
+	// Single blocking conversion, takes a few microseconds
+	uint32_t read() const;
+
+private:
+	ADC_HandleTypeDef* hadc;
+	uint32_t channel;
+};
+
+
 class PWMPin
 {
 public:
@@ -89,7 +111,7 @@ private:
 class DRV8874
 {
 public:
-	DRV8874(PWMPin in1, PWMPin in2, GPIOPin nSleep, GPIOPin nFault);
+	DRV8874(PWMPin in1, PWMPin in2, GPIOPin nSleep, GPIOPin nFault, ADCPin ipropi);
 
 	void out1PWM(uint32_t value);
 	void out2PWM(uint32_t value);
@@ -97,12 +119,14 @@ public:
 	void wakeup();
 	bool isAsleep() const;
 	uint32_t readIPropi() const;
+	uint32_t readCurrent_mA() const;
 	bool isFaulted() const;
 private:
 	PWMPin in1;
 	PWMPin in2;
 	GPIOPin nSleep;
 	GPIOPin nFault;
+	ADCPin ipropi;
 };
 
 
@@ -127,15 +151,64 @@ public:
     {
     	const uint32_t cntValue = static_cast<uint32_t>(0xFFFF * (1.0f - static_cast<float>(flowRate) / maxFlowRate));
         (driver.*(pwmFn))(cntValue);
+        if (!runningSince)
+        {
+        	runningSince = ez::Clock::now();
+        }
     }
 
     void stop()
     {
     	(driver.*(pwmFn))(0xFFFF);
+    	if (runningSince)
+    	{
+    		runTime += ez::Clock::now() - *runningSince;
+    		runningSince.reset();
+    	}
+    }
+
+    bool isRunning() const { return runningSince.has_value(); }
+
+    // Total time the doser has been running
+    ez::Clock::duration runtime(ez::Clock::time_point now) const
+    {
+    	return runningSince ? runTime + (now - *runningSince) : runTime;
+    }
+
+    const DRV8874& getDriver() const { return driver; }
+
+    // Runs the doser for as long as it takes to deliver volume_uL at flowRate.
+    // The owner polls doseDue() and ends the dose with finishDose().
+    void dose(FlowRate flowRate, uint32_t volume_uL, ez::Clock::time_point now)
+    {
+    	run(flowRate);
+    	doseFlowRate = flowRate;
+    	doseStart = now;
+    	doseEnd = now + ez::Clock::duration(static_cast<uint64_t>(volume_uL) * 60'000 / flowRate);
+    }
+
+    bool isDosing() const { return doseEnd.has_value(); }
+
+    bool doseDue(ez::Clock::time_point now) const
+    {
+    	return doseEnd && now >= *doseEnd;
+    }
+
+    // Stops the dose and returns the volume delivered so far in uL
+    uint32_t finishDose(ez::Clock::time_point now)
+    {
+    	stop();
+    	doseEnd.reset();
+    	return static_cast<uint32_t>(static_cast<uint64_t>((now - doseStart).count()) * doseFlowRate / 60'000);
     }
 private:
     DRV8874& driver;
     PwmFn pwmFn;
+    std::optional<ez::Clock::time_point> runningSince;
+    ez::Clock::duration runTime{0};
+    FlowRate doseFlowRate{};
+    ez::Clock::time_point doseStart;
+    std::optional<ez::Clock::time_point> doseEnd;
 };
 
 
@@ -0,0 +1,44 @@
+#ifndef NUTRIDOSERSOFTWARE_HISTOGRAM_H
+#define NUTRIDOSERSOFTWARE_HISTOGRAM_H
+
+#include "clock.h"
+#include <array>
+
+
+namespace ez
+{
+
+    // Log2 bucketed histogram of durations. Bucket 0 counts everything below
+    // 2us, bucket i counts [2^i, 2^(i+1)) us and the last bucket everything
+    // longer.
+    template<uint32_t Buckets>
+    class Histogram
+    {
+    public:
+        static constexpr uint32_t bucketCount = Buckets;
+
+        void add(Clock::duration duration)
+        {
+            uint32_t us = duration.count() > 0 ? static_cast<uint32_t>(duration.count()) : 0;
+            uint32_t bucket = 0;
+            while (us > 1 && bucket < Buckets - 1)
+            {
+                us >>= 1;
+                ++bucket;
+            }
+            ++mCounts[bucket];
+        }
+
+        uint32_t count(uint32_t bucket) const
+        {
+            return mCounts[bucket];
+        }
+
+    private:
+        std::array<uint32_t, Buckets> mCounts{};
+    };
+
+}
+
+
+#endif //NUTRIDOSERSOFTWARE_HISTOGRAM_H
@@ -11,10 +11,18 @@ namespace can::protocol
 {
     enum RPC : uint8_t
     {
-    	Restart = 0x03,
+        Restart = 0x03,
         NewModule = 0x05,
         SetFlowRate = 0x07,
-		LastNode = 0x09
+        LastNode = 0x09,
+        SetModuleFlowRates = 0x0B,
+        SetAllFlowRates = 0x0D,
+        ReadLatency = 0x0F,
+        Announce = 0x11,
+        DoseVolume = 0x13,
+        Telemetry = 0x15,
+        SetTelemetryPeriod = 0x17,
+        SetBitrate = 0x19
     };
 
     struct RestartCommand {};
@@ -22,14 +30,21 @@ namespace can::protocol
     struct NewModuleCommand
     {
         uint8_t numDosers;
+        uint8_t attempt; // 0 on the first NewModule after boot, counts repeats up
         uint16_t maxFlowRate; // ml/min
+        uint16_t uid; // Hash of the MCU unique ID, tells a retry from the next module
     };
 
     struct NewModuleResponse
     {
         uint32_t moduleID;
+        uint8_t address; // Position of the module in the chain
+        uint16_t uid; // Echoes the module's uid so a late answer to a retry can't
+                      // be taken by the next module in the chain
     };
 
+    static_assert(sizeof(NewModuleResponse) == 8);
+
     struct LastNodeCommand {};
 
     struct SetFlowRateCommand
@@ -38,7 +53,166 @@ namespace can::protocol
         uint16_t flowRate; // ml/min
     };
 
+    // Sets every channel of one module (SetModuleFlowRates) or of all modules
+    // (SetAllFlowRates) in a single frame.
+    constexpr uint8_t moduleChannels = 4;
+
+    struct SetModuleFlowRatesCommand
+    {
+        uint16_t flowRates[moduleChannels]; // ml/min
+    };
+
+    static_assert(sizeof(SetModuleFlowRatesCommand) == 8);
+
+    // Channel value that leaves the doser as it is, used for dosers that run
+    // a module timed dose
+    constexpr uint16_t keepFlowRate = 0xFFFF;
+
+    // Broadcast to an already enumerated chain. Every module answers with
+    // AnnounceResponse in its own slot, address * slot_us after the request,
+    // so the answers never contend for the bus.
+    struct AnnounceCommand
+    {
+        uint16_t slot_us;
+    };
+
+    struct AnnounceResponse
+    {
+        uint16_t uid;
+        uint8_t numDosers;
+        uint16_t maxFlowRate; // ml/min
+        uint16_t moduleID;
+    };
+
+    static_assert(sizeof(AnnounceResponse) == 8);
+
+    // Dose timed by the module. The doser runs for volume / flowRate on the
+    // module's clock, and the module answers with DoseVolumeResponse when the
+    // dose ends, echoing the sequence number. Any flow rate command for the
+    // doser ends the dose early.
+    struct DoseVolumeCommand
+    {
+        uint16_t doserID;
+        uint16_t flowRate; // ml/min
+        uint32_t volume_uL;
+    };
+
+    enum DoseStatus : uint8_t
+    {
+        Completed,
+        Interrupted,
+        Rejected
+    };
+
+    struct DoseVolumeResponse
+    {
+        uint16_t doserID;
+        DoseStatus status;
+        uint32_t delivered_uL;
+    };
+
+    static_assert(sizeof(DoseVolumeCommand) == 8);
+    static_assert(sizeof(DoseVolumeResponse) == 8);
+
+    // State of one doser, sent by its module every telemetry period with the
+    // module's address. Channels whose state didn't change since their last
+    // frame are skipped. current_mA is measured per motor driver, the two
+    // channels of a driver report the same current.
+    enum TelemetryFlag : uint8_t
+    {
+        Running = 0x01,
+        Fault = 0x02,
+        Asleep = 0x04,
+        Dosing = 0x08
+    };
+
+    struct TelemetryCommand
+    {
+        uint8_t channel;
+        uint8_t flags; // TelemetryFlag bits
+        uint16_t current_mA;
+        uint32_t runtime_s; // Accumulated run time since the module started
+    };
+
+    static_assert(sizeof(TelemetryCommand) == 8);
+
+    // Addressed or broadcast, 0 turns telemetry off
+    struct SetTelemetryPeriodCommand
+    {
+        uint16_t period_ms;
+    };
+
+    // Bitrate every node starts at, and falls back to when its controller goes
+    // error passive
+    constexpr uint32_t defaultBitrate = 50'000;
+
+    // Bitrate switch in two steps, both broadcast. Every module answers
+    // Prepare in its own slot, address * slot_us after the request, and
+    // accepts if it supports the bitrate. Once all accepted Sensei sends
+    // Commit and every node switches delay_ms after the Commit frame. Modules
+    // hold back telemetry and announcements between Commit and the switch.
+    enum BitrateStep : uint8_t
+    {
+        Prepare,
+        Commit
+    };
+
+    struct SetBitrateCommand
+    {
+        uint8_t step;     // BitrateStep
+        uint8_t delay_ms; // Commit only
+        uint16_t slot_us; // Prepare only
+        uint32_t bitrate;
+    };
+
+    struct SetBitrateResponse
+    {
+        uint32_t bitrate;
+        uint8_t accepted;
+    };
+
+    static_assert(sizeof(SetBitrateCommand) == 8);
+
+    // Frame arrival to PWM update latency histogram of a module. The module
+    // answers with LatencyHistogramResponse frames that cover every bucket.
+    constexpr uint8_t latencyBuckets = 16;
+
+    struct ReadLatencyCommand {};
+
+    struct LatencyHistogramResponse
+    {
+        uint8_t firstBucket;
+        uint8_t bucketCount;
+        uint16_t counts[3]; // Saturated at 0xFFFF
+    };
+
+    // Everything after enumeration uses 29-bit extended identifiers:
+    //   [28..21] rpc, [20..13] sequence, [12..8] reserved, [7..0] module address
+    // Commands carry the destination module, or broadcastAddress for every
+    // module. Module responses carry their own address and echo the sequence
+    // number of the request they answer. Modules filter on the address bits
+    // in hardware. NewModule and LastNode are the only standard identifier
+    // frames.
+    constexpr uint8_t broadcastAddress = 0xFF;
+    constexpr uint32_t addressMask = 0xFF;
+
+    constexpr uint32_t identifier(RPC rpc, uint8_t address, uint8_t seq = 0)
+    {
+        return (static_cast<uint32_t>(rpc) << 21) | (static_cast<uint32_t>(seq) << 13) | address;
+    }
+
+    constexpr RPC rpcOf(uint32_t identifier)
+    {
+        return static_cast<RPC>((identifier >> 21) & 0xFF);
+    }
+
+    constexpr uint8_t seqOf(uint32_t identifier) { return (identifier >> 13) & 0xFF; }
+
+    constexpr uint8_t addressOf(uint32_t identifier) { return identifier & 0xFF; }
+
     constexpr uint8_t responseID(RPC rpc) { return rpc + 1; }
+
+    constexpr RPC responseRPC(RPC rpc) { return static_cast<RPC>(rpc + 1); }
 }
 
 #endif //NUTRIDOSERSOFTWARE_PROTOCOL_H
@@ -0,0 +1,61 @@
+#ifndef NUTRIDOSERSOFTWARE_RING_BUFFER_H
+#define NUTRIDOSERSOFTWARE_RING_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace ez
+{
+
+    // Lock-free single producer single consumer queue. The producer is an
+    // interrupt handler and the consumer the main loop, so neither side may
+    // block. Capacity must be a power of two.
+    template<typename T, uint32_t Capacity>
+    class RingBuffer
+    {
+        static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+    public:
+        bool push(const T& item)
+        {
+            const uint32_t head = mHead.load(std::memory_order_relaxed);
+            if (head - mTail.load(std::memory_order_acquire) == Capacity)
+            {
+                return false;
+            }
+
+            mItems[head & (Capacity - 1)] = item;
+            mHead.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T& item)
+        {
+            const uint32_t tail = mTail.load(std::memory_order_relaxed);
+            if (tail == mHead.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+
+            item = mItems[tail & (Capacity - 1)];
+            mTail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool empty() const
+        {
+            return mTail.load(std::memory_order_acquire) == mHead.load(std::memory_order_acquire);
+        }
+
+    private:
+        T mItems[Capacity];
+        std::atomic<uint32_t> mHead{0};
+        std::atomic<uint32_t> mTail{0};
+    };
+
+}
+
+
+#endif //NUTRIDOSERSOFTWARE_RING_BUFFER_H
@@ -57,6 +57,8 @@ void PendSV_Handler(void);
 void SysTick_Handler(void);
 void TIM1_UP_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+void USB_LP_CAN1_RX0_IRQHandler(void);
+void CAN1_RX1_IRQHandler(void);
 
 /* USER CODE END EFP */
 
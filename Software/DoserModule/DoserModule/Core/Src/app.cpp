@@ -6,35 +6,75 @@
 #include "protocol.h"
 
 
+static_assert(doserCount <= can::protocol::moduleChannels);
+
+namespace
+{
+    bool isFlowRateRPC(const ez::CanFrame& frame)
+    {
+        using namespace can::protocol;
+
+        if (frame.extended)
+        {
+            const RPC rpc = rpcOf(frame.id);
+            return rpc == RPC::SetFlowRate || rpc == RPC::SetModuleFlowRates || rpc == RPC::SetAllFlowRates;
+        }
+        return false;
+    }
+
+    uint16_t hashUID()
+    {
+        const uint32_t words[3] = {HAL_GetUIDw0(), HAL_GetUIDw1(), HAL_GetUIDw2()};
+        uint32_t hash = 2166136261u;
+        for (uint32_t word : words)
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                hash = (hash ^ ((word >> (8 * i)) & 0xFF)) * 16777619u;
+            }
+        }
+        return static_cast<uint16_t>(hash ^ (hash >> 16));
+    }
+}
+
 enum Err
 {
     Init = 3,
     Command = 5,
 };
 
-void app_main(CAN_HandleTypeDef& hcan)
+void app_main(CAN_HandleTypeDef& hcan, ADC_HandleTypeDef& hadc)
 {
+    if (HAL_ADCEx_Calibration_Start(&hadc) != HAL_OK)
+    {
+        handleError();
+    }
+
     DRV8874 drv1{
             {TIM2, TIM_CHANNEL_2},
             {TIM2, TIM_CHANNEL_1},
             {GPIOA, GPIO_PIN_4},
-            {GPIOA, GPIO_PIN_5}
+            {GPIOA, GPIO_PIN_5},
+            {hadc, ADC_CHANNEL_8}
     };
 
     DRV8874 drv2{
             {TIM2, TIM_CHANNEL_4},
             {TIM2, TIM_CHANNEL_3},
             {GPIOA, GPIO_PIN_6},
-            {GPIOA, GPIO_PIN_7}
+            {GPIOA, GPIO_PIN_7},
+            {hadc, ADC_CHANNEL_9}
     };
 
-    App app{hcan, drv1, drv2};
+    ez::BxCanPort port{hcan};
+    App app{port, drv1, drv2};
     app.run();
 }
 
 
-App::App(CAN_HandleTypeDef &hcan, DRV8874 &drv1, DRV8874 &drv2)
-:   hcan{hcan},
+App::App(ez::CanPort& can, DRV8874 &drv1, DRV8874 &drv2)
+:   can{can},
+    uid{hashUID()},
     dosers{
         Doser293KCZL{drv1, &DRV8874::out1PWM},
         Doser293KCZL{drv1, &DRV8874::out2PWM},
@@ -42,7 +82,7 @@ App::App(CAN_HandleTypeDef &hcan, DRV8874 &drv1, DRV8874 &drv2)
         Doser293KCZL{drv2, &DRV8874::out2PWM}
     }
 {
-	filterAll();
+    can.acceptAll();
     if (!initialize())
     {
         handleError(Err::Init);
@@ -57,24 +97,72 @@ App::App(CAN_HandleTypeDef &hcan, DRV8874 &drv1, DRV8874 &drv2)
         terminateCAN();
         transmitLastNodeCommand();
     }
+
+    can.acceptAddressed(address);
 }
 
 void App::run()
 {
-    CAN_RxHeaderTypeDef rxHeader;
+    // Spread the telemetry of the chain over the period
+    nextTelemetry = ez::Clock::now() + address * 2ms;
 
     for (;;)
     {
-        if (HAL_CAN_GetRxFifoFillLevel(&hcan, CAN_RX_FIFO0) > 0)
+        ez::RxFrame frame;
+        while (can.receive(frame))
         {
-            uint8_t rxData[8];
-            if (HAL_CAN_GetRxMessage(&hcan, CAN_RX_FIFO0, &rxHeader, rxData) == HAL_OK)
+            handleRPC(frame);
+            if (isFlowRateRPC(frame.frame))
             {
-                handleRPC(rxHeader, rxData);
+                latency.add(ez::Clock::now() - frame.receivedAt);
             }
         }
 
-        ez::delay(1ms);
+        const auto now = ez::Clock::now();
+        if (bitrateSwitchAt && now >= *bitrateSwitchAt)
+        {
+            bitrateSwitchAt.reset();
+            can.setBitrate(nextBitrate);
+        }
+        else if (!bitrateSwitchAt && can.bitrate() != can::protocol::defaultBitrate && can.errorPassive())
+        {
+            // The rest of the chain is likely at another bitrate
+            can.setBitrate(can::protocol::defaultBitrate);
+        }
+
+        if (bitrateAckAt && now >= *bitrateAckAt)
+        {
+            bitrateAckAt.reset();
+            transmitBitrateAck();
+        }
+
+        if (announceAt && now >= *announceAt && !bitrateSwitchAt)
+        {
+            announceAt.reset();
+            transmitAnnounce();
+        }
+
+        for (uint32_t i = 0; i < dosers.size(); ++i)
+        {
+            if (dosers[i].doseDue(now))
+            {
+                finishDose(i, can::protocol::DoseStatus::Completed);
+            }
+        }
+
+        if (telemetryPeriod > 0us && now >= nextTelemetry && !bitrateSwitchAt)
+        {
+            nextTelemetry += telemetryPeriod;
+            if (nextTelemetry < now)
+            {
+                nextTelemetry = now + telemetryPeriod;
+            }
+            transmitTelemetry(now);
+        }
+
+        // SysTick wakes the loop every millisecond for pending
+        // announcements, dose ends and telemetry
+        can.waitForFrame();
     }
 }
 
@@ -82,45 +170,39 @@ bool App::initialize()
 {
 	using namespace can::protocol;
 
-    NewModuleCommand command{doserCount, Doser293KCZL::maxFlowRate};
-    const CAN_TxHeaderTypeDef initHeader = {
-            .StdId = RPC::NewModule,
-            .IDE = CAN_ID_STD,
-            .RTR = CAN_RTR_DATA,
-            .DLC = sizeof(command)
-    };
-    uint32_t mailbox;
-    uint8_t txData[8] = {};
-    std::memcpy(txData, &command, sizeof(command));
+    NewModuleCommand command{doserCount, 0, Doser293KCZL::maxFlowRate, uid};
+    ez::CanFrame request{RPC::NewModule, false, sizeof(command), {}};
 
-    CAN_RxHeaderTypeDef rxHeader;
-    uint8_t rxData[8];
-
-    constexpr int retryMax = 10000;
+    constexpr int retryMax = initializeTimeout / initializeListen;
     for(int i = 0; i < retryMax; ++i)
     {
-    	while (HAL_CAN_GetTxMailboxesFreeLevel(&hcan) == 0) { ez::delay(10ms); }
-
-        if (HAL_CAN_AddTxMessage(&hcan, &initHeader, txData, &mailbox) != HAL_OK)
+        command.attempt = static_cast<uint8_t>(i < 0xFF ? i : 0xFF);
+        std::memcpy(request.data, &command, sizeof(command));
+        if (!can.transmit(request))
         {
             handleError();
         }
 
         // Wait for the response to arrive
         const auto listenStart = ez::Clock::now();
-        uint32_t fillLevel;
-        while ((fillLevel = HAL_CAN_GetRxFifoFillLevel(&hcan, CAN_RX_FIFO0)) == 0 &&
-               (ez::Clock::now() - listenStart < 500ms))
-        {}
-
-        while ((fillLevel-- > 0) &&
-               HAL_CAN_GetRxMessage(&hcan, CAN_RX_FIFO0, &rxHeader, rxData) == HAL_OK)
+        while (ez::Clock::now() - listenStart < initializeListen)
         {
-            if (rxHeader.StdId == responseID(RPC::NewModule))
+            ez::RxFrame rx;
+            if (!can.receive(rx))
+            {
+                continue;
+            }
+
+            if (!rx.frame.extended && rx.frame.id == responseID(RPC::NewModule))
             {
                 NewModuleResponse response;
-                std::memcpy(&response, rxData, sizeof(response));
+                std::memcpy(&response, rx.frame.data, sizeof(response));
+                if (response.uid != uid)
+                {
+                    continue;
+                }
                 moduleID = response.moduleID;
+                address = response.address;
                 return true;
             }
         }
@@ -130,22 +212,15 @@ bool App::initialize()
 
 bool App::nextNodeExists()
 {
-    CAN_RxHeaderTypeDef rxHeader;
-    uint8_t rxData[8];
     const auto startTime = ez::Clock::now();
 
-    // Wait 1s for a NewModule message
-    while (ez::Clock::now() - startTime < 500ms)
+    // Wait for the next module to boot and send NewModule
+    while (ez::Clock::now() - startTime < nextNodeWindow)
     {
-        if (HAL_CAN_GetRxFifoFillLevel(&hcan, CAN_RX_FIFO0) > 0)
+        ez::RxFrame rx;
+        if (can.receive(rx) && !rx.frame.extended && rx.frame.id == can::protocol::RPC::NewModule)
         {
-            if (HAL_CAN_GetRxMessage(&hcan, CAN_RX_FIFO0, &rxHeader, rxData) == HAL_OK)
-            {
-                if (rxHeader.StdId == can::protocol::RPC::NewModule)
-                {
-                    return true;
-                }
-            }
+            return true;
         }
     }
 
@@ -156,50 +231,46 @@ void App::transmitLastNodeCommand()
 {
 	using namespace can::protocol;
 
-	const CAN_TxHeaderTypeDef initHeader = {
-			.StdId = RPC::LastNode,
-			.IDE = CAN_ID_STD,
-			.RTR = CAN_RTR_DATA,
-			.DLC = sizeof(LastNodeCommand)
-	};
-	uint32_t mailbox;
-	uint8_t txData[8] = {};
-
-	if (HAL_CAN_AddTxMessage(&hcan, &initHeader, txData, &mailbox) != HAL_OK)
+	const ez::CanFrame command{RPC::LastNode, false, sizeof(LastNodeCommand), {}};
+	if (!can.transmit(command))
 	{
 		handleError();
 	}
 }
 
-void App::filterAll()
+void App::handleRPC(const ez::RxFrame& frame)
 {
-    CAN_FilterTypeDef sFilterConfig;
-    sFilterConfig.FilterBank = 0;
-    sFilterConfig.FilterMode = CAN_FILTERMODE_IDMASK;
-    sFilterConfig.FilterScale = CAN_FILTERSCALE_32BIT;
-    sFilterConfig.FilterIdHigh = 0x0000;
-    sFilterConfig.FilterIdLow = 0x0000;
-    sFilterConfig.FilterMaskIdHigh = 0x0000;
-    sFilterConfig.FilterMaskIdLow = 0x0000;
-    sFilterConfig.FilterFIFOAssignment = CAN_RX_FIFO0;
-    sFilterConfig.FilterActivation = ENABLE;
+	using namespace can::protocol;
 
-    if (HAL_CAN_ConfigFilter(&hcan, &sFilterConfig) != HAL_OK)
-    {
-        handleError();
-    }
-}
+	const uint32_t id = frame.frame.id;
+	const uint8_t* data = frame.frame.data;
 
-void App::handleRPC(CAN_RxHeaderTypeDef &header, uint8_t *data)
-{
-	if (header.StdId == can::protocol::RPC::SetFlowRate)
+	if (!frame.frame.extended)
+	{
+		return;
+	}
+
+	const uint8_t dst = addressOf(id);
+	if (dst != address && dst != broadcastAddress)
+	{
+		return;
+	}
+
+	switch (rpcOf(id))
+	{
+	case RPC::SetFlowRate:
 	{
-		can::protocol::SetFlowRateCommand command;
+		SetFlowRateCommand command;
 		std::memcpy(&command, data, sizeof(command));
 
 		const uint32_t idx = command.doserID - moduleID;
 		if (idx < dosers.size())
 		{
+			if (dosers[idx].isDosing())
+			{
+				finishDose(idx, DoseStatus::Interrupted);
+			}
+
 			if (command.flowRate == 0)
 			{
 				dosers[idx].stop();
@@ -209,12 +280,222 @@ void App::handleRPC(CAN_RxHeaderTypeDef &header, uint8_t *data)
 				dosers[idx].run(command.flowRate);
 			}
 		}
-	} else if (header.StdId == can::protocol::RPC::Restart) {
+		break;
+	}
+	case RPC::SetModuleFlowRates:
+	case RPC::SetAllFlowRates:
+		setFlowRates(data);
+		break;
+	case RPC::DoseVolume:
+	{
+		DoseVolumeCommand command;
+		std::memcpy(&command, data, sizeof(command));
+		startDose(command, seqOf(id));
+		break;
+	}
+	case RPC::SetTelemetryPeriod:
+	{
+		SetTelemetryPeriodCommand command;
+		std::memcpy(&command, data, sizeof(command));
+		telemetryPeriod = std::chrono::milliseconds(command.period_ms);
+		nextTelemetry = ez::Clock::now() + address * 2ms;
+		break;
+	}
+	case RPC::ReadLatency:
+		transmitLatencyHistogram(seqOf(id));
+		break;
+	case RPC::Announce:
+	{
+		AnnounceCommand command;
+		std::memcpy(&command, data, sizeof(command));
+		announceAt = frame.receivedAt + std::chrono::microseconds(uint32_t{command.slot_us} * address);
+		announceSeq = seqOf(id);
+		break;
+	}
+	case RPC::SetBitrate:
+	{
+		SetBitrateCommand command;
+		std::memcpy(&command, data, sizeof(command));
+		if (command.step == BitrateStep::Prepare)
+		{
+			bitrateAckAt = frame.receivedAt + std::chrono::microseconds(uint32_t{command.slot_us} * address);
+			bitrateAckSeq = seqOf(id);
+			nextBitrate = command.bitrate;
+		}
+		else if (command.step == BitrateStep::Commit && can.supports(command.bitrate))
+		{
+			bitrateSwitchAt = frame.receivedAt + std::chrono::milliseconds(command.delay_ms);
+			nextBitrate = command.bitrate;
+		}
+		break;
+	}
+	case RPC::Restart:
 		shutdownNext();
 		terminateCAN();
 		for (auto& doser : dosers) {
 			doser.stop();
 		}
 		HAL_NVIC_SystemReset();
+		break;
+	default:
+		break;
+	}
+}
+
+// Applies all channels of a module at once. TIM2 compare registers are
+// preloaded, so writing them back to back with interrupts masked makes every
+// channel switch on the same PWM period.
+void App::setFlowRates(const uint8_t data[8])
+{
+	using namespace can::protocol;
+
+	SetModuleFlowRatesCommand command;
+	std::memcpy(&command, data, sizeof(command));
+
+	for (uint32_t i = 0; i < dosers.size(); ++i)
+	{
+		if (command.flowRates[i] != keepFlowRate && dosers[i].isDosing())
+		{
+			finishDose(i, DoseStatus::Interrupted);
+		}
+	}
+
+	__disable_irq();
+	for (uint32_t i = 0; i < dosers.size(); ++i)
+	{
+		if (command.flowRates[i] == keepFlowRate)
+		{
+			continue;
+		}
+		else if (command.flowRates[i] == 0)
+		{
+			dosers[i].stop();
+		}
+		else
+		{
+			dosers[i].run(command.flowRates[i]);
+		}
+	}
+	__enable_irq();
+}
+
+void App::startDose(const can::protocol::DoseVolumeCommand& command, uint8_t seq)
+{
+	using namespace can::protocol;
+
+	const uint32_t idx = command.doserID - moduleID;
+	if (idx >= dosers.size() || command.flowRate == 0 || command.flowRate > Doser293KCZL::maxFlowRate)
+	{
+		transmitDoseResponse(command.doserID, seq, DoseStatus::Rejected, 0);
+		return;
+	}
+
+	if (dosers[idx].isDosing())
+	{
+		finishDose(idx, DoseStatus::Interrupted);
+	}
+
+	doseSeq[idx] = seq;
+	dosers[idx].dose(command.flowRate, command.volume_uL, ez::Clock::now());
+}
+
+void App::finishDose(uint32_t idx, can::protocol::DoseStatus status)
+{
+	const uint32_t delivered = dosers[idx].finishDose(ez::Clock::now());
+	transmitDoseResponse(moduleID + idx, doseSeq[idx], status, delivered);
+}
+
+void App::transmitDoseResponse(uint16_t doserID, uint8_t seq, can::protocol::DoseStatus status, uint32_t delivered_uL)
+{
+	using namespace can::protocol;
+
+	const uint32_t id = identifier(responseRPC(RPC::DoseVolume), address, seq);
+
+	const DoseVolumeResponse response{doserID, status, delivered_uL};
+	transmit(id, &response, sizeof(response));
+}
+
+// Sends the channels whose state changed since their last frame. Running
+// channels change every second through their run time.
+void App::transmitTelemetry(ez::Clock::time_point now)
+{
+	using namespace can::protocol;
+
+	const uint32_t id = identifier(RPC::Telemetry, address);
+
+	for (uint8_t i = 0; i < dosers.size(); ++i)
+	{
+		const auto& doser = dosers[i];
+		const auto& driver = doser.getDriver();
+
+		TelemetryCommand telemetry{i, 0, 0, 0};
+		telemetry.flags = (doser.isRunning() ? Running : 0) |
+						  (driver.isFaulted() ? Fault : 0) |
+						  (driver.isAsleep() ? Asleep : 0) |
+						  (doser.isDosing() ? Dosing : 0);
+		const uint32_t current = driver.readCurrent_mA();
+		telemetry.current_mA = current > 0xFFFF ? 0xFFFF : current;
+		telemetry.runtime_s = std::chrono::duration_cast<std::chrono::seconds>(doser.runtime(now)).count();
+
+		const auto& last = lastTelemetry[i];
+		const bool changed = !last ||
+				last->flags != telemetry.flags ||
+				last->runtime_s != telemetry.runtime_s ||
+				std::abs(last->current_mA - telemetry.current_mA) > currentDeadband_mA;
+		if (changed)
+		{
+			transmit(id, &telemetry, sizeof(telemetry));
+			lastTelemetry[i] = telemetry;
+		}
+	}
+}
+
+void App::transmitLatencyHistogram(uint8_t seq)
+{
+	using namespace can::protocol;
+
+	const uint32_t id = identifier(responseRPC(RPC::ReadLatency), address, seq);
+
+	constexpr uint8_t perFrame = std::size(LatencyHistogramResponse{}.counts);
+	for (uint8_t first = 0; first < latencyBuckets; first += perFrame)
+	{
+		LatencyHistogramResponse response{first, 0, {}};
+		for (uint8_t i = first; i < latencyBuckets && i < first + perFrame; ++i)
+		{
+			const uint32_t count = latency.count(i);
+			response.counts[response.bucketCount++] = count > 0xFFFF ? 0xFFFF : count;
+		}
+		transmit(id, &response, sizeof(response));
+	}
+}
+
+void App::transmitAnnounce()
+{
+	using namespace can::protocol;
+
+	const uint32_t id = identifier(responseRPC(RPC::Announce), address, announceSeq);
+
+	const AnnounceResponse response{
+		uid, doserCount, Doser293KCZL::maxFlowRate, static_cast<uint16_t>(moduleID)
+	};
+	transmit(id, &response, sizeof(response));
+}
+
+void App::transmitBitrateAck()
+{
+	using namespace can::protocol;
+
+	const uint32_t id = identifier(responseRPC(RPC::SetBitrate), address, bitrateAckSeq);
+	const SetBitrateResponse response{nextBitrate, can.supports(nextBitrate)};
+	transmit(id, &response, sizeof(response));
+}
+
+void App::transmit(uint32_t identifier, const void* data, uint8_t dlc)
+{
+	ez::CanFrame frame{identifier, true, dlc, {}};
+	std::memcpy(frame.data, data, dlc);
+	if (!can.transmit(frame))
+	{
+		handleError();
 	}
 }
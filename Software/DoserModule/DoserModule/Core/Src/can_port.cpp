@@ -0,0 +1,213 @@
+#include "can_port.h"
+#include "error.h"
+#include "protocol.h"
+#include <cstring>
+
+
+namespace
+{
+    ez::BxCanPort* instance = nullptr;
+
+    struct BitTiming
+    {
+        uint32_t bitrate;
+        uint32_t prescaler;
+        uint32_t timeSeg1;
+        uint32_t timeSeg2;
+    };
+
+    // APB1 runs at 36 MHz. Sample points at 80 % and above, like the
+    // 50 kbit/s timing MX_CAN_Init starts with.
+    constexpr BitTiming bitTimings[] = {
+        {50'000, 36, CAN_BS1_15TQ, CAN_BS2_4TQ},
+        {125'000, 18, CAN_BS1_12TQ, CAN_BS2_3TQ},
+        {250'000, 9, CAN_BS1_12TQ, CAN_BS2_3TQ},
+        {500'000, 4, CAN_BS1_14TQ, CAN_BS2_3TQ},
+    };
+
+    const BitTiming* findTiming(uint32_t bitrate)
+    {
+        for (const auto& timing : bitTimings)
+        {
+            if (timing.bitrate == bitrate)
+            {
+                return &timing;
+            }
+        }
+        return nullptr;
+    }
+}
+
+extern "C" void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef*)
+{
+    if (instance)
+    {
+        instance->drain(CAN_RX_FIFO0);
+    }
+}
+
+extern "C" void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef*)
+{
+    if (instance)
+    {
+        instance->drain(CAN_RX_FIFO1);
+    }
+}
+
+
+namespace ez
+{
+
+    BxCanPort::BxCanPort(CAN_HandleTypeDef& hcan)
+    :   hcan{hcan},
+        currentBitrate{can::protocol::defaultBitrate}
+    {
+        instance = this;
+        if (HAL_CAN_ActivateNotification(&hcan, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO1_MSG_PENDING) != HAL_OK)
+        {
+            handleError();
+        }
+    }
+
+    BxCanPort::~BxCanPort()
+    {
+        HAL_CAN_DeactivateNotification(&hcan, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO1_MSG_PENDING);
+        instance = nullptr;
+    }
+
+    void BxCanPort::acceptAll()
+    {
+        CAN_FilterTypeDef sFilterConfig;
+        sFilterConfig.FilterBank = 0;
+        sFilterConfig.FilterMode = CAN_FILTERMODE_IDMASK;
+        sFilterConfig.FilterScale = CAN_FILTERSCALE_32BIT;
+        sFilterConfig.FilterIdHigh = 0x0000;
+        sFilterConfig.FilterIdLow = 0x0000;
+        sFilterConfig.FilterMaskIdHigh = 0x0000;
+        sFilterConfig.FilterMaskIdLow = 0x0000;
+        sFilterConfig.FilterFIFOAssignment = CAN_RX_FIFO0;
+        sFilterConfig.FilterActivation = ENABLE;
+
+        if (HAL_CAN_ConfigFilter(&hcan, &sFilterConfig) != HAL_OK)
+        {
+            handleError();
+        }
+    }
+
+    // Frames addressed to the module go to FIFO0 and broadcasts to FIFO1.
+    // Everything else, like other modules' traffic, is dropped by the
+    // hardware.
+    void BxCanPort::acceptAddressed(uint8_t address)
+    {
+        using namespace can::protocol;
+
+        filterExtended(0, address, addressMask, CAN_FILTER_FIFO0);
+        filterExtended(1, broadcastAddress, addressMask, CAN_FILTER_FIFO1);
+    }
+
+    void BxCanPort::filterExtended(uint32_t bank, uint32_t id, uint32_t mask, uint32_t fifo)
+    {
+        // 32-bit filter registers hold EXTID[28:0] << 3 | IDE << 2 | RTR << 1
+        const uint32_t filterId = (id << 3) | CAN_ID_EXT;
+        const uint32_t filterMask = (mask << 3) | CAN_ID_EXT;
+
+        CAN_FilterTypeDef sFilterConfig;
+        sFilterConfig.FilterBank = bank;
+        sFilterConfig.FilterMode = CAN_FILTERMODE_IDMASK;
+        sFilterConfig.FilterScale = CAN_FILTERSCALE_32BIT;
+        sFilterConfig.FilterIdHigh = filterId >> 16;
+        sFilterConfig.FilterIdLow = filterId & 0xFFFF;
+        sFilterConfig.FilterMaskIdHigh = filterMask >> 16;
+        sFilterConfig.FilterMaskIdLow = filterMask & 0xFFFF;
+        sFilterConfig.FilterFIFOAssignment = fifo;
+        sFilterConfig.FilterActivation = ENABLE;
+
+        if (HAL_CAN_ConfigFilter(&hcan, &sFilterConfig) != HAL_OK)
+        {
+            handleError();
+        }
+    }
+
+    bool BxCanPort::transmit(const CanFrame& frame)
+    {
+        CAN_TxHeaderTypeDef header = {};
+        header.StdId = frame.extended ? 0 : frame.id;
+        header.ExtId = frame.extended ? frame.id : 0;
+        header.IDE = frame.extended ? CAN_ID_EXT : CAN_ID_STD;
+        header.RTR = CAN_RTR_DATA;
+        header.DLC = frame.dlc;
+
+        while (HAL_CAN_GetTxMailboxesFreeLevel(&hcan) == 0) {}
+
+        uint32_t mailbox;
+        return HAL_CAN_AddTxMessage(&hcan, &header, frame.data, &mailbox) == HAL_OK;
+    }
+
+    bool BxCanPort::receive(RxFrame& frame)
+    {
+        return rxQueue.pop(frame);
+    }
+
+    // WFI wakes up on a pending interrupt even while they are masked, so a
+    // frame arriving between the check and the sleep isn't missed. SysTick
+    // wakes the caller every millisecond.
+    void BxCanPort::waitForFrame()
+    {
+        __disable_irq();
+        if (rxQueue.empty())
+        {
+            __WFI();
+        }
+        __enable_irq();
+    }
+
+    bool BxCanPort::supports(uint32_t bitrate) const
+    {
+        return findTiming(bitrate) != nullptr;
+    }
+
+    bool BxCanPort::setBitrate(uint32_t bitrate)
+    {
+        const BitTiming* timing = findTiming(bitrate);
+        if (!timing)
+        {
+            return false;
+        }
+
+        // Filter banks and interrupt enables survive the re-initialization
+        HAL_CAN_Stop(&hcan);
+        hcan.Init.Prescaler = timing->prescaler;
+        hcan.Init.TimeSeg1 = timing->timeSeg1;
+        hcan.Init.TimeSeg2 = timing->timeSeg2;
+        if (HAL_CAN_Init(&hcan) != HAL_OK || HAL_CAN_Start(&hcan) != HAL_OK)
+        {
+            handleError();
+        }
+        currentBitrate = bitrate;
+        return true;
+    }
+
+    bool BxCanPort::errorPassive() const
+    {
+        return (hcan.Instance->ESR & (CAN_ESR_EPVF | CAN_ESR_BOFF)) != 0;
+    }
+
+    void BxCanPort::drain(uint32_t fifo)
+    {
+        CAN_RxHeaderTypeDef header;
+        RxFrame frame;
+        while (HAL_CAN_GetRxFifoFillLevel(&hcan, fifo) > 0 &&
+               HAL_CAN_GetRxMessage(&hcan, fifo, &header, frame.frame.data) == HAL_OK)
+        {
+            frame.receivedAt = Clock::now();
+            frame.frame.extended = header.IDE == CAN_ID_EXT;
+            frame.frame.id = frame.frame.extended ? header.ExtId : header.StdId;
+            frame.frame.dlc = header.DLC;
+            if (!rxQueue.push(frame))
+            {
+                rxDropped = rxDropped + 1;
+            }
+        }
+    }
+
+}
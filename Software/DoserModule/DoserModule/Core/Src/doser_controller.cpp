@@ -32,8 +32,30 @@ void removeTerminationCAN()
 }
 
 
-DRV8874::DRV8874(PWMPin in1, PWMPin in2, GPIOPin nSleep, GPIOPin nFault)
-: in1{in1}, in2{in2}, nSleep{nSleep}, nFault{nFault}
+uint32_t ADCPin::read() const
+{
+	ADC_ChannelConfTypeDef config = {};
+	config.Channel = channel;
+	config.Rank = ADC_REGULAR_RANK_1;
+	config.SamplingTime = ADC_SAMPLETIME_71CYCLES_5; // IPROPI has a high source impedance
+
+	if (HAL_ADC_ConfigChannel(hadc, &config) != HAL_OK || HAL_ADC_Start(hadc) != HAL_OK)
+	{
+		return 0;
+	}
+
+	uint32_t value = 0;
+	if (HAL_ADC_PollForConversion(hadc, 1) == HAL_OK)
+	{
+		value = HAL_ADC_GetValue(hadc);
+	}
+	HAL_ADC_Stop(hadc);
+	return value;
+}
+
+
+DRV8874::DRV8874(PWMPin in1, PWMPin in2, GPIOPin nSleep, GPIOPin nFault, ADCPin ipropi)
+: in1{in1}, in2{in2}, nSleep{nSleep}, nFault{nFault}, ipropi{ipropi}
 {
 	wakeup();
     in1.setPWM(0xFFFF);
@@ -62,15 +84,29 @@ void DRV8874::wakeup()
 
 bool DRV8874::isAsleep() const
 {
-	return false;
+	return !nSleep.read();
 }
 
+// Raw ADC reading of the IPROPI pin
 uint32_t DRV8874::readIPropi() const
 {
-	return 0;
+	return ipropi.read();
+}
+
+// IPROPI sources 455 uA per A of load current into the IPROPI resistor,
+// R2 and R12 in Hardware/DoserModule/DoserDriver.kicad_sch.
+uint32_t DRV8874::readCurrent_mA() const
+{
+	constexpr float adcReference = 3.3f; // V
+	constexpr float adcCounts = 4095.0f;
+	constexpr float ipropiGain = 455e-6f; // A/A
+	constexpr float ipropiResistor = 4700.0f; // Ohm
+
+	const float volts = readIPropi() * adcReference / adcCounts;
+	return static_cast<uint32_t>(volts / ipropiResistor / ipropiGain * 1000.0f);
 }
 
 bool DRV8874::isFaulted() const
 {
-	return false;
+	return !nFault.read(); // nFAULT is pulled low on a fault
 }
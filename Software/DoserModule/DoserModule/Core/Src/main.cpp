@@ -117,7 +117,7 @@ int main(void)
       Error_Handler();
   }
 
-  app_main(hcan);
+  app_main(hcan, hadc1);
 
   /* USER CODE END 2 */
 
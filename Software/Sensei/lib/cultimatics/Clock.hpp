@@ -1,7 +1,140 @@
 #ifndef CLOCK_HPP
 #define CLOCK_HPP
 
+#include <atomic>
 #include <chrono>
-using Clock = std::chrono::high_resolution_clock;
+#include <functional>
+#include <future>
+#include <optional>
+#include <stdexcept>
+#include <thread>
 
-#endif
\ No newline at end of file
+// Time of the whole stack. It's the steady clock unless a host test or
+// simulation installs a source of virtual time, such as VirtualClock. Neither
+// goes back, so timers, the PID and settling hold when the wall time is set.
+// Code that waits on this time does so through waitUntil(), wait() and
+// sleepFor(): under virtual time the waiting task runs what happens until
+// then instead of blocking.
+struct Clock {
+  using duration = std::chrono::nanoseconds;
+  using rep = duration::rep;
+  using period = duration::period;
+  using time_point = std::chrono::time_point<Clock>;
+  static constexpr bool is_steady = true;
+
+  // Something that runs on time, like a timer heap. Under virtual time the
+  // source runs it, otherwise it runs on a task of its own.
+  struct Actor {
+    std::function<bool()> runReady; // Does what is due, false if nothing was
+    std::function<std::optional<time_point>()> nextWakeup;
+  };
+
+  // Time that only passes as its owner runs the actors attached to it
+  class Source {
+  public:
+    virtual ~Source() = default;
+    virtual time_point now() const noexcept = 0;
+    virtual int attach(Actor actor) = 0;
+    virtual void detach(int actor) = 0;
+    // Runs the actors until done() holds or nothing happens before `until`.
+    // Returns done().
+    virtual bool runUntil(const std::function<bool()> &done,
+                          time_point until) = 0;
+  };
+
+  // An actor attached to a source for the lifetime of this
+  class Attachment {
+  public:
+    Attachment(Source *source, Actor actor)
+        : source{source}, id{source->attach(std::move(actor))} {}
+    ~Attachment() { source->detach(id); }
+
+    Attachment(const Attachment &) = delete;
+    Attachment &operator=(const Attachment &) = delete;
+
+  private:
+    Source *source;
+    int id;
+  };
+
+  static time_point now() noexcept {
+    if (const Source *virtualTime = source()) {
+      return virtualTime->now();
+    }
+    return time_point{std::chrono::duration_cast<duration>(
+        std::chrono::steady_clock::now().time_since_epoch())};
+  }
+
+  // The source of virtual time, nullptr while time is real
+  static Source *source() noexcept {
+    return installed.load(std::memory_order_acquire);
+  }
+
+  // Returns the source installed before
+  static Source *install(Source *source) {
+    return installed.exchange(source, std::memory_order_acq_rel);
+  }
+
+  // cv.wait_until(lock, deadline, ready) on this clock, waits without a
+  // deadline for time_point::max(). Under virtual time a wait without a
+  // deadline that nothing can end throws rather than hangs.
+  template <typename Cv, typename Lock, typename Predicate>
+  static bool waitUntil(Cv &cv, Lock &lock, time_point deadline,
+                        Predicate ready) {
+    if (ready()) {
+      return true;
+    }
+    if (Source *virtualTime = source()) {
+      // The actors take the lock the caller holds
+      bool satisfied = false;
+      lock.unlock();
+      virtualTime->runUntil(
+          [&] {
+            lock.lock();
+            satisfied = ready();
+            lock.unlock();
+            return satisfied;
+          },
+          deadline);
+      lock.lock();
+      if (!satisfied && deadline == time_point::max()) {
+        throw std::logic_error("waiting for what virtual time never brings");
+      }
+      return satisfied;
+    }
+    if (deadline == time_point::max()) {
+      cv.wait(lock, ready);
+      return true;
+    }
+    return cv.wait_until(lock, deadline, ready);
+  }
+
+  // Blocks until the future has its result
+  template <typename T> static void wait(const std::future<T> &future) {
+    if (Source *virtualTime = source()) {
+      if (!virtualTime->runUntil(
+              [&future] {
+                return future.wait_for(std::chrono::seconds{0}) ==
+                       std::future_status::ready;
+              },
+              time_point::max())) {
+        throw std::logic_error("waiting for what virtual time never brings");
+      }
+    } else {
+      future.wait();
+    }
+  }
+
+  static void sleepFor(duration duration) {
+    if (Source *virtualTime = source()) {
+      virtualTime->runUntil([] { return false; }, now() + duration);
+    } else {
+      std::this_thread::sleep_for(duration);
+    }
+  }
+
+private:
+  static inline std::atomic<Source *> installed{nullptr};
+};
+
+#endif
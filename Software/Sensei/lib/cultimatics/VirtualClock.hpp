@@ -0,0 +1,136 @@
+#ifndef VIRTUAL_CLOCK_HPP
+#define VIRTUAL_CLOCK_HPP
+
+#include "Clock.hpp"
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// Discrete-event time for host tests and simulations. Like the simulation's
+// RelativeClock it sets the stack's time apart from the wall clock, but
+// rather than scaling it, time stands still while there is work and then
+// jumps to the next timer. While it's installed Clock reads it, and the
+// DoserManager executor and the ControlScheduler run on whichever task
+// waits on the time instead of tasks of their own. A run does the same
+// every time, and a day of dosing passes in milliseconds.
+class VirtualClock : public Clock::Source {
+public:
+  // Installs the clock until it's destroyed. Construct it before the
+  // managers and schedulers that should run on it.
+  explicit VirtualClock(Clock::time_point start = Clock::now())
+      : current{start.time_since_epoch().count()},
+        previous{Clock::install(this)} {}
+
+  ~VirtualClock() override { Clock::install(previous); }
+
+  VirtualClock(const VirtualClock &) = delete;
+  VirtualClock &operator=(const VirtualClock &) = delete;
+
+  Clock::time_point now() const noexcept override {
+    return Clock::time_point{
+        Clock::duration{current.load(std::memory_order_acquire)}};
+  }
+
+  int attach(Clock::Actor actor) override {
+    std::lock_guard guard{mtx};
+    const int id = nextActor++;
+    actors.emplace(id, std::move(actor));
+    return id;
+  }
+
+  void detach(int actor) override {
+    std::lock_guard guard{mtx};
+    actors.erase(actor);
+  }
+
+  bool runUntil(const std::function<bool()> &done,
+                Clock::time_point until) override {
+    // One task drives the clock at a time, an actor may drive it further
+    std::lock_guard driving{driver};
+    for (;;) {
+      if (done()) {
+        return true;
+      }
+      if (runActors()) {
+        continue;
+      }
+      const auto next = nextWakeup();
+      if (!next || *next > until) {
+        if (until != Clock::time_point::max()) {
+          advance(until);
+        }
+        return done();
+      }
+      advance(*next);
+    }
+  }
+
+  // Runs everything that happens within the duration
+  void runFor(Clock::duration duration) {
+    runUntil([] { return false; }, now() + duration);
+  }
+
+private:
+  // Every actor once, in the order they were attached
+  bool runActors() {
+    bool worked = false;
+    for (int id : attached()) {
+      std::function<bool()> runReady;
+      {
+        std::lock_guard guard{mtx};
+        if (auto actor = actors.find(id); actor != actors.end()) {
+          runReady = actor->second.runReady;
+        }
+      }
+      if (runReady && runReady()) {
+        worked = true;
+      }
+    }
+    return worked;
+  }
+
+  std::optional<Clock::time_point> nextWakeup() {
+    std::optional<Clock::time_point> next;
+    for (int id : attached()) {
+      std::function<std::optional<Clock::time_point>()> wakeup;
+      {
+        std::lock_guard guard{mtx};
+        if (auto actor = actors.find(id); actor != actors.end()) {
+          wakeup = actor->second.nextWakeup;
+        }
+      }
+      if (auto at = wakeup ? wakeup() : std::nullopt;
+          at && (!next || *at < *next)) {
+        next = at;
+      }
+    }
+    return next;
+  }
+
+  std::vector<int> attached() {
+    std::lock_guard guard{mtx};
+    std::vector<int> ids;
+    for (const auto &[id, _] : actors) {
+      ids.push_back(id);
+    }
+    return ids;
+  }
+
+  // Time never runs backwards, a timer in the past is due now
+  void advance(Clock::time_point to) {
+    const Clock::rep ticks = to.time_since_epoch().count();
+    current.store(std::max(current.load(std::memory_order_relaxed), ticks),
+                  std::memory_order_release);
+  }
+
+  std::atomic<Clock::rep> current;
+  Clock::Source *previous;
+  std::recursive_mutex driver;
+  std::mutex mtx; // Guards the actors
+  std::map<int, Clock::Actor> actors;
+  int nextActor{0};
+};
+
+#endif
@@ -0,0 +1,133 @@
+//
+// Doser lending under contention: the mutex guarded set DoserManager used
+// against the atomic DoserBitmap.
+//
+// Eight threads lend and return random dosers of a 16 doser chain as fast as
+// they can, and every 16th operation takes a snapshot of the available
+// dosers, like status publishing and the UI do. Reported are operations per
+// second over all threads and the mean time one operation takes a thread.
+//
+#include "DoserBitmap.hpp"
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+using Seconds = std::chrono::duration<double>;
+using BenchClock = std::chrono::steady_clock;
+
+constexpr int threads = 8;
+constexpr int dosers = 16;
+constexpr int operations = 200'000; // Per thread
+constexpr int snapshotEvery = 16;
+
+// What DoserManager did before the bitmap
+class LockedSet
+{
+public:
+    void reset(int count)
+    {
+        std::lock_guard guard{mtx};
+        for (int i = 0; i < count; ++i)
+        {
+            available.insert(i);
+        }
+    }
+
+    bool take(int id)
+    {
+        std::lock_guard guard{mtx};
+        return available.erase(id) == 1;
+    }
+
+    void give(int id)
+    {
+        std::lock_guard guard{mtx};
+        available.insert(id);
+    }
+
+    std::unordered_set<int> snapshot()
+    {
+        std::lock_guard guard{mtx};
+        return available;
+    }
+
+private:
+    std::mutex mtx;
+    std::unordered_set<int> available;
+};
+
+struct Result
+{
+    double opsPerSecond;
+    double perOperation_ns;
+    long snapshotSizes; // Keeps the snapshots from being optimized away
+};
+
+template <typename Available> Result run()
+{
+    Available available;
+    available.reset(dosers);
+
+    std::atomic<bool> go{false};
+    std::vector<long> sizes(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t] {
+            std::mt19937 rng(t);
+            std::uniform_int_distribution<int> doser{0, dosers - 1};
+            while (!go)
+            {
+            }
+
+            for (int i = 0; i < operations; ++i)
+            {
+                if (i % snapshotEvery == 0)
+                {
+                    sizes[t] += available.snapshot().size();
+                }
+                else if (const int id = doser(rng); available.take(id))
+                {
+                    available.give(id);
+                }
+            }
+        });
+    }
+
+    const auto start = BenchClock::now();
+    go = true;
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    const double seconds = Seconds(BenchClock::now() - start).count();
+
+    long snapshotSizes = 0;
+    for (long size : sizes)
+    {
+        snapshotSizes += size;
+    }
+    return {threads * operations / seconds, seconds * 1e9 / operations, snapshotSizes};
+}
+
+int main()
+{
+    const Result locked = run<LockedSet>();
+    const Result bitmap = run<DoserBitmap>();
+
+    std::cout << threads << " threads, " << dosers << " dosers, a snapshot every " << snapshotEvery
+              << " operations\n"
+              << std::setw(12) << "" << std::setw(14) << "Mops/s" << std::setw(12) << "ns/op" << '\n'
+              << std::fixed << std::setprecision(2);
+    std::cout << std::setw(12) << "mutex+set" << std::setw(14) << locked.opsPerSecond / 1e6 << std::setw(12)
+              << locked.perOperation_ns << '\n';
+    std::cout << std::setw(12) << "bitmap" << std::setw(14) << bitmap.opsPerSecond / 1e6 << std::setw(12)
+              << bitmap.perOperation_ns << '\n';
+    std::cout << "speedup " << bitmap.opsPerSecond / locked.opsPerSecond << "x\n";
+}
@@ -0,0 +1,147 @@
+//
+// Throughput and latency of the CAN bus at the bitrates the chain supports.
+//
+// Runs CANBus on the in-process SimulatedBus against an echo node, in real
+// time. Throughput streams 8 byte extended frames through the bus task,
+// round trip is a request and its response on an idle bus, and chain update
+// is the time to send one SetModuleFlowRates frame to each of 64 modules.
+//
+#include "CANBus.hpp"
+#include "SimulatedBus.hpp"
+#include "can_protocol.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+using Seconds = std::chrono::duration<double>;
+using Millis = std::chrono::duration<double, std::milli>;
+
+constexpr uint32_t bitrates[] = {50'000, 125'000, 250'000, 500'000};
+constexpr int streamFrames = 300;
+constexpr int requests = 200;
+constexpr int chainModules = 64;
+
+// Answers every extended request with its response RPC, echoing address and
+// sequence number, and counts everything else
+class EchoNode
+{
+public:
+    explicit EchoNode(SimulatedBus& bus, uint32_t bitrate) : port{bus.attach()}
+    {
+        port->setBitrate(bitrate);
+        thread = std::jthread([this](std::stop_token stop) { run(stop); });
+    }
+
+    std::atomic<int> received{0};
+
+private:
+    void run(std::stop_token stop)
+    {
+        using namespace can::protocol;
+
+        while (!stop.stop_requested())
+        {
+            auto frame = port->receive(10ms);
+            if (!frame)
+            {
+                continue;
+            }
+
+            const RPC rpc = rpcOf(frame->identifier);
+            if (rpc == RPC::ReadLatency)
+            {
+                Frame response = *frame;
+                response.identifier = identifier(responseRPC(rpc), addressOf(frame->identifier),
+                                                 seqOf(frame->identifier));
+                port->transmit(response, 10ms);
+            }
+            else
+            {
+                ++received;
+            }
+        }
+    }
+
+    std::unique_ptr<SimulatedBus::Port> port;
+    std::jthread thread;
+};
+
+bool waitFor(const std::atomic<int>& count, int target, Clock::duration timeout)
+{
+    const auto deadline = Clock::now() + timeout;
+    while (count < target)
+    {
+        if (Clock::now() > deadline)
+        {
+            return false;
+        }
+        std::this_thread::sleep_for(100us);
+    }
+    return true;
+}
+
+int main()
+{
+    using namespace can::protocol;
+
+    std::cout << std::setw(10) << "bit/s" << std::setw(12) << "frames/s" << std::setw(12) << "load"
+              << std::setw(12) << "rtt p50" << std::setw(12) << "rtt p99" << std::setw(14) << "64 modules"
+              << '\n';
+
+    for (uint32_t bitrate : bitrates)
+    {
+        SimulatedBus bus{bitrate};
+        EchoNode echo{bus, bitrate};
+        auto port = bus.attach();
+        port->setBitrate(bitrate);
+        CANBus can{std::move(port)};
+
+        // Throughput
+        Frame data{identifier(RPC::SetModuleFlowRates, 0), true, 8, {}};
+        const auto streamStart = Clock::now();
+        for (int i = 0; i < streamFrames; ++i)
+        {
+            can.send(data, 1s);
+        }
+        waitFor(echo.received, streamFrames, 10s);
+        const Seconds streamTime = Clock::now() - streamStart;
+        const double framesPerSecond = streamFrames / streamTime.count();
+        const double load = framesPerSecond * frameBits(8, true) / bitrate;
+
+        // Round trip
+        std::vector<Millis> roundTrips;
+        Frame request{identifier(RPC::ReadLatency, 0), true, 0, {}};
+        for (int i = 0; i < requests; ++i)
+        {
+            const auto start = Clock::now();
+            if (can.request(request, 1, 100ms).get().size() == 1)
+            {
+                roundTrips.push_back(Clock::now() - start);
+            }
+        }
+        std::sort(roundTrips.begin(), roundTrips.end());
+        const auto percentile = [&roundTrips](double p) {
+            return roundTrips.empty() ? Millis{0} : roundTrips[static_cast<size_t>(p * (roundTrips.size() - 1))];
+        };
+
+        // Chain update
+        const int before = echo.received;
+        const auto chainStart = Clock::now();
+        for (int module = 0; module < chainModules; ++module)
+        {
+            can.send({identifier(RPC::SetModuleFlowRates, module), true, 8, {}}, 1s);
+        }
+        waitFor(echo.received, before + chainModules, 10s);
+        const Millis chainTime = Clock::now() - chainStart;
+
+        std::cout << std::setw(10) << bitrate << std::fixed << std::setprecision(0) << std::setw(12)
+                  << framesPerSecond << std::setprecision(2) << std::setw(12) << load << std::setw(9)
+                  << percentile(0.5).count() << " ms" << std::setw(9) << percentile(0.99).count() << " ms"
+                  << std::setw(11) << chainTime.count() << " ms\n";
+    }
+}
@@ -0,0 +1,110 @@
+//
+// Cold start to first dose of a DoserModule chain.
+//
+// Models the enumeration handshake of the modules and Sensei on a 50 kbit/s
+// bus. Every module boots when the previous one powers it, sends NewModule
+// until it hears its answer and then listens for the next module. The last
+// module reports LastNode once its detection window passes. Frames are lost
+// with a small probability since the modules don't retransmit, a lost frame
+// costs the module a listen window.
+//
+#include "can_protocol.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+using namespace std::chrono_literals;
+using Duration = std::chrono::duration<double>;
+
+struct Timing
+{
+    const char* name;
+    Duration listen;     // NewModule retry interval
+    Duration nextWindow; // Next module detection window
+};
+
+constexpr double bitrate = 50'000;
+constexpr Duration bootTime = 15ms;     // Power on to the first NewModule
+constexpr Duration handlerLatency = 1ms; // Sensei frame arrival to answer
+constexpr int runs = 200;
+
+Duration frameTime(uint8_t dlc, bool extended)
+{
+    return Duration{can::protocol::frameBits(dlc, extended) / bitrate};
+}
+
+// Restart broadcast followed by the whole enumeration, up to the first dose
+Duration enumerate(const Timing& timing, int modules, double loss, std::mt19937& rng)
+{
+    using namespace can::protocol;
+
+    std::bernoulli_distribution lost{loss};
+    Duration t = frameTime(sizeof(RestartCommand), true);
+
+    for (int i = 0; i < modules; ++i)
+    {
+        t += bootTime;
+        for (;;)
+        {
+            const bool requestLost = lost(rng);
+            t += frameTime(sizeof(NewModuleCommand), false);
+            if (!requestLost)
+            {
+                const Duration answered = handlerLatency + frameTime(sizeof(NewModuleResponse), false);
+                if (!lost(rng))
+                {
+                    t += answered;
+                    break;
+                }
+            }
+            t += timing.listen;
+        }
+    }
+
+    t += timing.nextWindow + frameTime(sizeof(LastNodeCommand), false);
+    return t + frameTime(sizeof(SetFlowRateCommand), true);
+}
+
+// Announce round of an already enumerated chain, the switch off broadcast and
+// the first dose
+Duration attach(int modules, uint16_t slot_us)
+{
+    using namespace can::protocol;
+
+    const Duration slot = std::chrono::microseconds(slot_us);
+    const Duration lastAnswer = frameTime(sizeof(AnnounceCommand), true) + (modules - 1) * slot +
+                                frameTime(sizeof(AnnounceResponse), true);
+    return lastAnswer + handlerLatency + frameTime(sizeof(SetModuleFlowRatesCommand), true) +
+           frameTime(sizeof(SetFlowRateCommand), true);
+}
+
+int main()
+{
+    constexpr int modules = 32;
+    constexpr uint16_t announceSlot_us = 4000;
+
+    const Timing legacy{"legacy", 500ms, 500ms};
+    const Timing fast{"fast", 20ms, 500ms};
+
+    std::cout << "Cold start to first dose, " << modules << " modules\n";
+    for (double loss : {0.0, 0.01, 0.05})
+    {
+        for (const Timing& timing : {legacy, fast})
+        {
+            std::mt19937 rng{1};
+            Duration total{0}, worst{0};
+            for (int run = 0; run < runs; ++run)
+            {
+                const Duration t = enumerate(timing, modules, loss, rng);
+                total += t;
+                worst = std::max(worst, t);
+            }
+            std::cout << std::setw(8) << timing.name << " loss " << std::fixed << std::setprecision(2) << loss
+                      << ": mean " << std::setprecision(3) << (total / runs).count() << " s, worst "
+                      << worst.count() << " s\n";
+        }
+    }
+    std::cout << std::setw(8) << "cached" << " attach: " << std::fixed << std::setprecision(3)
+              << attach(modules, announceSlot_us).count() << " s\n";
+}
@@ -0,0 +1,293 @@
+//
+// DoserManager micro-benchmarks, to track regressions as the manager changes.
+//
+// Over thread counts and chains of 8 to 256 dosers it measures:
+//  - lend: lendDoser() and giving the doser back, operations per second over
+//    all threads
+//  - on: latency of Doser::on() while the threads compete for the slots
+//  - try_on: how often Doser::tryOn() finds every slot taken
+//  - memory: heap bytes per doser of a manager with every doser lent, and
+//    after every doser dosed once, over those of a manager without dosers
+//
+// Threads turning dosers on own disjoint dosers, as controllers do, and hold
+// the slot for a few microseconds. Output is CSV, one measurement per row:
+// benchmark,threads,dosers,metric,value
+//
+#include "DoserManager.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <malloc.h>
+#include <new>
+#include <random>
+#include <thread>
+#include <vector>
+
+using Nanos = std::chrono::duration<double, std::nano>;
+using Seconds = std::chrono::duration<double>;
+using BenchClock = std::chrono::steady_clock;
+
+constexpr int threadCounts[] = {1, 2, 4, 8, 16};
+constexpr int doserCounts[] = {8, 32, 64, 256};
+constexpr int slotCount = 4;
+constexpr int lendOperations = 20'000; // Per thread
+constexpr int onOperations = 2'000;    // Per thread
+constexpr auto hold = std::chrono::microseconds{5};
+
+// Heap bytes in use, counted by the replaced global allocator below
+std::atomic<long> heapBytes{0};
+
+void* operator new(std::size_t size)
+{
+    void* p = std::malloc(size ? size : 1);
+    if (!p)
+    {
+        throw std::bad_alloc{};
+    }
+    heapBytes += malloc_usable_size(p);
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p)
+    {
+        heapBytes -= malloc_usable_size(p);
+        std::free(p);
+    }
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    operator delete(p);
+}
+
+// Dosers that do nothing, so only the manager is measured
+class BenchManager : public DoserManager
+{
+public:
+    explicit BenchManager(int dosers) : DoserManager{slotCount}, dosers{dosers}
+    {
+        connectDosers();
+    }
+
+    ~BenchManager()
+    {
+        shutdown();
+    }
+
+private:
+    std::vector<float> implConnectDosers() override
+    {
+        return std::vector<float>(dosers, 100);
+    }
+
+    void implDoserOn(int, float) override
+    {
+        ++switched;
+    }
+
+    void implDoserOff(int) override
+    {
+        ++switched;
+    }
+
+    const int dosers;
+    std::atomic<long> switched{0};
+};
+
+void report(const char* benchmark, int threads, int dosers, const char* metric, double value)
+{
+    std::cout << benchmark << ',' << threads << ',' << dosers << ',' << metric << ',' << value << '\n';
+}
+
+void spin(BenchClock::duration duration)
+{
+    const auto until = BenchClock::now() + duration;
+    while (BenchClock::now() < until)
+    {
+    }
+}
+
+// Starts the workers together and returns the seconds until all of them ended
+template <typename Work> double runThreads(int threads, Work work)
+{
+    std::atomic<bool> go{false};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t] {
+            while (!go)
+            {
+                std::this_thread::yield();
+            }
+            work(t);
+        });
+    }
+
+    const auto start = BenchClock::now();
+    go = true;
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    return Seconds(BenchClock::now() - start).count();
+}
+
+void benchLend(int threads, int dosers)
+{
+    BenchManager manager{dosers};
+    std::atomic<long> lent{0};
+    const double seconds = runThreads(threads, [&](int t) {
+        std::mt19937 rng(t);
+        std::uniform_int_distribution<int> doser{0, dosers - 1};
+        long mine = 0;
+        for (int i = 0; i < lendOperations; ++i)
+        {
+            // Given back when it goes out of scope
+            mine += manager.lendDoser(doser(rng)).has_value();
+        }
+        lent += mine;
+    });
+    report("lend", threads, dosers, "ops_per_s", threads * lendOperations / seconds);
+    report("lend", threads, dosers, "success_rate", double(lent) / (threads * lendOperations));
+}
+
+// The dosers of thread t are t, t + threads, ...
+std::vector<DoserManager::Doser> lendOwn(BenchManager& manager, int t, int threads, int dosers)
+{
+    std::vector<DoserManager::Doser> own;
+    for (int id = t; id < dosers; id += threads)
+    {
+        own.push_back(std::move(*manager.lendDoser(id)));
+    }
+    return own;
+}
+
+void benchOn(int threads, int dosers)
+{
+    BenchManager manager{dosers};
+    std::vector<std::vector<double>> latencies(threads);
+    runThreads(threads, [&](int t) {
+        auto own = lendOwn(manager, t, threads, dosers);
+        latencies[t].reserve(onOperations);
+        for (int i = 0; i < onOperations; ++i)
+        {
+            auto& doser = own[i % own.size()];
+            const auto start = BenchClock::now();
+            doser.on(100);
+            latencies[t].push_back(Nanos(BenchClock::now() - start).count());
+            spin(hold);
+            doser.off();
+        }
+    });
+
+    std::vector<double> all;
+    for (const auto& latency : latencies)
+    {
+        all.insert(all.end(), latency.begin(), latency.end());
+    }
+    std::sort(all.begin(), all.end());
+    double sum = 0;
+    for (double latency : all)
+    {
+        sum += latency;
+    }
+    report("on", threads, dosers, "mean_ns", sum / all.size());
+    report("on", threads, dosers, "p50_ns", all[all.size() / 2]);
+    report("on", threads, dosers, "p99_ns", all[all.size() * 99 / 100]);
+    report("on", threads, dosers, "max_ns", all.back());
+}
+
+void benchTryOn(int threads, int dosers)
+{
+    BenchManager manager{dosers};
+    std::atomic<long> failed{0};
+    runThreads(threads, [&](int t) {
+        auto own = lendOwn(manager, t, threads, dosers);
+        long mine = 0;
+        for (int i = 0; i < onOperations; ++i)
+        {
+            auto& doser = own[i % own.size()];
+            if (doser.tryOn(100))
+            {
+                spin(hold);
+                doser.off();
+            }
+            else
+            {
+                ++mine;
+                std::this_thread::yield();
+            }
+        }
+        failed += mine;
+    });
+    report("try_on", threads, dosers, "failure_rate", double(failed) / (threads * onOperations));
+}
+
+struct Footprint
+{
+    long lent;  // Heap bytes with every doser lent
+    long dosed; // After every doser dosed once
+};
+
+Footprint footprint(int dosers)
+{
+    Footprint bytes{};
+    const long before = heapBytes;
+    BenchManager manager{dosers};
+    std::vector<DoserManager::Doser> lent;
+    lent.reserve(dosers);
+    for (int id = 0; id < dosers; ++id)
+    {
+        lent.push_back(std::move(*manager.lendDoser(id)));
+    }
+    bytes.lent = heapBytes - before;
+
+    // Leaves results, ledger entries and the like behind
+    std::vector<std::future<float>> doses;
+    for (auto& doser : lent)
+    {
+        doses.push_back(doser.dose(0.001f, 6000));
+    }
+    for (auto& dose : doses)
+    {
+        dose.get();
+    }
+    doses.clear();
+    doses.shrink_to_fit();
+    bytes.dosed = heapBytes - before;
+    return bytes;
+}
+
+// Per doser over what a manager without dosers takes
+void benchMemory(int dosers, const Footprint& base)
+{
+    const Footprint bytes = footprint(dosers);
+    report("memory", 1, dosers, "lent_bytes_per_doser", double(bytes.lent - base.lent) / dosers);
+    report("memory", 1, dosers, "dosed_bytes_per_doser", double(bytes.dosed - base.dosed) / dosers);
+}
+
+int main()
+{
+    std::cout << "benchmark,threads,dosers,metric,value\n";
+    const Footprint base = footprint(0);
+    report("memory", 1, 0, "manager_heap_bytes", base.lent);
+    report("memory", 1, 0, "manager_bytes", sizeof(BenchManager));
+    report("memory", 1, 0, "doser_handle_bytes", sizeof(DoserManager::Doser));
+    for (int dosers : doserCounts)
+    {
+        benchMemory(dosers, base);
+        for (int threads : threadCounts)
+        {
+            benchLend(threads, dosers);
+            if (threads <= dosers)
+            {
+                benchOn(threads, dosers);
+                benchTryOn(threads, dosers);
+            }
+        }
+    }
+}
@@ -0,0 +1,112 @@
+//
+// Recipe completion time of planned against first come first served doses.
+//
+// Draws random nutrient schedules, a few long doses among many short ones,
+// and compares the makespan of the doses started in the order they were
+// queued, which is what the parallelism semaphore does, with the longest
+// first plan of DosePlanner. Both are measured against the lower bound of
+// total dosing time spread over every slot, the longest single dose or, with
+// one dose per module at a time, the busiest module.
+//
+#include "DosePlanner.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <vector>
+
+using Seconds = std::chrono::duration<double>;
+
+constexpr int schedules = 2000;
+constexpr int modules = 8; // Two dosers each
+constexpr int dosersPerModule = 2;
+
+struct Result
+{
+    double fifo{};     // Mean makespan in s
+    double planned{};
+    double fifoOverBound{};   // Worst makespan over the lower bound
+    double plannedOverBound{};
+    int improved{};
+};
+
+std::vector<DoseJob> randomSchedule(std::mt19937& rng)
+{
+    std::uniform_int_distribution<int> count{3, modules * dosersPerModule};
+    std::uniform_real_distribution<double> shortDose{1, 10};
+    std::uniform_real_distribution<double> longDose{20, 90};
+    std::bernoulli_distribution isLong{0.2};
+
+    std::vector<int> dosers(modules * dosersPerModule);
+    std::iota(dosers.begin(), dosers.end(), 0);
+    std::shuffle(dosers.begin(), dosers.end(), rng);
+    dosers.resize(count(rng));
+
+    std::vector<DoseJob> jobs;
+    for (int doser : dosers)
+    {
+        const double seconds = isLong(rng) ? longDose(rng) : shortDose(rng);
+        jobs.push_back({doser / dosersPerModule,
+                        std::chrono::duration_cast<Clock::duration>(Seconds{seconds})});
+    }
+    return jobs;
+}
+
+Result compare(int parallelMax, int moduleMax)
+{
+    std::mt19937 rng{1234};
+    Result result;
+    for (int i = 0; i < schedules; ++i)
+    {
+        const auto jobs = randomSchedule(rng);
+        std::vector<size_t> fifo(jobs.size());
+        std::iota(fifo.begin(), fifo.end(), 0);
+
+        Clock::duration total{};
+        Clock::duration longest{};
+        std::vector<Clock::duration> perModule(modules);
+        for (const DoseJob& job : jobs)
+        {
+            total += job.duration;
+            longest = std::max(longest, job.duration);
+            perModule[job.module] += job.duration;
+        }
+        double bound = std::max(Seconds{total}.count() / parallelMax, Seconds{longest}.count());
+        if (moduleMax > 0)
+        {
+            const auto busiest = *std::max_element(perModule.begin(), perModule.end());
+            bound = std::max(bound, Seconds{busiest}.count() / moduleMax);
+        }
+
+        const double queued = Seconds{scheduleInOrder(jobs, fifo, parallelMax, moduleMax).makespan}.count();
+        const double planned = Seconds{planDoses(jobs, parallelMax, moduleMax).makespan}.count();
+
+        result.fifo += queued / schedules;
+        result.planned += planned / schedules;
+        result.fifoOverBound = std::max(result.fifoOverBound, queued / bound);
+        result.plannedOverBound = std::max(result.plannedOverBound, planned / bound);
+        result.improved += planned < queued;
+    }
+    return result;
+}
+
+int main()
+{
+    std::cout << std::setw(9) << "parallel" << std::setw(8) << "module" << std::setw(10) << "fifo s"
+              << std::setw(10) << "planned s" << std::setw(9) << "gain" << std::setw(12) << "fifo/bound"
+              << std::setw(14) << "planned/bound" << std::setw(10) << "improved" << '\n';
+
+    for (int parallelMax : {2, 3, 4, 6})
+    {
+        for (int moduleMax : {0, 1})
+        {
+            const Result r = compare(parallelMax, moduleMax);
+            std::cout << std::setw(9) << parallelMax << std::setw(8) << (moduleMax ? "1" : "-") << std::fixed
+                      << std::setprecision(1) << std::setw(10) << r.fifo << std::setw(10) << r.planned
+                      << std::setw(8) << 100 * (1 - r.planned / r.fifo) << '%' << std::setprecision(2)
+                      << std::setw(12) << r.fifoOverBound << std::setw(14) << r.plannedOverBound
+                      << std::setw(9) << 100 * r.improved / schedules << "%\n";
+        }
+    }
+}
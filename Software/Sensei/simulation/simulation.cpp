@@ -1,9 +1,35 @@
 //
 // Created by vaige on 20.7.2024.
 //
-#include <iostream>
-#include "../src/Pid.h"
+// pH and nutrient control of a reservoir.
+//
+// Runs the controllers with a DoserManager on virtual time against a
+// reservoir in which what is dosed mixes in with a time constant and plants
+// take nutrients up. For pH, bang-bang against PID on a large and a small
+// reservoir: the time until the pH stays within the accepted error, the
+// overshoot past the target, and the doses it took. For nutrients, full
+// schedule shots against doses scaled to the EC deficit: the adjustments
+// until EC reaches the target, the overshoot, and the dosing over a day.
+// Both also run on a conservative fixed interval and with a settling
+// detector that adjusts as soon as a dose has mixed in, and with MPC that
+// plans the doses on the reservoir's model.
+//
+#include "ControlScheduler.hpp"
+#include "DoserManager.hpp"
+#include "NutrientController.hpp"
+#include "Mpc.hpp"
+#include "PhController.hpp"
+#include "SettlingDetector.hpp"
+#include "VirtualClock.hpp"
+#include <chrono>
+#include <cmath>
 #include <iomanip>
+#include <iostream>
+#include <optional>
+#include <vector>
+
+using namespace std::chrono_literals;
+using Minutes = std::chrono::duration<float, std::chrono::minutes::period>;
 
 class Reservoir
 {
@@ -11,6 +37,8 @@ private:
     float liquid_amount;
     float ph;
     float ec;
+    float unmixed{0}; // pH change of what was added but didn't mix in yet
+    float unmixed_ec{0};
 public:
     Reservoir(float liquid_amount, float ph, float ec)
     : liquid_amount{liquid_amount}, ph{ph}, ec{ec}
@@ -30,18 +58,34 @@ public:
     {
         // Suppose that 1ml / 10000ml makes ph go down by 1
         const float ratio = amount / liquid_amount;
-        ph -= ratio  * 10000.0f;
+        unmixed -= ratio  * 10000.0f;
     }
 
     void add_ph_up(float amount)
     {
         const float ratio = amount / liquid_amount;
-        ph += ratio  * 10000.0f;
+        unmixed += ratio  * 10000.0f;
     }
 
-    void add_nutrient(float amount)
+    // Strength is the EC 1 ml of the nutrient gives a liter
+    void add_nutrient(float amount, float strength)
     {
+        unmixed_ec += amount / liquid_amount * 1000.0f * strength;
+    }
 
+    // What was added mixes in with the time constant
+    void mix(Minutes dt, Minutes mixing)
+    {
+        const float fraction = 1 - std::exp(-dt / mixing);
+        ph += unmixed * fraction;
+        unmixed -= unmixed * fraction;
+        ec += unmixed_ec * fraction;
+        unmixed_ec -= unmixed_ec * fraction;
+    }
+
+    void take_up(float ec_amount)
+    {
+        ec = std::max(0.0f, ec - ec_amount);
     }
 
     float get_liquid_amount() const { return liquid_amount; }
@@ -49,30 +93,373 @@ public:
     float get_ec() const { return ec; }
 };
 
-using namespace std::chrono_literals;
+constexpr int phDown = 0;
+constexpr int phUp = 1;
+constexpr int nutrientA = 2;
+constexpr int nutrientB = 3;
+constexpr float strengthA = 1.0f;
+constexpr float strengthB = 1.4f;
+constexpr float startPh = 7.0f;
+constexpr float target = 5.8f;
+constexpr float acceptedError = 0.1f;
+constexpr auto mixing = 3min;
+constexpr auto physicsStep = 10s;
+constexpr auto horizon = 8h;
 
-int main(int argc, char** argv)
+// Pumps into the reservoir, at the flow rate for as long as a doser is on
+class ReservoirDosers : public DoserManager
 {
-    Reservoir reservoir{250 * 1000, 10.0f, 0.2f};
-    constexpr float target = 5.8f;
-    Pid pid{reservoir.get_liquid_amount() / 1000.0f / 20.0f, 0.000f, 0.0f};
+public:
+    explicit ReservoirDosers(Reservoir& reservoir) : DoserManager{4}, reservoir{reservoir}
+    {
+        connectDosers();
+    }
+
+    ~ReservoirDosers()
+    {
+        shutdown();
+    }
+
+    int doses{0};
+    float pumped_mL{0};
 
-    int count{0};
-    while (std::abs(reservoir.get_ph() - target) > 0.1f)
+private:
+    std::vector<float> implConnectDosers() override
+    {
+        return {60, 60, 60, 60};
+    }
+
+    void implDoserOn(int id, float flowRate) override
     {
-        const float err = target - reservoir.get_ph();
-        float result = pid.update(err, 60s);
-        std::cout << "ph: " << std::fixed << std::setprecision(3) << std::setw(5) << reservoir.get_ph()
-                  << " add: " << std::fixed << std::setprecision(3) << std::setw(5) << std::abs(result) << "ml of " << ((result > 0.0f) ? "ph-up" : "ph-down") << std::endl;
-        if (result > 0)
+        running[id] = {flowRate, Clock::now()};
+        ++doses;
+    }
+
+    void implDoserOff(int id) override
+    {
+        if (auto [flowRate, since] = running[id]; flowRate > 0)
         {
-            reservoir.add_ph_up(std::abs(result));
+            const float amount = flowRate * Minutes(Clock::now() - since).count();
+            pumped_mL += amount;
+            switch (id)
+            {
+            case phDown:
+                reservoir.add_ph_down(amount);
+                break;
+            case phUp:
+                reservoir.add_ph_up(amount);
+                break;
+            default:
+                reservoir.add_nutrient(amount, id == nutrientA ? strengthA : strengthB);
+            }
         }
-        else
+        running[id] = {};
+    }
+
+    Reservoir& reservoir;
+    std::pair<float, Clock::time_point> running[4]{};
+};
+
+// Publishes a sample every physics step, as the firmware's sensor task does
+class PhProbe : public Sensor
+{
+public:
+    explicit PhProbe(const Reservoir& reservoir) : reservoir{reservoir} {}
+
+    float reading() const override { return reservoir.get_ph(); }
+    void sample() { published(); }
+
+private:
+    const Reservoir& reservoir;
+};
+
+class EcProbe : public Sensor
+{
+public:
+    explicit EcProbe(const Reservoir& reservoir) : reservoir{reservoir} {}
+
+    float reading() const override { return reservoir.get_ec(); }
+    void sample() { published(); }
+
+private:
+    const Reservoir& reservoir;
+};
+
+struct Result
+{
+    std::optional<Minutes> settled; // None if it never stays within the error
+    float overshoot{0};
+    int doses{0};
+    float pumped_mL{0};
+};
+
+Result simulate(float liters, const PhController::Config& config)
+{
+    VirtualClock clock;
+    const auto start = Clock::now();
+    Reservoir reservoir{liters * 1000, startPh, 0.2f};
+    auto dosers = std::make_unique<ReservoirDosers>(reservoir);
+    auto& reservoirDosers = *dosers;
+    gDoserManager = std::move(dosers);
+
+    Result result;
+    {
+        PhProbe probe{reservoir};
+        PhController controller{probe};
+        ControlScheduler scheduler;
+        std::optional<Clock::time_point> within;
+        auto physics = [&]() -> ControlTask {
+            for (;;)
+            {
+                co_await sleepFor(physicsStep);
+                reservoir.mix(physicsStep, mixing);
+                probe.sample();
+                const float ph = reservoir.get_ph();
+                result.overshoot = std::max(result.overshoot, target - ph);
+                if (std::abs(ph - target) > acceptedError)
+                {
+                    within.reset();
+                }
+                else if (!within)
+                {
+                    within = Clock::now();
+                }
+            }
+        };
+        scheduler.spawn(physics());
+        scheduler.spawn(controller.run());
+        controller.start(config);
+        clock.runFor(horizon);
+        controller.stop();
+        if (within)
         {
-            reservoir.add_ph_down(std::abs(result));
+            result.settled = *within - start;
         }
-        ++count;
     }
-    std::cout << "PH adjusted in " << count << "-minutes\n";
-}
\ No newline at end of file
+
+    result.doses = reservoirDosers.doses;
+    result.pumped_mL = reservoirDosers.pumped_mL;
+    gDoserManager.reset();
+    return result;
+}
+
+PhController::Config bangBang()
+{
+    return {.target = target,
+            .acceptedError = acceptedError,
+            .flowRate = 60,
+            .doseAmount = 2,
+            .adjustInterval = 5min,
+            .pHDownDoser = phDown,
+            .pHUpDoser = phUp};
+}
+
+// Gains scale with the reservoir, it takes liters / 10 mL to move it by 1 pH
+PhController::Config pid(float liters)
+{
+    PhController::Config config = bangBang();
+    const float mL_per_pH = liters / 10;
+    config.mode = PhController::Mode::Pid;
+    config.kp = 0.5f * mL_per_pH;
+    config.ki = config.kp / 7200;
+    config.kd = config.kp * 60;
+    config.derivativeFilter = 2min;
+    config.maxDose = 20;
+    config.minDose = 0.05f;
+    return config;
+}
+
+// Plans on the simulated reservoir's own model, 1 mL in a liter moves the pH
+// by 10
+PhController::Config mpc(float liters)
+{
+    PhController::Config config = bangBang();
+    config.mode = PhController::Mode::Mpc;
+    config.maxDose = 20;
+    config.minDose = 0.05f;
+    config.volume = liters;
+    config.mixing = mixing;
+    config.upStrength = 10;
+    config.downStrength = 10;
+    return config;
+}
+
+// An interval long enough for the slowest mixing, which the controllers
+// use without a settling detector
+constexpr auto conservative = 15min;
+
+template <typename Config> Config slow(Config config)
+{
+    config.adjustInterval = conservative;
+    return config;
+}
+
+// Adjusts once the reading settled after a dose, waiting the conservative
+// interval at most
+template <typename Config> Config settling(Config config)
+{
+    config.adjustInterval = conservative;
+    config.settling = SettlingDetector::Config{2min, 15s, 0.01f, 0.01f};
+    return config;
+}
+
+constexpr float ecTarget = 1.4f;
+constexpr float ecAccepted = 0.05f;
+constexpr float uptake_per_h = 0.01f;
+
+struct NutrientResult
+{
+    std::optional<int> cycles; // Dosing adjustments until EC reached the target
+    Minutes reached{0};
+    float overshoot{0};
+    int dosingCycles{0}; // Over the whole day
+    float pumped_mL{0};
+};
+
+NutrientResult simulateNutrients(float startEc, const NutrientController::Config& config)
+{
+    constexpr float liters = 100;
+    VirtualClock clock;
+    const auto start = Clock::now();
+    Reservoir reservoir{liters * 1000, target, startEc};
+    auto dosers = std::make_unique<ReservoirDosers>(reservoir);
+    auto& reservoirDosers = *dosers;
+    gDoserManager = std::move(dosers);
+
+    NutrientResult result;
+    {
+        EcProbe probe{reservoir};
+        NutrientController controller{probe};
+        ControlScheduler scheduler;
+        auto physics = [&]() -> ControlTask {
+            for (;;)
+            {
+                co_await sleepFor(physicsStep);
+                reservoir.mix(physicsStep, mixing);
+                reservoir.take_up(uptake_per_h * std::chrono::duration<float, std::ratio<3600>>(physicsStep).count());
+                probe.sample();
+                const float ec = reservoir.get_ec();
+                result.overshoot = std::max(result.overshoot, ec - ecTarget);
+                if (!result.cycles && ec >= ecTarget - ecAccepted)
+                {
+                    // Both nutrients dose together, every cycle switches two dosers on
+                    result.cycles = reservoirDosers.doses / 2;
+                    result.reached = Clock::now() - start;
+                }
+            }
+        };
+        scheduler.spawn(physics());
+        scheduler.spawn(controller.run());
+        clock.runFor(1s);
+        controller.start(config);
+        clock.runFor(24h);
+        controller.stop();
+    }
+
+    result.dosingCycles = reservoirDosers.doses / 2;
+    result.pumped_mL = reservoirDosers.pumped_mL;
+    gDoserManager.reset();
+    return result;
+}
+
+NutrientController::Config nutrients(NutrientController::Mode mode)
+{
+    return {.target = ecTarget,
+            .acceptedError = ecAccepted,
+            .flowRate = 60,
+            .adjustInterval = 10min,
+            .schedule = {{nutrientA, 5}, {nutrientB, 5}},
+            .mode = mode,
+            // The schedule in a liter adds 5 * 1.0 + 5 * 1.4 EC
+            .volume = 100,
+            .mixing = mixing,
+            .strength = 5 * strengthA + 5 * strengthB};
+}
+
+void printNutrients(float startEc, const char* mode, const NutrientResult& r)
+{
+    std::cout << std::fixed << std::setprecision(2) << std::setw(7) << startEc << std::setw(16) << mode;
+    if (r.cycles)
+    {
+        std::cout << std::setw(8) << *r.cycles << std::setprecision(0) << std::setw(9) << r.reached.count()
+                  << std::setprecision(2);
+    }
+    else
+    {
+        std::cout << std::setw(8) << "never" << std::setw(9) << "-";
+    }
+    std::cout << std::setw(11) << r.overshoot << std::setw(8) << r.dosingCycles << std::setprecision(1)
+              << std::setw(10) << r.pumped_mL << '\n';
+}
+
+void print(float liters, const char* mode, const Result& r)
+{
+    std::cout << std::fixed << std::setprecision(0) << std::setw(7) << liters << std::setw(20) << mode
+              << std::setw(12);
+    if (r.settled)
+    {
+        std::cout << r.settled->count();
+    }
+    else
+    {
+        std::cout << "never";
+    }
+    std::cout << std::setprecision(2) << std::setw(11) << r.overshoot << std::setw(7) << r.doses << std::setprecision(1)
+              << std::setw(10) << r.pumped_mL << '\n';
+}
+
+// The solver's cost at its largest horizon, on the host's steady clock
+void timeSolver()
+{
+    constexpr int plans = 1000;
+    Mpc mpc;
+    mpc.horizon = Mpc::maxHorizon;
+    const Mpc::Model model{0.04f, mixing};
+    float sum = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < plans; ++i)
+    {
+        sum += mpc.plan(model, 5min, 20, 1.2f + i * 1e-4f, 0.1f);
+    }
+    const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "\nMPC plan, horizon " << mpc.horizon << ", " << mpc.iterations << " iterations: " << std::setprecision(1)
+              << elapsed.count() / plans << " us on this host, at most "
+              << (mpc.horizon * mpc.horizon + 32 * mpc.horizon) * mpc.iterations << " operations (dose " << sum / plans
+              << " mL)\n";
+}
+
+int main()
+{
+    std::cout << "pH " << startPh << " to " << target << " +- " << acceptedError << ", adjusting every 5 min unless noted, "
+              << Minutes(mixing).count() << " min mixing, " << std::chrono::hours(horizon).count() << " h\n"
+              << std::setw(7) << "liters" << std::setw(20) << "mode" << std::setw(12) << "settled min"
+              << std::setw(11) << "overshoot" << std::setw(7) << "doses" << std::setw(10) << "pumped mL" << '\n';
+    for (float liters : {250.0f, 20.0f})
+    {
+        print(liters, "bang-bang", simulate(liters, bangBang()));
+        print(liters, "pid", simulate(liters, pid(liters)));
+        print(liters, "mpc", simulate(liters, mpc(liters)));
+        print(liters, "bang-bang 15 min", simulate(liters, slow(bangBang())));
+        print(liters, "pid 15 min", simulate(liters, slow(pid(liters))));
+        print(liters, "bang-bang settling", simulate(liters, settling(bangBang())));
+        print(liters, "pid settling", simulate(liters, settling(pid(liters))));
+        print(liters, "mpc 15 min", simulate(liters, slow(mpc(liters))));
+    }
+
+    std::cout << std::setprecision(2) << "\nEC to " << ecTarget << " -" << ecAccepted << " in 100 l, adjusting every 10 min unless noted, schedule 5 + 5 ml, "
+              << uptake_per_h << " EC/h uptake, 24 h\n"
+              << std::setw(7) << "from" << std::setw(16) << "mode" << std::setw(8) << "cycles" << std::setw(9)
+              << "min" << std::setw(11)
+              << "overshoot" << std::setw(8) << "dosing" << std::setw(10) << "pumped mL" << '\n';
+    for (float startEc : {0.6f, 1.3f})
+    {
+        const auto proportional = nutrients(NutrientController::Mode::Proportional);
+        printNutrients(startEc, "schedule", simulateNutrients(startEc, nutrients(NutrientController::Mode::Schedule)));
+        printNutrients(startEc, "proportional", simulateNutrients(startEc, proportional));
+        printNutrients(startEc, "prop. 15 min", simulateNutrients(startEc, slow(proportional)));
+        printNutrients(startEc, "prop. settling", simulateNutrients(startEc, settling(proportional)));
+        printNutrients(startEc, "mpc", simulateNutrients(startEc, nutrients(NutrientController::Mode::Mpc)));
+    }
+
+    timeSolver();
+}
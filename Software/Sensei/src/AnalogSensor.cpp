@@ -52,19 +52,22 @@ void AnalogSensor::read()
         return 3.3f * avg / 0xFFF;
     }(channel);
 
-    std::lock_guard guard{mtx};
+    {
+        std::lock_guard guard{mtx};
 
-    CalibrationPoint& lowPoint = calibration.first;
-    CalibrationPoint& highPoint = calibration.second;
+        CalibrationPoint& lowPoint = calibration.first;
+        CalibrationPoint& highPoint = calibration.second;
 
-    const float k = (highPoint.value - lowPoint.value) / (highPoint.voltage - lowPoint.voltage);
-    readings.push_back({lowPoint.value + k * (voltage - lowPoint.voltage), voltage});
+        const float k = (highPoint.value - lowPoint.value) / (highPoint.voltage - lowPoint.voltage);
+        readings.push_back({lowPoint.value + k * (voltage - lowPoint.voltage), voltage});
 
-    if (readings.size() > 10) {
-        readings.pop_front();
-    }
+        if (readings.size() > 10) {
+            readings.pop_front();
+        }
 
-    value = readings.back().value;
+        value = readings.back().value;
+    }
+    published();
 }
 
 float AnalogSensor::reading() const
@@ -24,6 +24,7 @@ public:
     using CalibrationData = std::pair<CalibrationPoint, CalibrationPoint>;
 
     AnalogSensor(int ioNum, CalibrationData calibration, const char* nvsNameSpace);
+    // Takes a sample and publishes it
     void read();
     float reading() const override;
     void calibrate(float actual);
@@ -4,28 +4,57 @@
 #include "AnalogSensor.hpp"
 #include "CANDoserManager.hpp"
 #include "Clock.hpp"
+#include "ControlScheduler.hpp"
 #include "DFRobot_RGBLCD1602.h"
 #include "DeltaTimer.hpp"
 #include "NutrientController.hpp"
 #include "PhController.hpp"
+#include "TWAITransport.hpp"
 #include "adc.hpp"
-#include "can.h"
+#include "nvs.h"
+#include "util.h"
 #include "wifi.hpp"
+#include <algorithm>
+#include <map>
 #include <memory>
+#include <stdexcept>
 #include <thread>
+#include <utility>
 
 // Goal: provide a public thread-safe api for server to use
 
 class App {
+  static constexpr char tag[] = "App";
+  static constexpr char nvsDosingNameSpace[] = "dosing";
+  // How long stopAll() waits for the modules to report their doses
+  static constexpr Clock::duration stopReportTimeout =
+      std::chrono::milliseconds(200);
+  // How often the volume ledger is checked for a due flush
+  static constexpr Clock::duration ledgerCheckInterval =
+      std::chrono::minutes(1);
+
 public:
   enum class State { Init, Normal };
 
+  // How many dosers run together and the supply current they may draw, kept
+  // across restarts. Without a stored setting one doser runs at a time and
+  // the current isn't limited. Neither the supply nor the pumps are rated in
+  // the hardware files, so raise these only for a supply that is known to
+  // carry the load: the DRV8874 drivers of a module don't limit it.
+  struct DosingLimits {
+    int parallelDosers{1};
+    CurrentBudget supply{}; // mA, total/module
+  };
+
   struct Status {
     float ph;
     float ec;
     std::vector<float> flowRates;
+    std::vector<DoserTelemetry> telemetry; // Streamed by the modules
     bool pHControllerRunning;
     bool nutrientContollerRunning;
+    std::array<SlotScheduler::WaitStats, slotClasses> slotWaits;
+    std::map<int, DoserVolume> volumes;
   };
 
   App() {
@@ -39,7 +68,6 @@ public:
 
     ESP_ERROR_CHECK(i2c::init(GPIO_NUM_5, GPIO_NUM_18));
     ESP_ERROR_CHECK(adc::init());
-    ESP_ERROR_CHECK(can::init());
 
     lcd = std::make_unique<DFRobot_RGBLCD1602>(0x60);
 
@@ -71,7 +99,16 @@ public:
                                       CalibrationPoint{3.f, 3.f}},
         "EC_sensor");
 
-    gDoserManager = std::make_unique<CANDoserManager>(1);
+    const DosingLimits limits = loadDosingLimits();
+    auto canDoserManager = std::make_unique<CANDoserManager>(
+        limits.parallelDosers,
+        std::make_unique<TWAITransport>(CANDoserManager::loadBitrate()));
+    canDoserManager->setCurrentBudget(limits.supply);
+#ifdef ESP_PLATFORM
+    canDoserManager->ledger().attach(std::make_unique<NvsLedgerStore>());
+#endif
+    canDosers = canDoserManager.get();
+    gDoserManager = std::move(canDoserManager);
 
     nutrientController = std::make_unique<NutrientController>(*ecSensor);
 
@@ -86,10 +123,13 @@ public:
       }
     });
 
-    nutrientControllerThread =
-        std::jthread([this]() { nutrientController->run(); });
-
-    pHControllerThread = std::jthread([this]() { pHController->run(); });
+    // Every control loop shares one task, they only wait on doses, timers
+    // and the sensors' samples
+    controlScheduler.spawn(nutrientController->run());
+    controlScheduler.spawn(pHController->run());
+    controlScheduler.spawn(maintainLedger());
+    controlThread = std::jthread(
+        [this](std::stop_token stop) { controlScheduler.run(stop); });
 
     state = State::Normal;
   }
@@ -97,13 +137,61 @@ public:
   ~App() {
     ESP_ERROR_CHECK(i2c::shutdown());
     ESP_ERROR_CHECK(adc::shutdown());
-    ESP_ERROR_CHECK(can::shutdown());
   }
 
   Status status() const {
-    return {pHSensor->reading(), ecSensor->reading(),
-            gDoserManager->getFlowRates(), pHController->isRunning(),
-            nutrientController->isRunning()};
+    return {pHSensor->reading(),          ecSensor->reading(),
+            gDoserManager->getFlowRates(), gDoserManager->telemetry(),
+            pHController->isRunning(),     nutrientController->isRunning(),
+            gDoserManager->slotWaitStats(),
+            gDoserManager->ledger().snapshot()};
+  }
+
+  // Bottles that ran low since the last call
+  std::vector<LowStock> lowStockAlerts() {
+    return gDoserManager->ledger().takeAlerts();
+  }
+
+  BusStats::Snapshot busStatistics() const {
+    return canDosers->busStatistics();
+  }
+
+  // Switches every pump off at once, then stops the controllers and the
+  // dosers turned on by hand. Returns what every stopped doser delivered.
+  std::vector<DoserManager::Stopped> stopAll() {
+    auto stopped = gDoserManager->stopAll(stopReportTimeout);
+    nutrientController->stop();
+    pHController->stop();
+    runningDosers.clear();
+    return stopped;
+  }
+
+  // Switches the module chain and keeps the bitrate across restarts
+  bool setBusBitrate(uint32_t bitrate) {
+    return canDosers->setBitrate(bitrate);
+  }
+
+  // Applies at once and is kept across restarts
+  void setCurrentBudget(CurrentBudget budget) {
+    DosingLimits limits = loadDosingLimits();
+    limits.supply = budget;
+    gDoserManager->setCurrentBudget(budget);
+    try {
+      storeDosingLimits(limits);
+    } catch (const std::runtime_error &err) {
+      ESP_LOGW(tag, "Failed to store current budget: %s", err.what());
+    }
+  }
+
+  // Applies from the next restart
+  void setParallelDosers(int count) {
+    DosingLimits limits = loadDosingLimits();
+    limits.parallelDosers = std::max(count, 1);
+    try {
+      storeDosingLimits(limits);
+    } catch (const std::runtime_error &err) {
+      ESP_LOGW(tag, "Failed to store parallelism: %s", err.what());
+    }
   }
 
   std::unique_ptr<AnalogSensor> pHSensor;
@@ -113,6 +201,49 @@ public:
   std::vector<DoserManager::Doser> runningDosers;
 
 private:
+  // Limits stored by the setters, the defaults if there are none
+  static DosingLimits loadDosingLimits() {
+    DosingLimits limits;
+    nvs_handle_t handle;
+    if (nvs_open(nvsDosingNameSpace, NVS_READONLY, &handle) == ESP_OK) {
+      uint32_t parallel = limits.parallelDosers;
+      nvs_get_u32(handle, "parallel", &parallel);
+      nvs_get_u32(handle, "system_mA", &limits.supply.system_mA);
+      nvs_get_u32(handle, "module_mA", &limits.supply.module_mA);
+      nvs_close(handle);
+      limits.parallelDosers = std::max<uint32_t>(parallel, 1);
+    }
+    return limits;
+  }
+
+  static void storeDosingLimits(const DosingLimits &limits) {
+    nvs_handle_t handle;
+    if (auto err = nvs_open(nvsDosingNameSpace, NVS_READWRITE, &handle);
+        err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+
+    ez::ScopeGuard closeGuard([handle]() { nvs_close(handle); });
+
+    const std::pair<const char *, uint32_t> values[] = {
+        {"parallel", uint32_t(limits.parallelDosers)},
+        {"system_mA", limits.supply.system_mA},
+        {"module_mA", limits.supply.module_mA}};
+    for (auto [key, value] : values) {
+      if (auto err = nvs_set_u32(handle, key, value); err != ESP_OK)
+        throw std::runtime_error(esp_err_to_name(err));
+    }
+
+    if (auto err = nvs_commit(handle); err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+  }
+
+  ControlTask maintainLedger() {
+    for (;;) {
+      gDoserManager->ledger().flushIfDue();
+      co_await sleepFor(ledgerCheckInterval);
+    }
+  }
+
   void uiInitializing() {
     static int nDots = 0;
     std::string msg = "Loading";
@@ -133,12 +264,13 @@ private:
   }
 
   std::unique_ptr<DFRobot_RGBLCD1602> lcd;
+  CANDoserManager *canDosers; // Owned by gDoserManager
   State state{State::Init};
   std::jthread sensorThread;
   std::jthread uiThread;
   std::jthread dosingThread;
-  std::jthread nutrientControllerThread;
-  std::jthread pHControllerThread;
+  ControlScheduler controlScheduler;
+  std::jthread controlThread;
 };
 
 extern std::unique_ptr<App> gApp;
@@ -148,12 +280,77 @@ inline void convertToJson(const App::Status &status, JsonVariant doc) {
   doc["ec"] = status.ec;
 
   JsonArray dosers = doc.createNestedArray("dosers");
-  for (auto &flowRate : status.flowRates) {
-    dosers.createNestedObject()["maxFlowRate"] = flowRate;
+  for (size_t id = 0; id < status.flowRates.size(); ++id) {
+    JsonObject doser = dosers.createNestedObject();
+    doser["maxFlowRate"] = status.flowRates[id];
+    if (id < status.telemetry.size() && status.telemetry[id].valid) {
+      const DoserTelemetry &telemetry = status.telemetry[id];
+      doser["current"] = telemetry.current_mA;
+      doser["running"] = telemetry.running;
+      doser["dosing"] = telemetry.dosing;
+      doser["fault"] = telemetry.fault;
+      doser["asleep"] = telemetry.asleep;
+      doser["runtime"] = telemetry.runtime_s;
+    }
+    if (auto volume = status.volumes.find(id);
+        volume != status.volumes.end()) {
+      doser["pumped"] = volume->second.total_mL;
+      doser["pumpedToday"] = volume->second.daily_mL[0];
+      if (volume->second.bottle_mL > 0) {
+        doser["remaining"] = volume->second.remaining_mL;
+        doser["lowStock"] = volume->second.low();
+      }
+    }
   }
 
   doc["pHControllerRunning"] = status.pHControllerRunning;
   doc["nutrientControllerRunning"] = status.nutrientContollerRunning;
+
+  using Millis = std::chrono::duration<float, std::milli>;
+  JsonObject slotWaits = doc.createNestedObject("slotWait");
+  for (size_t i = 0; i < slotClasses; ++i) {
+    const SlotScheduler::WaitStats &waits = status.slotWaits[i];
+    JsonObject entry =
+        slotWaits.createNestedObject(slotClassName(static_cast<SlotClass>(i)));
+    entry["grants"] = waits.grants;
+    entry["meanMs"] =
+        waits.grants ? Millis(waits.total).count() / waits.grants : 0.0f;
+    entry["maxMs"] = Millis(waits.max).count();
+  }
+}
+
+inline void addHistogram(JsonArray buckets,
+                         const BusStats::Histogram &histogram) {
+  for (uint32_t count : histogram) {
+    buckets.add(count);
+  }
+}
+
+inline void convertToJson(const BusStats::Snapshot &stats, JsonVariant doc) {
+  doc["bitrate"] = stats.bitrate;
+  doc["load"] = stats.load;
+  doc["bits"] = stats.bits;
+  addHistogram(doc.createNestedArray("queueLatency"), stats.queueLatency);
+
+  JsonObject controller = doc.createNestedObject("controller");
+  controller["state"] = stats.controller.state;
+  controller["txErrorCounter"] = stats.controller.txErrorCounter;
+  controller["rxErrorCounter"] = stats.controller.rxErrorCounter;
+  controller["txFailed"] = stats.controller.txFailed;
+  controller["rxMissed"] = stats.controller.rxMissed;
+  controller["rxOverrun"] = stats.controller.rxOverrun;
+  controller["arbitrationLost"] = stats.controller.arbitrationLost;
+  controller["busErrors"] = stats.controller.busErrors;
+
+  JsonObject rpcs = doc.createNestedObject("rpcs");
+  for (const auto &[rpc, counters] : stats.rpcs) {
+    JsonObject entry = rpcs.createNestedObject(std::to_string(rpc));
+    entry["tx"] = counters.tx;
+    entry["rx"] = counters.rx;
+    entry["txFailed"] = counters.txFailed;
+    entry["timeouts"] = counters.timeouts;
+    addHistogram(entry.createNestedArray("roundTrip"), counters.roundTrip);
+  }
 }
 
 inline void convertFromJson(JsonVariantConst doc, App::Status &status) {
@@ -161,10 +358,23 @@ inline void convertFromJson(JsonVariantConst doc, App::Status &status) {
   status.ec = doc["ec"].as<float>();
 
   status.flowRates.clear();
+  status.telemetry.clear();
   if (doc["dosers"].is<JsonArrayConst>()) {
     for (JsonVariantConst doserJson : doc["dosers"].as<JsonArrayConst>()) {
       auto flowRate = doserJson["maxFlowRate"].as<float>();
       status.flowRates.push_back(flowRate);
+
+      DoserTelemetry telemetry{};
+      if (doserJson["current"].is<uint16_t>()) {
+        telemetry.valid = true;
+        telemetry.current_mA = doserJson["current"];
+        telemetry.running = doserJson["running"];
+        telemetry.dosing = doserJson["dosing"];
+        telemetry.fault = doserJson["fault"];
+        telemetry.asleep = doserJson["asleep"];
+        telemetry.runtime_s = doserJson["runtime"];
+      }
+      status.telemetry.push_back(telemetry);
     }
   }
 
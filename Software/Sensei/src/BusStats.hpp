@@ -0,0 +1,133 @@
+#ifndef BUS_STATS_HPP
+#define BUS_STATS_HPP
+
+#include "Clock.hpp"
+#include "can_protocol.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string_view>
+
+// Frame counters, latency histograms and bus load of the CAN bus. Updated by
+// the bus tasks and read as snapshots, so the cost on the bus path is a
+// lock and a few increments per frame.
+class BusStats {
+public:
+  // Bucket i counts latencies in [2^i, 2^(i+1)) us, the last bucket
+  // everything above
+  static constexpr size_t buckets = 24;
+  using Histogram = std::array<uint32_t, buckets>;
+
+  // Counters of the controller as reported by the driver
+  struct Controller {
+    const char *state;
+    uint32_t txErrorCounter;
+    uint32_t rxErrorCounter;
+    uint32_t txFailed;
+    uint32_t rxMissed;
+    uint32_t rxOverrun;
+    uint32_t arbitrationLost;
+    uint32_t busErrors;
+
+    // Error passive starts at 128 on either counter, bus off at 256
+    bool errorPassive() const {
+      return txErrorCounter >= 128 || rxErrorCounter >= 128 ||
+             std::string_view{state} == "bus off";
+    }
+  };
+
+  struct RPC {
+    uint32_t tx{0};
+    uint32_t rx{0};
+    uint32_t txFailed{0};
+    uint32_t timeouts{0};
+    Histogram roundTrip{}; // Request queued to last response
+  };
+
+  struct Snapshot {
+    uint32_t bitrate;
+    float load; // Share of the bus time used since the previous snapshot
+    uint64_t bits;
+    Histogram queueLatency; // Frame queued to accepted by the driver
+    std::map<can::protocol::RPC, RPC> rpcs;
+    Controller controller;
+  };
+
+  explicit BusStats(uint32_t bitrate)
+      : bitrate{bitrate}, lastSnapshot{Clock::now()} {}
+
+  void setBitrate(uint32_t rate) {
+    std::lock_guard guard{mtx};
+    bitrate = rate;
+  }
+
+  void transmitted(const can::protocol::Frame &frame, bool ok,
+                   Clock::duration queued) {
+    std::lock_guard guard{mtx};
+    RPC &rpc = rpcs[frame.rpc()];
+    if (ok) {
+      ++rpc.tx;
+      bits += can::protocol::frameBits(frame.dlc, frame.extended);
+      add(queueLatency, queued);
+    } else {
+      ++rpc.txFailed;
+    }
+  }
+
+  void received(const can::protocol::Frame &frame) {
+    std::lock_guard guard{mtx};
+    ++rpcs[frame.rpc()].rx;
+    bits += can::protocol::frameBits(frame.dlc, frame.extended);
+  }
+
+  void answered(can::protocol::RPC rpc, Clock::duration roundTrip) {
+    std::lock_guard guard{mtx};
+    add(rpcs[rpc].roundTrip, roundTrip);
+  }
+
+  void timedOut(can::protocol::RPC rpc) {
+    std::lock_guard guard{mtx};
+    ++rpcs[rpc].timeouts;
+  }
+
+  Snapshot snapshot(const Controller &controller,
+                    Clock::time_point now = Clock::now()) {
+    std::lock_guard guard{mtx};
+    const std::chrono::duration<float> elapsed = now - lastSnapshot;
+    const float load =
+        elapsed.count() > 0
+            ? (bits - bitsAtSnapshot) / (bitrate * elapsed.count())
+            : 0;
+    lastSnapshot = now;
+    bitsAtSnapshot = bits;
+    return {bitrate, load, bits, queueLatency, rpcs, controller};
+  }
+
+  static size_t bucket(Clock::duration latency) {
+    const auto us =
+        std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    if (us <= 0) {
+      return 0;
+    }
+    return std::min<size_t>(std::bit_width(static_cast<uint64_t>(us)) - 1,
+                            buckets - 1);
+  }
+
+private:
+  static void add(Histogram &histogram, Clock::duration latency) {
+    ++histogram[bucket(latency)];
+  }
+
+  uint32_t bitrate;
+  std::mutex mtx;
+  std::map<can::protocol::RPC, RPC> rpcs;
+  Histogram queueLatency{};
+  uint64_t bits{0};
+  uint64_t bitsAtSnapshot{0};
+  Clock::time_point lastSnapshot;
+};
+
+#endif
@@ -0,0 +1,358 @@
+#ifndef CAN_BUS_HPP
+#define CAN_BUS_HPP
+
+#include "BusStats.hpp"
+#include "CANTransport.hpp"
+#include "Clock.hpp"
+#include "can_protocol.h"
+#include "logging.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// CAN I/O tasks on top of a transport. Callers queue frames and get
+// futures back, so a dead bus times requests out instead of blocking the
+// thread that sent them. Responses are matched to requests by their RPC,
+// module address and sequence number.
+//
+// The bus falls back to the default bitrate when the controller goes error
+// passive at another one, which is what happens when the other nodes switched
+// back or never switched.
+class CANBus {
+  static constexpr char tag[] = "CANBus";
+  static constexpr Clock::duration healthCheckPeriod =
+      std::chrono::milliseconds(100);
+  // Longest wait for the driver to take a frame. A request's deadline is
+  // that of its response, which runs as long as the dose for timed doses.
+  static constexpr Clock::duration txTimeout = std::chrono::milliseconds(100);
+
+public:
+  using Frame = can::protocol::Frame;
+  using Responses = std::vector<Frame>;
+  using Handler = std::function<void(const Frame &)>;
+  using Completion = std::function<void(Responses)>;
+
+  explicit CANBus(std::unique_ptr<CANTransport> transport)
+      : transport{std::move(transport)}, stats{this->transport->bitrate()} {
+    rxThread = std::jthread([this](std::stop_token stop) { receive(stop); });
+    txThread = std::jthread([this](std::stop_token stop) { transmit(stop); });
+  }
+
+  ~CANBus() {
+    rxThread.request_stop();
+    txThread.request_stop();
+    rxThread.join();
+    txThread.join();
+  }
+
+  // Resolves to true once the driver accepted the frame, or to false if it
+  // couldn't before the timeout.
+  std::future<bool> send(const Frame &frame, Clock::duration timeout) {
+    std::lock_guard guard{mtx};
+    txQueue.push_back({frame, Clock::now() + timeout, {}});
+    auto sent = txQueue.back().sent.get_future();
+    cv.notify_all();
+    return sent;
+  }
+
+  // Sends an extended frame with the next sequence number and collects up to
+  // `count` responses that echo it. A broadcast request collects responses
+  // from every module. Resolves with whatever arrived when the count is
+  // reached or the timeout expires. The timeout runs from when the request
+  // went on the bus, so requests queued behind a burst aren't cut short. A
+  // request the driver doesn't take within the timeout, or txTimeout once
+  // it's next in the queue, fails with no responses.
+  std::future<Responses> request(Frame frame, size_t count,
+                                 Clock::duration timeout) {
+    auto promise = std::make_shared<std::promise<Responses>>();
+    auto responses = promise->get_future();
+    request(frame, count, timeout, [promise](Responses responses) {
+      promise->set_value(std::move(responses));
+    });
+    return responses;
+  }
+
+  // Same as above but hands the responses to `done`, which runs on the bus
+  // task and must not block. Used for long running requests that nobody
+  // waits on.
+  void request(Frame frame, size_t count, Clock::duration timeout,
+               Completion done) {
+    using namespace can::protocol;
+
+    std::lock_guard guard{mtx};
+    const RPC rpc = rpcOf(frame.identifier);
+    const uint8_t address = addressOf(frame.identifier);
+    const uint32_t mask =
+        address == broadcastAddress ? ~addressMask : ~uint32_t{0};
+    const uint8_t seq = freeSeq(responseRPC(rpc), address, mask);
+    frame.identifier = identifier(rpc, address, seq);
+    const uint32_t response = identifier(responseRPC(rpc), address, seq) & mask;
+    const auto deadline = Clock::now() + timeout;
+    pending.push_back(Pending{response, mask, count, timeout, deadline, {},
+                              std::move(done), rpc});
+
+    txQueue.push_back({frame, deadline, {}, Clock::now(), response});
+    cv.notify_all();
+  }
+
+  // Frames that don't answer a request are passed to the handler of their
+  // RPC. Handlers run on the receive task and must not block.
+  void subscribe(can::protocol::RPC rpc, Handler handler) {
+    std::lock_guard guard{mtx};
+    handlers[rpc] = std::move(handler);
+  }
+
+  void unsubscribe(can::protocol::RPC rpc) {
+    std::lock_guard guard{mtx};
+    handlers.erase(rpc);
+  }
+
+  uint32_t bitrate() const { return transport->bitrate(); }
+
+  bool supports(uint32_t bitrate) const {
+    return transport->supports(bitrate);
+  }
+
+  // Switches this node only, the other nodes are switched by the protocol
+  bool setBitrate(uint32_t bitrate) {
+    if (!transport->setBitrate(bitrate)) {
+      return false;
+    }
+    stats.setBitrate(bitrate);
+    return true;
+  }
+
+  // Frame counters and latencies since start, the bus load since the
+  // previous call and the controller's error counters
+  BusStats::Snapshot statistics() {
+    return stats.snapshot(transport->status());
+  }
+
+private:
+  struct Transmit {
+    Frame frame;
+    Clock::time_point deadline;
+    std::promise<bool> sent;
+    Clock::time_point queuedAt{Clock::now()};
+    std::optional<uint32_t> response{}; // Response identifier of a request
+  };
+
+  struct Pending {
+    uint32_t responseIdentifier;
+    uint32_t responseMask;
+    size_t count;
+    Clock::duration timeout;
+    Clock::time_point deadline;
+    Responses responses;
+    Completion done;
+    can::protocol::RPC rpc;
+    Clock::time_point queuedAt{Clock::now()};
+  };
+
+  using Completions = std::vector<std::pair<Completion, Responses>>;
+
+  void transmit(std::stop_token stop) {
+    std::unique_lock lock{mtx};
+    while (!stop.stop_requested()) {
+      if (txQueue.empty()) {
+        auto queued = [this] { return !txQueue.empty(); };
+        if (const auto deadline = nextDeadline(); deadline) {
+          cv.wait_until(lock, stop, *deadline, queued);
+        } else {
+          cv.wait(lock, stop, queued);
+        }
+      }
+
+      if (auto expired = expire(Clock::now()); !expired.empty()) {
+        lock.unlock();
+        for (auto &[done, responses] : expired) {
+          done(std::move(responses));
+        }
+        lock.lock();
+      }
+
+      if (txQueue.empty()) {
+        continue;
+      }
+
+      Transmit item = std::move(txQueue.front());
+      txQueue.pop_front();
+      lock.unlock();
+
+      const bool ok = transport->transmit(
+          item.frame, std::min(item.deadline - Clock::now(), txTimeout));
+      stats.transmitted(item.frame, ok, Clock::now() - item.queuedAt);
+      item.sent.set_value(ok);
+
+      lock.lock();
+      if (ok && item.response) {
+        restartTimeout(*item.response);
+      } else if (item.response) {
+        // Nothing answers a request that never went out
+        if (Completion done = abandon(*item.response)) {
+          lock.unlock();
+          done({});
+          lock.lock();
+        }
+      }
+    }
+  }
+
+  void receive(std::stop_token stop) {
+    auto nextCheck = Clock::now() + healthCheckPeriod;
+    while (!stop.stop_requested()) {
+      if (auto frame = transport->receive(std::chrono::milliseconds(100))) {
+        dispatch(*frame);
+      }
+
+      if (Clock::now() >= nextCheck) {
+        nextCheck = Clock::now() + healthCheckPeriod;
+        checkHealth();
+      }
+    }
+  }
+
+  void checkHealth() {
+    using can::protocol::defaultBitrate;
+
+    const uint32_t current = transport->bitrate();
+    if (current != defaultBitrate && transport->status().errorPassive()) {
+      ESP_LOGW(tag, "Error passive at %lu bit/s, falling back to %lu bit/s",
+               static_cast<unsigned long>(current),
+               static_cast<unsigned long>(defaultBitrate));
+      setBitrate(defaultBitrate);
+    }
+  }
+
+  void dispatch(const Frame &frame) {
+    stats.received(frame);
+    std::unique_lock lock{mtx};
+
+    if (frame.extended) {
+      auto it = std::ranges::find_if(pending, [&frame](const Pending &p) {
+        return (frame.identifier & p.responseMask) == p.responseIdentifier;
+      });
+      if (it != pending.end()) {
+        it->responses.push_back(frame);
+        if (it->responses.size() >= it->count) {
+          stats.answered(it->rpc, Clock::now() - it->queuedAt);
+          Completion done = std::move(it->done);
+          Responses responses = std::move(it->responses);
+          pending.erase(it);
+          lock.unlock();
+          done(std::move(responses));
+        }
+        return;
+      }
+    }
+
+    if (auto it = handlers.find(frame.rpc()); it != handlers.end()) {
+      Handler handler = it->second;
+      lock.unlock();
+      handler(frame);
+    } else {
+      ESP_LOGW(tag, "Unhandled frame %lx",
+               static_cast<unsigned long>(frame.identifier));
+    }
+  }
+
+  // Drops transmits whose deadline has passed and returns the completions of
+  // expired requests, to be called without the lock held
+  Completions expire(Clock::time_point now) {
+    Completions expired;
+    for (auto it = pending.begin(); it != pending.end();) {
+      if (it->deadline <= now) {
+        stats.timedOut(it->rpc);
+        expired.emplace_back(std::move(it->done), std::move(it->responses));
+        it = pending.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    for (auto it = txQueue.begin(); it != txQueue.end();) {
+      if (it->deadline <= now) {
+        it->sent.set_value(false);
+        it = txQueue.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    return expired;
+  }
+
+  // Holds mtx. The next sequence number whose responses no pending request
+  // would take, so a long request isn't answered by a later one's responses
+  // once the numbers wrapped.
+  uint8_t freeSeq(can::protocol::RPC rpc, uint8_t address, uint32_t mask) {
+    using can::protocol::identifier;
+
+    for (int tries = 0; tries < 256; ++tries) {
+      const uint8_t seq = nextSeq++;
+      const uint32_t response = identifier(rpc, address, seq) & mask;
+      const bool taken = std::ranges::any_of(pending, [&](const Pending &p) {
+        return (response & p.responseMask) == p.responseIdentifier ||
+               (p.responseIdentifier & mask) == response;
+      });
+      if (!taken) {
+        return seq;
+      }
+    }
+    ESP_LOGW(tag, "Every sequence number of RPC %d is pending",
+             static_cast<int>(rpc));
+    return nextSeq++;
+  }
+
+  void restartTimeout(uint32_t response) {
+    auto it =
+        std::ranges::find(pending, response, &Pending::responseIdentifier);
+    if (it != pending.end()) {
+      it->deadline = Clock::now() + it->timeout;
+    }
+  }
+
+  Completion abandon(uint32_t response) {
+    auto it =
+        std::ranges::find(pending, response, &Pending::responseIdentifier);
+    if (it == pending.end()) {
+      return {};
+    }
+    stats.timedOut(it->rpc);
+    Completion done = std::move(it->done);
+    pending.erase(it);
+    return done;
+  }
+
+  std::optional<Clock::time_point> nextDeadline() const {
+    std::optional<Clock::time_point> deadline;
+    for (const auto &request : pending) {
+      if (!deadline || request.deadline < *deadline) {
+        deadline = request.deadline;
+      }
+    }
+    return deadline;
+  }
+
+  std::unique_ptr<CANTransport> transport;
+  BusStats stats;
+  std::mutex mtx;
+  std::condition_variable_any cv;
+  std::deque<Transmit> txQueue;
+  std::list<Pending> pending;
+  std::map<can::protocol::RPC, Handler> handlers;
+  uint8_t nextSeq{0};
+  std::jthread rxThread;
+  std::jthread txThread;
+};
+
+#endif
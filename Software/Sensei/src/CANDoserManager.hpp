@@ -1,89 +1,621 @@
 #ifndef CAN_DOSER_MANAGER2_HPP
 #define CAN_DOSER_MANAGER2_HPP
 
+#include "CANBus.hpp"
+#include "CANModuleMap.hpp"
+#include "CANTransport.hpp"
 #include "DoserManager.hpp"
 #include "can_protocol.h"
-#include "driver/twai.h"
-#include "esp_log.h"
+#include "logging.h"
+#ifdef ESP_PLATFORM
+#include "can.h"
+#include "nvs.h"
+#include "util.h"
+#endif
+#include <algorithm>
+#include <array>
+#include <condition_variable>
 #include <cstring>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+
+using namespace std::chrono_literals;
 
 class CANDoserManager : public DoserManager {
   static constexpr char tag[] = "CANDoserManager";
+  static constexpr char nvsNameSpace[] = "topology";
+  static constexpr char nvsBusNameSpace[] = "can";
 
 public:
-  CANDoserManager(int parallelMax) : DoserManager{parallelMax} {
+  using LatencyHistogram = std::array<uint32_t, can::protocol::latencyBuckets>;
+
+  // Flow rate frames are dropped if the bus can't take them in this time
+  static constexpr Clock::duration txTimeout = 100ms;
+  static constexpr Clock::duration requestTimeout = 200ms;
+  // Enumeration is restarted if the chain goes quiet for this long
+  static constexpr Clock::duration enumerationTimeout = 3s;
+  // Answer slot of each module when the known chain is asked to announce
+  // itself. An 8 byte extended frame takes 3.2 ms at 50 kbit/s.
+  static constexpr uint16_t announceSlot_us = 4000;
+  // Time between the Commit of a bitrate switch and the switch
+  static constexpr uint8_t bitrateSwitchDelay_ms = 20;
+
+  // The transport starts at the bitrate the chain is expected to run at,
+  // usually loadBitrate(). The chain is switched to it after enumeration.
+  CANDoserManager(int parallelMax, std::unique_ptr<CANTransport> transport)
+      : DoserManager{parallelMax}, bus{std::move(transport)} {
+    configuredBitrate = bus.bitrate();
     connectDosers();
+    subscribeTelemetry();
+  }
+
+  ~CANDoserManager() { shutdown(); }
+
+  std::vector<DoserTelemetry> telemetry() const override {
+    std::vector<DoserTelemetry> result;
+    for (size_t id = 0; id < telemetryTable.size(); ++id) {
+      result.push_back(telemetryTable.load(id));
+    }
+    return result;
+  }
+
+  BusStats::Snapshot busStatistics() { return bus.statistics(); }
+
+  uint32_t bitrate() const { return bus.bitrate(); }
+
+  // Switches the whole chain and stores the bitrate for the next start.
+  // Fails without switching if a module doesn't accept it, and falls back to
+  // the default bitrate if the chain doesn't answer after the switch.
+  bool setBitrate(uint32_t bitrate) {
+    if (!negotiateBitrate(bitrate)) {
+      return false;
+    }
+
+    configuredBitrate = bitrate;
+    try {
+      storeBitrate(bitrate);
+    } catch (const std::runtime_error &err) {
+      ESP_LOGW(tag, "Failed to store bitrate: %s", err.what());
+    }
+    return true;
+  }
+
+  // Bitrate stored by setBitrate, the default if there is none
+  static uint32_t loadBitrate() {
+    uint32_t bitrate = can::protocol::defaultBitrate;
+#ifdef ESP_PLATFORM
+    nvs_handle_t handle;
+    if (nvs_open(nvsBusNameSpace, NVS_READONLY, &handle) == ESP_OK) {
+      nvs_get_u32(handle, "bitrate", &bitrate);
+      nvs_close(handle);
+    }
+    if (!can::supported(bitrate)) {
+      bitrate = can::protocol::defaultBitrate;
+    }
+#endif
+    return bitrate;
+  }
+
+  // Telemetry period of every module, 0 turns telemetry off
+  bool setTelemetryPeriod(std::chrono::milliseconds period) {
+    using namespace can::protocol;
+
+    CANBus::Frame command{identifier(RPC::SetTelemetryPeriod, broadcastAddress),
+                          true, sizeof(SetTelemetryPeriodCommand), {}};
+    const SetTelemetryPeriodCommand tmp{static_cast<uint16_t>(period.count())};
+    std::memcpy(command.data, &tmp, sizeof(tmp));
+    return bus.send(command, txTimeout).get();
+  }
+
+  // Reads the frame arrival to PWM update latency histogram of a module
+  std::optional<LatencyHistogram> readLatencyHistogram(uint8_t address) {
+    using namespace can::protocol;
+
+    constexpr size_t perFrame = std::size(LatencyHistogramResponse{}.counts);
+    constexpr size_t frameCount = (latencyBuckets + perFrame - 1) / perFrame;
+
+    const CANBus::Frame command{identifier(RPC::ReadLatency, address), true,
+                                sizeof(ReadLatencyCommand), {}};
+    const auto responses =
+        bus.request(command, frameCount, requestTimeout).get();
+    if (responses.size() < frameCount) {
+      return std::nullopt;
+    }
+
+    LatencyHistogram histogram{};
+    for (const auto &frame : responses) {
+      LatencyHistogramResponse response;
+      std::memcpy(&response, frame.data, sizeof(response));
+      for (int i = 0; i < response.bucketCount; ++i) {
+        if (response.firstBucket + i < latencyBuckets) {
+          histogram[response.firstBucket + i] = response.counts[i];
+        }
+      }
+    }
+    return histogram;
   }
 
 private:
-  std::vector<float> implConnectDosers() override {
+  struct Enumeration {
+    std::mutex mtx;
+    std::condition_variable cv;
+    CANModuleMap modules;
+    std::vector<float> flowRates;
+    Clock::time_point lastHeard;
+    bool done{false};
+  };
 
+  // Modules stream telemetry on their own. The table is sized once the chain
+  // is known and written only by the receive task.
+  void subscribeTelemetry() {
     using namespace can::protocol;
 
-    twai_message_t message;
-    message.identifier = RPC::Restart;
-    message.data_length_code = sizeof(RestartCommand);
-    ESP_ERROR_CHECK(twai_transmit(&message, portMAX_DELAY));
+    std::vector<CANModuleMap::Module> chain;
+    {
+      std::lock_guard guard{txMtx};
+      telemetryTable = TelemetryTable(modules.doserCount());
+      chain = modules.getModules();
+    }
 
-    twai_message_t response = {};
-    response.identifier = responseID(RPC::NewModule);
-    response.data_length_code = sizeof(NewModuleResponse);
+    auto store = [this, chain](const CANBus::Frame &frame) {
+      const uint8_t address = addressOf(frame.identifier);
+      TelemetryCommand command;
+      std::memcpy(&command, frame.data, sizeof(command));
+      if (address >= chain.size() ||
+          command.channel >= chain[address].numDosers) {
+        return;
+      }
 
-    twai_clear_receive_queue();
+      const auto &module = chain[address];
+      const int id = module.firstDoser + command.channel;
+      telemetryTable.store(id, {true, (command.flags & Running) != 0,
+                                (command.flags & Fault) != 0,
+                                (command.flags & Asleep) != 0,
+                                (command.flags & Dosing) != 0,
+                                command.current_mA, command.runtime_s});
 
-    for (std::vector<float> flowRates;;) {
-      ESP_ERROR_CHECK(twai_receive(&message, portMAX_DELAY));
+      // Both channels of a motor driver share the measured current
+      const int first = id - command.channel % 2;
+      const bool paired = first + 1 < module.firstDoser + module.numDosers;
+      const int driver[] = {first, first + 1};
+      reportCurrent(std::span<const int>(driver, paired ? 2 : 1),
+                    command.current_mA);
+    };
+    bus.subscribe(RPC::Telemetry, std::move(store));
+  }
 
-      switch (message.identifier) {
-      case RPC::NewModule: {
-        // Parse command
-        assert(sizeof(NewModuleCommand) == message.data_length_code);
-        NewModuleCommand command{};
-        std::memcpy(&command, message.data, sizeof(command));
+  // Attaches to the chain recorded in NVS if it still answers with the same
+  // layout, otherwise restarts the chain and enumerates it again. Modules
+  // start at the default bitrate, so the chain is switched to the configured
+  // one after that.
+  std::vector<float> implConnectDosers() override {
+    auto flowRates = connectChain();
+    if (bus.bitrate() != configuredBitrate &&
+        !negotiateBitrate(configuredBitrate)) {
+      ESP_LOGW(tag, "Chain stays at %lu bit/s",
+               static_cast<unsigned long>(bus.bitrate()));
+    }
+    return flowRates;
+  }
 
-        // Send response
-        const uint32_t moduleID = flowRates.size();
-        {
-          NewModuleResponse tmp{moduleID};
-          std::memcpy(&response.data, &tmp, sizeof(tmp));
-        }
-        ESP_ERROR_CHECK(twai_transmit(&response, portMAX_DELAY));
+  std::vector<float> connectChain() {
+    using can::protocol::defaultBitrate;
 
-        for (int i = 0; i < command.numDosers; ++i) {
-          flowRates.push_back(command.maxFlowRate);
-        }
-        break;
+    std::optional<CANModuleMap> cached;
+    try {
+      cached = loadTopology();
+    } catch (const std::runtime_error &err) {
+      ESP_LOGW(tag, "Failed to load module topology: %s", err.what());
+    }
+
+    if (cached) {
+      if (auto flowRates = attach(*cached); flowRates) {
+        ESP_LOGI(tag, "Attached to %zu known modules",
+                 cached->getModules().size());
+        return *flowRates;
       }
-      case RPC::LastNode:
-        return flowRates;
-      default:
-        ESP_LOGE(tag, "Unknown message identifier %lu\n", message.identifier);
-        break;
+      ESP_LOGI(tag, "Module chain changed, enumerating");
+    }
+
+    if (bus.bitrate() != defaultBitrate) {
+      bus.setBitrate(defaultBitrate);
+    }
+    auto flowRates = enumerate();
+    try {
+      storeTopology(modules);
+    } catch (const std::runtime_error &err) {
+      ESP_LOGW(tag, "Failed to store module topology: %s", err.what());
+    }
+    return flowRates;
+  }
+
+  // Asks every module of the cached chain to announce itself in its slot.
+  // Modules keep running through a Sensei restart, so they are switched off
+  // before the chain is used again.
+  std::optional<std::vector<float>> attach(const CANModuleMap &cached) {
+    using namespace can::protocol;
+
+    const size_t count = cached.getModules().size();
+    if (count == 0) {
+      return std::nullopt;
+    }
+
+    CANBus::Frame command{identifier(RPC::Announce, broadcastAddress), true,
+                          sizeof(AnnounceCommand), {}};
+    const AnnounceCommand announce{announceSlot_us};
+    std::memcpy(command.data, &announce, sizeof(announce));
+
+    const auto timeout =
+        std::chrono::microseconds(announceSlot_us) * (count + 1) +
+        requestTimeout;
+    const auto responses = bus.request(command, count, timeout).get();
+    if (responses.size() != count) {
+      return std::nullopt;
+    }
+
+    std::vector<std::optional<AnnounceResponse>> byAddress(count);
+    for (const auto &frame : responses) {
+      const uint8_t address = addressOf(frame.identifier);
+      if (address >= count) {
+        return std::nullopt;
       }
+      byAddress[address].emplace();
+      std::memcpy(&*byAddress[address], frame.data, sizeof(AnnounceResponse));
     }
 
-    throw std::runtime_error("connecting to dosers failed!");
+    CANModuleMap announced;
+    std::vector<float> flowRates;
+    for (const auto &response : byAddress) {
+      if (!response || response->moduleID != announced.doserCount()) {
+        return std::nullopt;
+      }
+      announced.addModule(response->numDosers, response->maxFlowRate,
+                          response->uid);
+      flowRates.insert(flowRates.end(), response->numDosers,
+                       response->maxFlowRate);
+    }
+
+    if (announced.fingerprint() != cached.fingerprint()) {
+      return std::nullopt;
+    }
+
+    std::vector<FlowCommand> off;
+    for (int id = 0; id < announced.doserCount(); ++id) {
+      off.emplace_back(id, 0);
+    }
+
+    std::lock_guard guard{txMtx};
+    modules = announced;
+    modules.setFlowRates(off, [this](const CANBus::Frame &frame) {
+      bus.send(frame, txTimeout);
+    });
+    return flowRates;
   }
 
-  void implDoserOn(int id, float flowRate) {
+  // Two step switch of the whole chain, see SetBitrateCommand. Flow rate
+  // commands wait until the switch is done.
+  bool negotiateBitrate(uint32_t bitrate) {
     using namespace can::protocol;
 
-    twai_message_t message = {};
-    message.identifier = RPC::SetFlowRate;
-    message.data_length_code = sizeof(SetFlowRateCommand);
+    if (!bus.supports(bitrate)) {
+      return false;
+    }
+
+    size_t count;
+    {
+      std::lock_guard guard{txMtx};
+      count = modules.getModules().size();
+    }
+    const auto slotsTimeout =
+        std::chrono::microseconds(announceSlot_us) * (count + 1) +
+        requestTimeout;
+
+    auto command = [bitrate](BitrateStep step) {
+      CANBus::Frame frame{identifier(RPC::SetBitrate, broadcastAddress), true,
+                          sizeof(SetBitrateCommand), {}};
+      const SetBitrateCommand tmp{step, bitrateSwitchDelay_ms,
+                                  announceSlot_us, bitrate};
+      std::memcpy(frame.data, &tmp, sizeof(tmp));
+      return frame;
+    };
+
+    if (count > 0) {
+      const auto responses =
+          bus.request(command(BitrateStep::Prepare), count, slotsTimeout)
+              .get();
+      const bool accepted =
+          responses.size() == count &&
+          std::ranges::all_of(responses, [bitrate](const CANBus::Frame &f) {
+            SetBitrateResponse response;
+            std::memcpy(&response, f.data, sizeof(response));
+            return response.accepted && response.bitrate == bitrate;
+          });
+      if (!accepted) {
+        ESP_LOGW(tag, "Chain refused %lu bit/s",
+                 static_cast<unsigned long>(bitrate));
+        return false;
+      }
+    }
 
     {
-      SetFlowRateCommand command{static_cast<uint32_t>(id),
-                                 static_cast<uint16_t>(flowRate)};
-      std::memcpy(message.data, &command, sizeof(command));
+      std::lock_guard guard{txMtx};
+      if (!bus.send(command(BitrateStep::Commit), txTimeout).get()) {
+        return false;
+      }
+      // The driver takes the frame before it's on the bus, so the modules
+      // switch a little later than this node. Give them another delay
+      // before anything is sent at the new bitrate.
+      const auto delay = std::chrono::milliseconds(bitrateSwitchDelay_ms);
+      Clock::sleepFor(delay);
+      bus.setBitrate(bitrate);
+      Clock::sleepFor(delay);
     }
 
-    if (twai_transmit(&message, portMAX_DELAY) != ESP_OK) {
-      ESP_LOGE(tag, "Failed to transmit SetFlowRateCommand\n");
+    if (count > 0 && !chainAnswers(count)) {
+      ESP_LOGW(tag, "Chain silent at %lu bit/s, falling back",
+               static_cast<unsigned long>(bitrate));
+      bus.setBitrate(defaultBitrate);
+      return false;
+    }
+    ESP_LOGI(tag, "Chain switched to %lu bit/s",
+             static_cast<unsigned long>(bitrate));
+    return true;
+  }
+
+  bool chainAnswers(size_t count) {
+    using namespace can::protocol;
+
+    CANBus::Frame command{identifier(RPC::Announce, broadcastAddress), true,
+                          sizeof(AnnounceCommand), {}};
+    const AnnounceCommand announce{announceSlot_us};
+    std::memcpy(command.data, &announce, sizeof(announce));
+
+    const auto timeout =
+        std::chrono::microseconds(announceSlot_us) * (count + 1) +
+        requestTimeout;
+    return bus.request(command, count, timeout).get().size() == count;
+  }
+
+  // Restarts the chain and answers every NewModule with the module's first
+  // doser ID and address until the last module reports LastNode. Modules
+  // repeat NewModule until they hear their answer. A repeat is recognized by
+  // its attempt and the uid and answered again, a first attempt is always a
+  // new module, so neighbours whose uid hashes collide still tell apart.
+  std::vector<float> enumerate() {
+    using namespace can::protocol;
+
+    auto state = std::make_shared<Enumeration>();
+
+    bus.subscribe(RPC::NewModule, [this, state](const CANBus::Frame &frame) {
+      NewModuleCommand command{};
+      std::memcpy(&command, frame.data, sizeof(command));
+
+      std::lock_guard guard{state->mtx};
+      const auto &known = state->modules.getModules();
+      if (known.empty() || command.attempt == 0 ||
+          known.back().uid != command.uid) {
+        state->modules.addModule(command.numDosers, command.maxFlowRate,
+                                 command.uid);
+        state->flowRates.insert(state->flowRates.end(), command.numDosers,
+                                command.maxFlowRate);
+      }
+      state->lastHeard = Clock::now();
+
+      const auto &module = state->modules.getModules().back();
+      CANBus::Frame response{responseID(RPC::NewModule), false,
+                             sizeof(NewModuleResponse), {}};
+      NewModuleResponse tmp{static_cast<uint32_t>(module.firstDoser),
+                            static_cast<uint8_t>(known.size() - 1),
+                            command.uid};
+      std::memcpy(response.data, &tmp, sizeof(tmp));
+      bus.send(response, txTimeout);
+    });
+
+    bus.subscribe(RPC::LastNode, [state](const CANBus::Frame &) {
+      std::lock_guard guard{state->mtx};
+      state->done = true;
+      state->cv.notify_all();
+    });
+
+    std::unique_lock lock{state->mtx};
+    while (!state->done) {
+      state->modules.clear();
+      state->flowRates.clear();
+      state->lastHeard = Clock::now();
+
+      lock.unlock();
+      const CANBus::Frame restart{identifier(RPC::Restart, broadcastAddress),
+                                  true, sizeof(RestartCommand), {}};
+      bus.send(restart, txTimeout);
+      lock.lock();
+
+      while (!state->done &&
+             Clock::now() - state->lastHeard < enumerationTimeout) {
+        state->cv.wait_until(lock, state->lastHeard + enumerationTimeout);
+      }
+
+      if (!state->done) {
+        ESP_LOGW(tag, "Module chain went quiet, restarting enumeration");
+      }
     }
+
+    bus.unsubscribe(RPC::NewModule);
+    bus.unsubscribe(RPC::LastNode);
+
+    std::lock_guard guard{txMtx};
+    modules = state->modules;
+    return state->flowRates;
+  }
+
+#ifdef ESP_PLATFORM
+  static void storeTopology(const CANModuleMap &topology) {
+    nvs_handle_t handle;
+
+    if (auto err = nvs_open(nvsNameSpace, NVS_READWRITE, &handle);
+        err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+
+    ez::ScopeGuard closeGuard([handle]() { nvs_close(handle); });
+
+    const auto &modules = topology.getModules();
+    if (auto err = nvs_set_blob(handle, "modules", modules.data(),
+                                modules.size() * sizeof(modules[0]));
+        err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+
+    if (auto err = nvs_set_u32(handle, "fingerprint", topology.fingerprint());
+        err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+
+    if (auto err = nvs_commit(handle); err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+  }
+
+  static std::optional<CANModuleMap> loadTopology() {
+    nvs_handle_t handle;
+
+    if (auto err = nvs_open(nvsNameSpace, NVS_READWRITE, &handle);
+        err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+
+    ez::ScopeGuard closeGuard([handle]() { nvs_close(handle); });
+
+    std::size_t length = 0;
+    if (auto err = nvs_get_blob(handle, "modules", nullptr, &length);
+        err != ESP_OK || length % sizeof(CANModuleMap::Module) != 0)
+      return std::nullopt;
+
+    std::vector<CANModuleMap::Module> modules(length /
+                                              sizeof(CANModuleMap::Module));
+    if (auto err = nvs_get_blob(handle, "modules", modules.data(), &length);
+        err != ESP_OK)
+      return std::nullopt;
+
+    uint32_t fingerprint;
+    if (auto err = nvs_get_u32(handle, "fingerprint", &fingerprint);
+        err != ESP_OK)
+      return std::nullopt;
+
+    CANModuleMap topology;
+    for (const auto &module : modules) {
+      topology.addModule(module.numDosers, module.maxFlowRate, module.uid);
+    }
+    if (topology.fingerprint() != fingerprint) {
+      return std::nullopt;
+    }
+    return topology;
+  }
+
+  static void storeBitrate(uint32_t bitrate) {
+    nvs_handle_t handle;
+
+    if (auto err = nvs_open(nvsBusNameSpace, NVS_READWRITE, &handle);
+        err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+
+    ez::ScopeGuard closeGuard([handle]() { nvs_close(handle); });
+
+    if (auto err = nvs_set_u32(handle, "bitrate", bitrate); err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+
+    if (auto err = nvs_commit(handle); err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+  }
+#else
+  // Host builds don't persist the chain and always enumerate
+  static void storeTopology(const CANModuleMap &) {}
+
+  static std::optional<CANModuleMap> loadTopology() { return std::nullopt; }
+
+  static void storeBitrate(uint32_t) {}
+#endif
+
+  // The module times the dose and reports the delivered volume, so no thread
+  // waits for it here. If the report doesn't arrive the doser is switched off
+  // and the dose fails.
+  void implDose(int id, float amount_mL, float flowRate_mL_per_min,
+                DoseResult delivered) override {
+    using namespace can::protocol;
+    using Minutes = std::chrono::duration<float, std::chrono::minutes::period>;
+
+    const auto flowRate = static_cast<uint16_t>(
+        std::clamp(flowRate_mL_per_min, 0.0f, float{keepFlowRate - 1}));
+    const auto volume_uL =
+        static_cast<uint32_t>(std::max(amount_mL, 0.0f) * 1000);
+
+    std::pair<CANBus::Frame, uint32_t> dose;
+    {
+      std::lock_guard guard{txMtx};
+      dose = modules.startDose(id, flowRate, volume_uL);
+    }
+
+    const auto expected = std::chrono::duration_cast<Clock::duration>(
+        Minutes(amount_mL / flowRate_mL_per_min));
+    const auto timeout = expected + expected / 100 + requestTimeout;
+
+    auto done = [this, id, token = dose.second,
+                 delivered](CANBus::Responses responses) {
+      {
+        std::lock_guard guard{txMtx};
+        modules.finishDose(id, token);
+      }
+
+      if (responses.empty()) {
+        ESP_LOGE(tag, "Lost the end of the dose of doser %d", id);
+        implDoserOff(id);
+        doseFinished(id);
+        delivered.fail(
+            std::make_exception_ptr(std::runtime_error("dose result lost")));
+        return;
+      }
+
+      DoseVolumeResponse response;
+      std::memcpy(&response, responses.front().data, sizeof(response));
+      const float delivered_mL = response.status == DoseStatus::Rejected
+                                     ? 0.0f
+                                     : response.delivered_uL / 1000.0f;
+      doseFinished(id, delivered_mL);
+      if (response.status == DoseStatus::Rejected) {
+        delivered.fail(
+            std::make_exception_ptr(std::runtime_error("dose rejected")));
+      } else {
+        delivered.set(delivered_mL);
+      }
+    };
+    bus.request(dose.first, 1, timeout, std::move(done));
+  }
+
+  int implModuleOf(int id) override {
+    std::lock_guard guard{txMtx};
+    return id >= 0 && id < modules.doserCount() ? modules.moduleIndex(id)
+                                                : id;
+  }
+
+  void implDoserOn(int id, float flowRate) override {
+    const FlowCommand command{id, flowRate};
+    implSetFlowRates({&command, 1});
+  }
+
+  void implDoserOff(int id) override { implDoserOn(id, 0); }
+
+  // Frames are queued on the bus task, a stuck bus can't block the caller
+  void implSetFlowRates(std::span<const FlowCommand> commands) override {
+    std::lock_guard guard{txMtx};
+    modules.setFlowRates(commands, [this](const CANBus::Frame &frame) {
+      bus.send(frame, txTimeout);
+    });
   }
 
-  void implDoserOff(int id) { implDoserOn(id, 0); }
+  CANModuleMap modules;
+  std::mutex txMtx;
+  TelemetryTable telemetryTable;
+  uint32_t configuredBitrate;
+  // Last so its tasks stop before the state their handlers use goes away
+  CANBus bus;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,187 @@
+#ifndef CAN_MODULE_MAP_HPP
+#define CAN_MODULE_MAP_HPP
+
+#include "can_protocol.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Doser layout of the module chain and the flow rates last commanded to every
+// doser. Turns a group of flow rate changes into as few frames as possible:
+// a single SetAllFlowRates when every module ends up with the same channels,
+// otherwise one SetModuleFlowRates per touched module, or the plain
+// SetFlowRate when only one channel of a module changes.
+// Dosers that run a module timed dose are sent keepFlowRate in multi channel
+// frames so that switching their neighbours doesn't end the dose.
+class CANModuleMap {
+public:
+  using FlowCommand = std::pair<int, float>;
+  using Channels = std::array<uint16_t, can::protocol::moduleChannels>;
+
+  using Frame = can::protocol::Frame;
+
+  struct Module {
+    int firstDoser;
+    int numDosers;
+    uint16_t maxFlowRate{0}; // ml/min
+    uint16_t uid{0};         // Hash of the module's MCU unique ID
+  };
+
+  void clear() {
+    modules.clear();
+    flowRates.clear();
+    moduleOf.clear();
+    doses.clear();
+  }
+
+  // Appends a module to the end of the chain and returns its first doser ID
+  int addModule(int numDosers, uint16_t maxFlowRate = 0, uint16_t uid = 0) {
+    const int firstDoser = flowRates.size();
+    for (int i = 0; i < numDosers; ++i) {
+      moduleOf.push_back(modules.size());
+    }
+    modules.push_back({firstDoser, numDosers, maxFlowRate, uid});
+    flowRates.resize(flowRates.size() + numDosers, 0);
+    doses.resize(flowRates.size(), 0);
+    return firstDoser;
+  }
+
+  const std::vector<Module> &getModules() const { return modules; }
+  int doserCount() const { return flowRates.size(); }
+  int moduleIndex(int id) const { return moduleOf.at(id); }
+
+  // FNV-1a over the chain layout. Two chains with the same fingerprint have
+  // the same modules in the same order, so the doser IDs mean the same pumps.
+  uint32_t fingerprint() const {
+    uint32_t hash = 2166136261u;
+    auto add = [&hash](uint32_t value, int bytes) {
+      for (int i = 0; i < bytes; ++i) {
+        hash = (hash ^ ((value >> (8 * i)) & 0xFF)) * 16777619u;
+      }
+    };
+    for (const Module &module : modules) {
+      add(module.numDosers, 1);
+      add(module.maxFlowRate, 2);
+      add(module.uid, 2);
+    }
+    return hash;
+  }
+
+  template <typename Send>
+  void setFlowRates(std::span<const FlowCommand> commands, Send &&send) {
+    using namespace can::protocol;
+
+    std::vector<uint8_t> changed(modules.size(), 0);
+    for (auto [id, flowRate] : commands) {
+      if (id < 0 || id >= doserCount()) {
+        continue;
+      }
+      // keepFlowRate is no flow rate, it would leave the doser as it is
+      flowRates[id] = static_cast<uint16_t>(
+          std::clamp(flowRate, 0.0f, float{keepFlowRate - 1}));
+      doses[id] &= ~doseRunning;
+      ++changed[moduleOf[id]];
+    }
+
+    if (!modules.empty() &&
+        std::ranges::all_of(changed, [](uint8_t n) { return n > 0; }) &&
+        std::ranges::all_of(modules, [this](const Module &module) {
+          return channels(module) == channels(modules.front());
+        })) {
+      send(moduleFrame(SetAllFlowRates, broadcastAddress,
+                       channels(modules.front())));
+      return;
+    }
+
+    for (size_t address = 0; address < modules.size(); ++address) {
+      if (changed[address] == 0) {
+        continue;
+      }
+
+      const Module &module = modules[address];
+      if (changed[address] == 1) {
+        for (auto [id, _] : commands) {
+          if (id >= module.firstDoser &&
+              id < module.firstDoser + module.numDosers) {
+            send(flowRateFrame(address, id, flowRates[id]));
+            break;
+          }
+        }
+      } else {
+        send(moduleFrame(SetModuleFlowRates, address, channels(module)));
+      }
+    }
+  }
+
+  static Frame flowRateFrame(uint8_t address, int id, uint16_t flowRate) {
+    using namespace can::protocol;
+
+    Frame frame{identifier(RPC::SetFlowRate, address), true,
+                sizeof(SetFlowRateCommand), {}};
+    SetFlowRateCommand command{static_cast<uint32_t>(id), flowRate};
+    std::memcpy(frame.data, &command, sizeof(command));
+    return frame;
+  }
+
+  // Builds the DoseVolume frame of a module timed dose and marks the doser
+  // as owned by its module until finishDose() is called with the returned
+  // token. A later dose or flow rate command takes the doser over, a stale
+  // finishDose() is then ignored.
+  std::pair<Frame, uint32_t> startDose(int id, uint16_t flowRate,
+                                       uint32_t volume_uL) {
+    using namespace can::protocol;
+
+    Frame frame{identifier(RPC::DoseVolume, moduleOf.at(id)), true,
+                sizeof(DoseVolumeCommand), {}};
+    DoseVolumeCommand command{static_cast<uint16_t>(id), flowRate, volume_uL};
+    std::memcpy(frame.data, &command, sizeof(command));
+
+    flowRates[id] = 0;
+    doses[id] = ((doses[id] & ~doseRunning) + 2) | doseRunning;
+    return {frame, doses[id]};
+  }
+
+  void finishDose(int id, uint32_t token) {
+    if (doses.at(id) == token) {
+      doses[id] &= ~doseRunning;
+    }
+  }
+
+  bool isDosing(int id) const { return doses.at(id) & doseRunning; }
+
+private:
+  // Low bit of doses marks a running dose, the rest counts doses
+  static constexpr uint32_t doseRunning = 1;
+
+  Channels channels(const Module &module) const {
+    Channels result{};
+    for (int i = 0; i < module.numDosers && i < can::protocol::moduleChannels;
+         ++i) {
+      const int id = module.firstDoser + i;
+      result[i] = isDosing(id) ? can::protocol::keepFlowRate : flowRates[id];
+    }
+    return result;
+  }
+
+  static Frame moduleFrame(can::protocol::RPC rpc, uint8_t address,
+                           const Channels &channels) {
+    using namespace can::protocol;
+
+    Frame frame{identifier(rpc, address), true,
+                sizeof(SetModuleFlowRatesCommand), {}};
+    SetModuleFlowRatesCommand command{};
+    std::copy(channels.begin(), channels.end(), command.flowRates);
+    std::memcpy(frame.data, &command, sizeof(command));
+    return frame;
+  }
+
+  std::vector<Module> modules;
+  std::vector<uint16_t> flowRates;
+  std::vector<size_t> moduleOf;
+  std::vector<uint32_t> doses;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef CAN_TRANSPORT_HPP
+#define CAN_TRANSPORT_HPP
+
+#include "BusStats.hpp"
+#include "Clock.hpp"
+#include "can_protocol.h"
+#include <cstdint>
+#include <optional>
+
+// Frame level access to a CAN controller. CANBus runs its tasks on top of
+// this, so the protocol code runs unchanged on the TWAI driver, on Linux
+// SocketCAN and on the in-process SimulatedBus.
+class CANTransport {
+public:
+  using Frame = can::protocol::Frame;
+
+  virtual ~CANTransport() = default;
+
+  // Hands the frame to the controller, false if it couldn't take it before
+  // the timeout. Called from one thread only.
+  virtual bool transmit(const Frame &frame, Clock::duration timeout) = 0;
+
+  // Next received frame, or nothing if none arrived before the timeout.
+  // Called from one thread only.
+  virtual std::optional<Frame> receive(Clock::duration timeout) = 0;
+
+  virtual uint32_t bitrate() const = 0;
+
+  virtual bool supports(uint32_t bitrate) const {
+    return bitrate == this->bitrate();
+  }
+
+  // Restarts the controller at another bitrate, false if it doesn't support
+  // it. Safe to call while other threads transmit and receive.
+  virtual bool setBitrate(uint32_t) { return false; }
+
+  virtual BusStats::Controller status() {
+    return {"unknown", 0, 0, 0, 0, 0, 0, 0};
+  }
+};
+
+#endif
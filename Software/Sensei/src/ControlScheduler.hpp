@@ -0,0 +1,338 @@
+#ifndef CONTROL_SCHEDULER_HPP
+#define CONTROL_SCHEDULER_HPP
+
+#include "Clock.hpp"
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <stop_token>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class ControlScheduler;
+
+// A control loop written as a coroutine. It runs on the task of the
+// ControlScheduler it was spawned on, or that of the task awaiting it, and
+// gives the task to the other loops at every co_await.
+class ControlTask {
+public:
+  struct promise_type {
+    ControlScheduler *scheduler{nullptr};
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    ControlTask get_return_object() {
+      return ControlTask{Handle::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    // Resumes whoever awaits the task, a spawned task just stays done
+    auto final_suspend() noexcept {
+      struct Resume {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(Handle handle) noexcept {
+          if (auto next = handle.promise().continuation) {
+            return next;
+          }
+          return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+      };
+      return Resume{};
+    }
+
+    void return_void() {}
+    void unhandled_exception() { error = std::current_exception(); }
+  };
+
+  using Handle = std::coroutine_handle<promise_type>;
+
+  ControlTask(ControlTask &&other) : handle{std::exchange(other.handle, {})} {}
+
+  ControlTask &operator=(ControlTask &&other) {
+    if (this != &other) {
+      if (handle) {
+        handle.destroy();
+      }
+      handle = std::exchange(other.handle, {});
+    }
+    return *this;
+  }
+
+  ~ControlTask() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  bool done() const { return !handle || handle.done(); }
+
+  // Awaiting a task runs it on the awaiting task until it ends
+  bool await_ready() const { return done(); }
+
+  std::coroutine_handle<> await_suspend(Handle awaiting) {
+    handle.promise().scheduler = awaiting.promise().scheduler;
+    handle.promise().continuation = awaiting;
+    return handle;
+  }
+
+  void await_resume() {
+    if (auto error = handle.promise().error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  ControlTask(const ControlTask &) = delete;
+  ControlTask &operator=(const ControlTask &) = delete;
+
+private:
+  friend ControlScheduler;
+
+  explicit ControlTask(Handle handle) : handle{handle} {}
+
+  Handle handle;
+};
+
+// Runs any number of control tasks on the one task that calls run(). Tasks
+// are resumed one at a time in the order they became ready: when something
+// they awaited ended, such as a dose or a timer, or when another task posts
+// them. Every call but run() may come from other tasks.
+class ControlScheduler {
+public:
+  using Sleeper = uint64_t;
+
+  // The task starts with the next round of run()
+  void spawn(ControlTask task) {
+    task.handle.promise().scheduler = this;
+    std::lock_guard guard{mtx};
+    ready.push_back(task.handle);
+    tasks.push_back(std::move(task));
+    cv.notify_one();
+  }
+
+  // Resumes a suspended task on the scheduler's task
+  void post(std::coroutine_handle<> handle) {
+    std::lock_guard guard{mtx};
+    ready.push_back(handle);
+    cv.notify_one();
+  }
+
+  // Resumes the task at the given time unless woken before, only when woken
+  // for time_point::max()
+  Sleeper sleepUntil(Clock::time_point at, std::coroutine_handle<> handle) {
+    std::lock_guard guard{mtx};
+    const Sleeper sleeper = nextSleeper++;
+    sleepers.emplace(sleeper, handle);
+    if (at != Clock::time_point::max()) {
+      timers.push({at, sleeper});
+    }
+    cv.notify_one();
+    return sleeper;
+  }
+
+  // Resumes a sleeping task early, false if it woke already
+  bool wake(Sleeper sleeper) {
+    std::lock_guard guard{mtx};
+    auto sleeping = sleepers.find(sleeper);
+    if (sleeping == sleepers.end()) {
+      return false;
+    }
+    ready.push_back(sleeping->second);
+    sleepers.erase(sleeping);
+    cv.notify_one();
+    return true;
+  }
+
+  ControlScheduler() {
+    // Under virtual time the task waiting on the clock runs the tasks
+    if (Clock::Source *source = Clock::source()) {
+      timeActor.emplace(
+          source, Clock::Actor{[this] { return step(); },
+                               [this] { return nextWakeup(); }});
+    }
+  }
+
+  // Runs the tasks until stop is requested. Rethrows what a spawned task
+  // didn't catch, like the thread of a blocking control loop would. Not
+  // called under virtual time.
+  void run(std::stop_token stop) {
+    std::stop_callback interrupt{stop, [this] {
+                                   std::lock_guard guard{mtx};
+                                   cv.notify_one();
+                                 }};
+
+    while (!stop.stop_requested()) {
+      if (step()) {
+        continue;
+      }
+
+      std::unique_lock lock{mtx};
+      if (!ready.empty() || stop.stop_requested()) {
+        continue;
+      }
+      if (timers.empty()) {
+        cv.wait(lock);
+      } else {
+        const Clock::time_point next = timers.top().at;
+        cv.wait_until(lock, next);
+      }
+    }
+  }
+
+private:
+  struct Timer {
+    Clock::time_point at;
+    Sleeper sleeper;
+
+    bool operator>(const Timer &other) const { return at > other.at; }
+  };
+
+  // Resumes the next ready task, false if none is ready
+  bool step() {
+    std::unique_lock lock{mtx};
+    const auto now = Clock::now();
+    while (!timers.empty() && timers.top().at <= now) {
+      if (auto sleeping = sleepers.find(timers.top().sleeper);
+          sleeping != sleepers.end()) {
+        ready.push_back(sleeping->second);
+        sleepers.erase(sleeping);
+      }
+      timers.pop();
+    }
+
+    if (ready.empty()) {
+      return false;
+    }
+    const auto handle = ready.front();
+    ready.pop_front();
+    lock.unlock();
+    handle.resume();
+    reap();
+    return true;
+  }
+
+  std::optional<Clock::time_point> nextWakeup() {
+    std::lock_guard guard{mtx};
+    if (!ready.empty()) {
+      return Clock::now();
+    }
+    // Timers of sleepers woken early stay in the heap
+    while (!timers.empty() && !sleepers.contains(timers.top().sleeper)) {
+      timers.pop();
+    }
+    if (timers.empty()) {
+      return std::nullopt;
+    }
+    return timers.top().at;
+  }
+
+  // Drops the tasks that ended, on the scheduler's task only
+  void reap() {
+    std::vector<ControlTask> ended;
+    {
+      std::lock_guard guard{mtx};
+      for (auto task = tasks.begin(); task != tasks.end();) {
+        if (task->done()) {
+          ended.push_back(std::move(*task));
+          task = tasks.erase(task);
+        } else {
+          ++task;
+        }
+      }
+    }
+    for (const ControlTask &task : ended) {
+      if (auto error = task.handle.promise().error) {
+        std::rethrow_exception(error);
+      }
+    }
+  }
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::vector<ControlTask> tasks;
+  std::deque<std::coroutine_handle<>> ready;
+  std::unordered_map<Sleeper, std::coroutine_handle<>> sleepers;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers;
+  Sleeper nextSleeper{0};
+  std::optional<Clock::Attachment> timeActor;
+};
+
+// co_await sleepFor(interval) suspends the awaiting task for the interval
+inline auto sleepFor(Clock::duration duration) {
+  struct Sleep {
+    Clock::time_point until;
+
+    bool await_ready() const { return until <= Clock::now(); }
+    void await_suspend(ControlTask::Handle handle) {
+      handle.promise().scheduler->sleepUntil(until, handle);
+    }
+    void await_resume() const {}
+  };
+  return Sleep{Clock::now() + duration};
+}
+
+// Wakes a task sleeping in wait() or waitFor() from any other task, like
+// releasing a binary semaphore: a notify() without a sleeper ends the next
+// wait at once
+class Wakeup {
+public:
+  // Awaited, true if notified
+  struct Wait {
+    Wakeup &wakeup;
+    Clock::time_point until;
+    bool notified{false};
+
+    bool await_ready() const { return false; }
+    bool await_suspend(ControlTask::Handle handle) {
+      std::lock_guard guard{wakeup.mtx};
+      if (std::exchange(wakeup.pending, false)) {
+        notified = true;
+        return false;
+      }
+      wakeup.scheduler = handle.promise().scheduler;
+      wakeup.sleeper = wakeup.scheduler->sleepUntil(until, handle);
+      return true;
+    }
+    bool await_resume() {
+      std::lock_guard guard{wakeup.mtx};
+      wakeup.sleeper.reset();
+      return notified || std::exchange(wakeup.woken, false);
+    }
+  };
+
+  void notify() {
+    std::lock_guard guard{mtx};
+    if (sleeper && scheduler->wake(*sleeper)) {
+      woken = true;
+    } else {
+      pending = true;
+    }
+    sleeper.reset();
+  }
+
+  // co_await wakeup.wait() suspends until notified
+  Wait wait() { return Wait{*this, Clock::time_point::max()}; }
+
+  // co_await wakeup.waitFor(timeout) suspends until notified or timed out,
+  // and is true if notified
+  Wait waitFor(Clock::duration timeout) {
+    return Wait{*this, Clock::now() + timeout};
+  }
+
+  Wait waitUntil(Clock::time_point until) { return Wait{*this, until}; }
+
+private:
+  std::mutex mtx;
+  ControlScheduler *scheduler{nullptr};
+  std::optional<ControlScheduler::Sleeper> sleeper;
+  bool pending{false};
+  bool woken{false}; // The sleeper was resumed by notify()
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef CURRENT_MODEL_HPP
+#define CURRENT_MODEL_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+
+// Supply current a doser draws at a flow rate. Starts from a conservative
+// guess for every doser and learns the current per ml/min of each one from
+// what the modules measure, so small pumps stop being counted like big ones.
+// Not synchronized, the owner serializes every call.
+class CurrentModel {
+public:
+  // Current assumed for a doser nothing was measured of yet. A placeholder
+  // rather than a rating, it only matters once a current budget is set and
+  // is replaced by the first measurement of the doser.
+  static constexpr uint32_t defaultCurrent_mA = 350;
+  // Weight of a new measurement in the running average
+  static constexpr float smoothing = 0.2f;
+  // Headroom on learned estimates for measurement noise and load changes
+  static constexpr float margin = 1.15f;
+
+  uint32_t estimate(int id, float flowRate_mL_per_min) const {
+    const auto learned = perFlow.find(id);
+    if (learned == perFlow.end() || flowRate_mL_per_min <= 0) {
+      return defaultCurrent_mA;
+    }
+    return static_cast<uint32_t>(
+        std::ceil(learned->second * flowRate_mL_per_min * margin));
+  }
+
+  // A measurement of a doser running at the given flow rate
+  void observe(int id, float flowRate_mL_per_min, float current_mA) {
+    if (flowRate_mL_per_min <= 0 || current_mA <= 0) {
+      return;
+    }
+
+    const float sample = current_mA / flowRate_mL_per_min;
+    auto [learned, first] = perFlow.try_emplace(id, sample);
+    if (!first) {
+      learned->second += smoothing * (sample - learned->second);
+    }
+  }
+
+  bool learned(int id) const { return perFlow.contains(id); }
+
+private:
+  std::unordered_map<int, float> perFlow; // mA per ml/min
+};
+
+#endif
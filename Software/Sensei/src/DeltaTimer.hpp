@@ -1,10 +1,9 @@
 #ifndef DELTA_TIMER_HPP
 #define DELTA_TIMER_HPP
 
-#include <chrono>
+#include "Clock.hpp"
 
 class DeltaTimer {
-    using Clock = std::chrono::steady_clock;
 public:
     void reset() {
         prev = Clock::now();
@@ -21,4 +20,4 @@ private:
 };
 
 
-#endif
\ No newline at end of file
+#endif
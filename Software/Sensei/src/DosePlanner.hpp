@@ -0,0 +1,135 @@
+#ifndef DOSE_PLANNER_HPP
+#define DOSE_PLANNER_HPP
+
+#include "Clock.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <numeric>
+#include <queue>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+// A dose to plan, module is whatever limits how many of its dosers may run
+// together
+struct DoseJob {
+  int module;
+  Clock::duration duration;
+  uint32_t current_mA{0}; // Estimated supply current while it runs
+};
+
+// Supply current the running dosers may draw together, 0 doesn't limit
+struct CurrentBudget {
+  uint32_t system_mA{0};
+  uint32_t module_mA{0};
+
+  // A doser that alone exceeds a limit still runs once nothing else draws
+  // from it, it would never run otherwise
+  bool fits(uint32_t systemDraw_mA, uint32_t moduleDraw_mA,
+            uint32_t current_mA) const {
+    auto within = [current_mA](uint32_t limit, uint32_t draw) {
+      return limit == 0 || draw == 0 || draw + current_mA <= limit;
+    };
+    return within(system_mA, systemDraw_mA) && within(module_mA, moduleDraw_mA);
+  }
+};
+
+struct PlannedDose {
+  size_t job; // Index into the planned jobs
+  int slot;   // Parallelism slot, 0 to parallelMax - 1
+  Clock::duration start;
+  Clock::duration end;
+};
+
+// Timeline of a group of doses, in the order they start
+struct DosePlan {
+  std::vector<PlannedDose> doses;
+  Clock::duration makespan{};
+};
+
+// Starts the jobs in the order given whenever a slot is free, skipping jobs
+// whose module is at its limit or that don't fit the current budget until
+// one of the running doses ends. A moduleMax of 0 doesn't limit modules. With
+// the order the jobs were queued in, this is what a plain semaphore does.
+inline DosePlan scheduleInOrder(std::span<const DoseJob> jobs,
+                                std::span<const size_t> order, int parallelMax,
+                                int moduleMax = 0, CurrentBudget budget = {}) {
+  struct Running {
+    Clock::duration end;
+    int slot;
+    int module;
+    uint32_t current_mA;
+
+    bool operator>(const Running &other) const { return end > other.end; }
+  };
+
+  DosePlan plan;
+  std::vector<size_t> waiting(order.begin(), order.end());
+  std::priority_queue<Running, std::vector<Running>, std::greater<>> running;
+  std::unordered_map<int, int> perModule;
+  std::unordered_map<int, uint32_t> moduleDraw;
+  uint32_t systemDraw{0};
+  std::vector<int> freeSlots(std::max(parallelMax, 0));
+  std::iota(freeSlots.rbegin(), freeSlots.rend(), 0);
+  Clock::duration now{};
+
+  while (!waiting.empty() && !freeSlots.empty()) {
+    for (auto next = waiting.begin();
+         next != waiting.end() && !freeSlots.empty();) {
+      const DoseJob &job = jobs[*next];
+      if ((moduleMax > 0 && perModule[job.module] >= moduleMax) ||
+          !budget.fits(systemDraw, moduleDraw[job.module], job.current_mA)) {
+        ++next;
+        continue;
+      }
+
+      const int slot = freeSlots.back();
+      freeSlots.pop_back();
+      ++perModule[job.module];
+      systemDraw += job.current_mA;
+      moduleDraw[job.module] += job.current_mA;
+      plan.doses.push_back({*next, slot, now, now + job.duration});
+      running.push({now + job.duration, slot, job.module, job.current_mA});
+      plan.makespan = std::max(plan.makespan, now + job.duration);
+      next = waiting.erase(next);
+    }
+
+    if (waiting.empty() || running.empty()) {
+      break;
+    }
+
+    // Everything that ends at the same time frees its slot at once
+    now = running.top().end;
+    while (!running.empty() && running.top().end == now) {
+      const Running &ended = running.top();
+      freeSlots.push_back(ended.slot);
+      --perModule[ended.module];
+      systemDraw -= ended.current_mA;
+      moduleDraw[ended.module] -= ended.current_mA;
+      running.pop();
+    }
+  }
+  return plan;
+}
+
+// Longest processing time first: list scheduling with the longest jobs at
+// the front, which keeps long doses from being started last and finishes
+// within 4/3 of the shortest possible makespan. Module and current limits can
+// make the order the jobs came in the better one, then that plan is kept.
+inline DosePlan planDoses(std::span<const DoseJob> jobs, int parallelMax,
+                          int moduleMax = 0, CurrentBudget budget = {}) {
+  std::vector<size_t> order(jobs.size());
+  std::iota(order.begin(), order.end(), 0);
+  DosePlan queued =
+      scheduleInOrder(jobs, order, parallelMax, moduleMax, budget);
+
+  std::stable_sort(order.begin(), order.end(), [&jobs](size_t a, size_t b) {
+    return jobs[a].duration > jobs[b].duration;
+  });
+  DosePlan longestFirst =
+      scheduleInOrder(jobs, order, parallelMax, moduleMax, budget);
+  return longestFirst.makespan <= queued.makespan ? longestFirst : queued;
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef DOSER_BITMAP_HPP
+#define DOSER_BITMAP_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+// Set of doser ids, one bit each, wide enough for a full chain: 255 module
+// addresses, 0xFF broadcasts, of 4 channels each. Words are 32 bits, the
+// widest the ESP32 does atomically without a lock.
+class DoserBits {
+public:
+  using Word = uint32_t;
+  static constexpr int maxDosers = 255 * 4;
+  static constexpr int wordBits = 32;
+  static constexpr size_t words = (maxDosers + wordBits - 1) / wordBits;
+
+  class Iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = int;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = int;
+
+    Iterator() = default;
+    Iterator(const DoserBits *bits, int id) : bits{bits}, id{bits->from(id)} {}
+
+    int operator*() const { return id; }
+    Iterator &operator++() {
+      id = bits->from(id + 1);
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator previous = *this;
+      ++*this;
+      return previous;
+    }
+    bool operator==(const Iterator &other) const { return id == other.id; }
+
+  private:
+    const DoserBits *bits{nullptr};
+    int id{maxDosers};
+  };
+
+  static bool valid(int id) { return id >= 0 && id < maxDosers; }
+
+  bool contains(int id) const {
+    return valid(id) && (word[id / wordBits] & bit(id)) != 0;
+  }
+
+  size_t size() const {
+    size_t count = 0;
+    for (Word bits : word) {
+      count += std::popcount(bits);
+    }
+    return count;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  // Ids in ascending order
+  Iterator begin() const { return {this, 0}; }
+  Iterator end() const { return {this, maxDosers}; }
+
+private:
+  friend class DoserBitmap;
+
+  static Word bit(int id) { return Word{1} << (id % wordBits); }
+
+  // First id in the set from id on, maxDosers if there is none
+  int from(int id) const {
+    while (id < maxDosers) {
+      if (const Word bits = word[id / wordBits] >> (id % wordBits); bits) {
+        return id + std::countr_zero(bits);
+      }
+      id = (id / wordBits + 1) * wordBits;
+    }
+    return maxDosers;
+  }
+
+  std::array<Word, words> word{};
+};
+
+// The dosers free to lend. Taking and giving back a doser is a single
+// atomic operation on its word, so lending neither locks nor allocates and
+// a snapshot is a copy of the words.
+class DoserBitmap {
+public:
+  // Makes dosers 0 to count - 1 available and every other one unavailable,
+  // up to maxDosers
+  void reset(int count) {
+    count = std::min(count, DoserBits::maxDosers);
+    for (size_t i = 0; i < DoserBits::words; ++i) {
+      const int first = i * DoserBits::wordBits;
+      const int set = std::clamp(count - first, 0, DoserBits::wordBits);
+      const DoserBits::Word bits = set == DoserBits::wordBits
+                                       ? ~DoserBits::Word{0}
+                                       : (DoserBits::Word{1} << set) - 1;
+      word[i].store(bits, std::memory_order_release);
+    }
+  }
+
+  // Takes the doser if it's available, false if someone else has it
+  bool take(int id) {
+    if (!DoserBits::valid(id)) {
+      return false;
+    }
+    const DoserBits::Word bit = DoserBits::bit(id);
+    return (word[id / DoserBits::wordBits].fetch_and(
+                ~bit, std::memory_order_acquire) &
+            bit) != 0;
+  }
+
+  void give(int id) {
+    if (DoserBits::valid(id)) {
+      word[id / DoserBits::wordBits].fetch_or(DoserBits::bit(id),
+                                              std::memory_order_release);
+    }
+  }
+
+  // Every word is read atomically, but not all of them at the same instant
+  DoserBits snapshot() const {
+    DoserBits bits;
+    for (size_t i = 0; i < DoserBits::words; ++i) {
+      bits.word[i] = word[i].load(std::memory_order_acquire);
+    }
+    return bits;
+  }
+
+private:
+  std::array<std::atomic<DoserBits::Word>, DoserBits::words> word{};
+};
+
+#endif
@@ -2,20 +2,156 @@
 #define DOSER_MANAGER2_HPP
 
 #include "Clock.hpp"
+#include "ControlScheduler.hpp"
+#include "CurrentModel.hpp"
+#include "DosePlanner.hpp"
+#include "DoserBitmap.hpp"
+#include "SlotScheduler.hpp"
+#include "TelemetryTable.hpp"
+#include "VolumeLedger.hpp"
+#include "logging.h"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
 #include <deque>
-#include <semaphore>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Ends a dose early, whether it still waits for a slot or runs already:
+// once stop is requested on the token or once the deadline passed
+struct DoseControl {
+  std::stop_token stop;
+  Clock::time_point deadline{Clock::time_point::max()};
+};
 
 class DoserManager {
   constexpr static char tag[] = "DoserManager";
 
 public:
+  using FlowCommand = std::pair<int, float>;
+
+  // Volume a doser delivered until stopAll() switched it off. Module timed
+  // doses report it, for the rest it follows from flow rate and run time.
+  struct Stopped {
+    int id;
+    float delivered_mL;
+  };
+
+  // Where a dose reports the volume it delivered once it ended, the promise
+  // behind a future or an operation a control task awaits
+  class DoseResult {
+  public:
+    using Report = std::function<void(float, std::exception_ptr)>;
+
+    explicit DoseResult(Report report) : report{std::move(report)} {}
+
+    explicit DoseResult(std::promise<float> promise)
+        : DoseResult{[promise = std::make_shared<std::promise<float>>(
+                          std::move(promise))](float delivered_mL,
+                                               std::exception_ptr error) {
+            if (error) {
+              promise->set_exception(error);
+            } else {
+              promise->set_value(delivered_mL);
+            }
+          }} {}
+
+    void set(float delivered_mL) const { report(delivered_mL, nullptr); }
+    void fail(std::exception_ptr error) const { report(0, error); }
+
+  private:
+    Report report;
+  };
+
+  // Doses a control task co_awaits instead of blocking on their futures.
+  // They are queued when the operation is created, the task is resumed on
+  // its scheduler once every one of them ended. Results in the order of
+  // doses, the first failure is rethrown.
+  template <typename Result> class DoseOperation {
+    friend DoserManager;
+
+  public:
+    bool await_ready() const {
+      std::lock_guard guard{state->mtx};
+      return state->remaining == 0;
+    }
+
+    bool await_suspend(ControlTask::Handle handle) {
+      std::lock_guard guard{state->mtx};
+      if (state->remaining == 0) {
+        return false;
+      }
+      state->scheduler = handle.promise().scheduler;
+      state->awaiting = handle;
+      return true;
+    }
+
+    Result await_resume() {
+      std::lock_guard guard{state->mtx};
+      if (state->error) {
+        std::rethrow_exception(state->error);
+      }
+      if constexpr (std::is_same_v<Result, float>) {
+        return state->delivered.front();
+      } else {
+        return std::move(state->delivered);
+      }
+    }
+
+  private:
+    // Shared with the doses, which may end after the awaiting task is gone
+    struct State {
+      std::mutex mtx;
+      std::vector<float> delivered;
+      std::exception_ptr error;
+      size_t remaining;
+      ControlScheduler *scheduler{nullptr};
+      std::coroutine_handle<> awaiting;
+    };
+
+    explicit DoseOperation(size_t doses) : state{std::make_shared<State>()} {
+      state->delivered.resize(doses);
+      state->remaining = doses;
+    }
+
+    DoseResult result(size_t dose) const {
+      return DoseResult{[state = state, dose](float delivered_mL,
+                                              std::exception_ptr error) {
+        std::lock_guard guard{state->mtx};
+        state->delivered[dose] = delivered_mL;
+        if (error && !state->error) {
+          state->error = error;
+        }
+        if (--state->remaining == 0 && state->awaiting) {
+          state->scheduler->post(state->awaiting);
+        }
+      }};
+    }
+
+    std::shared_ptr<State> state;
+  };
+
   class Doser {
     friend DoserManager;
 
   public:
     Doser(Doser &&other)
-        : manager{other.manager}, id{other.id}, isOn{other.isOn} {
+        : manager{other.manager}, id{other.id}, isOn{other.isOn},
+          slotClass{other.slotClass} {
       other.manager = nullptr;
     }
 
@@ -28,6 +164,7 @@ public:
         manager = other.manager;
         id = other.id;
         isOn = other.isOn;
+        slotClass = other.slotClass;
         other.manager = nullptr;
       }
       return *this;
@@ -42,13 +179,14 @@ public:
 
     void on(float flowRate_mL_per_min) {
       if (manager) {
-        manager->doserOn(id, flowRate_mL_per_min, isOn);
+        manager->doserOn(id, flowRate_mL_per_min, isOn, slotClass);
         isOn = true;
       }
     }
 
     bool tryOn(float flowRate_mL_per_min) {
-      if (manager && manager->tryDoserOn(id, flowRate_mL_per_min, isOn)) {
+      if (manager &&
+          manager->tryDoserOn(id, flowRate_mL_per_min, isOn, slotClass)) {
         isOn = true;
         return true;
       }
@@ -57,70 +195,537 @@ public:
 
     void off() {
       if (manager && isOn) {
-        manager->doserOff(id);
+        manager->doserOff(id, slotClass);
         isOn = false;
+      } else if (manager) {
+        manager->stopDose(id);
       }
     }
 
+    // Doses amount_mL at the given flow rate. Returns at once, the dose
+    // starts when a slot is free. The future resolves with the delivered
+    // volume once the dose ended, turning the doser off or the control ends
+    // it early.
+    std::future<float> dose(float amount_mL, float flowRate_mL_per_min,
+                            const DoseControl &control = {}) {
+      std::promise<float> delivered;
+      auto result = delivered.get_future();
+      start(amount_mL, flowRate_mL_per_min, control,
+            DoseResult{std::move(delivered)});
+      return result;
+    }
+
+    // The same dose for a control task: co_await yields the delivered volume
+    // without blocking the scheduler's task
+    DoseOperation<float> doseAsync(float amount_mL, float flowRate_mL_per_min,
+                                   const DoseControl &control = {}) {
+      DoseOperation<float> operation{1};
+      start(amount_mL, flowRate_mL_per_min, control, operation.result(0));
+      return operation;
+    }
+
     int getId() const { return id; }
     bool getIsOn() const { return isOn; }
+    SlotClass getSlotClass() const { return slotClass; }
 
     Doser(const Doser &) = delete;
     Doser &operator=(const Doser &) = delete;
 
   private:
-    Doser(DoserManager *manager, int id) : manager{manager}, id{id} { off(); }
+    Doser(DoserManager *manager, int id, SlotClass slotClass)
+        : manager{manager}, id{id}, slotClass{slotClass} {
+      off();
+    }
+
+    void start(float amount_mL, float flowRate_mL_per_min,
+               const DoseControl &control, DoseResult delivered) {
+      if (!manager) {
+        throw std::logic_error("dose on a moved from doser");
+      }
+      checkDose(amount_mL, flowRate_mL_per_min);
+      off();
+      manager->startDose(id, amount_mL, flowRate_mL_per_min, slotClass,
+                         control, std::move(delivered));
+    }
 
     DoserManager *manager;
     int id;
     bool isOn{false};
+    SlotClass slotClass;
   };
 
-  DoserManager(int parallelMax) : sem{parallelMax} {}
-  virtual ~DoserManager() = default;
+  // Doses of a group, wait() blocks until every one of them ended
+  class DoseBatch {
+    friend DoserManager;
+
+  public:
+    // Timeline the doses were queued by, with job indices in the order of
+    // doses. Actual start times follow the delivered durations.
+    const DosePlan &timeline() const { return plan; }
+
+    // Delivered volumes in the order of doses. Rethrows the first failure
+    // once every dose ended.
+    std::vector<float> wait() {
+      for (auto &dose : doses) {
+        Clock::wait(dose);
+      }
 
+      std::vector<float> delivered;
+      for (auto &dose : doses) {
+        delivered.push_back(dose.get());
+      }
+      return delivered;
+    }
+
+  private:
+    std::vector<std::future<float>> doses;
+    DosePlan plan;
+  };
+
+  DoserManager(int parallelMax) : parallelMax{parallelMax}, slots{parallelMax} {
+    // Under virtual time the task waiting on the clock runs the executor
+    if (Clock::Source *source = Clock::source()) {
+      timeActor.emplace(source, Clock::Actor{[this] {
+                                               std::unique_lock lock{doseMtx};
+                                               return executeReady(lock);
+                                             },
+                                             [this] { return nextWakeup(); }});
+    } else {
+      executor = std::jthread([this](std::stop_token stop) { execute(stop); });
+    }
+  }
+  // Subclasses call shutdown() first in their destructor, the executor
+  // would otherwise call into them while they're torn down
+  virtual ~DoserManager() { shutdown(); }
+
+  // Dosers past DoserBits::maxDosers are never lent
   void connectDosers() {
-    std::lock_guard guard{mtx};
     flowRates = implConnectDosers();
-    for (int i = 0; i < flowRates.size(); ++i) {
-      available.insert(i);
+    if (flowRates.size() > DoserBits::maxDosers) {
+      ESP_LOGE(tag, "%zu dosers connected, only %d can be lent",
+               flowRates.size(), DoserBits::maxDosers);
     }
+    available.reset(flowRates.size());
   }
 
-  std::optional<Doser> lendDoser(int id) {
-    std::lock_guard guard{mtx};
-    if (available.erase(id) == 1) {
-      return Doser{this, id};
+  // The doser competes for slots in the given class while it's lent
+  std::optional<Doser> lendDoser(int id,
+                                 SlotClass slotClass = SlotClass::Manual) {
+    if (available.take(id)) {
+      return Doser{this, id, slotClass};
     } else {
       return std::nullopt;
     }
   }
 
-  std::unordered_set<int> availableDosers() {
-    std::lock_guard guard{mtx};
-    return available;
-  }
+  DoserBits availableDosers() const { return available.snapshot(); }
 
   const std::vector<float> &getFlowRates() const { return flowRates; }
 
+  // What every doser pumped, timed doses as they report it and dosers turned
+  // on by hand by their flow rate and run time
+  VolumeLedger &ledger() { return volumeLedger; }
+
+  // Latest state the dosers reported themselves, empty for managers whose
+  // dosers don't report
+  virtual std::vector<DoserTelemetry> telemetry() const { return {}; }
+  int getParallelMax() const { return parallelMax; }
+
+  // Limits the doses that run at once on the dosers of one module, 0 doesn't
+  // limit them. Dosers turned on by hand don't count.
+  void setModuleParallelMax(int max) {
+    std::lock_guard guard{doseMtx};
+    moduleParallelMax = max;
+  }
+
+  // Caps the slots one class may hold, which keeps the rest for the classes
+  // above it
+  void setSlotLimit(SlotClass slotClass, int max) {
+    std::lock_guard guard{doseMtx};
+    slots.setLimit(slotClass, max);
+  }
+
+  // Waiting this long counts as one class more urgent
+  void setSlotAging(Clock::duration step) {
+    std::lock_guard guard{doseMtx};
+    slots.setAgingStep(step);
+  }
+
+  // Limits the supply current of the running dosers, in total and per
+  // module. Dosers wait for a slot until their estimated current fits.
+  void setCurrentBudget(CurrentBudget budget) {
+    std::lock_guard guard{doseMtx};
+    currentBudget = budget;
+    dispatch();
+  }
+
+  // Current the running dosers are estimated to draw
+  uint32_t currentDraw() {
+    std::lock_guard guard{doseMtx};
+    return systemDraw_mA;
+  }
+
+  uint32_t currentEstimate(int id, float flowRate_mL_per_min) {
+    std::lock_guard guard{doseMtx};
+    return currents.estimate(id, flowRate_mL_per_min);
+  }
+
+  // A current measured on the supply of a group of dosers, such as the
+  // channels of one motor driver. Split over the running ones by their
+  // estimates, it teaches the current model what each of them draws.
+  void reportCurrent(std::span<const int> ids, float current_mA) {
+    std::lock_guard guard{doseMtx};
+    uint32_t estimated = 0;
+    for (int id : ids) {
+      if (auto draw = drawing.find(id); draw != drawing.end()) {
+        estimated += draw->second.current_mA;
+      }
+    }
+    if (estimated == 0) {
+      return;
+    }
+
+    for (int id : ids) {
+      if (auto draw = drawing.find(id); draw != drawing.end()) {
+        const float share = float(draw->second.current_mA) / estimated;
+        currents.observe(id, draw->second.flowRate, current_mA * share);
+      }
+    }
+  }
+
+  std::array<SlotScheduler::WaitStats, slotClasses> slotWaitStats() {
+    std::lock_guard guard{doseMtx};
+    return slots.waitStats();
+  }
+
+  // Turns a group of dosers on with a single call to the implementation so
+  // that they start together. Dosers that are off take their slots and
+  // current at once, so the group must be of one slot class and fit in its
+  // slot limit.
+  void on(std::span<Doser *const> dosers, float flowRate_mL_per_min) {
+    std::vector<FlowCommand> starting;
+    std::optional<SlotClass> slotClass;
+    for (Doser *doser : dosers) {
+      if (doser->manager == this && !doser->isOn) {
+        if (slotClass && doser->slotClass != *slotClass) {
+          throw std::logic_error("doser group mixes slot classes");
+        }
+        slotClass = doser->slotClass;
+        starting.emplace_back(doser->id, flowRate_mL_per_min);
+      }
+    }
+    if (slotClass) {
+      acquireSlots(*slotClass, starting);
+    }
+
+    std::vector<FlowCommand> commands;
+    for (Doser *doser : dosers) {
+      if (doser->manager != this) {
+        continue;
+      }
+      if (doser->isOn) {
+        changeFlow(doser->id, flowRate_mL_per_min);
+      }
+      commands.emplace_back(doser->id, flowRate_mL_per_min);
+    }
+
+    implSetFlowRates(commands);
+    for (Doser *doser : dosers) {
+      if (doser->manager == this) {
+        doser->isOn = true;
+      }
+    }
+  }
+
+  void off(std::span<Doser *const> dosers) {
+    std::vector<FlowCommand> commands;
+    for (Doser *doser : dosers) {
+      if (doser->manager == this && doser->isOn) {
+        commands.emplace_back(doser->id, 0.0f);
+      }
+    }
+
+    if (commands.empty()) {
+      return;
+    }
+
+    implSetFlowRates(commands);
+    for (Doser *doser : dosers) {
+      if (doser->manager == this && doser->isOn) {
+        doser->isOn = false;
+        releaseSlot(doser->slotClass, doser->id);
+      }
+    }
+  }
+
+  // Queues the doses of a group and returns at once. The doses are queued
+  // longest first so that the group finishes as early as the parallelism,
+  // module and current limits allow, later ones start as earlier ones
+  // finish.
+  DoseBatch submit(std::span<const std::pair<Doser *, float>> doses,
+                   float flowRate_mL_per_min,
+                   const DoseControl &control = {}) {
+    DoseBatch batch;
+    batch.plan = planGroup(doses, flowRate_mL_per_min);
+    batch.doses.resize(doses.size());
+    for (const PlannedDose &planned : batch.plan.doses) {
+      auto [doser, amount_mL] = doses[planned.job];
+      batch.doses[planned.job] =
+          doser->dose(amount_mL, flowRate_mL_per_min, control);
+    }
+    return batch;
+  }
+
+  // Queues the doses of a group like submit() for a control task to
+  // co_await, which yields the delivered volumes in the order of doses
+  DoseOperation<std::vector<float>>
+  doseAsync(std::span<const std::pair<Doser *, float>> doses,
+            float flowRate_mL_per_min, const DoseControl &control = {}) {
+    const DosePlan plan = planGroup(doses, flowRate_mL_per_min);
+    DoseOperation<std::vector<float>> operation{doses.size()};
+    for (const PlannedDose &planned : plan.doses) {
+      auto [doser, amount_mL] = doses[planned.job];
+      doser->start(amount_mL, flowRate_mL_per_min, control,
+                   operation.result(planned.job));
+    }
+    return operation;
+  }
+
+  // Doses a group of dosers and waits until every dose ended. Returns the
+  // delivered volumes in the order of doses.
+  std::vector<float> dose(std::span<const std::pair<Doser *, float>> doses,
+                          float flowRate_mL_per_min,
+                          const DoseControl &control = {}) {
+    return submit(doses, flowRate_mL_per_min, control).wait();
+  }
+
+  // Switches every doser off with a single call to the implementation and
+  // drops the doses waiting for a slot. Waits up to `timeout` for the
+  // running doses to report what they delivered. Dosers turned on by hand
+  // stay lent and keep their slot until their owner turns them off.
+  std::vector<Stopped> stopAll(Clock::duration timeout) {
+    std::vector<Stopped> stopped;
+    std::vector<FlowCommand> commands;
+    std::unordered_map<int, uint64_t> stopping;
+    {
+      std::lock_guard guard{doseMtx};
+      while (!queued.empty()) {
+        stopped.push_back({queued.front().id, 0});
+        dropDose(queued.front().id, std::nullopt);
+      }
+      while (!starting.empty()) {
+        stopped.push_back({starting.front().id, 0});
+        dropDose(starting.front().id, std::nullopt);
+      }
+
+      // A doser on by hand keeps its slot without flow, what it pumped so
+      // far is booked now and nothing more once its owner turns it off
+      const auto now = Clock::now();
+      for (auto &[id, draw] : drawing) {
+        commands.emplace_back(id, 0.0f);
+        if (auto dose = dosing.find(id); dose != dosing.end()) {
+          stopping.emplace(id, dose->second.serial);
+          endTimedDose(id, now);
+        } else {
+          stopped.push_back({id, rebook(id, draw, 0, now)});
+        }
+      }
+    }
+
+    implSetFlowRates(commands);
+
+    std::unique_lock lock{doseMtx};
+    Clock::waitUntil(finishedCv, lock, Clock::now() + timeout,
+                     [this, &stopping] {
+                       return std::ranges::none_of(
+                           stopping, [this](const auto &dose) {
+                             auto running = dosing.find(dose.first);
+                             return running != dosing.end() &&
+                                    running->second.serial == dose.second;
+                           });
+                     });
+    for (auto [id, serial] : stopping) {
+      if (auto result = finished.find(id);
+          result != finished.end() && result->second.first == serial) {
+        stopped.push_back({id, result->second.second});
+      } else if (auto dose = dosing.find(id); dose != dosing.end()) {
+        // Didn't report in time
+        stopped.push_back({id, dose->second.deliveredUntil(Clock::now())});
+      }
+    }
+    return stopped;
+  }
+
+protected:
+  // Stops the executor, or leaves virtual time, so nothing calls the
+  // implementation any more. Then flushes the ledger, which keeps what was
+  // pumped across restarts. Later calls do nothing.
+  void shutdown() {
+    if (executor.joinable()) {
+      executor.request_stop();
+      executor.join();
+    }
+    timeActor.reset();
+    if (!shutDown) {
+      shutDown = true;
+      volumeLedger.flush();
+    }
+  }
+
+  // Called with every flow rate change of a group. Implementations that can
+  // switch several dosers with one message override this.
+  virtual void implSetFlowRates(std::span<const FlowCommand> commands) {
+    for (auto [id, flowRate] : commands) {
+      if (flowRate > 0) {
+        implDoserOn(id, flowRate);
+      } else {
+        implDoserOff(id);
+      }
+    }
+  }
+
+  // Runs a dose on the executor task, which must not block on it. Calls
+  // doseFinished() once the dose ended and then resolves `delivered`.
+  // Implementations that can time doses on the doser itself override this.
+  // The default switches the doser off from the executor's timer heap.
+  virtual void implDose(int id, float amount_mL, float flowRate_mL_per_min,
+                        DoseResult delivered) {
+    using Minutes = std::chrono::duration<float, std::chrono::minutes::period>;
+
+    implDoserOn(id, flowRate_mL_per_min);
+    const auto start = Clock::now();
+    const auto end = start + std::chrono::duration_cast<Clock::duration>(
+                                 Minutes(amount_mL / flowRate_mL_per_min));
+
+    std::lock_guard guard{doseMtx};
+    const uint64_t serial = dosing.at(id).serial;
+    timed.insert_or_assign(id, TimedDose{serial, start, end, amount_mL,
+                                         flowRate_mL_per_min, false,
+                                         std::move(delivered)});
+    timers.push({end, id, serial, Timer::End});
+    wakeExecutor();
+  }
+
+  // Module a doser belongs to for the module limit. Every doser is a module
+  // of its own unless the implementation knows better.
+  virtual int implModuleOf(int id) { return id; }
+
+  // Frees the parallelism slot of a dose. Without the delivered volume it
+  // is estimated from the flow rate and how long the dose ran.
+  void doseFinished(int id, std::optional<float> delivered_mL = std::nullopt) {
+    std::lock_guard guard{doseMtx};
+    if (auto dose = dosing.find(id); dose != dosing.end()) {
+      const RunningDose &ended = dose->second;
+      const float delivered =
+          delivered_mL.value_or(ended.deliveredUntil(Clock::now()));
+      finished.insert_or_assign(id, std::pair{ended.serial, delivered});
+      volumeLedger.record(id, delivered);
+      --moduleDoses[ended.module];
+      slots.release(ended.slotClass);
+      retireCanceller(ended.serial);
+      dosing.erase(dose);
+      finishedCv.notify_all();
+    }
+    stopDrawing(id);
+    dispatch();
+  }
+
 private:
+  // A doser that holds or waits for a slot, with the current it was granted
+  // for
+  struct Draw {
+    int module;
+    float flowRate;
+    uint32_t current_mA;
+    Clock::time_point since{};
+  };
+
+  using Canceller = std::stop_callback<std::function<void()>>;
+
+  struct QueuedDose {
+    uint64_t serial;
+    SlotScheduler::Ticket ticket;
+    int id;
+    int module;
+    SlotClass slotClass;
+    float amount_mL;
+    float flowRate_mL_per_min;
+    uint32_t current_mA;
+    DoseResult delivered;
+
+    Draw draw() const { return {module, flowRate_mL_per_min, current_mA}; }
+  };
+
+  struct RunningDose {
+    uint64_t serial;
+    int module;
+    SlotClass slotClass;
+    float amount_mL;
+    float flowRate_mL_per_min;
+    Clock::time_point start;
+    bool stopped{false};
+
+    float deliveredUntil(Clock::time_point now) const {
+      using Minutes =
+          std::chrono::duration<float, std::chrono::minutes::period>;
+      return std::min(amount_mL,
+                      flowRate_mL_per_min * Minutes(now - start).count());
+    }
+  };
+
+  struct TimedDose {
+    uint64_t serial;
+    Clock::time_point start;
+    Clock::time_point end;
+    float amount_mL;
+    float flowRate_mL_per_min;
+    bool stopped;
+    DoseResult delivered;
+  };
+
+  struct Timer {
+    enum Kind : uint8_t { End, Deadline };
+
+    Clock::time_point at;
+    int id;
+    uint64_t serial; // Of the dose the timer belongs to
+    Kind kind;
+
+    bool operator>(const Timer &other) const { return at > other.at; }
+  };
+
   virtual std::vector<float> implConnectDosers() = 0;
   virtual void implDoserOn(int id, float flowRate) = 0;
   virtual void implDoserOff(int id) = 0;
 
-  void doserOn(int id, float flowRate, bool isOn) {
-    if (!isOn)
-      sem.acquire();
+  void doserOn(int id, float flowRate, bool isOn, SlotClass slotClass) {
+    if (isOn) {
+      changeFlow(id, flowRate);
+    } else {
+      const FlowCommand command{id, flowRate};
+      acquireSlots(slotClass, {&command, 1});
+    }
     implDoserOn(id, flowRate);
   }
 
-  bool tryDoserOn(int id, float flowRate, bool isOn) {
+  bool tryDoserOn(int id, float flowRate, bool isOn, SlotClass slotClass) {
     if (isOn) {
+      changeFlow(id, flowRate);
       implDoserOn(id, flowRate);
       return true;
     }
 
-    if (sem.try_acquire()) {
+    const int module = implModuleOf(id);
+    bool acquired;
+    {
+      std::lock_guard guard{doseMtx};
+      const Draw draw{module, flowRate, currents.estimate(id, flowRate)};
+      acquired = fits(draw) && slots.tryAcquire(slotClass);
+      if (acquired) {
+        startDrawing(id, draw);
+      }
+    }
+    if (acquired) {
       implDoserOn(id, flowRate);
       return true;
     }
@@ -128,31 +733,488 @@ private:
     return false;
   }
 
-  void doserOff(int id) {
+  void doserOff(int id, SlotClass slotClass) {
     implDoserOff(id);
-    sem.release();
+    releaseSlot(slotClass, id);
+  }
+
+  // Blocks until the scheduler hands this caller a slot for every doser and
+  // their current fits the budget together. Taking them one at a time could
+  // wait forever on what the group's own dosers hold.
+  void acquireSlots(SlotClass slotClass, std::span<const FlowCommand> dosers) {
+    std::vector<int> modules;
+    for (auto [id, _] : dosers) {
+      modules.push_back(implModuleOf(id));
+    }
+    const int count = static_cast<int>(dosers.size());
+    std::unique_lock lock{doseMtx};
+    if (count > std::min(parallelMax, slots.limit(slotClass))) {
+      throw std::logic_error("doser group exceeds parallelism limit");
+    }
+    std::vector<std::pair<int, Draw>> draws;
+    for (size_t i = 0; i < dosers.size(); ++i) {
+      auto [id, flowRate] = dosers[i];
+      draws.emplace_back(
+          id, Draw{modules[i], flowRate, currents.estimate(id, flowRate)});
+    }
+    const auto ticket = slots.enqueue(slotClass, count);
+    blocked.emplace(ticket, std::move(draws));
+    dispatch();
+    Clock::waitUntil(slotCv, lock, Clock::time_point::max(),
+                     [this, ticket] { return granted.erase(ticket) == 1; });
+  }
+
+  void releaseSlot(SlotClass slotClass, int id) {
+    std::lock_guard guard{doseMtx};
+    slots.release(slotClass);
+    if (auto draw = drawing.find(id); draw != drawing.end()) {
+      rebook(id, draw->second, 0, Clock::now());
+    }
+    stopDrawing(id);
+    dispatch();
+  }
+
+  // A doser that is on already runs at another flow rate from now
+  void changeFlow(int id, float flowRate) {
+    std::lock_guard guard{doseMtx};
+    if (auto draw = drawing.find(id); draw != drawing.end()) {
+      rebook(id, draw->second, flowRate, Clock::now());
+    }
+  }
+
+  // Holds doseMtx. Records what the draw pumped until now in the ledger and
+  // goes on at the flow rate. Returns the recorded volume.
+  float rebook(int id, Draw &draw, float flowRate, Clock::time_point now) {
+    using Minutes = std::chrono::duration<float, std::chrono::minutes::period>;
+
+    const float pumped_mL = draw.flowRate * Minutes(now - draw.since).count();
+    volumeLedger.record(id, pumped_mL, now);
+    draw.flowRate = flowRate;
+    draw.since = now;
+    return pumped_mL;
+  }
+
+  // Holds doseMtx
+  bool fits(const Draw &draw) {
+    return currentBudget.fits(systemDraw_mA, moduleDraw_mA[draw.module],
+                              draw.current_mA);
+  }
+
+  // Holds doseMtx. The draws of a group together, by module and in total.
+  bool fits(std::span<const std::pair<int, Draw>> draws) {
+    std::unordered_map<int, uint32_t> modules;
+    uint32_t total = 0;
+    for (const auto &[_, draw] : draws) {
+      modules[draw.module] += draw.current_mA;
+      total += draw.current_mA;
+    }
+    // A draw of 0 leaves out the limit it stands for
+    return currentBudget.fits(systemDraw_mA, 0, total) &&
+           std::ranges::all_of(modules, [this](auto module) {
+             return currentBudget.fits(0, moduleDraw_mA[module.first],
+                                       module.second);
+           });
+  }
+
+  // Holds doseMtx
+  void startDrawing(int id, Draw draw) {
+    systemDraw_mA += draw.current_mA;
+    moduleDraw_mA[draw.module] += draw.current_mA;
+    draw.since = Clock::now();
+    drawing.insert_or_assign(id, draw);
+  }
+
+  // Holds doseMtx
+  void stopDrawing(int id) {
+    if (auto draw = drawing.find(id); draw != drawing.end()) {
+      systemDraw_mA -= draw->second.current_mA;
+      moduleDraw_mA[draw->second.module] -= draw->second.current_mA;
+      drawing.erase(draw);
+    }
+  }
+
+  // Holds doseMtx. Hands free slots out until none is left or every waiter
+  // is held back by its module or the current budget. Doses move on to the
+  // executor, callers of acquireSlots() are woken.
+  void dispatch() {
+    auto eligible = [this](SlotScheduler::Ticket ticket) {
+      if (auto waiter = blocked.find(ticket); waiter != blocked.end()) {
+        return fits(waiter->second);
+      }
+      auto dose = std::ranges::find(queued, ticket, &QueuedDose::ticket);
+      return dose == queued.end() ||
+             ((moduleParallelMax <= 0 ||
+               moduleDoses[dose->module] < moduleParallelMax) &&
+              fits(dose->draw()));
+    };
+
+    while (const auto ticket = slots.next(eligible)) {
+      if (auto waiter = blocked.find(*ticket); waiter != blocked.end()) {
+        for (const auto &[id, draw] : waiter->second) {
+          startDrawing(id, draw);
+        }
+        blocked.erase(waiter);
+        granted.insert(*ticket);
+        slotCv.notify_all();
+        continue;
+      }
+
+      auto dose = std::ranges::find(queued, *ticket, &QueuedDose::ticket);
+      if (dose == queued.end()) {
+        continue;
+      }
+
+      ++moduleDoses[dose->module];
+      startDrawing(dose->id, dose->draw());
+      starting.push_back(std::move(*dose));
+      queued.erase(dose);
+      wakeExecutor();
+    }
+  }
+
+  // The duration of a dose is amount over flow rate, it has to be a number
+  static void checkDose(float amount_mL, float flowRate_mL_per_min) {
+    if (!std::isfinite(amount_mL)) {
+      throw std::logic_error("dose amount is not a number");
+    }
+    if (!(flowRate_mL_per_min > 0) || !std::isfinite(flowRate_mL_per_min)) {
+      throw std::logic_error("dose flow rate must be positive");
+    }
+  }
+
+  // Order a group's doses are queued in, planned under the limits in force
+  DosePlan planGroup(std::span<const std::pair<Doser *, float>> doses,
+                     float flowRate_mL_per_min) {
+    using Minutes = std::chrono::duration<float, std::chrono::minutes::period>;
+
+    std::vector<DoseJob> jobs;
+    for (auto [doser, amount_mL] : doses) {
+      if (doser->manager != this) {
+        throw std::logic_error("dose on a doser of another manager");
+      }
+      checkDose(amount_mL, flowRate_mL_per_min);
+      jobs.push_back({implModuleOf(doser->id),
+                      std::chrono::duration_cast<Clock::duration>(
+                          Minutes(amount_mL / flowRate_mL_per_min))});
+    }
+
+    int moduleMax;
+    CurrentBudget budget;
+    {
+      std::lock_guard guard{doseMtx};
+      moduleMax = moduleParallelMax;
+      budget = currentBudget;
+      for (size_t i = 0; i < jobs.size(); ++i) {
+        jobs[i].current_mA =
+            currents.estimate(doses[i].first->id, flowRate_mL_per_min);
+      }
+    }
+
+    return planDoses(jobs, parallelMax, moduleMax, budget);
   }
 
-  void returnDoser(int id) {
-    std::lock_guard guard{mtx};
-    available.insert(id);
+  void startDose(int id, float amount_mL, float flowRate_mL_per_min,
+                 SlotClass slotClass, const DoseControl &control,
+                 DoseResult delivered) {
+    // Stopped before it was even queued
+    if (control.stop.stop_requested()) {
+      delivered.set(0);
+      return;
+    }
+    const int module = implModuleOf(id);
+
+    uint64_t serial;
+    {
+      std::lock_guard guard{doseMtx};
+      serial = nextSerial++;
+      queued.push_back({serial, slots.enqueue(slotClass), id, module,
+                        slotClass, amount_mL, flowRate_mL_per_min,
+                        currents.estimate(id, flowRate_mL_per_min),
+                        std::move(delivered)});
+      if (control.deadline != Clock::time_point::max()) {
+        timers.push({control.deadline, id, serial, Timer::Deadline});
+        wakeExecutor();
+      }
+      dispatch();
+    }
+
+    // Runs at once if stop was requested already, so it's set up unlocked
+    if (control.stop.stop_possible()) {
+      auto canceller = std::make_unique<Canceller>(
+          control.stop, [this, id, serial] { stopDose(id, serial); });
+      std::lock_guard guard{doseMtx};
+      if (isCurrent(id, serial)) {
+        cancellers.emplace(serial, std::move(canceller));
+      } else {
+        retired.push_back(std::move(canceller));
+        wakeExecutor();
+      }
+    }
+  }
+
+  // Switching off a dosing doser ends the dose, its slot is freed when the
+  // implementation reports the end. A dose still waiting for a slot is
+  // dropped and delivered nothing. With a serial only that dose is stopped,
+  // not a later one of the same doser.
+  void stopDose(int id, std::optional<uint64_t> serial = std::nullopt) {
+    bool running;
+    {
+      std::lock_guard guard{doseMtx};
+      running = stopLocked(id, serial);
+    }
+    if (running) {
+      implDoserOff(id);
+    }
+  }
+
+  // Holds doseMtx. Returns whether the dose runs and the doser must be
+  // switched off.
+  bool stopLocked(int id, std::optional<uint64_t> serial) {
+    if (dropDose(id, serial)) {
+      return false;
+    }
+
+    auto dose = dosing.find(id);
+    if (dose == dosing.end() || (serial && dose->second.serial != *serial)) {
+      return false;
+    }
+    dose->second.stopped = true;
+    endTimedDose(id, Clock::now());
+    return true;
+  }
+
+  // Holds doseMtx. Drops a dose that didn't start yet, it delivered nothing.
+  bool dropDose(int id, std::optional<uint64_t> serial) {
+    auto matches = [id, serial](const QueuedDose &dose) {
+      return dose.id == id && (!serial || dose.serial == *serial);
+    };
+
+    if (auto waiting = std::ranges::find_if(queued, matches);
+        waiting != queued.end()) {
+      slots.remove(waiting->ticket);
+      retireCanceller(waiting->serial);
+      waiting->delivered.set(0);
+      queued.erase(waiting);
+      return true;
+    }
+    // Granted a slot but not started yet
+    if (auto pending = std::ranges::find_if(starting, matches);
+        pending != starting.end()) {
+      --moduleDoses[pending->module];
+      slots.release(pending->slotClass);
+      stopDrawing(id);
+      retireCanceller(pending->serial);
+      pending->delivered.set(0);
+      starting.erase(pending);
+      dispatch();
+      return true;
+    }
+    return false;
+  }
+
+  // Holds doseMtx. Moves the end of a dose the default implDose() times to
+  // now, the executor switches the doser off.
+  void endTimedDose(int id, Clock::time_point now) {
+    if (auto dose = timed.find(id); dose != timed.end()) {
+      dose->second.end = now;
+      dose->second.stopped = true;
+      timers.push({now, id, dose->second.serial, Timer::End});
+      wakeExecutor();
+    }
+  }
+
+  // Holds doseMtx
+  bool isCurrent(int id, uint64_t serial) const {
+    auto matches = [id, serial](const QueuedDose &dose) {
+      return dose.id == id && dose.serial == serial;
+    };
+    auto dose = dosing.find(id);
+    return (dose != dosing.end() && dose->second.serial == serial) ||
+           std::ranges::any_of(queued, matches) ||
+           std::ranges::any_of(starting, matches);
+  }
+
+  // Holds doseMtx. A stop callback can't be destroyed while its owner holds
+  // the lock the callback takes, the executor destroys it unlocked.
+  void retireCanceller(uint64_t serial) {
+    if (auto canceller = cancellers.find(serial);
+        canceller != cancellers.end()) {
+      retired.push_back(std::move(canceller->second));
+      cancellers.erase(canceller);
+      wakeExecutor();
+    }
+  }
+
+  // Holds doseMtx
+  void wakeExecutor() {
+    wake = true;
+    executorCv.notify_one();
   }
 
+  // The single task behind every dose: starts doses once the scheduler
+  // granted them a slot and ends the doses the default implDose() times, so
+  // the number of tasks doesn't grow with the number of dosers.
+  void execute(std::stop_token stop) {
+    std::unique_lock lock{doseMtx};
+    while (!stop.stop_requested()) {
+      wake = false;
+      if (executeReady(lock)) {
+        continue;
+      }
+
+      if (timers.empty()) {
+        executorCv.wait(lock, stop, [this] { return wake; });
+      } else {
+        // Taken by value, the heap may grow while the wait is unlocked
+        const Clock::time_point next = timers.top().at;
+        executorCv.wait_until(lock, stop, next, [this] { return wake; });
+      }
+    }
+  }
+
+  // Holds doseMtx, unlocks it around calls to the implementation. Does
+  // what is due now, false if nothing was.
+  bool executeReady(std::unique_lock<std::mutex> &lock) {
+    bool worked = false;
+    if (!retired.empty()) {
+      auto done = std::move(retired);
+      retired.clear();
+      lock.unlock();
+      done.clear();
+      lock.lock();
+      worked = true;
+    }
+
+    while (!starting.empty()) {
+      auto dose = std::move(starting.front());
+      starting.pop_front();
+      dosing.emplace(dose.id, RunningDose{dose.serial, dose.module,
+                                          dose.slotClass, dose.amount_mL,
+                                          dose.flowRate_mL_per_min,
+                                          Clock::now()});
+      lock.unlock();
+      implDose(dose.id, dose.amount_mL, dose.flowRate_mL_per_min,
+               std::move(dose.delivered));
+      lock.lock();
+      worked = true;
+
+      // A stop while the dose was being started may have come before it
+      if (auto started = dosing.find(dose.id);
+          started != dosing.end() && started->second.serial == dose.serial &&
+          started->second.stopped) {
+        endTimedDose(dose.id, Clock::now());
+        lock.unlock();
+        implDoserOff(dose.id);
+        lock.lock();
+      }
+    }
+
+    while (!timers.empty() && timers.top().at <= Clock::now()) {
+      const Timer timer = timers.top();
+      timers.pop();
+      const int id = timer.id;
+      worked = true;
+
+      if (timer.kind == Timer::Deadline) {
+        if (stopLocked(id, timer.serial)) {
+          lock.unlock();
+          implDoserOff(id);
+          lock.lock();
+        }
+        continue;
+      }
+
+      if (isStale(timer)) {
+        continue;
+      }
+      auto dose = timed.find(id);
+      auto ended = std::move(dose->second);
+      timed.erase(dose);
+      lock.unlock();
+      finishTimedDose(id, std::move(ended));
+      lock.lock();
+    }
+    return worked;
+  }
+
+  // When the executor has something to do next, for virtual time
+  std::optional<Clock::time_point> nextWakeup() {
+    std::lock_guard guard{doseMtx};
+    if (!retired.empty() || !starting.empty()) {
+      return Clock::now();
+    }
+    while (!timers.empty() && isStale(timers.top())) {
+      timers.pop();
+    }
+    if (timers.empty()) {
+      return std::nullopt;
+    }
+    return timers.top().at;
+  }
+
+  // Holds doseMtx. Timers of stopped doses stay in the heap, only the
+  // latest end and the deadline of a dose still around count.
+  bool isStale(const Timer &timer) const {
+    if (timer.kind == Timer::Deadline) {
+      return !isCurrent(timer.id, timer.serial);
+    }
+    auto dose = timed.find(timer.id);
+    return dose == timed.end() || dose->second.serial != timer.serial ||
+           dose->second.end != timer.at;
+  }
+
+  void finishTimedDose(int id, TimedDose dose) {
+    using Minutes = std::chrono::duration<float, std::chrono::minutes::period>;
+
+    implDoserOff(id);
+    const float delivered =
+        dose.stopped ? std::min(dose.amount_mL,
+                                dose.flowRate_mL_per_min *
+                                    Minutes(dose.end - dose.start).count())
+                     : dose.amount_mL;
+    doseFinished(id, delivered);
+    dose.delivered.set(delivered);
+  }
+
+  void returnDoser(int id) { available.give(id); }
+
   std::vector<float> flowRates;
-  std::unordered_set<int> available;
-  std::counting_semaphore<> sem;
-  std::mutex mtx;
+  const int parallelMax;
+  DoserBitmap available;
+  std::unordered_map<int, RunningDose> dosing;
+  VolumeLedger volumeLedger;
+  // Guards dosing, the slots and the executor's state
+  std::mutex doseMtx;
+  SlotScheduler slots;
+  std::unordered_set<SlotScheduler::Ticket> granted;
+  std::condition_variable slotCv;
+  std::deque<QueuedDose> queued;   // Waiting for a slot
+  std::deque<QueuedDose> starting; // Granted a slot, started by the executor
+  std::unordered_map<int, int> moduleDoses;
+  std::unordered_map<SlotScheduler::Ticket, std::vector<std::pair<int, Draw>>>
+      blocked;
+  CurrentModel currents;
+  CurrentBudget currentBudget;
+  std::unordered_map<int, Draw> drawing; // Dosers holding a slot
+  std::unordered_map<int, uint32_t> moduleDraw_mA;
+  uint32_t systemDraw_mA{0};
+  int moduleParallelMax{0};
+  std::unordered_map<int, TimedDose> timed;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers;
+  uint64_t nextSerial{0};
+  std::unordered_map<uint64_t, std::unique_ptr<Canceller>> cancellers;
+  std::vector<std::unique_ptr<Canceller>> retired;
+  // Serial and delivered volume of the last dose of every doser
+  std::unordered_map<int, std::pair<uint64_t, float>> finished;
+  std::condition_variable finishedCv;
+  std::condition_variable_any executorCv;
+  bool wake{false};
+  bool shutDown{false};
+  // Last so they stop before the state they use goes away
+  std::optional<Clock::Attachment> timeActor;
+  std::jthread executor;
 };
 
 extern std::unique_ptr<DoserManager> gDoserManager;
 
-static void dose(DoserManager::Doser &doser, float amount_mL,
-                 float flowRate_mL_per_min) {
-  doser.on(flowRate_mL_per_min);
-  std::this_thread::sleep_for(
-      std::chrono::duration<float, std::chrono::minutes::period>(
-          amount_mL / flowRate_mL_per_min));
-  doser.off();
-}
-
 #endif
\ No newline at end of file
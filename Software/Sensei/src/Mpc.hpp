@@ -0,0 +1,164 @@
+#ifndef MPC_HPP
+#define MPC_HPP
+
+#include "Clock.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+
+// Plans the doses of one direction over a horizon of adjustments on a model
+// of the reservoir: a dose changes the reading by gain per mL once it has
+// mixed in, and mixes in with a time constant. The plan closes the deficit
+// as fast as the largest dose per step allows, and never doses more than it
+// takes to reach the target once everything pending has mixed in, so the
+// reading doesn't pass it.
+//
+// The solver runs a fixed number of projected gradient iterations on
+// preallocated arrays. Each takes horizon^2 multiply-adds for the gradient
+// and at most 32 * horizon for the projection.
+class Mpc {
+public:
+  static constexpr int maxHorizon = 16;
+
+  struct Model {
+    float gain;             // Reading change per mL once mixed in
+    Clock::duration mixing; // Time constant of mixing
+  };
+
+  int horizon{8};          // Adjustments planned for, up to maxHorizon
+  int iterations{50};      // Of the solver
+  float doseWeight{0.01f}; // Against the deficit, spreads doses when > 0
+
+  // mL to dose now towards the target. The deficit is how far the reading
+  // is from the target, pending the part of earlier doses that hasn't
+  // mixed in yet, both in the direction the doser moves the reading.
+  float plan(const Model &model, Clock::duration step, float maxDose,
+             float deficit, float pending) {
+    using Seconds = std::chrono::duration<float>;
+
+    planned.fill(0);
+    const int n = std::clamp(horizon, 1, maxHorizon);
+    const float g = model.gain;
+    const float budget = (deficit - pending) / std::max(g, 1e-9f);
+    if (g <= 0 || budget <= 0 || maxDose <= 0) {
+      return 0;
+    }
+
+    // Share of a dose mixed in m steps after it, mixed[m - 1]
+    const float stay =
+        model.mixing.count() > 0
+            ? std::exp(-Seconds(step).count() / Seconds(model.mixing).count())
+            : 0;
+    std::array<float, maxHorizon> mixed;
+    float left = 1;
+    for (int m = 0; m < n; ++m) {
+      left *= stay;
+      mixed[m] = 1 - left;
+    }
+
+    // Deficit at the end of every step without doses
+    std::array<float, maxHorizon> undosed;
+    for (int k = 0; k < n; ++k) {
+      undosed[k] = deficit - pending * mixed[k];
+    }
+
+    // Lipschitz bound of the gradient sets the step
+    float lipschitz = doseWeight;
+    for (int m = 0; m < n; ++m) {
+      lipschitz += (n - m) * mixed[m] * mixed[m];
+    }
+    lipschitz *= 2 * g * g;
+
+    // Starts from dosing as early as possible, usually close to the plan
+    float remaining = budget;
+    for (int j = 0; j < n; ++j) {
+      planned[j] = std::min(maxDose, remaining);
+      remaining -= planned[j];
+    }
+
+    std::array<float, maxHorizon> error;
+    for (int i = 0; i < iterations; ++i) {
+      for (int k = 0; k < n; ++k) {
+        float dosed = 0;
+        for (int j = 0; j <= k; ++j) {
+          dosed += mixed[k - j] * planned[j];
+        }
+        error[k] = undosed[k] - g * dosed;
+      }
+      for (int j = 0; j < n; ++j) {
+        float gradient = 2 * g * g * doseWeight * planned[j];
+        for (int k = j; k < n; ++k) {
+          gradient -= 2 * g * mixed[k - j] * error[k];
+        }
+        planned[j] -= gradient / lipschitz;
+      }
+      project(n, maxDose, budget);
+    }
+    return planned[0];
+  }
+
+  // Doses of the last plan, one per step
+  const std::array<float, maxHorizon> &doses() const { return planned; }
+
+private:
+  // Onto 0 <= dose <= maxDose with the doses summing to the budget at most
+  void project(int n, float maxDose, float budget) {
+    const std::array<float, maxHorizon> unclamped = planned;
+    const auto clampedSum = [&](float shift) {
+      float sum = 0;
+      for (int j = 0; j < n; ++j) {
+        sum += std::clamp(unclamped[j] - shift, 0.0f, maxDose);
+      }
+      return sum;
+    };
+
+    // Lowers every dose by the same amount, found by bisection, until the
+    // sum fits
+    float shift = 0;
+    if (clampedSum(0) > budget) {
+      float low = 0;
+      float high = *std::max_element(unclamped.begin(), unclamped.begin() + n);
+      for (int i = 0; i < 32; ++i) {
+        shift = (low + high) / 2;
+        (clampedSum(shift) > budget ? low : high) = shift;
+      }
+      shift = high;
+    }
+    for (int j = 0; j < n; ++j) {
+      planned[j] = std::clamp(unclamped[j] - shift, 0.0f, maxDose);
+    }
+  }
+
+  std::array<float, maxHorizon> planned{};
+};
+
+// What was dosed and hasn't mixed in yet, as a change of the reading. It
+// mixes in with the time constant from the end of each dose.
+class PendingMix {
+public:
+  // Of a dose that ended now
+  void dosed(float change, Clock::duration mixing) {
+    pending = value(mixing) + change;
+    since = Clock::now();
+  }
+
+  float value(Clock::duration mixing) const {
+    using Seconds = std::chrono::duration<float>;
+
+    if (mixing.count() <= 0) {
+      return 0;
+    }
+    const auto elapsed = Clock::now() - since;
+    return pending *
+           std::exp(-Seconds(elapsed).count() / Seconds(mixing).count());
+  }
+
+  void reset() { pending = 0; }
+
+private:
+  float pending{0};
+  Clock::time_point since{};
+};
+
+#endif
@@ -1,35 +1,74 @@
 #ifndef NUTRIENT_CONTROLLER_HPP
 #define NUTRIENT_CONTROLLER_HPP
 
+#include "ControlScheduler.hpp"
 #include "DoserManager.hpp"
+#include "Mpc.hpp"
+#include "SampleGate.hpp"
 #include "Sensor.hpp"
-#include <ArduinoJson.h>
+#include "SettlingDetector.hpp"
+#include "logging.h"
+#include <algorithm>
 #include <chrono>
+#include <atomic>
 #include <map>
-#include <semaphore>
-#include <thread>
+#include <optional>
+#include <mutex>
+#include <stop_token>
+#include <vector>
 
 using NutrientSchedule = std::map<int, float>;
 
 class NutrientController {
   using Doser = DoserManager::Doser;
+  static constexpr char tag[] = "NutrientController";
 
 public:
+  // Schedule doses the full schedule whenever EC is low. Proportional
+  // scales it by the deficit over the EC the schedule is expected to add.
+  // MPC plans the multiples of the schedule on a model of the reservoir.
+  enum class Mode { Schedule, Proportional, Mpc };
+
   struct Config {
     float target;
     float acceptedError{};
     float flowRate{};
     Clock::duration adjustInterval{};
-    NutrientSchedule schedule;
+    NutrientSchedule schedule{}; // mL of each doser, or their ratio
+    Mode mode{Mode::Proportional};
+    // Largest multiple of the schedule a proportional or MPC dose may be
+    float maxScale{4};
+    // Step of the gain estimate towards each observed response, 0 to 1
+    float learningRate{0.5f};
+    // Adjusts again once EC settled after a dose rather than after
+    // adjustInterval, which stays the longest wait
+    std::optional<SettlingDetector::Config> settling{};
+    // Reservoir model of MPC: liters, the time constant of mixing, and the
+    // EC change of the schedule's doses in a liter
+    float volume{};
+    Clock::duration mixing{};
+    float strength{};
+    int horizon{8}; // Adjustments planned for
   };
 
   NutrientController(const Sensor &ecSensor) : ecSensor{ecSensor} {}
 
   void start(const Config &config) {
+    if (config.settling && config.settling->samplePeriod <= Clock::duration{}) {
+      throw std::logic_error("settling needs a sample period");
+    }
+    if (!(config.flowRate > 0)) {
+      throw std::logic_error("dosing needs a positive flow rate");
+    }
+    std::lock_guard guard{mtx};
     this->config = config;
     dosers.clear();
+    stopSource = {};
+    last.reset();
+    mpc.horizon = config.horizon;
+    pendingMix.reset();
     for (auto [id, _] : config.schedule) {
-      auto doser = gDoserManager->lendDoser(id);
+      auto doser = gDoserManager->lendDoser(id, SlotClass::Nutrient);
       if (!doser) {
         dosers.clear();
         throw std::logic_error("doser " + std::to_string(id) +
@@ -39,48 +78,254 @@ public:
     }
 
     running = true;
-    sem.release();
+    wakeup.notify();
   }
 
+  // Ends the running doses before the dosers are given back, the dose in
+  // progress returns what it delivered so far
   void stop() {
+    std::lock_guard guard{mtx};
+    stopSource.request_stop();
     dosers.clear();
     running = false;
+    wakeup.notify();
   }
 
-  void run() {
+  // The control loop, spawned on a ControlScheduler
+  ControlTask run() {
     for (;;) {
-      if (running)
-        adjust();
-      sem.try_acquire_for(config.adjustInterval);
+      if (running) {
+        co_await adjust();
+        co_await next();
+      } else {
+        // Stopped, there's no interval to adjust at until started
+        co_await wakeup.wait();
+      }
     }
   }
 
   bool isRunning() const { return running; }
 
+  // Learned EC per mL of the dosers, they stay across restarts
+  std::map<int, float> gains() {
+    std::lock_guard guard{mtx};
+    return gain;
+  }
+
 private:
-  void adjust() {
-    if (const float ec = ecSensor.reading();
-        ec + config.acceptedError < config.target) {
-      std::vector<std::thread> doses;
+  // EC at an adjustment and what was dosed after it
+  struct Observation {
+    float ec;
+    Clock::time_point at;
+    std::map<int, float> dosed;
+  };
+
+  ControlTask adjust() {
+    co_await fresh();
+    const float ec = ecSensor.reading();
+    const auto at = Clock::now();
+    learn(ec);
+    // Doses beyond the parallelism limit start as earlier ones finish
+    std::vector<float> delivered;
+    try {
+      delivered = co_await startDoses(ec);
+    } catch (const std::exception &e) {
+      // What the doses delivered isn't known, so nothing is learned from
+      // them and the next adjustment doses again
+      ESP_LOGE(tag, "Doses failed: %s", e.what());
+      forget();
+      co_return;
+    }
+    observe(ec, at, delivered);
+    mixIn(delivered);
+    dosed = std::any_of(delivered.begin(), delivered.end(),
+                        [](float volume) { return volume > 0; });
+  }
+
+  // Nothing to dose once stopped or when the EC is within the accepted error
+  DoserManager::DoseOperation<std::vector<float>> startDoses(float ec) {
+    std::lock_guard guard{mtx};
+    std::vector<std::pair<Doser *, float>> group;
+    const float deficit = config.target - ec;
+    const bool due = running && deficit > config.acceptedError;
+    const float factor = due ? scale(deficit) : 0;
+    if (factor > 0) {
       for (auto [id, amount] : config.schedule) {
-        doses.emplace_back([this, id, amount]() {
-          dose(dosers.at(id), amount, config.flowRate);
-        });
+        group.emplace_back(&dosers.at(id), amount * factor);
+      }
+    }
+    return gDoserManager->doseAsync(group, config.flowRate,
+                                    {stopSource.get_token()});
+  }
+
+  // Holds mtx. The full schedule until there's a gain to predict by.
+  float scale(float deficit) {
+    if (config.mode == Mode::Schedule) {
+      return 1;
+    }
+    if (config.mode == Mode::Mpc) {
+      return mpcScale(deficit);
+    }
+    float expected = 0;
+    for (auto [id, amount] : config.schedule) {
+      if (auto g = gain.find(id); g != gain.end()) {
+        expected += amount * g->second;
+      }
+    }
+    if (expected <= 0) {
+      return 1;
+    }
+    return std::clamp(deficit / expected, 0.0f, config.maxScale);
+  }
+
+  // Holds mtx. Plans on the reservoir model, counting what earlier doses
+  // have yet to mix in so it doesn't dose for them again.
+  float mpcScale(float deficit) {
+    const float pending = pendingMix.value(config.mixing);
+    if (deficit - pending <= config.acceptedError || config.volume <= 0) {
+      return 0;
+    }
+    const Mpc::Model model{config.strength / config.volume, config.mixing};
+    return mpc.plan(model, config.adjustInterval, config.maxScale, deficit,
+                    pending);
+  }
+
+  // What the doses delivered mixes in from now on, MPC only
+  void mixIn(const std::vector<float> &delivered) {
+    std::lock_guard guard{mtx};
+    if (config.mode != Mode::Mpc || config.volume <= 0) {
+      return;
+    }
+    float schedule = 0;
+    for (auto [_, amount] : config.schedule) {
+      schedule += amount;
+    }
+    float total = 0;
+    for (float volume : delivered) {
+      total += volume;
+    }
+    if (schedule > 0) {
+      pendingMix.dosed(config.strength / config.volume * total / schedule,
+                       config.mixing);
+    }
+  }
+
+  // What was dosed after this reading, in the order of the schedule
+  void observe(float ec, Clock::time_point at,
+               const std::vector<float> &delivered) {
+    std::lock_guard guard{mtx};
+    Observation observation{ec, at, {}};
+    auto volume = delivered.begin();
+    for (auto [id, _] : config.schedule) {
+      if (volume == delivered.end()) {
+        break;
+      }
+      if (*volume > 0) {
+        observation.dosed.emplace(id, *volume);
+      }
+      ++volume;
+    }
+    last = std::move(observation);
+  }
+
+  void forget() {
+    std::lock_guard guard{mtx};
+    last.reset();
+  }
+
+  // Updates the drift from adjustments without doses and the gains from
+  // those with, by normalized least mean squares. A schedule doses in a
+  // fixed ratio, so only the EC of that mix is learned for sure. MPC
+  // adjusts before doses have mixed in and goes by its model instead.
+  void learn(float ec) {
+    using Hours = std::chrono::duration<float, std::chrono::hours::period>;
+
+    std::lock_guard guard{mtx};
+    if (!last || config.mode == Mode::Mpc) {
+      return;
+    }
+    const float hours = Hours(Clock::now() - last->at).count();
+    if (last->dosed.empty()) {
+      if (hours > 0) {
+        const float rate = (ec - last->ec) / hours;
+        drift_per_h = drift ? drift_per_h + 0.5f * (rate - drift_per_h) : rate;
+        drift = true;
+      }
+      return;
+    }
+
+    const float response = ec - last->ec - drift_per_h * hours;
+    float predicted = 0;
+    float norm = 0;
+    bool known = false;
+    for (auto [id, volume] : last->dosed) {
+      if (auto g = gain.find(id); g != gain.end()) {
+        predicted += g->second * volume;
+        known = true;
       }
+      norm += volume * volume;
+    }
+    // The first response sets the estimate, later ones move it
+    const float rate = known ? config.learningRate : 1;
+    for (auto [id, volume] : last->dosed) {
+      float &g = gain[id];
+      g = std::max(0.0f, g + rate * (response - predicted) * volume / norm);
+    }
+  }
 
-      for (auto &dose : doses) {
-        dose.join();
+  // A sensor that publishes is read once it took a sample after the one the
+  // last adjustment read, so a late sample isn't acted on twice
+  ControlTask fresh() {
+    while (ecSensor.sequence() > 0 && running) {
+      const bool sampled =
+          co_await samples.next(seen, {}, Clock::time_point::max());
+      if (sampled) {
+        break;
       }
     }
+    seen = ecSensor.sequence();
+  }
+
+  // Once a dose settled, if settling is configured, and after the adjust
+  // interval at the latest
+  ControlTask next() {
+    auto [interval, settling] = pace();
+    const auto deadline = Clock::now() + interval;
+    if (settling && std::exchange(dosed, false)) {
+      SettlingDetector detector{*settling};
+      co_await settle(detector, ecSensor, samples, wakeup, deadline);
+    } else {
+      co_await wakeup.waitFor(interval);
+    }
+  }
+
+  std::pair<Clock::duration, std::optional<SettlingDetector::Config>> pace() {
+    std::lock_guard guard{mtx};
+    return {config.adjustInterval, config.settling};
   }
 
   const Sensor &ecSensor;
   Config config;
   std::map<int, Doser> dosers;
-  std::binary_semaphore sem{0};
-  bool running{false};
+  std::map<int, float> gain;
+  std::optional<Observation> last;
+  Mpc mpc;
+  PendingMix pendingMix;
+  float drift_per_h{0}; // EC change without doses, as plants take it up
+  bool drift{false};
+  bool dosed{false}; // By the last adjustment, on the loop's task only
+  Wakeup wakeup;
+  SampleGate samples{ecSensor, wakeup};
+  uint64_t seen{0}; // Sample the last adjustment read, on the loop's task
+  std::atomic<bool> running{false};
+  std::mutex mtx; // Guards config, dosers and the estimates
+  std::stop_source stopSource;
 };
 
+// Native tests build the controller without the JSON library
+#if __has_include(<ArduinoJson.h>)
+#include <ArduinoJson.h>
+
 void convertToJson(const NutrientController::Config &config, JsonVariant doc) {
   for (const auto &[id, amount] : config.schedule) {
     doc["schedule"][std::to_string(id).c_str()].set(amount);
@@ -90,6 +335,28 @@ void convertToJson(const NutrientController::Config &config, JsonVariant doc) {
   doc["acceptedErr"].set(config.acceptedError);
   doc["adjustmentInterval"].set(config.adjustInterval);
   doc["flowRate"].set(config.flowRate);
+  switch (config.mode) {
+  case NutrientController::Mode::Schedule:
+    doc["mode"] = "schedule";
+    break;
+  case NutrientController::Mode::Proportional:
+    doc["mode"] = "proportional";
+    break;
+  case NutrientController::Mode::Mpc:
+    doc["mode"] = "mpc";
+    doc["volume"] = config.volume;
+    doc["mixing"] = std::chrono::duration_cast<std::chrono::duration<double>>(
+                        config.mixing)
+                        .count();
+    doc["strength"] = config.strength;
+    doc["horizon"] = config.horizon;
+    break;
+  }
+  doc["maxScale"] = config.maxScale;
+  doc["learningRate"] = config.learningRate;
+  if (config.settling) {
+    doc["settling"].set(*config.settling);
+  }
 }
 
 void convertFromJson(JsonVariantConst doc, NutrientController::Config &config) {
@@ -102,6 +369,23 @@ void convertFromJson(JsonVariantConst doc, NutrientController::Config &config) {
   config.acceptedError = doc["acceptedErr"];
   config.adjustInterval = doc["adjustmentInterval"];
   config.flowRate = doc["flowRate"];
+  if (doc["mode"] == "schedule") {
+    config.mode = NutrientController::Mode::Schedule;
+  } else if (doc["mode"] == "mpc") {
+    config.mode = NutrientController::Mode::Mpc;
+    config.volume = doc["volume"];
+    config.mixing = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(doc["mixing"].as<double>()));
+    config.strength = doc["strength"];
+    config.horizon = doc["horizon"] | config.horizon;
+  }
+  config.maxScale = doc["maxScale"] | config.maxScale;
+  config.learningRate = doc["learningRate"] | config.learningRate;
+  if (doc.containsKey("settling")) {
+    config.settling = doc["settling"].as<SettlingDetector::Config>();
+  }
 }
 
-#endif
\ No newline at end of file
+#endif
+
+#endif
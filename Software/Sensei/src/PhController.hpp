@@ -1,36 +1,84 @@
 #ifndef PH_CONTROLLER_HPP
 #define PH_CONTROLLER_HPP
 
+#include "ControlScheduler.hpp"
+#include "DeltaTimer.hpp"
 #include "DoserManager.hpp"
+#include "Mpc.hpp"
+#include "Pid.h"
+#include "SampleGate.hpp"
 #include "Sensor.hpp"
-#include <ArduinoJson.h>
+#include "SettlingDetector.hpp"
+#include "logging.h"
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <atomic>
 #include <map>
-#include <semaphore>
-#include <thread>
+#include <mutex>
+#include <optional>
+#include <stop_token>
 
 class PhController {
   using Doser = DoserManager::Doser;
+  static constexpr char tag[] = "PhController";
 
 public:
+  // Bang-bang doses doseAmount whenever the error is outside acceptedError,
+  // PID sizes every dose from the error, MPC plans the doses on a model of
+  // the reservoir
+  enum class Mode { BangBang, Pid, Mpc };
+
   struct Config {
     float target;
     float acceptedError{};
     float flowRate{};
     float doseAmount{};
     Clock::duration adjustInterval{};
-    std::optional<int> pHDownDoser;
-    std::optional<int> pHUpDoser;
+    std::optional<int> pHDownDoser{};
+    std::optional<int> pHUpDoser{};
+    Mode mode{Mode::BangBang};
+    // PID gains in mL per pH, mL per pH and second, and mL s per pH
+    float kp{};
+    float ki{};
+    float kd{};
+    Pid::Seconds derivativeFilter{};
+    // Largest dose of PID and MPC in mL, the flow rate bounds it further to
+    // what the doser pumps in an adjust interval. None if 0.
+    float maxDose{};
+    // Smaller doses are skipped, the doser can't deliver them accurately
+    float minDose{};
+    // Adjusts again once the pH settled after a dose rather than after
+    // adjustInterval, which stays the longest wait
+    std::optional<SettlingDetector::Config> settling{};
+    // Reservoir model of MPC: liters, the time constant of mixing, and the
+    // pH change of 1 mL of pH up and down in a liter
+    float volume{};
+    Clock::duration mixing{};
+    float upStrength{};
+    float downStrength{};
+    int horizon{8}; // Adjustments planned for
   };
 
   PhController(const Sensor &phSensor) : phSensor{phSensor} {}
 
   void start(const Config &config) {
+    if (config.settling && config.settling->samplePeriod <= Clock::duration{}) {
+      throw std::logic_error("settling needs a sample period");
+    }
+    if (!(config.flowRate > 0)) {
+      throw std::logic_error("dosing needs a positive flow rate");
+    }
+    std::lock_guard guard{mtx};
     this->config = config;
+    stopSource = {};
+    configurePid();
+    mpc.horizon = config.horizon;
+    pendingMix.reset();
 
     if (config.pHDownDoser) {
       const int id = *config.pHDownDoser;
-      auto doser = gDoserManager->lendDoser(id);
+      auto doser = gDoserManager->lendDoser(id, SlotClass::Ph);
       if (!doser) {
         phDownDoser.reset();
         phUpDoser.reset();
@@ -42,7 +90,7 @@ public:
 
     if (config.pHUpDoser) {
       const int id = *config.pHUpDoser;
-      auto doser = gDoserManager->lendDoser(id);
+      auto doser = gDoserManager->lendDoser(id, SlotClass::Ph);
       if (!doser) {
         phDownDoser.reset();
         phUpDoser.reset();
@@ -53,45 +101,198 @@ public:
     }
 
     running = true;
-    sem.release();
+    wakeup.notify();
   }
 
+  // Ends the running dose before the dosers are given back
   void stop() {
+    std::lock_guard guard{mtx};
+    stopSource.request_stop();
     phDownDoser.reset();
     phUpDoser.reset();
     running = false;
+    wakeup.notify();
   }
 
-  void run() {
+  // The control loop, spawned on a ControlScheduler
+  ControlTask run() {
     for (;;) {
-      if (running)
-        adjust();
-      sem.try_acquire_for(config.adjustInterval);
+      if (running) {
+        co_await adjust();
+        co_await next();
+      } else {
+        // Stopped, there's no interval to adjust at until started
+        co_await wakeup.wait();
+      }
     }
   }
 
   bool isRunning() const { return running; }
 
 private:
-  void adjust() {
-    const float ph = phSensor.reading();
+  ControlTask adjust() {
+    co_await fresh();
+    if (auto dose = startDose(phSensor.reading())) {
+      // A failed dose counts as none, the next adjustment doses again
+      float delivered = 0;
+      try {
+        delivered = co_await *dose;
+      } catch (const std::exception &e) {
+        ESP_LOGE(tag, "Dose failed: %s", e.what());
+      }
+      mixIn(delivered);
+      dosed = delivered > 0;
+    }
+  }
+
+  std::optional<DoserManager::DoseOperation<float>> startDose(float ph) {
+    std::lock_guard guard{mtx};
+    if (!running) {
+      return std::nullopt;
+    }
     const float err = config.target - ph;
+    changePerMl = 0;
+    float amount = 0;
+    switch (config.mode) {
+    case Mode::BangBang:
+      amount = bangBangDose(err);
+      break;
+    case Mode::Pid:
+      amount = pidDose(err);
+      break;
+    case Mode::Mpc:
+      amount = mpcDose(err);
+      break;
+    }
+    const DoseControl control{stopSource.get_token()};
+    if (amount < 0 && phDownDoser) {
+      return phDownDoser->doseAsync(-amount, config.flowRate, control);
+    } else if (amount > 0 && phUpDoser) {
+      return phUpDoser->doseAsync(amount, config.flowRate, control);
+    }
+    return std::nullopt;
+  }
+
+  // Doses in mL, positive raises the pH and negative lowers it
+  float bangBangDose(float err) const {
+    if (err < -config.acceptedError) {
+      return -config.doseAmount;
+    } else if (err > config.acceptedError) {
+      return config.doseAmount;
+    }
+    return 0;
+  }
+
+  // Holds mtx. Updates the PID every adjustment, inside acceptedError too,
+  // so the integral follows slow drift.
+  float pidDose(float err) {
+    const float amount = pid.update(err, sinceAdjust.dt());
+    if (std::abs(err) <= config.acceptedError ||
+        std::abs(amount) < config.minDose) {
+      return 0;
+    }
+    return amount;
+  }
+
+  // Holds mtx. Plans on the reservoir model, counting what earlier doses
+  // have yet to mix in so it doesn't dose for them again.
+  float mpcDose(float err) {
+    const float pending = pendingMix.value(config.mixing);
+    if (std::abs(err - pending) <= config.acceptedError || config.volume <= 0) {
+      return 0;
+    }
+    const float sign = err > pending ? 1 : -1;
+    const float strength = sign > 0 ? config.upStrength : config.downStrength;
+    const Mpc::Model model{strength / config.volume, config.mixing};
+    const float amount = mpc.plan(model, config.adjustInterval, doseLimit(),
+                                  sign * err, sign * pending);
+    if (amount < config.minDose) {
+      return 0;
+    }
+    changePerMl = sign * model.gain;
+    return sign * amount;
+  }
+
+  // What the dose delivered mixes in from now on
+  void mixIn(float delivered) {
+    std::lock_guard guard{mtx};
+    pendingMix.dosed(changePerMl * delivered, config.mixing);
+  }
+
+  // Holds mtx. What the dosers pump in an adjust interval, or maxDose.
+  float doseLimit() const {
+    using Minutes = std::chrono::duration<float, std::chrono::minutes::period>;
+
+    float limit = config.flowRate * Minutes(config.adjustInterval).count();
+    if (config.maxDose > 0) {
+      limit = std::min(limit, config.maxDose);
+    }
+    return limit;
+  }
+
+  // Holds mtx. Clamps the output to what the dosers there are can deliver.
+  void configurePid() {
+    const float limit = doseLimit();
+    pid = Pid{config.kp, config.ki, config.kd};
+    pid.derivativeFilter = config.derivativeFilter;
+    pid.outputMin = config.pHDownDoser ? -limit : 0;
+    pid.outputMax = config.pHUpDoser ? limit : 0;
+    sinceAdjust.reset();
+  }
+
+  // A sensor that publishes is read once it took a sample after the one the
+  // last adjustment read, so a late sample isn't acted on twice
+  ControlTask fresh() {
+    while (phSensor.sequence() > 0 && running) {
+      const bool sampled =
+          co_await samples.next(seen, {}, Clock::time_point::max());
+      if (sampled) {
+        break;
+      }
+    }
+    seen = phSensor.sequence();
+  }
 
-    if (err < config.acceptedError && phDownDoser) {
-      dose(*phDownDoser, config.doseAmount, config.flowRate);
-    } else if (err > config.acceptedError && phUpDoser) {
-      dose(*phUpDoser, config.doseAmount, config.flowRate);
+  // Once a dose settled, if settling is configured, and after the adjust
+  // interval at the latest
+  ControlTask next() {
+    auto [interval, settling] = pace();
+    const auto deadline = Clock::now() + interval;
+    if (settling && std::exchange(dosed, false)) {
+      SettlingDetector detector{*settling};
+      co_await settle(detector, phSensor, samples, wakeup, deadline);
+    } else {
+      co_await wakeup.waitFor(interval);
     }
   }
 
+  std::pair<Clock::duration, std::optional<SettlingDetector::Config>> pace() {
+    std::lock_guard guard{mtx};
+    return {config.adjustInterval, config.settling};
+  }
+
   const Sensor &phSensor;
   Config config;
+  Pid pid{0, 0, 0};
+  Mpc mpc;
+  PendingMix pendingMix;
+  float changePerMl{0}; // pH change of the dose started, MPC only
+  DeltaTimer sinceAdjust;
   std::optional<Doser> phDownDoser;
   std::optional<Doser> phUpDoser;
-  std::binary_semaphore sem{0};
-  bool running{false};
+  bool dosed{false}; // By the last adjustment, on the loop's task only
+  Wakeup wakeup;
+  SampleGate samples{phSensor, wakeup};
+  uint64_t seen{0}; // Sample the last adjustment read, on the loop's task
+  std::atomic<bool> running{false};
+  std::mutex mtx; // Guards config and the dosers against stop()
+  std::stop_source stopSource;
 };
 
+// Native tests build the controller without the JSON library
+#if __has_include(<ArduinoJson.h>)
+#include <ArduinoJson.h>
+
 void convertToJson(const PhController::Config &config, JsonVariant doc) {
   doc["doseAmount"] = config.doseAmount;
   if (config.pHDownDoser) {
@@ -108,6 +309,31 @@ void convertToJson(const PhController::Config &config, JsonVariant doc) {
           config.adjustInterval)
           .count());
   doc["flowRate"] = config.flowRate;
+  if (config.mode == PhController::Mode::Pid) {
+    doc["mode"] = "pid";
+    doc["kp"] = config.kp;
+    doc["ki"] = config.ki;
+    doc["kd"] = config.kd;
+    doc["derivativeFilter"] = config.derivativeFilter.count();
+    doc["maxDose"] = config.maxDose;
+    doc["minDose"] = config.minDose;
+  } else if (config.mode == PhController::Mode::Mpc) {
+    doc["mode"] = "mpc";
+    doc["volume"] = config.volume;
+    doc["mixing"] = std::chrono::duration_cast<std::chrono::duration<double>>(
+                        config.mixing)
+                        .count();
+    doc["upStrength"] = config.upStrength;
+    doc["downStrength"] = config.downStrength;
+    doc["horizon"] = config.horizon;
+    doc["maxDose"] = config.maxDose;
+    doc["minDose"] = config.minDose;
+  } else {
+    doc["mode"] = "bangBang";
+  }
+  if (config.settling) {
+    doc["settling"].set(*config.settling);
+  }
 }
 
 void convertFromJson(JsonVariantConst doc, PhController::Config &config) {
@@ -124,6 +350,30 @@ void convertFromJson(JsonVariantConst doc, PhController::Config &config) {
   config.adjustInterval = std::chrono::duration_cast<Clock::duration>(
       std::chrono::duration<double>(doc["adjustInterval"].as<double>()));
   config.flowRate = doc["flowRate"];
+  if (doc["mode"] == "pid") {
+    config.mode = PhController::Mode::Pid;
+    config.kp = doc["kp"];
+    config.ki = doc["ki"];
+    config.kd = doc["kd"];
+    config.derivativeFilter = Pid::Seconds{doc["derivativeFilter"] | 0.0f};
+    config.maxDose = doc["maxDose"] | 0.0f;
+    config.minDose = doc["minDose"] | 0.0f;
+  } else if (doc["mode"] == "mpc") {
+    config.mode = PhController::Mode::Mpc;
+    config.volume = doc["volume"];
+    config.mixing = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(doc["mixing"].as<double>()));
+    config.upStrength = doc["upStrength"] | 0.0f;
+    config.downStrength = doc["downStrength"] | 0.0f;
+    config.horizon = doc["horizon"] | config.horizon;
+    config.maxDose = doc["maxDose"] | 0.0f;
+    config.minDose = doc["minDose"] | 0.0f;
+  }
+  if (doc.containsKey("settling")) {
+    config.settling = doc["settling"].as<SettlingDetector::Config>();
+  }
 }
 
-#endif
\ No newline at end of file
+#endif
+
+#endif
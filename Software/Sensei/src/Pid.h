@@ -5,6 +5,8 @@
 #ifndef SENSEI_PID_H
 #define SENSEI_PID_H
 
+#include <algorithm>
+#include <limits>
 #include <optional>
 #include <chrono>
 
@@ -12,25 +14,59 @@
 class Pid
 {
 public:
+    using Seconds = std::chrono::duration<float, std::chrono::seconds::period>;
+
     Pid(float kp, float ki, float kd)
     : kp{kp}, ki{ki}, kd{kd}
     {}
 
-    float update(float input, std::chrono::duration<float, std::chrono::seconds::period> dt)
+    // Output for the error, clamped to the output limits. The integral stops
+    // growing while the output saturates in the direction of the error, so
+    // it doesn't wind up while the actuator can't follow.
+    float update(float input, Seconds dt)
     {
         const float proportional = kp * input;
-        integral += ki * input * dt.count();
-        const float derivative = kd * (input - prevInput) / dt.count();
+        if (dt.count() > 0 && prevInput)
+        {
+            const float rate = (input - *prevInput) / dt.count();
+            // First order low-pass, noise on the input would otherwise kick
+            // the output
+            derivative += (rate - derivative) * dt.count() / (derivativeFilter.count() + dt.count());
+        }
         prevInput = input;
-        return proportional + integral + derivative;
+
+        float next = integral;
+        if (dt.count() > 0)
+        {
+            next += ki * input * dt.count();
+        }
+        const float unclamped = proportional + next + kd * derivative;
+        const bool windsUp = (unclamped > outputMax && input > 0) || (unclamped < outputMin && input < 0);
+        if (!windsUp)
+        {
+            integral = next;
+        }
+        return std::clamp(proportional + integral + kd * derivative, outputMin, outputMax);
+    }
+
+    void reset()
+    {
+        integral = 0;
+        derivative = 0;
+        prevInput.reset();
     }
 
     float kp;
     float ki;
     float kd;
+    // Time constant of the derivative's low-pass, none by default
+    Seconds derivativeFilter{0};
+    float outputMin{-std::numeric_limits<float>::infinity()};
+    float outputMax{std::numeric_limits<float>::infinity()};
 private:
     float integral{0};
-    float prevInput{0};
+    float derivative{0};
+    std::optional<float> prevInput;
 };
 
 
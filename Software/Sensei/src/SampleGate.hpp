@@ -0,0 +1,92 @@
+#ifndef SAMPLE_GATE_HPP
+#define SAMPLE_GATE_HPP
+
+#include "Clock.hpp"
+#include "ControlScheduler.hpp"
+#include "Sensor.hpp"
+#include <cstdint>
+#include <mutex>
+
+// Wakes a control task for the sample of a sensor it waits for and for no
+// other, so a sensor sampling faster than the task needs doesn't wake it
+class SampleGate {
+  struct Next {
+    SampleGate &gate;
+    Wakeup::Wait wait;
+    bool sampled{false};
+
+    bool await_ready() {
+      sampled = gate.ready();
+      if (sampled) {
+        gate.close();
+      }
+      return sampled;
+    }
+    bool await_suspend(ControlTask::Handle handle) {
+      return wait.await_suspend(handle);
+    }
+    bool await_resume() {
+      if (!sampled) {
+        wait.await_resume();
+        gate.close();
+        sampled = gate.ready();
+      }
+      return sampled;
+    }
+  };
+
+public:
+  SampleGate(const Sensor &sensor, Wakeup &wakeup)
+      : sensor{sensor}, wakeup{wakeup},
+        subscription{sensor.subscribe(
+            [this](uint64_t sequence) { published(sequence); })} {}
+
+  // co_await gate.next(after, notBefore, deadline) waits for the first
+  // sample after the given sequence number taken at notBefore or later. It
+  // is true if the sample came, false at the deadline or when the wakeup was
+  // notified for something else.
+  Next next(uint64_t after, Clock::time_point notBefore,
+            Clock::time_point deadline) {
+    {
+      std::lock_guard guard{mtx};
+      this->after = after;
+      this->notBefore = notBefore;
+      open = true;
+    }
+    return Next{*this, wakeup.waitUntil(deadline)};
+  }
+
+private:
+  // The sensor's lock is taken after the gate's only, by published()
+  bool ready() {
+    std::unique_lock lock{mtx};
+    const uint64_t wanted = after;
+    const Clock::time_point from = notBefore;
+    lock.unlock();
+    return sensor.sequence() > wanted && sensor.sampledAt() >= from;
+  }
+
+  void close() {
+    std::lock_guard guard{mtx};
+    open = false;
+  }
+
+  // On the sensor's task
+  void published(uint64_t sequence) {
+    std::lock_guard guard{mtx};
+    if (open && sequence > after && Clock::now() >= notBefore) {
+      open = false;
+      wakeup.notify();
+    }
+  }
+
+  const Sensor &sensor;
+  Wakeup &wakeup;
+  std::mutex mtx;
+  uint64_t after{0};
+  Clock::time_point notBefore{};
+  bool open{false};
+  Sensor::Subscription subscription; // Last, unsubscribes first
+};
+
+#endif
@@ -1,10 +1,87 @@
 #ifndef SENSOR_HPP
 #define SENSOR_HPP
 
+#include "Clock.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <utility>
+
+
+// Sensors sample on their own task. Those that call published() after every
+// new sample tell subscribers of it with its sequence number, so readers act
+// on new samples instead of polling reading(). Sensors that never publish
+// are read whenever a reader is due.
+class Sensor {
+public:
+    using Callback = std::function<void(uint64_t sequence)>;
+
+    // Unsubscribes when destroyed
+    class Subscription {
+    public:
+        Subscription(Subscription&& other)
+            : sensor{std::exchange(other.sensor, nullptr)},
+              callback{other.callback} {}
+
+        Subscription& operator=(Subscription&&) = delete;
+
+        ~Subscription() {
+            if (sensor) {
+                std::lock_guard guard{sensor->mtx};
+                sensor->callbacks.erase(callback);
+            }
+        }
+
+    private:
+        friend class Sensor;
+
+        Subscription(const Sensor* sensor,
+                     std::list<Callback>::iterator callback)
+            : sensor{sensor}, callback{callback} {}
+
+        const Sensor* sensor;
+        std::list<Callback>::iterator callback;
+    };
+
+    virtual ~Sensor() = default;
 
-struct Sensor {
     virtual float reading() const = 0;
+
+    // Of the latest sample, 0 until the first is published
+    uint64_t sequence() const { return latest; }
+
+    Clock::time_point sampledAt() const {
+        std::lock_guard guard{mtx};
+        return at;
+    }
+
+    // The callback runs on the sensor's task for every new sample. It holds
+    // the sensor's lock, so it mustn't subscribe, unsubscribe or block.
+    Subscription subscribe(Callback callback) const {
+        std::lock_guard guard{mtx};
+        callbacks.push_back(std::move(callback));
+        return {this, std::prev(callbacks.end())};
+    }
+
+protected:
+    // After the new sample is stored, reading() returns it
+    void published() {
+        std::lock_guard guard{mtx};
+        at = Clock::now();
+        const uint64_t sequence = ++latest;
+        for (const Callback& callback : callbacks) {
+            callback(sequence);
+        }
+    }
+
+private:
+    mutable std::mutex mtx;
+    mutable std::list<Callback> callbacks;
+    std::atomic<uint64_t> latest{0};
+    Clock::time_point at{};
 };
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,158 @@
+#ifndef SETTLING_DETECTOR_HPP
+#define SETTLING_DETECTOR_HPP
+
+#include "Clock.hpp"
+#include "ControlScheduler.hpp"
+#include "SampleGate.hpp"
+#include "Sensor.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+
+// Tells when a reading stopped moving after a dose has mixed in. The
+// readings of the last window are fitted with a line: they have settled
+// when the line is flat enough and the readings stay close to it.
+class SettlingDetector {
+public:
+  struct Config {
+    // Span of the readings judged, longer than the delay before a dose
+    // reaches the probe
+    Clock::duration window{};
+    Clock::duration samplePeriod{};
+    float maxSlope{};     // Per minute
+    float maxDeviation{}; // Standard deviation around the line
+  };
+
+  SettlingDetector() = default;
+  explicit SettlingDetector(const Config &config) : config{config} {}
+
+  // Adds a reading, true once the readings have settled
+  bool add(float value, Clock::time_point at) {
+    samples.push_back({at, value});
+    while (samples.size() > 2 && samples[1].at <= at - config.window) {
+      samples.pop_front();
+    }
+    return settled();
+  }
+
+  // Readings of a whole window are needed, a few samples of a slow response
+  // look flat
+  bool settled() const {
+    if (samples.size() < 3 ||
+        samples.back().at - samples.front().at < config.window) {
+      return false;
+    }
+    auto [slope, deviation] = fit();
+    return std::abs(slope) <= config.maxSlope &&
+           deviation <= config.maxDeviation;
+  }
+
+  void reset() { samples.clear(); }
+
+  const Config &settings() const { return config; }
+
+private:
+  using Minutes = std::chrono::duration<float, std::chrono::minutes::period>;
+
+  struct Sample {
+    Clock::time_point at;
+    float value;
+  };
+
+  struct Fit {
+    float slope;
+    float deviation;
+  };
+
+  // Least squares line through the samples
+  Fit fit() const {
+    const auto start = samples.front().at;
+    const float n = samples.size();
+    float meanT = 0;
+    float meanV = 0;
+    for (const Sample &sample : samples) {
+      meanT += Minutes(sample.at - start).count();
+      meanV += sample.value;
+    }
+    meanT /= n;
+    meanV /= n;
+
+    float covariance = 0;
+    float variance = 0;
+    for (const Sample &sample : samples) {
+      const float dt = Minutes(sample.at - start).count() - meanT;
+      covariance += dt * (sample.value - meanV);
+      variance += dt * dt;
+    }
+    const float slope = variance > 0 ? covariance / variance : 0;
+
+    float residuals = 0;
+    for (const Sample &sample : samples) {
+      const float dt = Minutes(sample.at - start).count() - meanT;
+      const float residual = sample.value - meanV - slope * dt;
+      residuals += residual * residual;
+    }
+    return {slope, std::sqrt(residuals / n)};
+  }
+
+  Config config;
+  std::deque<Sample> samples;
+};
+
+// Samples the sensor until its reading settles, and at the latest until the
+// deadline. A sensor that publishes is read at the first sample it takes
+// every sample period. Ends early when the wakeup is notified.
+inline ControlTask settle(SettlingDetector &detector, const Sensor &sensor,
+                          SampleGate &samples, Wakeup &wakeup,
+                          Clock::time_point deadline) {
+  detector.reset();
+  for (;;) {
+    const uint64_t sequence = sensor.sequence();
+    const auto now = Clock::now();
+    if (now >= deadline || detector.add(sensor.reading(), now)) {
+      co_return;
+    }
+    const auto due =
+        std::min(deadline, now + detector.settings().samplePeriod);
+    if (sequence > 0) {
+      const bool sampled = co_await samples.next(sequence, due, deadline);
+      if (!sampled) {
+        co_return;
+      }
+    } else {
+      const bool notified = co_await wakeup.waitUntil(due);
+      if (notified) {
+        co_return;
+      }
+    }
+  }
+}
+
+// Native tests build the detector without the JSON library
+#if __has_include(<ArduinoJson.h>)
+#include <ArduinoJson.h>
+
+void convertToJson(const SettlingDetector::Config &config, JsonVariant doc) {
+  using Seconds = std::chrono::duration<double>;
+
+  doc["window"] = Seconds(config.window).count();
+  doc["samplePeriod"] = Seconds(config.samplePeriod).count();
+  doc["maxSlope"] = config.maxSlope;
+  doc["maxDeviation"] = config.maxDeviation;
+}
+
+void convertFromJson(JsonVariantConst doc, SettlingDetector::Config &config) {
+  using Seconds = std::chrono::duration<double>;
+
+  config.window = std::chrono::duration_cast<Clock::duration>(
+      Seconds(doc["window"].as<double>()));
+  config.samplePeriod = std::chrono::duration_cast<Clock::duration>(
+      Seconds(doc["samplePeriod"].as<double>()));
+  config.maxSlope = doc["maxSlope"];
+  config.maxDeviation = doc["maxDeviation"];
+}
+
+#endif
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef SIMULATED_BUS_HPP
+#define SIMULATED_BUS_HPP
+
+#include "CANTransport.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// In-process CAN bus for host builds. Every node attaches a Port and uses it
+// as its transport. One frame is on the bus at a time: whenever the bus is
+// idle the queued frame with the lowest identifier wins arbitration, occupies
+// the bus for its worst case wire time at the bitrate and is then delivered
+// to every other port. Frames queued while the bus is busy contend for the
+// next slot, like on the wire.
+//
+// Every port has its own bitrate. A frame is only received by the ports at
+// the sender's bitrate, the others count a receive error, and a frame nobody
+// receives counts as an acknowledgement error for the sender. That's enough
+// for the error counters to go error passive like a controller's on a bus
+// with mixed bitrates. Error frames and retransmission aren't modelled.
+//
+// timeScale stretches the wire time, 0 delivers frames as fast as the host
+// can.
+class SimulatedBus {
+  struct Shared;
+
+public:
+  using Frame = can::protocol::Frame;
+
+  // Queue lengths of the TWAI driver defaults and of a generous receiver
+  static constexpr size_t txQueueLength = 5;
+  static constexpr size_t rxQueueLength = 64;
+  static constexpr uint32_t errorPassiveLimit = 128;
+
+  class Port : public CANTransport {
+  public:
+    explicit Port(std::shared_ptr<Shared> bus)
+        : bus{std::move(bus)}, rate{this->bus->bitrate} {
+      std::lock_guard guard{this->bus->mtx};
+      this->bus->ports.push_back(this);
+    }
+
+    Port(const Port &) = delete;
+    Port &operator=(const Port &) = delete;
+
+    ~Port() override {
+      std::lock_guard guard{bus->mtx};
+      std::erase(bus->ports, this);
+    }
+
+    bool transmit(const Frame &frame, Clock::duration timeout) override {
+      std::unique_lock lock{bus->mtx};
+      if (!txSpace.wait_for(lock, timeout, [this] {
+            return bus->stopped || txQueue.size() < txQueueLength;
+          }) ||
+          bus->stopped) {
+        ++txFailed;
+        return false;
+      }
+      txQueue.push_back({frame, bus->nextOrder++});
+      bus->cv.notify_all();
+      return true;
+    }
+
+    std::optional<Frame> receive(Clock::duration timeout) override {
+      std::unique_lock lock{bus->mtx};
+      if (!rxReady.wait_for(lock, timeout,
+                            [this] { return !rxQueue.empty(); })) {
+        return std::nullopt;
+      }
+      const Frame frame = rxQueue.front();
+      rxQueue.pop_front();
+      return frame;
+    }
+
+    uint32_t bitrate() const override {
+      std::lock_guard guard{bus->mtx};
+      return rate;
+    }
+
+    bool supports(uint32_t bitrate) const override { return bitrate > 0; }
+
+    // Like reinstalling a driver this resets the error counters
+    bool setBitrate(uint32_t bitrate) override {
+      std::lock_guard guard{bus->mtx};
+      rate = bitrate;
+      txErrors = 0;
+      rxErrors = 0;
+      return true;
+    }
+
+    BusStats::Controller status() override {
+      std::lock_guard guard{bus->mtx};
+      const bool passive =
+          txErrors >= errorPassiveLimit || rxErrors >= errorPassiveLimit;
+      return {bus->stopped ? "stopped"
+              : passive    ? "error passive"
+                           : "running",
+              txErrors,
+              rxErrors,
+              txFailed,
+              0,
+              rxOverrun,
+              arbitrationLost,
+              0};
+    }
+
+  private:
+    friend class SimulatedBus;
+
+    struct Queued {
+      Frame frame;
+      uint64_t order;
+    };
+
+    std::shared_ptr<Shared> bus;
+    uint32_t rate;
+    uint32_t txErrors{0};
+    uint32_t rxErrors{0};
+    std::deque<Queued> txQueue;
+    std::deque<Frame> rxQueue;
+    std::condition_variable txSpace;
+    std::condition_variable rxReady;
+    uint32_t txFailed{0};
+    uint32_t rxOverrun{0};
+    uint32_t arbitrationLost{0};
+  };
+
+  explicit SimulatedBus(uint32_t bitrate, double timeScale = 1)
+      : shared{std::make_shared<Shared>(bitrate)}, timeScale{timeScale} {
+    thread = std::jthread([this](std::stop_token stop) { run(stop); });
+  }
+
+  ~SimulatedBus() {
+    {
+      std::lock_guard guard{shared->mtx};
+      shared->stopped = true;
+      for (Port *port : shared->ports) {
+        port->txSpace.notify_all();
+      }
+    }
+    thread.request_stop();
+    shared->cv.notify_all();
+  }
+
+  // Ports may outlive the bus, they fail to transmit once it's gone
+  std::unique_ptr<Port> attach() { return std::make_unique<Port>(shared); }
+
+  uint64_t framesCarried() const {
+    std::lock_guard guard{shared->mtx};
+    return shared->frames;
+  }
+
+  // Time the bus spent carrying frames
+  Clock::duration busyTime() const {
+    std::lock_guard guard{shared->mtx};
+    return shared->busy;
+  }
+
+  // Lower keys win arbitration. The base identifier comes first, then a
+  // standard frame's dominant RTR bit beats an extended frame's recessive
+  // SRR bit, then the extended identifier bits.
+  static uint32_t arbitrationKey(const Frame &frame) {
+    if (!frame.extended) {
+      return (frame.identifier & 0x7FF) << 19;
+    }
+    return ((frame.identifier >> 18) & 0x7FF) << 19 | 1u << 18 |
+           (frame.identifier & 0x3FFFF);
+  }
+
+private:
+  struct Shared {
+    explicit Shared(uint32_t bitrate) : bitrate{bitrate} {}
+
+    const uint32_t bitrate;
+    mutable std::mutex mtx;
+    std::condition_variable_any cv;
+    std::vector<Port *> ports;
+    bool stopped{false};
+    uint64_t nextOrder{0};
+    uint64_t frames{0};
+    Clock::duration busy{0};
+  };
+
+  void run(std::stop_token stop) {
+    std::unique_lock lock{shared->mtx};
+    auto busFree = Clock::now();
+    while (!stop.stop_requested()) {
+      Port *winner = nullptr;
+      if (!shared->cv.wait(lock, stop, [&] { return arbitrate(winner); })) {
+        break;
+      }
+
+      for (Port *port : shared->ports) {
+        if (port != winner && !port->txQueue.empty()) {
+          ++port->arbitrationLost;
+        }
+      }
+
+      const Frame frame = winner->txQueue.front().frame;
+      const uint32_t rate = winner->rate;
+      winner->txQueue.pop_front();
+      winner->txSpace.notify_all();
+
+      const auto wireTime = std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(
+              can::protocol::frameBits(frame.dlc, frame.extended) /
+              static_cast<double>(rate)));
+      shared->busy += wireTime;
+      ++shared->frames;
+
+      if (timeScale > 0) {
+        busFree = std::max(busFree, Clock::now()) +
+                  std::chrono::duration_cast<Clock::duration>(wireTime *
+                                                              timeScale);
+        lock.unlock();
+        std::this_thread::sleep_until(busFree);
+        lock.lock();
+      }
+
+      bool acknowledged = false;
+      for (Port *port : shared->ports) {
+        if (port == winner) {
+          continue;
+        }
+        if (port->rate != rate) {
+          port->rxErrors = std::min(port->rxErrors + 1, 255u);
+          continue;
+        }
+
+        acknowledged = true;
+        port->rxErrors -= port->rxErrors > 0;
+        if (port->rxQueue.size() >= rxQueueLength) {
+          ++port->rxOverrun;
+          continue;
+        }
+        port->rxQueue.push_back(frame);
+        port->rxReady.notify_all();
+      }
+
+      // The winner may have detached while its frame was on the bus. An
+      // error passive sender doesn't count acknowledgement errors.
+      if (std::ranges::find(shared->ports, winner) != shared->ports.end()) {
+        if (acknowledged) {
+          winner->txErrors -= winner->txErrors > 0;
+        } else if (winner->txErrors < errorPassiveLimit) {
+          winner->txErrors += 8;
+        }
+      }
+    }
+  }
+
+  // Port whose head frame wins the bus, ties go to the frame queued first
+  bool arbitrate(Port *&winner) const {
+    winner = nullptr;
+    for (Port *port : shared->ports) {
+      if (port->txQueue.empty()) {
+        continue;
+      }
+      if (!winner || before(port->txQueue.front(), winner->txQueue.front())) {
+        winner = port;
+      }
+    }
+    return winner != nullptr;
+  }
+
+  static bool before(const Port::Queued &a, const Port::Queued &b) {
+    const uint32_t keyA = arbitrationKey(a.frame);
+    const uint32_t keyB = arbitrationKey(b.frame);
+    return keyA != keyB ? keyA < keyB : a.order < b.order;
+  }
+
+  std::shared_ptr<Shared> shared;
+  const double timeScale;
+  std::jthread thread;
+};
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef SLOT_SCHEDULER_HPP
+#define SLOT_SCHEDULER_HPP
+
+#include "Clock.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Who a doser works for, most urgent first
+enum class SlotClass : uint8_t { Emergency, Ph, Nutrient, Manual };
+
+constexpr size_t slotClasses = 4;
+
+constexpr const char *slotClassName(SlotClass slotClass) {
+  constexpr const char *names[] = {"emergency", "pH", "nutrient", "manual"};
+  return names[static_cast<size_t>(slotClass)];
+}
+
+// Hands out the parallelism slots to waiters by class. A free slot goes to
+// the waiter of the most urgent class, ties to whoever waited longest. Every
+// agingStep a waiter waits counts as one class more urgent, so a steady
+// stream of pH doses can't starve the nutrients. A class can be limited to
+// fewer slots than there are, which keeps slots free for the classes above
+// it without having to cut a running dose short.
+// Not synchronized, the owner serializes every call.
+class SlotScheduler {
+public:
+  using Ticket = uint64_t;
+
+  struct WaitStats {
+    uint32_t grants{0};
+    Clock::duration total{};
+    Clock::duration max{};
+  };
+
+  explicit SlotScheduler(int slots) : free{slots} { limits.fill(slots); }
+
+  // Caps the slots a class holds at once
+  void setLimit(SlotClass slotClass, int slots) {
+    limits[index(slotClass)] = slots;
+  }
+
+  int limit(SlotClass slotClass) const { return limits[index(slotClass)]; }
+
+  void setAgingStep(Clock::duration step) { agingStep = step; }
+
+  // Takes a slot at once if one is free and no waiter is ahead
+  bool tryAcquire(SlotClass slotClass) {
+    const auto now = Clock::now();
+    if (free == 0 || !belowLimit(slotClass)) {
+      return false;
+    }
+    const int rank = static_cast<int>(slotClass);
+    for (const Waiter &waiter : waiters) {
+      if (belowLimit(waiter.slotClass) && rankOf(waiter, now) <= rank) {
+        return false;
+      }
+    }
+
+    grant(slotClass, now, now);
+    return true;
+  }
+
+  // A waiter for several slots is granted them together
+  Ticket enqueue(SlotClass slotClass, int count = 1) {
+    waiters.push_back({nextTicket, slotClass, Clock::now(), count});
+    return nextTicket++;
+  }
+
+  // Drops a waiter, false if it isn't waiting anymore
+  bool remove(Ticket ticket) {
+    return std::erase_if(waiters, [ticket](const Waiter &waiter) {
+             return waiter.ticket == ticket;
+           }) > 0;
+  }
+
+  // Grants a free slot to the most urgent waiter that `eligible` accepts.
+  // Returns nothing when no slot is free or nobody can take it.
+  template <typename Eligible>
+  std::optional<Ticket> next(Eligible &&eligible) {
+    if (free == 0) {
+      return std::nullopt;
+    }
+
+    const auto now = Clock::now();
+    auto best = waiters.end();
+    for (auto waiter = waiters.begin(); waiter != waiters.end(); ++waiter) {
+      if (waiter->count > free ||
+          !belowLimit(waiter->slotClass, waiter->count) ||
+          !eligible(waiter->ticket)) {
+        continue;
+      }
+      // Waiters are in ticket order, the first of a rank waited longest
+      if (best == waiters.end() || rankOf(*waiter, now) < rankOf(*best, now)) {
+        best = waiter;
+      }
+    }
+    if (best == waiters.end()) {
+      return std::nullopt;
+    }
+
+    const Waiter granted = *best;
+    waiters.erase(best);
+    grant(granted.slotClass, granted.since, now, granted.count);
+    return granted.ticket;
+  }
+
+  void release(SlotClass slotClass) {
+    ++free;
+    --held[index(slotClass)];
+  }
+
+  // Time from asking for a slot to getting it, by class
+  const std::array<WaitStats, slotClasses> &waitStats() const {
+    return stats;
+  }
+
+private:
+  struct Waiter {
+    Ticket ticket;
+    SlotClass slotClass;
+    Clock::time_point since;
+    int count;
+  };
+
+  static size_t index(SlotClass slotClass) {
+    return static_cast<size_t>(slotClass);
+  }
+
+  bool belowLimit(SlotClass slotClass, int count = 1) const {
+    return held[index(slotClass)] + count <= limits[index(slotClass)];
+  }
+
+  int rankOf(const Waiter &waiter, Clock::time_point now) const {
+    const int aged = agingStep.count() > 0 ? (now - waiter.since) / agingStep
+                                           : 0;
+    return std::max(static_cast<int>(waiter.slotClass) - aged, 0);
+  }
+
+  void grant(SlotClass slotClass, Clock::time_point since,
+             Clock::time_point now, int count = 1) {
+    free -= count;
+    held[index(slotClass)] += count;
+    WaitStats &waited = stats[index(slotClass)];
+    ++waited.grants;
+    waited.total += now - since;
+    waited.max = std::max(waited.max, now - since);
+  }
+
+  int free;
+  std::array<int, slotClasses> held{};
+  std::array<int, slotClasses> limits{};
+  std::array<WaitStats, slotClasses> stats{};
+  Clock::duration agingStep{std::chrono::seconds(30)};
+  std::vector<Waiter> waiters;
+  Ticket nextTicket{0};
+};
+
+#endif
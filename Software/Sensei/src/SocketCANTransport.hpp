@@ -0,0 +1,118 @@
+#ifndef SOCKET_CAN_TRANSPORT_HPP
+#define SOCKET_CAN_TRANSPORT_HPP
+
+#ifdef __linux__
+
+#include "CANTransport.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <system_error>
+#include <unistd.h>
+
+// Raw socket on a Linux CAN interface, for running Sensei on a host against
+// real modules through a USB adapter or against a virtual bus:
+//   ip link add dev vcan0 type vcan && ip link set up vcan0
+// The bitrate is configured on the interface, the one given here is only
+// used for the bus load statistics.
+class SocketCANTransport : public CANTransport {
+public:
+  SocketCANTransport(const char *interface, uint32_t bitrate)
+      : fd{::socket(PF_CAN, SOCK_RAW, CAN_RAW)}, rate{bitrate} {
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), "socket");
+    }
+
+    ifreq request{};
+    std::strncpy(request.ifr_name, interface, IFNAMSIZ - 1);
+    if (::ioctl(fd, SIOCGIFINDEX, &request) < 0) {
+      const int err = errno;
+      ::close(fd);
+      throw std::system_error(err, std::generic_category(), interface);
+    }
+
+    sockaddr_can address{};
+    address.can_family = AF_CAN;
+    address.can_ifindex = request.ifr_ifindex;
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) <
+        0) {
+      const int err = errno;
+      ::close(fd);
+      throw std::system_error(err, std::generic_category(), "bind");
+    }
+  }
+
+  SocketCANTransport(const SocketCANTransport &) = delete;
+  SocketCANTransport &operator=(const SocketCANTransport &) = delete;
+
+  ~SocketCANTransport() override { ::close(fd); }
+
+  bool transmit(const Frame &frame, Clock::duration timeout) override {
+    if (!wait(POLLOUT, timeout)) {
+      ++txFailed;
+      return false;
+    }
+
+    can_frame message{};
+    message.can_id = frame.extended ? (frame.identifier & CAN_EFF_MASK) |
+                                          CAN_EFF_FLAG
+                                    : frame.identifier & CAN_SFF_MASK;
+    message.can_dlc = std::min<uint8_t>(frame.dlc, CAN_MAX_DLEN);
+    std::memcpy(message.data, frame.data, sizeof(message.data));
+    if (::write(fd, &message, sizeof(message)) != sizeof(message)) {
+      ++txFailed;
+      return false;
+    }
+    return true;
+  }
+
+  std::optional<Frame> receive(Clock::duration timeout) override {
+    const auto deadline = Clock::now() + timeout;
+    while (wait(POLLIN, deadline - Clock::now())) {
+      can_frame message;
+      if (::read(fd, &message, sizeof(message)) != sizeof(message)) {
+        return std::nullopt;
+      }
+      if (message.can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) {
+        continue;
+      }
+
+      const bool extended = message.can_id & CAN_EFF_FLAG;
+      Frame frame{message.can_id & (extended ? CAN_EFF_MASK : CAN_SFF_MASK),
+                  extended, message.can_dlc, {}};
+      std::memcpy(frame.data, message.data, sizeof(frame.data));
+      return frame;
+    }
+    return std::nullopt;
+  }
+
+  uint32_t bitrate() const override { return rate; }
+
+  BusStats::Controller status() override {
+    return {"running", 0, 0, txFailed, 0, 0, 0, 0};
+  }
+
+private:
+  bool wait(short events, Clock::duration timeout) const {
+    const auto ms = std::chrono::ceil<std::chrono::milliseconds>(
+        std::max(timeout, Clock::duration::zero()));
+    pollfd request{fd, events, 0};
+    return ::poll(&request, 1, static_cast<int>(ms.count())) > 0 &&
+           (request.revents & events);
+  }
+
+  int fd;
+  uint32_t rate;
+  uint32_t txFailed{0};
+};
+
+#endif
+
+#endif
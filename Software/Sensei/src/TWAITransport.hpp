@@ -0,0 +1,148 @@
+#ifndef TWAI_TRANSPORT_HPP
+#define TWAI_TRANSPORT_HPP
+
+#include "CANTransport.hpp"
+#include "can.h"
+#include "driver/twai.h"
+#include "esp_log.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+
+// The ESP32 TWAI controller. Installs and starts the driver for its lifetime.
+// Changing the bitrate reinstalls the driver, so transmit and receive hold it
+// off while they are inside the driver.
+class TWAITransport : public CANTransport {
+  static constexpr char tag[] = "TWAITransport";
+
+public:
+  explicit TWAITransport(uint32_t bitrate = can::protocol::defaultBitrate)
+      : rate{bitrate} {
+    ESP_ERROR_CHECK(can::init(rate));
+  }
+
+  ~TWAITransport() override { ESP_ERROR_CHECK(can::shutdown()); }
+
+  bool transmit(const Frame &frame, Clock::duration timeout) override {
+    const Use use{*this};
+    twai_message_t message = {};
+    message.identifier = frame.identifier;
+    message.extd = frame.extended;
+    message.data_length_code = frame.dlc;
+    std::memcpy(message.data, frame.data, sizeof(message.data));
+
+    const esp_err_t err = twai_transmit(&message, ticks(timeout));
+    if (err != ESP_OK) {
+      ESP_LOGE(tag, "Failed to transmit %lx: %s", message.identifier,
+               esp_err_to_name(err));
+    }
+    return err == ESP_OK;
+  }
+
+  std::optional<Frame> receive(Clock::duration timeout) override {
+    const Use use{*this};
+    twai_message_t message;
+    if (twai_receive(&message, ticks(timeout)) != ESP_OK) {
+      return std::nullopt;
+    }
+
+    Frame frame{message.identifier, static_cast<bool>(message.extd),
+                message.data_length_code, {}};
+    std::memcpy(frame.data, message.data, sizeof(frame.data));
+    return frame;
+  }
+
+  uint32_t bitrate() const override {
+    std::lock_guard guard{mtx};
+    return rate;
+  }
+
+  bool supports(uint32_t bitrate) const override {
+    return can::supported(bitrate);
+  }
+
+  bool setBitrate(uint32_t bitrate) override {
+    if (!can::supported(bitrate)) {
+      return false;
+    }
+
+    std::unique_lock lock{mtx};
+    switching = true;
+    idle.wait(lock, [this] { return users == 0; });
+
+    ESP_ERROR_CHECK(can::shutdown());
+    if (esp_err_t err = can::init(bitrate); err != ESP_OK) {
+      ESP_LOGE(tag, "Failed to switch to %lu bit/s: %s",
+               static_cast<unsigned long>(bitrate), esp_err_to_name(err));
+      ESP_ERROR_CHECK(can::init(rate));
+    } else {
+      rate = bitrate;
+    }
+
+    switching = false;
+    idle.notify_all();
+    return rate == bitrate;
+  }
+
+  BusStats::Controller status() override {
+    const Use use{*this};
+    twai_status_info_t info;
+    if (twai_get_status_info(&info) != ESP_OK) {
+      return CANTransport::status();
+    }
+    return {stateName(info.state), info.tx_error_counter,
+            info.rx_error_counter, info.tx_failed_count,
+            info.rx_missed_count,  info.rx_overrun_count,
+            info.arb_lost_count,   info.bus_error_count};
+  }
+
+private:
+  // Marks a thread as inside the driver, waiting out a bitrate switch first
+  class Use {
+  public:
+    explicit Use(TWAITransport &transport) : transport{transport} {
+      std::unique_lock lock{transport.mtx};
+      transport.idle.wait(lock, [this] { return !this->transport.switching; });
+      ++transport.users;
+    }
+
+    ~Use() {
+      std::lock_guard guard{transport.mtx};
+      --transport.users;
+      transport.idle.notify_all();
+    }
+
+  private:
+    TWAITransport &transport;
+  };
+
+  static TickType_t ticks(Clock::duration timeout) {
+    const auto ms = std::chrono::ceil<std::chrono::milliseconds>(
+        std::max(timeout, Clock::duration::zero()));
+    return pdMS_TO_TICKS(ms.count());
+  }
+
+  static const char *stateName(twai_state_t state) {
+    switch (state) {
+    case TWAI_STATE_STOPPED:
+      return "stopped";
+    case TWAI_STATE_RUNNING:
+      return "running";
+    case TWAI_STATE_BUS_OFF:
+      return "bus off";
+    case TWAI_STATE_RECOVERING:
+      return "recovering";
+    }
+    return "unknown";
+  }
+
+  mutable std::mutex mtx;
+  std::condition_variable idle;
+  int users{0};
+  bool switching{false};
+  uint32_t rate;
+};
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef TELEMETRY_TABLE_HPP
+#define TELEMETRY_TABLE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Last reported state of a doser
+struct DoserTelemetry {
+  bool valid;   // False until the doser reported once
+  bool running;
+  bool fault;
+  bool asleep;
+  bool dosing;
+  uint16_t current_mA;
+  uint32_t runtime_s;
+};
+
+// Latest telemetry of every doser. One thread stores, any number of threads
+// load without taking a lock. Every slot is a sequence lock over two words:
+// a reader retries while the writer is inside the slot, so it never sees
+// the state of one frame mixed with the run time of another.
+class TelemetryTable {
+public:
+  explicit TelemetryTable(size_t size = 0)
+      : slots{std::make_unique<Slot[]>(size)}, count{size} {}
+
+  size_t size() const { return count; }
+
+  void store(size_t id, const DoserTelemetry &telemetry) {
+    if (id >= count) {
+      return;
+    }
+
+    Slot &slot = slots[id];
+    const uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.state.store(pack(telemetry), std::memory_order_relaxed);
+    slot.runtime.store(telemetry.runtime_s, std::memory_order_relaxed);
+    slot.seq.store(seq + 2, std::memory_order_release);
+  }
+
+  DoserTelemetry load(size_t id) const {
+    if (id >= count) {
+      return {};
+    }
+
+    const Slot &slot = slots[id];
+    for (;;) {
+      const uint32_t before = slot.seq.load(std::memory_order_acquire);
+      const uint32_t state = slot.state.load(std::memory_order_relaxed);
+      const uint32_t runtime = slot.runtime.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (before % 2 == 0 &&
+          before == slot.seq.load(std::memory_order_relaxed)) {
+        return unpack(state, runtime);
+      }
+    }
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint32_t> seq{0};
+    std::atomic<uint32_t> state{0};
+    std::atomic<uint32_t> runtime{0};
+  };
+
+  enum Bits : uint32_t {
+    Valid = 1 << 16,
+    Running = 1 << 17,
+    Fault = 1 << 18,
+    Asleep = 1 << 19,
+    Dosing = 1 << 20
+  };
+
+  static uint32_t pack(const DoserTelemetry &telemetry) {
+    auto flag = [](bool set, Bits bit) { return set ? uint32_t{bit} : 0u; };
+    return telemetry.current_mA | Valid | flag(telemetry.running, Running) |
+           flag(telemetry.fault, Fault) | flag(telemetry.asleep, Asleep) |
+           flag(telemetry.dosing, Dosing);
+  }
+
+  static DoserTelemetry unpack(uint32_t state, uint32_t runtime) {
+    return {(state & Valid) != 0,  (state & Running) != 0,
+            (state & Fault) != 0,  (state & Asleep) != 0,
+            (state & Dosing) != 0, static_cast<uint16_t>(state & 0xFFFF),
+            runtime};
+  }
+
+  std::unique_ptr<Slot[]> slots;
+  size_t count;
+};
+
+#endif
@@ -0,0 +1,415 @@
+#ifndef VOLUME_LEDGER_HPP
+#define VOLUME_LEDGER_HPP
+
+#include "Clock.hpp"
+#include "logging.h"
+#ifdef ESP_PLATFORM
+#include "nvs.h"
+#include "util.h"
+#endif
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// What a doser pumped and what is left in its bottle
+struct DoserVolume {
+  static constexpr int days = 7;
+
+  double total_mL{0};
+  std::array<float, days> daily_mL{}; // Today first, see VolumeLedger
+  float bottle_mL{0};                 // 0 if the bottle isn't tracked
+  float remaining_mL{0};
+  float lowStock_mL{0};
+
+  bool low() const { return bottle_mL > 0 && remaining_mL <= lowStock_mL; }
+};
+
+// A bottle that ran low since the last alerts were taken
+struct LowStock {
+  int id;
+  float remaining_mL;
+};
+
+// Where the ledger persists, in a few slots written in turn
+class LedgerStore {
+public:
+  virtual ~LedgerStore() = default;
+
+  // Empty if the slot was never written
+  virtual std::vector<uint8_t> read(int slot) = 0;
+  virtual void write(int slot, std::span<const uint8_t> data) = 0;
+};
+
+// Delivered volume per doser and day, kept in RAM and flushed to a store in
+// whole batches. A flush is due hourly, or once flushDelta_mL went unflushed
+// or a bottle changed, but never sooner than minFlushSpacing after the last
+// one. That bounds the flash writes to 24 h / minFlushSpacing a day however
+// many doses there are. Each flush goes to the next slot, so a write cut
+// short by a power loss leaves the previous ledger to load.
+//
+// The firmware never syncs the wall time, so days are counted from uptime:
+// the day and how far into it the ledger was are stored with it, and the
+// count goes on from there after a reboot. Time powered off doesn't count.
+class VolumeLedger {
+  static constexpr char tag[] = "VolumeLedger";
+
+public:
+  static constexpr Clock::duration flushInterval = std::chrono::hours(1);
+  static constexpr Clock::duration minFlushSpacing = std::chrono::minutes(15);
+  static constexpr float flushDelta_mL = 50;
+  static constexpr int slots = 2;
+
+  // Loads the newest ledger the store holds. What was recorded before is
+  // added on top, the stored bottles win.
+  void attach(std::unique_ptr<LedgerStore> store,
+              Clock::time_point now = Clock::now()) {
+    std::lock_guard flushGuard{flushMtx};
+    std::lock_guard guard{mtx};
+    this->store = std::move(store);
+    lastFlush = now;
+
+    std::optional<Loaded> newest;
+    for (int slot = 0; slot < slots; ++slot) {
+      try {
+        auto loaded = decode(this->store->read(slot));
+        if (loaded && (!newest || loaded->sequence > newest->sequence)) {
+          newest = std::move(loaded);
+        }
+      } catch (const std::exception &e) {
+        ESP_LOGE(tag, "Reading ledger slot %d failed: %s", slot, e.what());
+      }
+    }
+    if (!newest) {
+      return;
+    }
+
+    sequence = newest->sequence + 1;
+    // What was recorded since boot is on days of its own, counted from 0,
+    // the stored count goes on by as many
+    advance(now);
+    const Clock::duration ran = today * day + (now - dayStart);
+    const Clock::duration counted = newest->dayElapsed + ran;
+    today = newest->day + int32_t(counted / day);
+    dayStart = now - counted % day;
+    const int age = today - newest->day;
+    for (auto &[id, stored] : newest->volumes) {
+      DoserVolume &volume = volumes[id];
+      const double recorded = volume.total_mL;
+      volume.total_mL += stored.total_mL;
+      for (int day = 0; day + age < DoserVolume::days; ++day) {
+        volume.daily_mL[day + age] += stored.daily_mL[day];
+      }
+      volume.bottle_mL = stored.bottle_mL;
+      volume.lowStock_mL = stored.lowStock_mL;
+      volume.remaining_mL =
+          std::max(stored.remaining_mL - float(recorded), 0.0f);
+    }
+  }
+
+  void record(int id, float delivered_mL,
+              Clock::time_point now = Clock::now()) {
+    if (delivered_mL <= 0) {
+      return;
+    }
+
+    std::lock_guard guard{mtx};
+    advance(now);
+    DoserVolume &volume = volumes[id];
+    const bool wasLow = volume.low();
+    volume.total_mL += delivered_mL;
+    volume.daily_mL[0] += delivered_mL;
+    if (volume.bottle_mL > 0) {
+      volume.remaining_mL = std::max(volume.remaining_mL - delivered_mL, 0.0f);
+      if (!wasLow && volume.low()) {
+        alerts.push_back({id, volume.remaining_mL});
+      }
+    }
+    unflushed_mL += delivered_mL;
+    dirty = true;
+  }
+
+  // Tracks the bottle of a doser as full, a capacity of 0 stops tracking it
+  void setBottle(int id, float capacity_mL, float lowStock_mL) {
+    std::lock_guard guard{mtx};
+    DoserVolume &volume = volumes[id];
+    volume.bottle_mL = std::max(capacity_mL, 0.0f);
+    volume.remaining_mL = volume.bottle_mL;
+    volume.lowStock_mL = lowStock_mL;
+    changed();
+  }
+
+  void refill(int id) {
+    std::lock_guard guard{mtx};
+    if (auto volume = volumes.find(id); volume != volumes.end()) {
+      volume->second.remaining_mL = volume->second.bottle_mL;
+      changed();
+    }
+  }
+
+  // Remaining volume, nothing if the bottle isn't tracked
+  std::optional<float> remaining(int id) const {
+    std::lock_guard guard{mtx};
+    if (auto volume = volumes.find(id);
+        volume != volumes.end() && volume->second.bottle_mL > 0) {
+      return volume->second.remaining_mL;
+    }
+    return std::nullopt;
+  }
+
+  std::map<int, DoserVolume> snapshot(Clock::time_point now = Clock::now()) {
+    std::lock_guard guard{mtx};
+    advance(now);
+    return volumes;
+  }
+
+  std::vector<LowStock> takeAlerts() {
+    std::lock_guard guard{mtx};
+    return std::exchange(alerts, {});
+  }
+
+  // Flushes if one is due, true if it wrote
+  bool flushIfDue(Clock::time_point now = Clock::now()) {
+    {
+      std::lock_guard guard{mtx};
+      const auto since = now - lastFlush;
+      const bool large =
+          unflushed_mL >= flushDelta_mL && since >= minFlushSpacing;
+      const bool due = dirty && (since >= flushInterval || large);
+      if (!due) {
+        return false;
+      }
+    }
+    return flush(now);
+  }
+
+  // Writes the ledger at once, for shutdown. False if the store failed, the
+  // changes stay for the next flush then.
+  bool flush(Clock::time_point now = Clock::now()) {
+    std::lock_guard flushGuard{flushMtx};
+    std::vector<uint8_t> data;
+    uint32_t written;
+    float flushed_mL;
+    {
+      std::lock_guard guard{mtx};
+      if (!dirty) {
+        return false;
+      }
+      advance(now);
+      written = sequence;
+      flushed_mL = unflushed_mL;
+      data = encode(now);
+      dirty = false;
+      unflushed_mL = 0;
+      lastFlush = now;
+    }
+
+    try {
+      if (store) {
+        store->write(written % slots, data);
+      }
+    } catch (const std::exception &e) {
+      ESP_LOGE(tag, "Flushing the ledger failed: %s", e.what());
+      std::lock_guard guard{mtx};
+      dirty = true;
+      unflushed_mL += flushed_mL;
+      return false;
+    }
+
+    std::lock_guard guard{mtx};
+    sequence = written + 1;
+    ++flushCount;
+    return true;
+  }
+
+  uint32_t flushes() const {
+    std::lock_guard guard{mtx};
+    return flushCount;
+  }
+
+private:
+  static constexpr uint32_t magic = 0x4C4F5632; // "VOL2"
+  static constexpr Clock::duration day = std::chrono::hours(24);
+
+  struct Header {
+    uint32_t magic;
+    uint32_t sequence;
+    int32_t day;
+    uint32_t dayElapsed_s; // Into the day when written
+    uint32_t count;
+    uint32_t checksum; // FNV-1a over the whole ledger with this field 0
+  };
+
+  struct Record {
+    int32_t id;
+    float bottle_mL;
+    float remaining_mL;
+    float lowStock_mL;
+    double total_mL;
+    std::array<float, DoserVolume::days> daily_mL;
+  };
+
+  struct Loaded {
+    uint32_t sequence;
+    int32_t day;
+    Clock::duration dayElapsed;
+    std::map<int, DoserVolume> volumes;
+  };
+
+  static uint32_t checksum(std::span<const uint8_t> data) {
+    uint32_t hash = 2166136261u;
+    for (uint8_t byte : data) {
+      hash = (hash ^ byte) * 16777619u;
+    }
+    return hash;
+  }
+
+  // Holds mtx. Moves the daily volumes on to the current day.
+  void advance(Clock::time_point now) {
+    if (now - dayStart < day) {
+      return;
+    }
+    const auto passed = (now - dayStart) / day;
+    const int shift = std::min<int64_t>(passed, DoserVolume::days);
+    for (auto &[id, volume] : volumes) {
+      std::shift_right(volume.daily_mL.begin(), volume.daily_mL.end(), shift);
+      std::fill_n(volume.daily_mL.begin(), shift, 0.0f);
+    }
+    today += int32_t(passed);
+    dayStart += passed * day;
+  }
+
+  // Holds mtx. A bottle change is worth a flush of its own.
+  void changed() {
+    dirty = true;
+    unflushed_mL = std::max(unflushed_mL, flushDelta_mL);
+  }
+
+  // Holds mtx, advanced to now
+  std::vector<uint8_t> encode(Clock::time_point now) const {
+    const auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(
+        std::max(now - dayStart, Clock::duration::zero()));
+    Header header{magic,
+                  sequence,
+                  today,
+                  uint32_t(elapsed.count()),
+                  uint32_t(volumes.size()),
+                  0};
+    std::vector<uint8_t> data(sizeof(Header) + volumes.size() * sizeof(Record));
+    uint8_t *next = data.data() + sizeof(Header);
+    for (const auto &[id, volume] : volumes) {
+      const Record record{id,
+                          volume.bottle_mL,
+                          volume.remaining_mL,
+                          volume.lowStock_mL,
+                          volume.total_mL,
+                          volume.daily_mL};
+      std::memcpy(next, &record, sizeof(Record));
+      next += sizeof(Record);
+    }
+    std::memcpy(data.data(), &header, sizeof(Header));
+    header.checksum = checksum(data);
+    std::memcpy(data.data(), &header, sizeof(Header));
+    return data;
+  }
+
+  static std::optional<Loaded> decode(std::vector<uint8_t> data) {
+    Header header;
+    if (data.size() < sizeof(Header)) {
+      return std::nullopt;
+    }
+    std::memcpy(&header, data.data(), sizeof(Header));
+    if (header.magic != magic ||
+        data.size() != sizeof(Header) + header.count * sizeof(Record)) {
+      return std::nullopt;
+    }
+    const uint32_t stored = header.checksum;
+    header.checksum = 0;
+    std::memcpy(data.data(), &header, sizeof(Header));
+    if (checksum(data) != stored) {
+      return std::nullopt;
+    }
+
+    const Clock::duration elapsed = std::min<Clock::duration>(
+        std::chrono::seconds(header.dayElapsed_s), day);
+    Loaded loaded{header.sequence, header.day, elapsed, {}};
+    const uint8_t *next = data.data() + sizeof(Header);
+    for (uint32_t i = 0; i < header.count; ++i, next += sizeof(Record)) {
+      Record record;
+      std::memcpy(&record, next, sizeof(Record));
+      loaded.volumes[record.id] = {record.total_mL, record.daily_mL,
+                                   record.bottle_mL, record.remaining_mL,
+                                   record.lowStock_mL};
+    }
+    return loaded;
+  }
+
+  mutable std::mutex mtx;
+  std::mutex flushMtx; // Keeps flushes in sequence order, taken before mtx
+  std::unique_ptr<LedgerStore> store;
+  std::map<int, DoserVolume> volumes;
+  std::vector<LowStock> alerts;
+  int32_t today{0};                          // Days of uptime counted
+  Clock::time_point dayStart{Clock::now()}; // Of today
+  uint32_t sequence{0};
+  float unflushed_mL{0};
+  bool dirty{false};
+  Clock::time_point lastFlush{Clock::now()};
+  uint32_t flushCount{0};
+};
+
+#ifdef ESP_PLATFORM
+// The ledger slots as blobs in their own NVS namespace
+class NvsLedgerStore : public LedgerStore {
+  static constexpr char nvsNameSpace[] = "ledger";
+
+public:
+  std::vector<uint8_t> read(int slot) override {
+    nvs_handle_t handle;
+    if (nvs_open(nvsNameSpace, NVS_READONLY, &handle) != ESP_OK) {
+      return {};
+    }
+    ez::ScopeGuard closeGuard([handle]() { nvs_close(handle); });
+
+    const std::string key = "slot" + std::to_string(slot);
+    std::size_t length = 0;
+    if (nvs_get_blob(handle, key.c_str(), nullptr, &length) != ESP_OK) {
+      return {};
+    }
+    std::vector<uint8_t> data(length);
+    if (nvs_get_blob(handle, key.c_str(), data.data(), &length) != ESP_OK) {
+      return {};
+    }
+    return data;
+  }
+
+  void write(int slot, std::span<const uint8_t> data) override {
+    nvs_handle_t handle;
+    if (auto err = nvs_open(nvsNameSpace, NVS_READWRITE, &handle);
+        err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+
+    ez::ScopeGuard closeGuard([handle]() { nvs_close(handle); });
+
+    const std::string key = "slot" + std::to_string(slot);
+    if (auto err =
+            nvs_set_blob(handle, key.c_str(), data.data(), data.size());
+        err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+
+    if (auto err = nvs_commit(handle); err != ESP_OK)
+      throw std::runtime_error(esp_err_to_name(err));
+  }
+};
+#endif
+
+#endif
@@ -13,10 +13,40 @@ namespace can
 #define TWAI_TX_PIN GPIO_NUM_21
 #define TWAI_RX_PIN GPIO_NUM_22
 
-    esp_err_t init()
+    // Bitrates the modules support as well
+    constexpr uint32_t bitrates[] = {50'000, 125'000, 250'000, 500'000};
+
+    bool supported(uint32_t bitrate)
+    {
+        for (uint32_t supported : bitrates)
+        {
+            if (supported == bitrate)
+                return true;
+        }
+        return false;
+    }
+
+    esp_err_t init(uint32_t bitrate)
     {
         twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(TWAI_TX_PIN, TWAI_RX_PIN, TWAI_MODE_NORMAL);
-        twai_timing_config_t t_config = TWAI_TIMING_CONFIG_50KBITS();
+        twai_timing_config_t t_config;
+        switch (bitrate)
+        {
+        case 50'000:
+            t_config = TWAI_TIMING_CONFIG_50KBITS();
+            break;
+        case 125'000:
+            t_config = TWAI_TIMING_CONFIG_125KBITS();
+            break;
+        case 250'000:
+            t_config = TWAI_TIMING_CONFIG_250KBITS();
+            break;
+        case 500'000:
+            t_config = TWAI_TIMING_CONFIG_500KBITS();
+            break;
+        default:
+            return ESP_ERR_INVALID_ARG;
+        }
         twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
 
         if (esp_err_t err = twai_driver_install(&g_config, &t_config, &f_config); err != ESP_OK)
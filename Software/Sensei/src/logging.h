@@ -0,0 +1,19 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+// ESP-IDF logging on the target. Host builds of the bus and manager code
+// print warnings and errors to stderr and drop the rest.
+#ifdef ESP_PLATFORM
+#include "esp_log.h"
+#else
+#include <cstdio>
+
+#define ESP_LOGE(tag, format, ...)                                             \
+  std::fprintf(stderr, "E %s: " format "\n", tag __VA_OPT__(, ) __VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)                                             \
+  std::fprintf(stderr, "W %s: " format "\n", tag __VA_OPT__(, ) __VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)
+#define ESP_LOGD(tag, format, ...)
+#endif
+
+#endif
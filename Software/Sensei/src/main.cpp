@@ -26,6 +26,43 @@ void apiRun() {
   client.subscribe("sensei/doserManager/reset",
                    []() { gApp->runningDosers.clear(); });
 
+  // Reports what every stopped doser delivered
+  client.subscribe("sensei/doserManager/stopAll", [&client]() {
+    JsonDocument doc;
+    JsonArray stopped = doc.to<JsonArray>();
+    for (const auto &[id, delivered_mL] : gApp->stopAll()) {
+      JsonObject entry = stopped.createNestedObject();
+      entry["doserID"] = id;
+      entry["delivered"] = delivered_mL;
+    }
+    std::string payload;
+    serializeJson(doc, payload);
+    client.publish("sensei/doserManager/stopped", payload);
+  });
+
+  // Kept across restarts, 0 doesn't limit
+  client.subscribe("sensei/doserManager/currentBudget",
+                   [](const JsonDocument &doc) {
+                     gApp->setCurrentBudget({doc["system"].as<uint32_t>(),
+                                             doc["module"].as<uint32_t>()});
+                   });
+
+  // Dosers that run together from the next restart
+  client.subscribe("sensei/doserManager/parallelism",
+                   [](const JsonDocument &doc) {
+                     gApp->setParallelDosers(doc["count"]);
+                   });
+
+  // Tracks the bottle of a doser as full, capacity 0 stops tracking it
+  client.subscribe("sensei/doserManager/bottle", [](const JsonDocument &doc) {
+    gDoserManager->ledger().setBottle(doc["doserID"], doc["capacity"],
+                                      doc["lowStock"]);
+  });
+
+  client.subscribe("sensei/doserManager/refill", [](const JsonDocument &doc) {
+    gDoserManager->ledger().refill(doc["doserID"]);
+  });
+
   client.subscribe("sensei/pHSensor/calibrate", [](const JsonDocument &doc) {
     gApp->pHSensor->calibrate(doc["target"]);
   });
@@ -57,16 +94,42 @@ void apiRun() {
   client.subscribe("sensei/nutrientController/stop",
                    []() { gApp->nutrientController->stop(); });
 
+  client.subscribe("sensei/bus/bitrate", [](const JsonDocument &doc) {
+    gApp->setBusBitrate(doc["bitrate"]);
+  });
+
   client.start();
 
-  for (char buf[1024];;) {
+  // Bus statistics are published every busInterval status updates
+  constexpr int busInterval = 10;
+
+  for (int i = 0;; ++i) {
     const App::Status status = gApp->status();
 
     JsonDocument doc;
     convertToJson(status, doc);
 
-    size_t n = serializeJson(doc, buf);
-    client.publish("sensei/status", {buf, n});
+    // Doser telemetry makes the status outgrow a fixed buffer
+    std::string buf;
+    serializeJson(doc, buf);
+    client.publish("sensei/status", buf);
+
+    for (const auto &[id, remaining_mL] : gApp->lowStockAlerts()) {
+      JsonDocument alert;
+      alert["doserID"] = id;
+      alert["remaining"] = remaining_mL;
+      std::string payload;
+      serializeJson(alert, payload);
+      client.publish("sensei/doserManager/lowStock", payload, 1);
+    }
+
+    if (i % busInterval == 0) {
+      JsonDocument busDoc;
+      convertToJson(gApp->busStatistics(), busDoc);
+      std::string payload;
+      serializeJson(busDoc, payload);
+      client.publish("sensei/bus", payload);
+    }
 
     vTaskDelay(pdMS_TO_TICKS(500));
   }
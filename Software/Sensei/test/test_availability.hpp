@@ -0,0 +1,84 @@
+#ifndef TEST_AVAILABILITY_HPP
+#define TEST_AVAILABILITY_HPP
+
+#include "DoserBitmap.hpp"
+#include "test_manager.hpp"
+#include "unity.h"
+#include <array>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+void test_doser_bitmap() {
+  DoserBitmap bitmap;
+  bitmap.reset(40);
+  TEST_ASSERT_EQUAL(40, bitmap.snapshot().size());
+  TEST_ASSERT_TRUE(bitmap.take(0));
+  TEST_ASSERT_TRUE(bitmap.take(33));
+  TEST_ASSERT_FALSE(bitmap.take(33));
+  TEST_ASSERT_FALSE(bitmap.take(40));
+  TEST_ASSERT_FALSE(bitmap.take(-1));
+  TEST_ASSERT_FALSE(bitmap.take(DoserBits::maxDosers));
+
+  const DoserBits free = bitmap.snapshot();
+  TEST_ASSERT_EQUAL(38, free.size());
+  TEST_ASSERT_FALSE(free.contains(33));
+  std::vector<int> ids(free.begin(), free.end());
+  TEST_ASSERT_EQUAL(38, ids.size());
+  TEST_ASSERT_EQUAL(1, ids.front());
+  TEST_ASSERT_EQUAL(32, ids[31]);
+  TEST_ASSERT_EQUAL(34, ids[32]);
+  TEST_ASSERT_EQUAL(39, ids.back());
+
+  bitmap.give(33);
+  TEST_ASSERT_TRUE(bitmap.snapshot().contains(33));
+  bitmap.reset(DoserBits::maxDosers);
+  TEST_ASSERT_EQUAL(DoserBits::maxDosers, bitmap.snapshot().size());
+  bitmap.reset(DoserBits::maxDosers + 4);
+  TEST_ASSERT_EQUAL(DoserBits::maxDosers, bitmap.snapshot().size());
+  TEST_ASSERT_TRUE(bitmap.take(DoserBits::maxDosers - 1));
+}
+
+// A full chain of 4 channel modules fits, more dosers aren't lent
+void test_manager_full_chain() {
+  TestManager full{255 * 4, 1};
+  TEST_ASSERT_EQUAL(255 * 4, full.availableDosers().size());
+  TEST_ASSERT_TRUE(full.lendDoser(255 * 4 - 1));
+
+  TestManager over{DoserBits::maxDosers + 1, 1};
+  TEST_ASSERT_FALSE(over.lendDoser(DoserBits::maxDosers));
+  TEST_ASSERT_EQUAL(DoserBits::maxDosers, over.availableDosers().size());
+}
+
+void test_manager_lend_concurrent() {
+  TestManager man{4, 4};
+
+  // Every round exactly one of the threads gets each doser
+  constexpr int threads = 8;
+  constexpr int rounds = 200;
+  std::atomic<int> lent{0};
+  std::atomic<int> overlaps{0};
+  std::array<std::atomic<int>, 4> holders{};
+  std::vector<std::jthread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      for (int i = 0; i < rounds; ++i) {
+        const int id = (t + i) % 4;
+        if (auto doser = man.lendDoser(id)) {
+          if (holders[id].fetch_add(1) != 0) {
+            ++overlaps;
+          }
+          ++lent;
+          holders[id].fetch_sub(1);
+        }
+      }
+    });
+  }
+  workers.clear();
+
+  TEST_ASSERT_EQUAL(0, overlaps.load());
+  TEST_ASSERT_TRUE(lent > 0);
+  TEST_ASSERT_EQUAL(4, man.availableDosers().size());
+}
+
+#endif
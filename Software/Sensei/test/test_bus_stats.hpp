@@ -0,0 +1,64 @@
+#ifndef TEST_BUS_STATS_HPP
+#define TEST_BUS_STATS_HPP
+
+#include "BusStats.hpp"
+#include "unity.h"
+#include <cstdio>
+
+using namespace std::chrono_literals;
+
+void test_bus_stats_buckets() {
+  TEST_ASSERT_EQUAL(0, BusStats::bucket(0us));
+  TEST_ASSERT_EQUAL(0, BusStats::bucket(1us));
+  TEST_ASSERT_EQUAL(1, BusStats::bucket(3us));
+  TEST_ASSERT_EQUAL(10, BusStats::bucket(1024us));
+  TEST_ASSERT_EQUAL(BusStats::buckets - 1, BusStats::bucket(1h));
+}
+
+void test_bus_stats_load() {
+  using namespace can::protocol;
+
+  const auto start = Clock::now();
+  BusStats stats{50'000};
+  stats.snapshot({}, start);
+
+  // Every module streaming all four channels once a second
+  const Frame telemetry{identifier(RPC::Telemetry, 0), true,
+                        sizeof(TelemetryCommand), {}};
+  constexpr int modules = 8;
+  for (int i = 0; i < modules * moduleChannels; ++i) {
+    stats.received(telemetry);
+  }
+
+  const Frame request{identifier(RPC::ReadLatency, 0), true,
+                      sizeof(ReadLatencyCommand), {}};
+  stats.transmitted(request, true, 50us);
+  stats.transmitted(request, false, 0us);
+  stats.answered(RPC::ReadLatency, 3ms);
+  stats.timedOut(RPC::ReadLatency);
+
+  const auto snapshot = stats.snapshot({}, start + 1s);
+  const uint64_t bits = modules * moduleChannels * frameBits(8, true) +
+                        frameBits(sizeof(ReadLatencyCommand), true);
+  TEST_ASSERT_EQUAL(bits, snapshot.bits);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4, bits / 50'000.0, snapshot.load);
+  TEST_ASSERT_EQUAL(modules * moduleChannels,
+                    snapshot.rpcs.at(RPC::Telemetry).rx);
+  TEST_ASSERT_EQUAL(1, snapshot.rpcs.at(RPC::ReadLatency).tx);
+  TEST_ASSERT_EQUAL(1, snapshot.rpcs.at(RPC::ReadLatency).txFailed);
+  TEST_ASSERT_EQUAL(1, snapshot.rpcs.at(RPC::ReadLatency).timeouts);
+  TEST_ASSERT_EQUAL(
+      1, snapshot.rpcs.at(RPC::ReadLatency).roundTrip[BusStats::bucket(3ms)]);
+
+  // The next snapshot only covers what happened since this one
+  const auto idle = stats.snapshot({}, start + 2s);
+  TEST_ASSERT_EQUAL(0, idle.load);
+
+  char msg[96];
+  std::snprintf(msg, sizeof(msg),
+                "telemetry at 1 s: %.2f %% of 50 kbit/s per module",
+                snapshot.load * 100 / modules);
+  TEST_MESSAGE(msg);
+}
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef TEST_CAN_BATCH_HPP
+#define TEST_CAN_BATCH_HPP
+
+#include "CANModuleMap.hpp"
+#include "DoserManager.hpp"
+#include "unity.h"
+#include <cstdio>
+#include <map>
+#include <vector>
+
+// Serializes frames on a modelled 50 kbit/s bus and records when each doser
+// received its new flow rate.
+class BusModelManager : public DoserManager {
+public:
+  static constexpr double bitrate = 50'000;
+
+  BusModelManager(int nModules, int parallelMax, bool batched)
+      : DoserManager{parallelMax}, nModules{nModules}, batched{batched} {
+    connectDosers();
+  }
+
+  ~BusModelManager() { shutdown(); }
+
+  double busTime{0}; // s
+  int frames{0};
+  std::map<int, double> switchedAt;
+
+private:
+  std::vector<float> implConnectDosers() override {
+    modules.clear();
+    for (int i = 0; i < nModules; ++i) {
+      modules.addModule(can::protocol::moduleChannels);
+    }
+    return std::vector<float>(modules.doserCount(), 60);
+  }
+
+  void implDoserOn(int id, float flowRate) override {
+    const FlowCommand command{id, flowRate};
+    transmit({&command, 1});
+  }
+
+  void implDoserOff(int id) override { implDoserOn(id, 0); }
+
+  void implSetFlowRates(std::span<const FlowCommand> commands) override {
+    if (batched) {
+      transmit(commands);
+    } else {
+      DoserManager::implSetFlowRates(commands);
+    }
+  }
+
+  void transmit(std::span<const FlowCommand> commands) {
+    modules.setFlowRates(commands, [&](const CANModuleMap::Frame &frame) {
+      busTime += can::protocol::frameBits(frame.dlc, frame.extended) / bitrate;
+      ++frames;
+      for (auto [id, _] : commands) {
+        if (!switchedAt.contains(id) && touches(frame, id)) {
+          switchedAt[id] = busTime;
+        }
+      }
+    });
+  }
+
+  bool touches(const CANModuleMap::Frame &frame, int id) const {
+    using namespace can::protocol;
+    if (rpcOf(frame.identifier) == RPC::SetFlowRate) {
+      SetFlowRateCommand command;
+      std::memcpy(&command, frame.data, sizeof(command));
+      return command.doserID == static_cast<uint32_t>(id);
+    }
+    if (addressOf(frame.identifier) == broadcastAddress) {
+      return true;
+    }
+    const auto &module = modules.getModules()[addressOf(frame.identifier)];
+    return id >= module.firstDoser && id < module.firstDoser + module.numDosers;
+  }
+
+  const int nModules;
+  const bool batched;
+  CANModuleMap modules;
+};
+
+struct BatchResult {
+  double occupancy; // s
+  double skew;      // s
+  int frames;
+};
+
+static BatchResult measureScheduleStart(int nModules, int nDosers,
+                                        bool batched) {
+  BusModelManager man{nModules, nDosers, batched};
+
+  std::vector<DoserManager::Doser> dosers;
+  std::vector<DoserManager::Doser *> group;
+  for (int i = 0; i < nDosers; ++i) {
+    dosers.push_back(std::move(*man.lendDoser(i)));
+  }
+  for (auto &doser : dosers) {
+    group.push_back(&doser);
+  }
+
+  if (batched) {
+    man.on(group, 60);
+  } else {
+    for (auto *doser : group) {
+      doser->on(60);
+    }
+  }
+
+  double first = man.switchedAt.begin()->second, last = first;
+  for (auto [_, at] : man.switchedAt) {
+    first = std::min(first, at);
+    last = std::max(last, at);
+  }
+  return {man.busTime, last - first, man.frames};
+}
+
+void test_can_batch_frames() {
+  using namespace can::protocol;
+
+  CANModuleMap modules;
+  modules.addModule(4);
+  modules.addModule(4);
+
+  std::vector<CANModuleMap::Frame> sent;
+  auto record = [&](const CANModuleMap::Frame &frame) {
+    sent.push_back(frame);
+  };
+
+  // One channel of a module uses the single doser frame, addressed to the
+  // module that owns the doser
+  std::vector<CANModuleMap::FlowCommand> commands{{5, 30}};
+  modules.setFlowRates(commands, record);
+  TEST_ASSERT_EQUAL(1, sent.size());
+  TEST_ASSERT_TRUE(sent[0].extended);
+  TEST_ASSERT_EQUAL(RPC::SetFlowRate, rpcOf(sent[0].identifier));
+  TEST_ASSERT_EQUAL(1, addressOf(sent[0].identifier));
+
+  // A flow rate beyond the frame's range saturates below keepFlowRate
+  sent.clear();
+  commands = {{5, 1e6f}};
+  modules.setFlowRates(commands, record);
+  SetFlowRateCommand single;
+  std::memcpy(&single, sent[0].data, sizeof(single));
+  TEST_ASSERT_EQUAL(keepFlowRate - 1, single.flowRate);
+  sent.clear();
+  commands = {{5, 30}};
+  modules.setFlowRates(commands, record);
+
+  // Several channels of one module go out in one addressed frame that keeps
+  // the earlier flow rate of doser 5
+  sent.clear();
+  commands = {{4, 10}, {6, 20}};
+  modules.setFlowRates(commands, record);
+  TEST_ASSERT_EQUAL(1, sent.size());
+  TEST_ASSERT_TRUE(sent[0].extended);
+  TEST_ASSERT_EQUAL(RPC::SetModuleFlowRates, rpcOf(sent[0].identifier));
+  TEST_ASSERT_EQUAL(1, addressOf(sent[0].identifier));
+  SetModuleFlowRatesCommand command;
+  std::memcpy(&command, sent[0].data, sizeof(command));
+  TEST_ASSERT_EQUAL(10, command.flowRates[0]);
+  TEST_ASSERT_EQUAL(30, command.flowRates[1]);
+  TEST_ASSERT_EQUAL(20, command.flowRates[2]);
+  TEST_ASSERT_EQUAL(0, command.flowRates[3]);
+
+  // Turning everything off is a single broadcast
+  sent.clear();
+  commands.clear();
+  for (int i = 0; i < modules.doserCount(); ++i) {
+    commands.emplace_back(i, 0);
+  }
+  modules.setFlowRates(commands, record);
+  TEST_ASSERT_EQUAL(1, sent.size());
+  TEST_ASSERT_EQUAL(RPC::SetAllFlowRates, rpcOf(sent[0].identifier));
+  TEST_ASSERT_EQUAL(broadcastAddress, addressOf(sent[0].identifier));
+}
+
+void test_can_batch_bus_occupancy() {
+  constexpr int nModules = 3;
+  constexpr int nDosers = 12;
+
+  const BatchResult single = measureScheduleStart(nModules, nDosers, false);
+  const BatchResult batched = measureScheduleStart(nModules, nDosers, true);
+
+  char msg[160];
+  std::snprintf(msg, sizeof(msg),
+                "%d dosers: per doser %d frames %.1f ms skew %.1f ms, "
+                "batched %d frames %.1f ms skew %.1f ms",
+                nDosers, single.frames, single.occupancy * 1e3,
+                single.skew * 1e3, batched.frames, batched.occupancy * 1e3,
+                batched.skew * 1e3);
+  TEST_MESSAGE(msg);
+
+  TEST_ASSERT_EQUAL(nDosers, single.frames);
+  TEST_ASSERT_LESS_OR_EQUAL(nModules, batched.frames);
+  TEST_ASSERT_LESS_THAN(single.occupancy / 3, batched.occupancy);
+  TEST_ASSERT_LESS_THAN(single.skew / 3, batched.skew);
+}
+
+void test_can_topology_fingerprint() {
+  CANModuleMap chain;
+  chain.addModule(4, 60, 0x1234);
+  chain.addModule(2, 60, 0x5678);
+
+  CANModuleMap same;
+  same.addModule(4, 60, 0x1234);
+  same.addModule(2, 60, 0x5678);
+  TEST_ASSERT_EQUAL(chain.fingerprint(), same.fingerprint());
+
+  // Swapped modules renumber the dosers
+  CANModuleMap swapped;
+  swapped.addModule(2, 60, 0x5678);
+  swapped.addModule(4, 60, 0x1234);
+  TEST_ASSERT_NOT_EQUAL(chain.fingerprint(), swapped.fingerprint());
+
+  CANModuleMap replaced;
+  replaced.addModule(4, 60, 0x1234);
+  replaced.addModule(2, 60, 0x9ABC);
+  TEST_ASSERT_NOT_EQUAL(chain.fingerprint(), replaced.fingerprint());
+
+  CANModuleMap shorter;
+  shorter.addModule(4, 60, 0x1234);
+  TEST_ASSERT_NOT_EQUAL(chain.fingerprint(), shorter.fingerprint());
+}
+
+void test_can_timed_dose_channels() {
+  using namespace can::protocol;
+
+  CANModuleMap modules;
+  modules.addModule(4);
+
+  std::vector<CANModuleMap::Frame> sent;
+  auto record = [&](const CANModuleMap::Frame &frame) {
+    sent.push_back(frame);
+  };
+
+  auto [frame, token] = modules.startDose(1, 60, 5000);
+  TEST_ASSERT_EQUAL(RPC::DoseVolume, rpcOf(frame.identifier));
+  TEST_ASSERT_EQUAL(0, addressOf(frame.identifier));
+  TEST_ASSERT_TRUE(modules.isDosing(1));
+
+  // Switching the neighbours leaves the dosing channel alone
+  std::vector<CANModuleMap::FlowCommand> commands{{0, 10}, {2, 20}};
+  modules.setFlowRates(commands, record);
+  TEST_ASSERT_EQUAL(1, sent.size());
+  SetModuleFlowRatesCommand command;
+  std::memcpy(&command, sent[0].data, sizeof(command));
+  TEST_ASSERT_EQUAL(10, command.flowRates[0]);
+  TEST_ASSERT_EQUAL(keepFlowRate, command.flowRates[1]);
+  TEST_ASSERT_EQUAL(20, command.flowRates[2]);
+
+  // A stale end of an earlier dose doesn't release the doser
+  auto [next, nextToken] = modules.startDose(1, 60, 5000);
+  modules.finishDose(1, token);
+  TEST_ASSERT_TRUE(modules.isDosing(1));
+  modules.finishDose(1, nextToken);
+  TEST_ASSERT_FALSE(modules.isDosing(1));
+}
+
+#endif
@@ -0,0 +1,596 @@
+#ifndef TEST_CAN_BUS_HPP
+#define TEST_CAN_BUS_HPP
+
+#include "CANDoserManager.hpp"
+#include "SimulatedBus.hpp"
+#include "can_protocol.h"
+#include "unity.h"
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+// Protocol side of a DoserModule on the simulated bus, following
+// DoserModule/Core/Src/app.cpp: boot when the previous module powers it,
+// repeat NewModule until answered, power the next module and report
+// LastNode if it doesn't show up. Then serve flow rates, doses,
+// announcements and bitrate switches of its address until Restart.
+class SimulatedModule {
+public:
+  static constexpr uint16_t maxFlowRate = 60;
+  static constexpr Clock::duration bootTime = 15ms;
+  static constexpr Clock::duration initializeListen = 20ms;
+  static constexpr Clock::duration nextNodeWindow = 500ms;
+
+  SimulatedModule(SimulatedBus &bus, uint16_t uid, bool poweredAtStart)
+      : powered{poweredAtStart}, port{bus.attach()}, uid{uid} {}
+
+  void start(SimulatedModule *nextModule) {
+    next = nextModule;
+    thread = std::jthread([this](std::stop_token stop) { run(stop); });
+  }
+
+  uint16_t flowRate(size_t channel) const {
+    std::lock_guard guard{mtx};
+    return flowRates[channel];
+  }
+
+  uint32_t bitrate() const { return port->bitrate(); }
+
+  // Like a module whose controller was reset behind Sensei's back
+  void resetBitrate() { port->setBitrate(can::protocol::defaultBitrate); }
+
+  std::atomic<bool> powered;
+
+private:
+  using Frame = can::protocol::Frame;
+
+  struct Dose {
+    Clock::time_point start;
+    Clock::time_point end;
+    uint16_t flowRate;
+    uint8_t seq;
+  };
+
+  void run(std::stop_token stop) {
+    while (!stop.stop_requested()) {
+      if (!powered) {
+        port->receive(1ms);
+        continue;
+      }
+
+      std::this_thread::sleep_for(bootTime);
+      port->setBitrate(can::protocol::defaultBitrate);
+      if (powered && initialize(stop)) {
+        serve(stop);
+      }
+
+      std::lock_guard guard{mtx};
+      flowRates = {};
+      doses = {};
+    }
+  }
+
+  bool initialize(std::stop_token stop) {
+    using namespace can::protocol;
+
+    NewModuleCommand command{moduleChannels, 0, maxFlowRate, uid};
+    Frame request{RPC::NewModule, false, sizeof(command), {}};
+
+    std::optional<NewModuleResponse> response;
+    while (!response) {
+      if (stop.stop_requested() || !powered) {
+        return false;
+      }
+
+      std::memcpy(request.data, &command, sizeof(command));
+      port->transmit(request, 10ms);
+      command.attempt += command.attempt < UINT8_MAX;
+      const auto listenStart = Clock::now();
+      while (!response && Clock::now() - listenStart < initializeListen) {
+        const auto frame = port->receive(1ms);
+        if (frame && !frame->extended &&
+            frame->identifier == responseID(RPC::NewModule)) {
+          NewModuleResponse answer;
+          std::memcpy(&answer, frame->data, sizeof(answer));
+          if (answer.uid == uid) {
+            response = answer;
+          }
+        }
+      }
+    }
+    moduleID = response->moduleID;
+    address = response->address;
+
+    if (next) {
+      next->powered = true;
+    }
+
+    const auto windowStart = Clock::now();
+    while (Clock::now() - windowStart < nextNodeWindow) {
+      const auto frame = port->receive(1ms);
+      if (frame && !frame->extended && frame->identifier == RPC::NewModule) {
+        return true;
+      }
+    }
+
+    if (next) {
+      next->powered = false;
+    }
+    port->transmit({RPC::LastNode, false, sizeof(LastNodeCommand), {}},
+                   10ms);
+    return true;
+  }
+
+  void serve(std::stop_token stop) {
+    using namespace can::protocol;
+
+    auto announceAt = Clock::time_point::max();
+    uint8_t announceSeq = 0;
+    auto bitrateAckAt = Clock::time_point::max();
+    uint8_t bitrateAckSeq = 0;
+    auto bitrateSwitchAt = Clock::time_point::max();
+    uint32_t nextBitrate = 0;
+
+    while (!stop.stop_requested() && powered) {
+      const auto frame = port->receive(1ms);
+      const auto now = Clock::now();
+
+      if (now >= bitrateSwitchAt) {
+        bitrateSwitchAt = Clock::time_point::max();
+        port->setBitrate(nextBitrate);
+      } else if (bitrateSwitchAt == Clock::time_point::max() &&
+                 port->bitrate() != defaultBitrate &&
+                 port->status().errorPassive()) {
+        port->setBitrate(defaultBitrate);
+      }
+
+      if (now >= bitrateAckAt) {
+        bitrateAckAt = Clock::time_point::max();
+        const SetBitrateResponse response{nextBitrate,
+                                          supports(nextBitrate)};
+        transmit(
+            identifier(responseRPC(RPC::SetBitrate), address, bitrateAckSeq),
+            response);
+      }
+
+      for (uint8_t i = 0; i < moduleChannels; ++i) {
+        if (doses[i] && now >= doses[i]->end) {
+          finishDose(i, DoseStatus::Completed, now);
+        }
+      }
+
+      if (now >= announceAt && bitrateSwitchAt == Clock::time_point::max()) {
+        announceAt = Clock::time_point::max();
+        const AnnounceResponse response{uid, moduleChannels, maxFlowRate,
+                                        static_cast<uint16_t>(moduleID)};
+        transmit(identifier(responseRPC(RPC::Announce), address, announceSeq),
+                 response);
+      }
+
+      if (!frame || !frame->extended) {
+        continue;
+      }
+
+      const uint8_t dst = addressOf(frame->identifier);
+      if (dst != address && dst != broadcastAddress) {
+        continue;
+      }
+
+      switch (rpcOf(frame->identifier)) {
+      case RPC::SetFlowRate: {
+        SetFlowRateCommand command;
+        std::memcpy(&command, frame->data, sizeof(command));
+        const uint32_t idx = command.doserID - moduleID;
+        if (idx < moduleChannels) {
+          setFlowRate(idx, command.flowRate, now);
+        }
+        break;
+      }
+      case RPC::SetModuleFlowRates:
+      case RPC::SetAllFlowRates: {
+        SetModuleFlowRatesCommand command;
+        std::memcpy(&command, frame->data, sizeof(command));
+        for (uint8_t i = 0; i < moduleChannels; ++i) {
+          if (command.flowRates[i] != keepFlowRate) {
+            setFlowRate(i, command.flowRates[i], now);
+          }
+        }
+        break;
+      }
+      case RPC::DoseVolume: {
+        DoseVolumeCommand command;
+        std::memcpy(&command, frame->data, sizeof(command));
+        startDose(command, seqOf(frame->identifier), now);
+        break;
+      }
+      case RPC::Announce: {
+        AnnounceCommand command;
+        std::memcpy(&command, frame->data, sizeof(command));
+        announceAt =
+            now + std::chrono::microseconds(uint32_t{command.slot_us} *
+                                            address);
+        announceSeq = seqOf(frame->identifier);
+        break;
+      }
+      case RPC::SetBitrate: {
+        SetBitrateCommand command;
+        std::memcpy(&command, frame->data, sizeof(command));
+        if (command.step == BitrateStep::Prepare) {
+          bitrateAckAt = now + std::chrono::microseconds(
+                                   uint32_t{command.slot_us} * address);
+          bitrateAckSeq = seqOf(frame->identifier);
+          nextBitrate = command.bitrate;
+        } else if (command.step == BitrateStep::Commit &&
+                   supports(command.bitrate)) {
+          bitrateSwitchAt = now + std::chrono::milliseconds(command.delay_ms);
+          nextBitrate = command.bitrate;
+        }
+        break;
+      }
+      case RPC::Restart:
+        if (next) {
+          next->powered = false;
+        }
+        return;
+      default:
+        break;
+      }
+    }
+  }
+
+  // Bitrates of the bxCAN timing table
+  static bool supports(uint32_t bitrate) {
+    return bitrate == 50'000 || bitrate == 125'000 || bitrate == 250'000 ||
+           bitrate == 500'000;
+  }
+
+  void setFlowRate(uint8_t idx, uint16_t flowRate, Clock::time_point now) {
+    if (doses[idx]) {
+      finishDose(idx, can::protocol::DoseStatus::Interrupted, now);
+    }
+    std::lock_guard guard{mtx};
+    flowRates[idx] = flowRate;
+  }
+
+  void startDose(const can::protocol::DoseVolumeCommand &command, uint8_t seq,
+                 Clock::time_point now) {
+    using namespace can::protocol;
+    using Minutes = std::chrono::duration<double, std::chrono::minutes::period>;
+
+    const uint32_t idx = command.doserID - moduleID;
+    if (idx >= moduleChannels || command.flowRate == 0 ||
+        command.flowRate > maxFlowRate) {
+      transmit(identifier(responseRPC(RPC::DoseVolume), address, seq),
+               DoseVolumeResponse{command.doserID, DoseStatus::Rejected, 0});
+      return;
+    }
+
+    if (doses[idx]) {
+      finishDose(idx, DoseStatus::Interrupted, now);
+    }
+    const auto duration = std::chrono::duration_cast<Clock::duration>(
+        Minutes(command.volume_uL / 1000.0 / command.flowRate));
+    doses[idx] = Dose{now, now + duration, command.flowRate, seq};
+    std::lock_guard guard{mtx};
+    flowRates[idx] = command.flowRate;
+  }
+
+  void finishDose(uint8_t idx, can::protocol::DoseStatus status,
+                  Clock::time_point now) {
+    using namespace can::protocol;
+
+    const Dose dose = *doses[idx];
+    doses[idx].reset();
+    {
+      std::lock_guard guard{mtx};
+      flowRates[idx] = 0;
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::min(now, dose.end) - dose.start);
+    const auto delivered =
+        static_cast<uint32_t>(elapsed.count() * dose.flowRate / 60'000);
+    transmit(identifier(responseRPC(RPC::DoseVolume), address, dose.seq),
+             DoseVolumeResponse{static_cast<uint16_t>(moduleID + idx), status,
+                                delivered});
+  }
+
+  template <typename T> void transmit(uint32_t id, const T &payload) {
+    Frame frame{id, true, sizeof(T), {}};
+    std::memcpy(frame.data, &payload, sizeof(T));
+    port->transmit(frame, 10ms);
+  }
+
+  std::unique_ptr<SimulatedBus::Port> port;
+  const uint16_t uid;
+  SimulatedModule *next{nullptr};
+  uint32_t moduleID{0};
+  uint8_t address{0};
+  mutable std::mutex mtx;
+  std::array<uint16_t, can::protocol::moduleChannels> flowRates{};
+  std::array<std::optional<Dose>, can::protocol::moduleChannels> doses;
+  std::jthread thread;
+};
+
+// Chain of modules, the first one powered by Sensei and every other one by
+// its predecessor
+class SimulatedChain {
+public:
+  // Modules whose uids are uidStep apart, all the same with 0
+  SimulatedChain(SimulatedBus &bus, size_t count, uint16_t uidStep = 7) {
+    for (size_t i = 0; i < count; ++i) {
+      modules.push_back(std::make_unique<SimulatedModule>(
+          bus, static_cast<uint16_t>(0x1000 + i * uidStep), i == 0));
+    }
+    for (size_t i = 0; i < count; ++i) {
+      modules[i]->start(i + 1 < count ? modules[i + 1].get() : nullptr);
+    }
+  }
+
+  SimulatedModule &operator[](size_t i) { return *modules[i]; }
+
+private:
+  std::vector<std::unique_ptr<SimulatedModule>> modules;
+};
+
+template <typename Predicate>
+bool eventually(Predicate predicate, Clock::duration timeout = 1s) {
+  const auto deadline = Clock::now() + timeout;
+  while (!predicate()) {
+    if (Clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(1ms);
+  }
+  return true;
+}
+
+void test_simulated_bus_arbitration() {
+  using can::protocol::Frame;
+
+  TEST_ASSERT(SimulatedBus::arbitrationKey({0x05, false, 0, {}}) <
+              SimulatedBus::arbitrationKey({0x06, false, 0, {}}));
+  // Same base identifier, the standard frame wins
+  TEST_ASSERT(SimulatedBus::arbitrationKey({0x05, false, 0, {}}) <
+              SimulatedBus::arbitrationKey({0x05u << 18, true, 0, {}}));
+  TEST_ASSERT(SimulatedBus::arbitrationKey({0x04u << 18 | 0x3FFFF, true, 0,
+                                            {}}) <
+              SimulatedBus::arbitrationKey({0x05, false, 0, {}}));
+
+  SimulatedBus bus{50'000};
+  auto a = bus.attach();
+  auto b = bus.attach();
+  auto c = bus.attach();
+
+  // Queued together, the lower identifier goes first whoever queued it
+  TEST_ASSERT(a->transmit({0x300, false, 8, {}}, 10ms));
+  TEST_ASSERT(b->transmit({0x100, false, 8, {}}, 10ms));
+  TEST_ASSERT(b->transmit({0x200, false, 8, {}}, 10ms));
+
+  std::vector<uint32_t> order;
+  const auto start = Clock::now();
+  while (order.size() < 3) {
+    if (auto frame = c->receive(100ms)) {
+      order.push_back(frame->identifier);
+    } else {
+      break;
+    }
+  }
+  const auto elapsed = Clock::now() - start;
+
+  TEST_ASSERT_EQUAL(3, order.size());
+  // The first frame may already be on the bus when the others are queued
+  TEST_ASSERT(order[1] < order[2]);
+  // Three 8 byte standard frames take about 7 ms at 50 kbit/s
+  TEST_ASSERT(elapsed >= 3 * can::protocol::frameBits(8, false) * 20us);
+
+  // A sender doesn't hear itself, everybody else does
+  TEST_ASSERT(a->receive(10ms));
+  TEST_ASSERT(a->receive(10ms));
+  TEST_ASSERT(!a->receive(10ms));
+  TEST_ASSERT_EQUAL(0x300, b->receive(10ms)->identifier);
+  TEST_ASSERT(!b->receive(10ms));
+  TEST_ASSERT_EQUAL(3, bus.framesCarried());
+}
+
+// A request outstanding while the sequence numbers wrap keeps its number, so
+// later requests can't take its response
+void test_can_bus_seq_wrap() {
+  using namespace can::protocol;
+
+  SimulatedBus bus{50'000, 0};
+  auto module = bus.attach();
+  CANBus canBus{bus.attach()};
+
+  Frame dose{identifier(DoseVolume, 1), true, 8, {}};
+  auto outstanding = canBus.request(dose, 1, 10s);
+  const auto first = module->receive(100ms);
+  TEST_ASSERT(first);
+
+  for (int i = 0; i < 300; ++i) {
+    auto answered = canBus.request(dose, 1, 100ms);
+    const auto request = module->receive(100ms);
+    TEST_ASSERT(request);
+    TEST_ASSERT(seqOf(request->identifier) != seqOf(first->identifier));
+    Frame response{identifier(responseRPC(DoseVolume), 1,
+                              seqOf(request->identifier)),
+                   true, 8, {}};
+    TEST_ASSERT(module->transmit(response, 100ms));
+    TEST_ASSERT_EQUAL(1, answered.get().size());
+  }
+
+  Frame response{identifier(responseRPC(DoseVolume), 1,
+                            seqOf(first->identifier)),
+                 true, 8, {42}};
+  TEST_ASSERT(module->transmit(response, 100ms));
+  const auto responses = outstanding.get();
+  TEST_ASSERT_EQUAL(1, responses.size());
+  TEST_ASSERT_EQUAL(42, responses[0].data[0]);
+}
+
+// A controller that never gets a frame out, as with nobody acknowledging
+class StuckTransport : public CANTransport {
+public:
+  bool transmit(const Frame &, Clock::duration timeout) override {
+    std::this_thread::sleep_for(timeout);
+    return false;
+  }
+
+  std::optional<Frame> receive(Clock::duration timeout) override {
+    std::this_thread::sleep_for(timeout);
+    return std::nullopt;
+  }
+
+  uint32_t bitrate() const override { return can::protocol::defaultBitrate; }
+};
+
+// The transmit of a long request gives up after the transmit timeout, the
+// request fails then rather than once its response would be due
+void test_can_bus_transmit_timeout() {
+  using namespace can::protocol;
+
+  CANBus canBus{std::make_unique<StuckTransport>()};
+  const auto start = Clock::now();
+  auto responses = canBus.request({identifier(DoseVolume, 1), true, 8, {}},
+                                  1, 10s);
+  TEST_ASSERT(responses.wait_for(1s) == std::future_status::ready);
+  TEST_ASSERT(responses.get().empty());
+  TEST_ASSERT(Clock::now() - start < 1s);
+}
+
+void test_can_manager_simulated_chain() {
+  SimulatedBus bus{50'000};
+  SimulatedChain chain{bus, 3};
+  CANDoserManager manager{2, bus.attach()};
+
+  const auto &flowRates = manager.getFlowRates();
+  TEST_ASSERT_EQUAL(3 * can::protocol::moduleChannels, flowRates.size());
+  for (float flowRate : flowRates) {
+    TEST_ASSERT_EQUAL_FLOAT(SimulatedModule::maxFlowRate, flowRate);
+  }
+
+  {
+    auto doser = manager.lendDoser(5);
+    TEST_ASSERT(doser);
+    doser->on(30);
+    TEST_ASSERT(eventually([&] { return chain[1].flowRate(1) == 30; }));
+    doser->off();
+    TEST_ASSERT(eventually([&] { return chain[1].flowRate(1) == 0; }));
+  }
+
+  {
+    auto doser = manager.lendDoser(9);
+    TEST_ASSERT(doser);
+    const float delivered = doser->dose(0.1, 60).get();
+    TEST_ASSERT_FLOAT_WITHIN(0.005, 0.1, delivered);
+    TEST_ASSERT_EQUAL(0, chain[2].flowRate(1));
+  }
+
+  const auto stats = manager.busStatistics();
+  TEST_ASSERT_EQUAL_STRING("running", stats.controller.state);
+  TEST_ASSERT_EQUAL(1, stats.rpcs.at(can::protocol::RPC::DoseVolume).tx);
+  TEST_ASSERT_EQUAL(0, stats.rpcs.at(can::protocol::RPC::DoseVolume).timeouts);
+}
+
+// Neighbours whose uids hash the same still get an address each
+void test_can_manager_uid_collision() {
+  SimulatedBus bus{50'000};
+  SimulatedChain chain{bus, 3, 0};
+  CANDoserManager manager{3, bus.attach()};
+
+  TEST_ASSERT_EQUAL(3 * can::protocol::moduleChannels,
+                    manager.getFlowRates().size());
+  auto doser = manager.lendDoser(9);
+  doser->on(30);
+  TEST_ASSERT(eventually([&] { return chain[2].flowRate(1) == 30; }));
+  TEST_ASSERT_EQUAL(0, chain[1].flowRate(1));
+}
+
+// Enumerates a 64 module chain at the real bitrate and doses on every module
+// at once
+void test_can_manager_simulated_64_modules() {
+  constexpr size_t moduleCount = 64;
+
+  SimulatedBus bus{50'000};
+  SimulatedChain chain{bus, moduleCount};
+  CANDoserManager manager{moduleCount, bus.attach()};
+
+  TEST_ASSERT_EQUAL(moduleCount * can::protocol::moduleChannels,
+                    manager.getFlowRates().size());
+
+  std::vector<DoserManager::Doser> dosers;
+  for (size_t i = 0; i < moduleCount; ++i) {
+    dosers.push_back(*manager.lendDoser(i * can::protocol::moduleChannels));
+  }
+
+  std::vector<std::pair<DoserManager::Doser *, float>> group;
+  for (auto &doser : dosers) {
+    group.emplace_back(&doser, 0.2f);
+  }
+  const auto delivered = manager.dose(group, 60);
+
+  TEST_ASSERT_EQUAL(moduleCount, delivered.size());
+  for (float volume : delivered) {
+    TEST_ASSERT_FLOAT_WITHIN(0.01, 0.2, volume);
+  }
+
+  const auto stats = manager.busStatistics();
+  const auto &doses = stats.rpcs.at(can::protocol::RPC::DoseVolume);
+  TEST_ASSERT_EQUAL(moduleCount, doses.tx);
+  TEST_ASSERT_EQUAL(0, doses.timeouts);
+  printf("64 modules: %llu frames, bus load %.2f\n",
+         static_cast<unsigned long long>(bus.framesCarried()), stats.load);
+}
+
+void test_can_bitrate_switch() {
+  SimulatedBus bus{can::protocol::defaultBitrate};
+  SimulatedChain chain{bus, 3};
+  CANDoserManager manager{2, bus.attach()};
+
+  TEST_ASSERT(manager.setBitrate(500'000));
+  TEST_ASSERT_EQUAL(500'000, manager.bitrate());
+  for (size_t i = 0; i < 3; ++i) {
+    TEST_ASSERT_EQUAL(500'000, chain[i].bitrate());
+  }
+
+  auto doser = manager.lendDoser(6);
+  doser->on(42);
+  TEST_ASSERT(eventually([&] { return chain[1].flowRate(2) == 42; }));
+
+  // Not in the modules' timing table, nobody switches
+  TEST_ASSERT(!manager.setBitrate(1'000'000));
+  TEST_ASSERT_EQUAL(500'000, manager.bitrate());
+  TEST_ASSERT_EQUAL(500'000, chain[0].bitrate());
+}
+
+// Modules back at the default bitrate leave Sensei's frames unacknowledged
+// until its controller goes error passive and it falls back as well
+void test_can_bitrate_fallback() {
+  SimulatedBus bus{can::protocol::defaultBitrate};
+  SimulatedChain chain{bus, 2};
+  CANDoserManager manager{1, bus.attach()};
+
+  TEST_ASSERT(manager.setBitrate(250'000));
+  chain[0].resetBitrate();
+  chain[1].resetBitrate();
+
+  auto doser = manager.lendDoser(1);
+  TEST_ASSERT(eventually(
+      [&] {
+        doser->on(doser->getIsOn() ? 0 : 10);
+        return manager.bitrate() == can::protocol::defaultBitrate;
+      },
+      2s));
+
+  doser->on(17);
+  TEST_ASSERT(eventually([&] { return chain[0].flowRate(1) == 17; }));
+}
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef TEST_CONTROL_HPP
+#define TEST_CONTROL_HPP
+
+#include "ControlScheduler.hpp"
+#include "NutrientController.hpp"
+#include "PhController.hpp"
+#include "VirtualClock.hpp"
+#include "test_manager.hpp"
+#include "unity.h"
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+
+void test_control_scheduler() {
+  using namespace std::chrono_literals;
+  ControlScheduler scheduler;
+  std::vector<int> log;
+  std::vector<std::thread::id> threads;
+  Wakeup wakeup;
+
+  auto loop = [&](int task, Clock::duration interval) -> ControlTask {
+    for (int i = 0; i < 3; ++i) {
+      log.push_back(task);
+      threads.push_back(std::this_thread::get_id());
+      co_await sleepFor(interval);
+    }
+  };
+  auto waiting = [&]() -> ControlTask {
+    co_await wakeup.waitFor(1s);
+    log.push_back(3);
+    co_await wakeup.waitFor(1s);
+    log.push_back(4);
+  };
+  scheduler.spawn(loop(1, 10ms));
+  scheduler.spawn(loop(2, 25ms));
+  scheduler.spawn(waiting());
+
+  // A notify without a sleeper ends the next wait at once
+  wakeup.notify();
+  const auto start = Clock::now();
+  std::jthread runner{[&](std::stop_token stop) { scheduler.run(stop); }};
+  std::this_thread::sleep_for(80ms);
+  wakeup.notify();
+  std::this_thread::sleep_for(10ms);
+  runner.request_stop();
+  runner.join();
+
+  // Both loops ran their sleeps side by side on the one thread
+  const std::vector<int> expected{1, 2, 3, 1, 1, 2, 2, 4};
+  TEST_ASSERT_TRUE(log == expected);
+  TEST_ASSERT_TRUE(std::ranges::all_of(
+      threads, [&](auto id) { return id == threads.front(); }));
+  TEST_ASSERT_TRUE(Clock::now() - start < 500ms);
+}
+
+void test_control_doses() {
+  using namespace std::chrono_literals;
+  status.clear();
+  TestManager man{4, 4};
+  auto single = man.lendDoser(0);
+  auto first = man.lendDoser(1);
+  auto second = man.lendDoser(2);
+  std::vector<std::pair<Doser *, float>> group{{&*first, 0.3f},
+                                               {&*second, 0.2f}};
+
+  // 50 ms and a group of 30 and 20 ms, the tasks await them side by side
+  ControlScheduler scheduler;
+  std::atomic<int> ended{0};
+  float delivered = 0;
+  std::vector<float> groupDelivered;
+  auto dosing = [&]() -> ControlTask {
+    delivered = co_await single->doseAsync(0.5f, 600);
+    ++ended;
+  };
+  auto groupDosing = [&]() -> ControlTask {
+    groupDelivered = co_await man.doseAsync(group, 600);
+    ++ended;
+  };
+  scheduler.spawn(dosing());
+  scheduler.spawn(groupDosing());
+
+  const auto start = Clock::now();
+  std::jthread runner{[&](std::stop_token stop) { scheduler.run(stop); }};
+  while (ended < 2 && Clock::now() - start < 1s) {
+    std::this_thread::sleep_for(1ms);
+  }
+  const auto took = Clock::now() - start;
+  runner.request_stop();
+  runner.join();
+
+  TEST_ASSERT_EQUAL(2, ended.load());
+  TEST_ASSERT_TRUE(took >= 50ms && took < 80ms);
+  TEST_ASSERT_EQUAL_FLOAT(0.5f, delivered);
+  TEST_ASSERT_EQUAL(2, groupDelivered.size());
+  TEST_ASSERT_EQUAL_FLOAT(0.3f, groupDelivered[0]);
+  TEST_ASSERT_EQUAL_FLOAT(0.2f, groupDelivered[1]);
+
+  // A stopped dose resumes its task with what it delivered, nothing here
+  std::stop_source source;
+  source.request_stop();
+  float cancelled = -1;
+  auto stopped = [&]() -> ControlTask {
+    const DoseControl control{source.get_token()};
+    cancelled = co_await single->doseAsync(1, 600, control);
+  };
+  ControlScheduler again;
+  again.spawn(stopped());
+  std::jthread rerun{[&](std::stop_token stop) { again.run(stop); }};
+  std::this_thread::sleep_for(20ms);
+  rerun.request_stop();
+  rerun.join();
+  TEST_ASSERT_EQUAL_FLOAT(0, cancelled);
+}
+
+// Loses the result of the first dose of every doser, as the CAN manager does
+// when the module's response times out
+class LosingManager : public TestManager2 {
+public:
+  using TestManager2::TestManager2;
+
+  ~LosingManager() { shutdown(); }
+
+private:
+  void implDose(int id, float amount_mL, float flowRate_mL_per_min,
+                DoseResult delivered) override {
+    if (lost.insert(id).second) {
+      doseFinished(id, 0.0f);
+      delivered.fail(
+          std::make_exception_ptr(std::runtime_error("dose result lost")));
+      return;
+    }
+    DoserManager::implDose(id, amount_mL, flowRate_mL_per_min,
+                           std::move(delivered));
+  }
+
+  std::set<int> lost; // On the executor task only
+};
+
+void test_control_lost_dose() {
+  using namespace std::chrono_literals;
+  struct Reading : Sensor {
+    explicit Reading(std::function<float()> read) : read{std::move(read)} {}
+    float reading() const override { return read(); }
+    std::function<float()> read;
+  };
+
+  status.clear();
+  VirtualClock clock;
+  gDoserManager = std::make_unique<LosingManager>(3, 3);
+  {
+    const Reading ph{[] { return 7 - 0.1f * status[0]; }};
+    const Reading ec{[] { return 1 + 0.02f * (status[1] + status[2]); }};
+    PhController phController{ph};
+    NutrientController nutrientController{ec};
+    ControlScheduler scheduler;
+    scheduler.spawn(phController.run());
+    scheduler.spawn(nutrientController.run());
+    clock.runFor(1s);
+    phController.start({.target = 6,
+                        .acceptedError = 0.05f,
+                        .flowRate = 60,
+                        .doseAmount = 1,
+                        .adjustInterval = 5min,
+                        .pHDownDoser = 0});
+    nutrientController.start({.target = 1.5f,
+                              .acceptedError = 0.01f,
+                              .flowRate = 60,
+                              .adjustInterval = 5min,
+                              .schedule = {{1, 1}, {2, 1}},
+                              .mode = NutrientController::Mode::Schedule});
+
+    // The first doses fail without ending the loops or the scheduler
+    clock.runFor(1min);
+    TEST_ASSERT_EQUAL_FLOAT(0, status[0] + status[1] + status[2]);
+
+    // Both controllers dose again at their next adjustment
+    clock.runFor(5min);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 1, status[0]);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 1, status[1]);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 1, status[2]);
+    phController.stop();
+    nutrientController.stop();
+  }
+  gDoserManager.reset();
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef TEST_CURRENT_HPP
+#define TEST_CURRENT_HPP
+
+#include "CurrentModel.hpp"
+#include "DosePlanner.hpp"
+#include "test_manager.hpp"
+#include "unity.h"
+#include <thread>
+#include <vector>
+
+void test_current_model() {
+  CurrentModel model;
+  TEST_ASSERT_EQUAL(CurrentModel::defaultCurrent_mA, model.estimate(0, 60));
+
+  model.observe(0, 60, 120);
+  TEST_ASSERT_TRUE(model.learned(0));
+  TEST_ASSERT_FALSE(model.learned(1));
+  // 2 mA per ml/min with the margin on top
+  TEST_ASSERT_EQUAL(138, model.estimate(0, 60));
+  TEST_ASSERT_EQUAL(69, model.estimate(0, 30));
+
+  // New measurements move the estimate gradually
+  model.observe(0, 60, 240);
+  const uint32_t moved = model.estimate(0, 60);
+  TEST_ASSERT_TRUE(moved > 138 && moved < 276);
+}
+
+void test_planner_current_budget() {
+  using namespace std::chrono_literals;
+
+  // Four 300 mA doses on two modules, 1000 mA in total, 400 mA per module
+  const std::vector<DoseJob> jobs{
+      {0, 1s, 300}, {0, 1s, 300}, {1, 1s, 300}, {1, 1s, 300}};
+  TEST_ASSERT_TRUE(planDoses(jobs, 4).makespan == 1s);
+  TEST_ASSERT_TRUE(planDoses(jobs, 4, 0, {1000, 0}).makespan == 2s);
+  TEST_ASSERT_TRUE(planDoses(jobs, 4, 0, {0, 400}).makespan == 2s);
+
+  // A dose larger than the budget runs alone instead of never
+  const std::vector<DoseJob> big{{0, 1s, 1500}, {1, 1s, 100}};
+  TEST_ASSERT_TRUE(planDoses(big, 2, 0, {1000, 0}).makespan == 2s);
+}
+
+void test_manager_current_budget() {
+  using namespace std::chrono_literals;
+  status.clear();
+  TestManager man{4, 4};
+  man.setCurrentBudget({2 * CurrentModel::defaultCurrent_mA, 0});
+
+  std::vector<Doser> dosers;
+  for (int i = 0; i < 4; ++i) {
+    dosers.push_back(std::move(*man.lendDoser(i)));
+  }
+
+  // Unknown dosers count the default current, two fit
+  TEST_ASSERT_TRUE(dosers[0].tryOn(60));
+  TEST_ASSERT_TRUE(dosers[1].tryOn(60));
+  TEST_ASSERT_FALSE(dosers[2].tryOn(60));
+  TEST_ASSERT_EQUAL(2 * CurrentModel::defaultCurrent_mA, man.currentDraw());
+
+  // Measured at 100 mA each, they make room for the others
+  man.reportCurrent(std::vector<int>{0, 1}, 200);
+  dosers[0].off();
+  dosers[1].off();
+  TEST_ASSERT_EQUAL(0, man.currentDraw());
+  TEST_ASSERT_TRUE(dosers[2].tryOn(60));
+  TEST_ASSERT_TRUE(dosers[3].tryOn(60));
+  man.reportCurrent(std::vector<int>{2, 3}, 200);
+  dosers[2].off();
+  dosers[3].off();
+
+  // All four doses of 50 ms now run at once instead of two by two
+  std::vector<std::pair<Doser *, float>> group;
+  for (auto &doser : dosers) {
+    group.emplace_back(&doser, 0.05f);
+  }
+  const auto start = Clock::now();
+  auto batch = man.submit(group, 60);
+  TEST_ASSERT_TRUE(batch.timeline().makespan < 60ms);
+  batch.wait();
+  TEST_ASSERT_TRUE(Clock::now() - start < 90ms);
+  TEST_ASSERT_EQUAL(0, man.currentDraw());
+}
+
+// A group takes its slots and current at once, so one that is over the
+// budget waits for the others to stop instead of for its own members
+void test_manager_group_current_budget() {
+  using namespace std::chrono_literals;
+  status.clear();
+  TestManager man{4, 4};
+  man.setCurrentBudget({2 * CurrentModel::defaultCurrent_mA, 0});
+
+  std::vector<Doser> dosers;
+  for (int i = 0; i < 4; ++i) {
+    dosers.push_back(std::move(*man.lendDoser(i)));
+  }
+  std::vector<Doser *> group{&dosers[0], &dosers[1], &dosers[2]};
+
+  dosers[3].on(60);
+  auto started = std::async(std::launch::async, [&] { man.on(group, 30); });
+  TEST_ASSERT_TRUE(started.wait_for(20ms) == std::future_status::timeout);
+  TEST_ASSERT_EQUAL_FLOAT(0, status[0]);
+
+  dosers[3].off();
+  TEST_ASSERT_TRUE(started.wait_for(1s) == std::future_status::ready);
+  started.get();
+  TEST_ASSERT_EQUAL_FLOAT(30, status[0]);
+  TEST_ASSERT_EQUAL_FLOAT(30, status[2]);
+  TEST_ASSERT_EQUAL(3 * CurrentModel::defaultCurrent_mA, man.currentDraw());
+  TEST_ASSERT_FALSE(dosers[3].tryOn(60));
+
+  man.off(group);
+  TEST_ASSERT_EQUAL(0, man.currentDraw());
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef TEST_LEDGER_HPP
+#define TEST_LEDGER_HPP
+
+#include "VirtualClock.hpp"
+#include "VolumeLedger.hpp"
+#include "test_manager.hpp"
+#include "unity.h"
+#include <map>
+#include <memory>
+#include <vector>
+
+// Keeps the slots in memory, shared so a second ledger can load them
+class MemoryLedgerStore : public LedgerStore {
+public:
+  struct Flash {
+    std::map<int, std::vector<uint8_t>> slots;
+    int writes{0};
+  };
+
+  explicit MemoryLedgerStore(std::shared_ptr<Flash> flash) : flash{flash} {}
+
+  std::vector<uint8_t> read(int slot) override { return flash->slots[slot]; }
+
+  void write(int slot, std::span<const uint8_t> data) override {
+    flash->slots[slot].assign(data.begin(), data.end());
+    ++flash->writes;
+  }
+
+private:
+  std::shared_ptr<Flash> flash;
+};
+
+void test_volume_ledger_flush_policy() {
+  using namespace std::chrono_literals;
+  auto flash = std::make_shared<MemoryLedgerStore::Flash>();
+  const auto start = Clock::now();
+  VolumeLedger ledger;
+  ledger.attach(std::make_unique<MemoryLedgerStore>(flash), start);
+
+  // Small doses don't flush before the hour is up
+  ledger.record(0, 1, start + 1min);
+  TEST_ASSERT_FALSE(ledger.flushIfDue(start + 59min));
+  TEST_ASSERT_TRUE(ledger.flushIfDue(start + 61min));
+  TEST_ASSERT_FALSE(ledger.flushIfDue(start + 62min));
+
+  // A large delta flushes early, but not sooner than the spacing allows
+  ledger.record(1, 60, start + 62min);
+  TEST_ASSERT_FALSE(ledger.flushIfDue(start + 70min));
+  TEST_ASSERT_TRUE(ledger.flushIfDue(start + 77min));
+  TEST_ASSERT_EQUAL(2, flash->writes);
+
+  // A dose every second for a day stays within the daily write bound
+  const auto day = start + 24h;
+  for (auto now = day; now < day + 24h; now += 1s) {
+    ledger.record(now.time_since_epoch().count() % 4, 0.5f, now);
+    ledger.flushIfDue(now);
+  }
+  const int writes = flash->writes - 2;
+  const int bound = 24h / VolumeLedger::minFlushSpacing;
+  TEST_ASSERT_TRUE(writes > 0 && writes <= bound);
+}
+
+void test_volume_ledger_restore() {
+  using namespace std::chrono_literals;
+  VirtualClock clock;
+  auto flash = std::make_shared<MemoryLedgerStore::Flash>();
+  const auto start = Clock::now();
+  {
+    VolumeLedger ledger;
+    ledger.attach(std::make_unique<MemoryLedgerStore>(flash), start);
+    ledger.setBottle(2, 100, 20);
+    ledger.record(2, 30, start);
+    ledger.record(2, 10, start + 24h);
+    ledger.record(5, 7, start + 24h);
+    TEST_ASSERT_TRUE(ledger.flush(start + 24h));
+  }
+
+  // Rebooted, the uptime starts over
+  VolumeLedger restored;
+  restored.record(2, 5, start);
+  restored.attach(std::make_unique<MemoryLedgerStore>(flash), start);
+  auto volumes = restored.snapshot(start);
+  TEST_ASSERT_EQUAL_FLOAT(45, volumes[2].total_mL);
+  TEST_ASSERT_EQUAL_FLOAT(15, volumes[2].daily_mL[0]);
+  TEST_ASSERT_EQUAL_FLOAT(30, volumes[2].daily_mL[1]);
+  TEST_ASSERT_EQUAL_FLOAT(55, *restored.remaining(2));
+  TEST_ASSERT_EQUAL_FLOAT(7, volumes[5].total_mL);
+  TEST_ASSERT_FALSE(restored.remaining(5));
+
+  // Days move on with the uptime
+  volumes = restored.snapshot(start + 24h);
+  TEST_ASSERT_EQUAL_FLOAT(0, volumes[2].daily_mL[0]);
+  TEST_ASSERT_EQUAL_FLOAT(15, volumes[2].daily_mL[1]);
+
+  // A torn write leaves the previous slot to load
+  restored.record(2, 1, start + 24h);
+  TEST_ASSERT_TRUE(restored.flush(start + 24h));
+  const int torn = (flash->writes - 1) % VolumeLedger::slots;
+  flash->slots[torn].resize(flash->slots[torn].size() - 3);
+  VolumeLedger fallback;
+  fallback.attach(std::make_unique<MemoryLedgerStore>(flash), start);
+  TEST_ASSERT_EQUAL_FLOAT(40, fallback.snapshot(start)[2].total_mL);
+}
+
+// Without wall time the clock starts over at every boot. The day goes on from
+// where the ledger was when it was written.
+void test_volume_ledger_reboot_across_day() {
+  using namespace std::chrono_literals;
+  auto flash = std::make_shared<MemoryLedgerStore::Flash>();
+  {
+    VirtualClock boot{Clock::time_point{}};
+    VolumeLedger ledger;
+    ledger.attach(std::make_unique<MemoryLedgerStore>(flash));
+    ledger.record(0, 10, Clock::time_point{20h});
+    TEST_ASSERT_TRUE(ledger.flush(Clock::time_point{20h}));
+  }
+
+  VirtualClock reboot{Clock::time_point{}};
+  VolumeLedger ledger;
+  ledger.record(0, 1);
+  ledger.attach(std::make_unique<MemoryLedgerStore>(flash));
+  auto volumes = ledger.snapshot(Clock::time_point{3h});
+  TEST_ASSERT_EQUAL_FLOAT(11, volumes[0].daily_mL[0]);
+
+  // 4 h were left of the day
+  volumes = ledger.snapshot(Clock::time_point{5h});
+  TEST_ASSERT_EQUAL_FLOAT(0, volumes[0].daily_mL[0]);
+  TEST_ASSERT_EQUAL_FLOAT(11, volumes[0].daily_mL[1]);
+  TEST_ASSERT_EQUAL_FLOAT(11, volumes[0].total_mL);
+
+  // And again a day later, past what was written before the reboot
+  TEST_ASSERT_TRUE(ledger.flush(Clock::time_point{29h}));
+  VirtualClock again{Clock::time_point{}};
+  VolumeLedger later;
+  later.attach(std::make_unique<MemoryLedgerStore>(flash));
+  volumes = later.snapshot(Clock::time_point{1h});
+  TEST_ASSERT_EQUAL_FLOAT(0, volumes[0].daily_mL[1]);
+  TEST_ASSERT_EQUAL_FLOAT(11, volumes[0].daily_mL[2]);
+}
+
+void test_volume_ledger_low_stock() {
+  VolumeLedger ledger;
+  ledger.setBottle(0, 100, 20);
+  ledger.record(0, 70);
+  TEST_ASSERT_TRUE(ledger.takeAlerts().empty());
+  ledger.record(0, 15);
+  ledger.record(0, 5);
+  const auto alerts = ledger.takeAlerts();
+  TEST_ASSERT_EQUAL(1, alerts.size());
+  TEST_ASSERT_EQUAL(0, alerts[0].id);
+  TEST_ASSERT_EQUAL_FLOAT(15, alerts[0].remaining_mL);
+  TEST_ASSERT_TRUE(ledger.takeAlerts().empty());
+
+  ledger.refill(0);
+  TEST_ASSERT_EQUAL_FLOAT(100, *ledger.remaining(0));
+}
+
+void test_manager_ledger() {
+  using namespace std::chrono_literals;
+  status.clear();
+  VirtualClock clock;
+  TestManager man{2, 2};
+  auto timed = man.lendDoser(0);
+  auto manual = man.lendDoser(1);
+
+  auto delivered = timed->dose(0.3f, 600);
+  Clock::wait(delivered);
+  manual->on(600);
+  Clock::sleepFor(20ms);
+  manual->off();
+
+  auto volumes = man.ledger().snapshot();
+  TEST_ASSERT_EQUAL_FLOAT(0.3f, volumes[0].total_mL);
+  TEST_ASSERT_EQUAL_FLOAT(0.2f, volumes[1].total_mL);
+}
+
+#endif
@@ -1,4 +1,21 @@
+#include "test_availability.hpp"
+#include "test_bus_stats.hpp"
+#include "test_can_bus.hpp"
+#include "test_can_batch.hpp"
+#include "test_control.hpp"
+#include "test_current.hpp"
+#include "test_ledger.hpp"
 #include "test_manager.hpp"
+#include "test_mpc.hpp"
+#include "test_nutrient.hpp"
+#include "test_ph.hpp"
+#include "test_planner.hpp"
+#include "test_sensor.hpp"
+#include "test_settling.hpp"
+#include "test_slots.hpp"
+#include "test_stop.hpp"
+#include "test_telemetry.hpp"
+#include "test_virtual_clock.hpp"
 #include "unity.h"
 
 void setUp() {}
@@ -10,5 +27,60 @@ int main() {
   RUN_TEST(test_manager_ownership);
   RUN_TEST(test_api);
   RUN_TEST(test_api2);
+  RUN_TEST(test_dose_future);
+  RUN_TEST(test_dose_executor);
+  RUN_TEST(test_doser_bitmap);
+  RUN_TEST(test_manager_full_chain);
+  RUN_TEST(test_manager_lend_concurrent);
+  RUN_TEST(test_planner_longest_first);
+  RUN_TEST(test_planner_module_limit);
+  RUN_TEST(test_planner_executes_plan);
+  RUN_TEST(test_slot_scheduler_classes);
+  RUN_TEST(test_slot_scheduler_limit);
+  RUN_TEST(test_manager_ph_ahead_of_nutrients);
+  RUN_TEST(test_current_model);
+  RUN_TEST(test_planner_current_budget);
+  RUN_TEST(test_manager_current_budget);
+  RUN_TEST(test_manager_group_current_budget);
+  RUN_TEST(test_dose_cancel_token);
+  RUN_TEST(test_dose_deadline);
+  RUN_TEST(test_stop_all);
+  RUN_TEST(test_stop_all_late_release);
+  RUN_TEST(test_control_scheduler);
+  RUN_TEST(test_control_doses);
+  RUN_TEST(test_control_lost_dose);
+  RUN_TEST(test_volume_ledger_flush_policy);
+  RUN_TEST(test_volume_ledger_restore);
+  RUN_TEST(test_volume_ledger_reboot_across_day);
+  RUN_TEST(test_volume_ledger_low_stock);
+  RUN_TEST(test_manager_ledger);
+  RUN_TEST(test_virtual_clock_timers);
+  RUN_TEST(test_virtual_clock_day_of_dosing);
+  RUN_TEST(test_pid_limits);
+  RUN_TEST(test_ph_controller_pid);
+  RUN_TEST(test_nutrient_proportional);
+  RUN_TEST(test_settling_detector);
+  RUN_TEST(test_ph_controller_settling);
+  RUN_TEST(test_sensor_subscription);
+  RUN_TEST(test_controller_waits_for_samples);
+  RUN_TEST(test_settling_on_samples);
+  RUN_TEST(test_mpc_plan);
+  RUN_TEST(test_ph_controller_mpc);
+  RUN_TEST(test_can_batch_frames);
+  RUN_TEST(test_can_batch_bus_occupancy);
+  RUN_TEST(test_can_topology_fingerprint);
+  RUN_TEST(test_can_timed_dose_channels);
+  RUN_TEST(test_telemetry_table);
+  RUN_TEST(test_telemetry_table_concurrent);
+  RUN_TEST(test_bus_stats_buckets);
+  RUN_TEST(test_bus_stats_load);
+  RUN_TEST(test_simulated_bus_arbitration);
+  RUN_TEST(test_can_bus_seq_wrap);
+  RUN_TEST(test_can_bus_transmit_timeout);
+  RUN_TEST(test_can_manager_simulated_chain);
+  RUN_TEST(test_can_manager_uid_collision);
+  RUN_TEST(test_can_manager_simulated_64_modules);
+  RUN_TEST(test_can_bitrate_switch);
+  RUN_TEST(test_can_bitrate_fallback);
   return UNITY_END();
 }
\ No newline at end of file
@@ -3,8 +3,10 @@
 
 #include "Clock.hpp"
 #include "DoserManager.hpp"
+#include "VirtualClock.hpp"
 #include "unity.h"
 #include <deque>
+#include <filesystem>
 #include <future>
 #include <map>
 #include <queue>
@@ -14,14 +16,17 @@ using namespace std::chrono_literals;
 using Status = std::map<int, float>;
 
 Status status;
+std::unique_ptr<DoserManager> gDoserManager;
 
 class TestManager : public DoserManager {
 public:
   TestManager(int nDosers, int parallelMax)
-      : n{nDosers}, DoserManager{parallelMax} {
+      : DoserManager{parallelMax}, n{nDosers} {
     connectDosers();
   }
 
+  ~TestManager() { shutdown(); }
+
 private:
   std::vector<float> implConnectDosers() override {
     return std::vector<float>(n);
@@ -34,10 +39,12 @@ private:
 class TestManager2 : public DoserManager {
 public:
   TestManager2(int nDosers, int parallelMax)
-      : n{nDosers}, DoserManager{parallelMax} {
+      : DoserManager{parallelMax}, n{nDosers} {
     connectDosers();
   }
 
+  ~TestManager2() { shutdown(); }
+
 private:
   std::vector<float> implConnectDosers() override {
     doserInfos.resize(n);
@@ -50,6 +57,7 @@ private:
     if (di.isOn) {
       updateStatus(id, now);
     }
+    di.isOn = true;
     di.flowRate = flowRate;
     di.startedAt = now;
   }
@@ -59,6 +67,7 @@ private:
     if (di.isOn) {
       updateStatus(id, Clock::now());
     }
+    di.isOn = false;
     di.flowRate = 0;
   }
 
@@ -169,8 +178,6 @@ void test_api() {
   constexpr int numParallel = 1;
   TestManager man{numDosers, numParallel};
 
-  auto isRunning = [](const Doser &doser) { return status[doser.getId()]; };
-
   std::vector<Doser> dosers;
   for (int i = 0; i < numDosers; ++i) {
     auto doser = man.lendDoser(i);
@@ -188,10 +195,10 @@ void test_api() {
 void test_api2() {
   status.clear();
   constexpr int n = 8;
-  constexpr int p = 2;
   constexpr float flowrate = 1000;
+  VirtualClock clock;
+  const auto start = Clock::now();
   TestManager2 man{n, 1};
-  man.connectDosers();
 
   std::map<int, float> schedule{{0, 1}, {1, 1}, {2, 1}, {3, 1}};
 
@@ -202,15 +209,111 @@ void test_api2() {
     }
   }
 
-  std::vector<std::thread> jobs;
+  std::vector<std::future<float>> doses;
+  for (auto [id, amount] : schedule) {
+    doses.push_back(dosers[id].dose(amount, flowrate));
+  }
+  for (auto &delivered : doses) {
+    Clock::wait(delivered);
+    TEST_ASSERT_EQUAL_FLOAT(1, delivered.get());
+  }
+
+  // One slot, so the 60 ms doses ran one after the other in virtual time
+  const auto elapsed = Clock::now() - start;
+  TEST_ASSERT_TRUE(elapsed > 239ms && elapsed < 241ms);
   for (auto [id, amount] : schedule) {
-    auto &doser = dosers[id];
-    jobs.emplace_back([amount, &doser]() { dose(doser, amount, flowrate); });
+    TEST_ASSERT_EQUAL_FLOAT(amount, status[id]);
+  }
+}
+
+void test_dose_future() {
+  status.clear();
+  TestManager man{2, 1};
+
+  auto doser = man.lendDoser(0);
+  auto other = man.lendDoser(1);
+  auto delivered = doser->dose(1, 6000);
+  TEST_ASSERT_EQUAL_FLOAT(1, delivered.get());
+  TEST_ASSERT_EQUAL(0, status[0]);
+
+  // The slot of the finished dose is free again
+  TEST_ASSERT_TRUE(other->tryOn(60));
+  other->off();
+
+  std::vector<std::pair<Doser *, float>> group{{&*doser, 1}, {&*other, 2}};
+  const auto volumes = man.dose(group, 6000);
+  TEST_ASSERT_EQUAL(2, volumes.size());
+  TEST_ASSERT_EQUAL_FLOAT(1, volumes[0]);
+  TEST_ASSERT_EQUAL_FLOAT(2, volumes[1]);
+
+  // A dose has to have a duration, nothing is queued without one
+  auto rejected = [](auto dose) {
+    try {
+      dose();
+    } catch (const std::logic_error &) {
+      return true;
+    }
+    return false;
+  };
+  TEST_ASSERT_TRUE(rejected([&] { doser->dose(1, 0); }));
+  TEST_ASSERT_TRUE(rejected([&] { doser->dose(1, -60); }));
+  TEST_ASSERT_TRUE(rejected([&] { doser->doseAsync(NAN, 60); }));
+  TEST_ASSERT_TRUE(rejected([&] { man.dose(group, 0); }));
+  TEST_ASSERT_TRUE(other->tryOn(60));
+}
+
+static int threadCount() {
+#ifdef __linux__
+  const std::filesystem::directory_iterator tasks{"/proc/self/task"};
+  return std::distance(begin(tasks), end(tasks));
+#else
+  return 0;
+#endif
+}
+
+void test_dose_executor() {
+  status.clear();
+  constexpr int n = 32;
+  TestManager man{n, 8};
+  const int threads = threadCount();
+
+  std::vector<Doser> dosers;
+  std::vector<std::pair<Doser *, float>> group;
+  for (int i = 0; i < n; ++i) {
+    dosers.push_back(std::move(*man.lendDoser(i)));
+  }
+  for (auto &doser : dosers) {
+    group.emplace_back(&doser, 0.5f);
   }
 
-  for (auto &job : jobs) {
-    job.join();
+  // 32 doses of 5 ms in 4 rounds of 8, all driven by the executor
+  const auto start = Clock::now();
+  auto batch = man.submit(group, 6000);
+  std::this_thread::sleep_for(2ms);
+  TEST_ASSERT_EQUAL(threads, threadCount());
+  const auto volumes = batch.wait();
+  TEST_ASSERT_TRUE(Clock::now() - start >= 20ms);
+  TEST_ASSERT_EQUAL(n, volumes.size());
+  for (int i = 0; i < n; ++i) {
+    TEST_ASSERT_EQUAL_FLOAT(0.5f, volumes[i]);
+    TEST_ASSERT_EQUAL(0, status[i]);
   }
+  TEST_ASSERT_EQUAL(threads, threadCount());
+
+  // Switching off ends a running dose early and drops a waiting one
+  TestManager single{2, 1};
+  auto first = single.lendDoser(0);
+  auto second = single.lendDoser(1);
+  auto running = first->dose(100, 600);
+  auto waiting = second->dose(1, 600);
+  std::this_thread::sleep_for(20ms);
+  second->off();
+  TEST_ASSERT_EQUAL_FLOAT(0, waiting.get());
+  first->off();
+  const float delivered = running.get();
+  TEST_ASSERT_TRUE(delivered > 0 && delivered < 1);
+  TEST_ASSERT_EQUAL(0, status[0]);
+  TEST_ASSERT_TRUE(second->tryOn(60));
 }
 
-#endif
\ No newline at end of file
+#endif
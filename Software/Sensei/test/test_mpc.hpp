@@ -0,0 +1,70 @@
+#ifndef TEST_MPC_HPP
+#define TEST_MPC_HPP
+
+#include "ControlScheduler.hpp"
+#include "Mpc.hpp"
+#include "PhController.hpp"
+#include "VirtualClock.hpp"
+#include "test_manager.hpp"
+#include "test_settling.hpp"
+#include "unity.h"
+#include <chrono>
+
+void test_mpc_plan() {
+  using namespace std::chrono_literals;
+  Mpc mpc;
+  const Mpc::Model model{.gain = 0.1f, .mixing = 3min};
+
+  // 10 mL close a deficit of 1, as fast as 4 mL a step allow
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 4, mpc.plan(model, 5min, 4, 1, 0));
+  float planned = 0;
+  for (float dose : mpc.doses()) {
+    planned += dose;
+  }
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 10, planned);
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 4, mpc.doses()[1]);
+
+  // What's still mixing in counts
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 4, mpc.plan(model, 5min, 20, 1, 0.6f));
+  TEST_ASSERT_EQUAL_FLOAT(0, mpc.plan(model, 5min, 20, 1, 1));
+  TEST_ASSERT_EQUAL_FLOAT(0, mpc.plan(model, 5min, 20, -0.1f, 0));
+}
+
+// From pH 7 to 6 in one dose, it doesn't dose again while the first mixes
+// in, and the pH doesn't pass 6
+void test_ph_controller_mpc() {
+  using namespace std::chrono_literals;
+  status.clear();
+  VirtualClock clock;
+  gDoserManager = std::make_unique<TestManager2>(2, 1);
+  {
+    MixingPhSensor sensor;
+    PhController controller{sensor};
+    ControlScheduler scheduler;
+    scheduler.spawn(controller.run());
+    clock.runFor(1s);
+    controller.start({.target = 6,
+                      .acceptedError = 0.05f,
+                      .flowRate = 60,
+                      .adjustInterval = 1min,
+                      .pHDownDoser = 0,
+                      .mode = PhController::Mode::Mpc,
+                      .maxDose = 20,
+                      .volume = 100,
+                      .mixing = 1min,
+                      .downStrength = 10});
+
+    float lowest = 7;
+    for (int i = 0; i < 6 * 30; ++i) {
+      clock.runFor(10s);
+      lowest = std::min(lowest, sensor.reading());
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 10, status[0]);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 6, sensor.reading());
+    TEST_ASSERT_TRUE(lowest > 5.99f);
+    controller.stop();
+  }
+  gDoserManager.reset();
+}
+
+#endif
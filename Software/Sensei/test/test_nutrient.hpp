@@ -0,0 +1,80 @@
+#ifndef TEST_NUTRIENT_HPP
+#define TEST_NUTRIENT_HPP
+
+#include "ControlScheduler.hpp"
+#include "NutrientController.hpp"
+#include "VirtualClock.hpp"
+#include "test_manager.hpp"
+#include "unity.h"
+#include <chrono>
+#include <map>
+
+// EC rises by 0.02 per mL of doser 0 and 0.03 per mL of doser 1
+class EcSensor : public Sensor {
+public:
+  float reading() const override {
+    ++readings;
+    return 1 + 0.02f * status[0] + 0.03f * status[1];
+  }
+
+  mutable int readings{0};
+};
+
+struct NutrientRun {
+  int cycles;  // Adjustments until EC reached the accepted error
+  float ec;    // At the end
+  float dosed; // mL of both dosers
+  std::map<int, float> gains;
+};
+
+static NutrientRun runNutrients(NutrientController::Mode mode) {
+  using namespace std::chrono_literals;
+  status.clear();
+  VirtualClock clock;
+  gDoserManager = std::make_unique<TestManager2>(2, 2);
+  NutrientRun run{};
+  {
+    EcSensor sensor;
+    NutrientController controller{sensor};
+    ControlScheduler scheduler;
+    scheduler.spawn(controller.run());
+    clock.runFor(1s);
+    controller.start({.target = 1.48f,
+                      .acceptedError = 0.01f,
+                      .flowRate = 60,
+                      .adjustInterval = 10min,
+                      .schedule = {{0, 1}, {1, 1}},
+                      .mode = mode});
+    while (sensor.reading() < 1.47f && run.cycles < 50) {
+      --sensor.readings;
+      clock.runFor(10min);
+      run.cycles = sensor.readings;
+    }
+    clock.runFor(2h);
+    run.ec = sensor.reading();
+    run.dosed = status[0] + status[1];
+    run.gains = controller.gains();
+    controller.stop();
+  }
+  gDoserManager.reset();
+  return run;
+}
+
+void test_nutrient_proportional() {
+  const auto shots = runNutrients(NutrientController::Mode::Schedule);
+  const auto scaled = runNutrients(NutrientController::Mode::Proportional);
+
+  // Full shots climb 0.05 a cycle and overshoot the band
+  TEST_ASSERT_EQUAL(10, shots.cycles);
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 1.5f, shots.ec);
+
+  // The first shot teaches the gain of the mix, then doses scale to the
+  // deficit
+  TEST_ASSERT_TRUE(scaled.cycles <= 4);
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 1.48f, scaled.ec);
+  TEST_ASSERT_TRUE(scaled.dosed < shots.dosed);
+  TEST_ASSERT_FLOAT_WITHIN(0.005f, 0.05f,
+                           scaled.gains.at(0) + scaled.gains.at(1));
+}
+
+#endif
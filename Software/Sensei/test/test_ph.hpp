@@ -0,0 +1,71 @@
+#ifndef TEST_PH_HPP
+#define TEST_PH_HPP
+
+#include "ControlScheduler.hpp"
+#include "PhController.hpp"
+#include "Pid.h"
+#include "VirtualClock.hpp"
+#include "test_manager.hpp"
+#include "unity.h"
+#include <chrono>
+
+void test_pid_limits() {
+  using namespace std::chrono_literals;
+  Pid pid{1, 1, 0};
+  pid.outputMin = -2;
+  pid.outputMax = 2;
+  for (int i = 0; i < 100; ++i) {
+    TEST_ASSERT_EQUAL_FLOAT(2, pid.update(10, 1s));
+  }
+  // The integral didn't wind up while saturated, the output turns at once
+  TEST_ASSERT_TRUE(pid.update(-1, 1s) < 0);
+
+  // No kick on the first update, the derivative then rises with the filter
+  Pid derivative{0, 0, 1};
+  derivative.derivativeFilter = 9s;
+  TEST_ASSERT_EQUAL_FLOAT(0, derivative.update(5, 1s));
+  TEST_ASSERT_EQUAL_FLOAT(0.1f, derivative.update(6, 1s));
+  TEST_ASSERT_EQUAL_FLOAT(0.19f, derivative.update(7, 1s));
+}
+
+// pH falls by 0.1 with every mL of pH down
+class PhSensor : public Sensor {
+public:
+  float reading() const override { return 7 - 0.1f * status[0]; }
+};
+
+void test_ph_controller_pid() {
+  using namespace std::chrono_literals;
+  status.clear();
+  VirtualClock clock;
+  gDoserManager = std::make_unique<TestManager2>(2, 1);
+  {
+    PhSensor sensor;
+    PhController controller{sensor};
+    ControlScheduler scheduler;
+    scheduler.spawn(controller.run());
+    clock.runFor(1s); // The loop waits for a start
+    PhController::Config config{.target = 6,
+                                .acceptedError = 0.05f,
+                                .flowRate = 60,
+                                .adjustInterval = 5min,
+                                .pHDownDoser = 0,
+                                .mode = PhController::Mode::Pid,
+                                .kp = 5,
+                                .maxDose = 4};
+    controller.start(config);
+
+    // 5 mL for the error of 1, clamped to the largest dose, then 3 mL
+    clock.runFor(1min);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 4, status[0]);
+    clock.runFor(5min);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 7, status[0]);
+    clock.runFor(1h);
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 6, sensor.reading());
+    TEST_ASSERT_EQUAL_FLOAT(0, status[1]);
+    controller.stop();
+  }
+  gDoserManager.reset();
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef TEST_PLANNER_HPP
+#define TEST_PLANNER_HPP
+
+#include "DosePlanner.hpp"
+#include "test_manager.hpp"
+#include "unity.h"
+#include <numeric>
+#include <vector>
+
+void test_planner_longest_first() {
+  using namespace std::chrono_literals;
+
+  // Five short doses queued before a long one, two at a time
+  const std::vector<DoseJob> jobs{
+      {0, 2s}, {1, 2s}, {2, 2s}, {3, 2s}, {4, 30s}};
+  std::vector<size_t> fifo(jobs.size());
+  std::iota(fifo.begin(), fifo.end(), 0);
+
+  const DosePlan queued = scheduleInOrder(jobs, fifo, 2);
+  TEST_ASSERT_TRUE(queued.makespan == 34s);
+
+  const DosePlan planned = planDoses(jobs, 2);
+  TEST_ASSERT_TRUE(planned.makespan == 30s);
+  TEST_ASSERT_EQUAL(jobs.size(), planned.doses.size());
+  TEST_ASSERT_EQUAL(4, planned.doses.front().job);
+  for (const PlannedDose &dose : planned.doses) {
+    TEST_ASSERT_TRUE(dose.end - dose.start == jobs[dose.job].duration);
+    TEST_ASSERT_TRUE(dose.slot == 0 || dose.slot == 1);
+  }
+}
+
+void test_planner_module_limit() {
+  using namespace std::chrono_literals;
+
+  const std::vector<DoseJob> jobs{{0, 1s}, {0, 1s}, {0, 1s}, {1, 1s}};
+  const DosePlan plan = planDoses(jobs, 4, 1);
+  TEST_ASSERT_TRUE(plan.makespan == 3s);
+
+  for (const PlannedDose &a : plan.doses) {
+    for (const PlannedDose &b : plan.doses) {
+      if (&a != &b && jobs[a.job].module == jobs[b.job].module) {
+        TEST_ASSERT_TRUE(a.end <= b.start || b.end <= a.start);
+      }
+    }
+  }
+}
+
+void test_planner_executes_plan() {
+  using namespace std::chrono_literals;
+  status.clear();
+  TestManager man{3, 2};
+
+  auto a = man.lendDoser(0);
+  auto b = man.lendDoser(1);
+  auto c = man.lendDoser(2);
+
+  // 20, 20 and 100 ms, queued in this order they would take 120 ms
+  std::vector<std::pair<Doser *, float>> group{
+      {&*a, 0.2f}, {&*b, 0.2f}, {&*c, 1.0f}};
+  const auto start = Clock::now();
+  auto batch = man.submit(group, 600);
+  const auto volumes = batch.wait();
+  const auto elapsed = Clock::now() - start;
+
+  const auto planned = batch.timeline().makespan;
+  TEST_ASSERT_TRUE(planned > 99ms && planned < 101ms);
+  TEST_ASSERT_TRUE(elapsed < 115ms);
+  TEST_ASSERT_EQUAL_FLOAT(0.2f, volumes[0]);
+  TEST_ASSERT_EQUAL_FLOAT(0.2f, volumes[1]);
+  TEST_ASSERT_EQUAL_FLOAT(1.0f, volumes[2]);
+}
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef TEST_SENSOR_HPP
+#define TEST_SENSOR_HPP
+
+#include "ControlScheduler.hpp"
+#include "PhController.hpp"
+#include "Sensor.hpp"
+#include "VirtualClock.hpp"
+#include "test_manager.hpp"
+#include "test_settling.hpp"
+#include "unity.h"
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+// Publishes the samples the test takes, counts the reads
+class PublishingSensor : public Sensor {
+public:
+  void sample(float value) {
+    latest = value;
+    ++samples;
+    published();
+  }
+
+  float reading() const override {
+    ++reads;
+    return latest;
+  }
+
+  mutable int reads{0};
+  int samples{0};
+
+private:
+  std::atomic<float> latest{0};
+};
+
+void test_sensor_subscription() {
+  PublishingSensor sensor;
+  TEST_ASSERT_EQUAL(0, sensor.sequence());
+
+  std::vector<uint64_t> heard;
+  {
+    auto subscription =
+        sensor.subscribe([&](uint64_t sequence) { heard.push_back(sequence); });
+    sensor.sample(1);
+    sensor.sample(2);
+  }
+  sensor.sample(3);
+
+  TEST_ASSERT_EQUAL(2, heard.size());
+  TEST_ASSERT_EQUAL(1, heard[0]);
+  TEST_ASSERT_EQUAL(2, heard[1]);
+  TEST_ASSERT_EQUAL(3, sensor.sequence());
+  TEST_ASSERT_EQUAL_FLOAT(3, sensor.reading());
+}
+
+void test_controller_waits_for_samples() {
+  using namespace std::chrono_literals;
+  status.clear();
+  VirtualClock clock;
+  gDoserManager = std::make_unique<TestManager2>(2, 1);
+  {
+    PublishingSensor sensor;
+    sensor.sample(7);
+    PhController controller{sensor};
+    ControlScheduler scheduler;
+    scheduler.spawn(controller.run());
+    clock.runFor(1s);
+    controller.start({.target = 6,
+                      .acceptedError = 0.05f,
+                      .flowRate = 60,
+                      .doseAmount = 1,
+                      .adjustInterval = 5min,
+                      .pHDownDoser = 0});
+
+    // The first sample is acted on once, the interval passes without another
+    clock.runFor(20min);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 1, status[0]);
+    TEST_ASSERT_EQUAL(1, sensor.reads);
+
+    // A new one is acted on as it arrives
+    sensor.sample(6.9f);
+    clock.runFor(1min);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 2, status[0]);
+
+    // Samples within the interval are acted on once, at its end
+    sensor.sample(6.8f);
+    sensor.sample(6.8f);
+    clock.runFor(20min);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 3, status[0]);
+    TEST_ASSERT_EQUAL(3, sensor.reads);
+    controller.stop();
+  }
+  gDoserManager.reset();
+}
+
+// Settles on samples taken every 250 ms as in the firmware, reading only one
+// every sample period
+void test_settling_on_samples() {
+  using namespace std::chrono_literals;
+  status.clear();
+  VirtualClock clock;
+  gDoserManager = std::make_unique<TestManager2>(2, 1);
+  {
+    MixingPhSensor mixing;
+    PublishingSensor sensor;
+    PhController controller{sensor};
+    ControlScheduler scheduler;
+    auto sampler = [&]() -> ControlTask {
+      for (;;) {
+        sensor.sample(mixing.reading());
+        co_await sleepFor(250ms);
+      }
+    };
+    scheduler.spawn(sampler());
+    scheduler.spawn(controller.run());
+    clock.runFor(1s);
+    controller.start({.target = 6,
+                      .acceptedError = 0.05f,
+                      .flowRate = 60,
+                      .doseAmount = 2,
+                      .adjustInterval = 30min,
+                      .pHDownDoser = 0,
+                      .settling = SettlingDetector::Config{
+                          .window = 2min,
+                          .samplePeriod = 10s,
+                          .maxSlope = 0.01f,
+                          .maxDeviation = 0.01f}});
+    clock.runFor(40min);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 10, status[0]);
+    TEST_ASSERT_TRUE(sensor.reads * 20 < sensor.samples);
+    controller.stop();
+  }
+  gDoserManager.reset();
+}
+
+#endif
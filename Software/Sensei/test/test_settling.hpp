@@ -0,0 +1,112 @@
+#ifndef TEST_SETTLING_HPP
+#define TEST_SETTLING_HPP
+
+#include "ControlScheduler.hpp"
+#include "PhController.hpp"
+#include "SettlingDetector.hpp"
+#include "VirtualClock.hpp"
+#include "test_manager.hpp"
+#include "unity.h"
+#include <chrono>
+#include <cmath>
+
+void test_settling_detector() {
+  using namespace std::chrono_literals;
+  using Minutes = std::chrono::duration<float, std::chrono::minutes::period>;
+  const SettlingDetector::Config config{.window = 2min,
+                                        .samplePeriod = 10s,
+                                        .maxSlope = 0.01f,
+                                        .maxDeviation = 0.005f};
+  const Clock::time_point start{};
+
+  // A dose mixing in with a time constant of 3 minutes flattens below
+  // 0.01 a minute after 10.5 minutes, the window lags it by about a minute
+  SettlingDetector mixing{config};
+  Clock::duration settledAfter{};
+  for (auto t = 0s; t < 30min; t += 10s) {
+    if (mixing.add(1 - std::exp(-Minutes(t).count() / 3), start + t)) {
+      settledAfter = t;
+      break;
+    }
+  }
+  TEST_ASSERT_TRUE(settledAfter >= 10min && settledAfter <= 13min);
+
+  // Noise and drift don't settle
+  SettlingDetector noisy{config};
+  SettlingDetector drifting{config};
+  for (auto t = 0s; t < 30min; t += 10s) {
+    const float noise = (t / 10s) % 2 ? 0.02f : -0.02f;
+    TEST_ASSERT_FALSE(noisy.add(1 + noise, start + t));
+    TEST_ASSERT_FALSE(drifting.add(0.02f * Minutes(t).count(), start + t));
+  }
+
+  // Nor do too few readings
+  SettlingDetector flat{config};
+  TEST_ASSERT_FALSE(flat.add(1, start));
+  TEST_ASSERT_FALSE(flat.add(1, start + 1min));
+  TEST_ASSERT_TRUE(flat.add(1, start + 2min));
+}
+
+// pH down mixes in with a time constant of a minute, every mL lowers the pH
+// by 0.1
+class MixingPhSensor : public Sensor {
+public:
+  float reading() const override {
+    using Minutes = std::chrono::duration<float, std::chrono::minutes::period>;
+    const auto now = Clock::now();
+    mixed += (status[0] - mixed) * (1 - std::exp(-Minutes(now - at).count()));
+    at = now;
+    return 7 - 0.1f * mixed;
+  }
+
+private:
+  mutable float mixed{0};
+  mutable Clock::time_point at{Clock::now()};
+};
+
+// mL of pH down dosed in 40 minutes from pH 7 to 6, 2 mL at a time
+static float settlingDosed(std::optional<SettlingDetector::Config> settling) {
+  using namespace std::chrono_literals;
+  status.clear();
+  VirtualClock clock;
+  gDoserManager = std::make_unique<TestManager2>(2, 1);
+  float dosed = 0;
+  {
+    MixingPhSensor sensor;
+    PhController controller{sensor};
+    ControlScheduler scheduler;
+    scheduler.spawn(controller.run());
+    clock.runFor(1s);
+    controller.start({.target = 6,
+                      .acceptedError = 0.05f,
+                      .flowRate = 60,
+                      .doseAmount = 2,
+                      .adjustInterval = 30min,
+                      .pHDownDoser = 0,
+                      .settling = settling});
+    clock.runFor(40min);
+    dosed = status[0];
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 7 - 0.1f * dosed, sensor.reading());
+    controller.stop();
+  }
+  gDoserManager.reset();
+  return dosed;
+}
+
+void test_ph_controller_settling() {
+  using namespace std::chrono_literals;
+
+  // Every 30 minutes without settling, the second dose is due at 30
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 4, settlingDosed(std::nullopt));
+
+  // Each dose settles in about 5 minutes, the pH reaches 6 in 5 doses and
+  // then holds
+  const float dosed =
+      settlingDosed(SettlingDetector::Config{.window = 2min,
+                                             .samplePeriod = 10s,
+                                             .maxSlope = 0.01f,
+                                             .maxDeviation = 0.01f});
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 10, dosed);
+}
+
+#endif
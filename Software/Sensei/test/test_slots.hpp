@@ -0,0 +1,93 @@
+#ifndef TEST_SLOTS_HPP
+#define TEST_SLOTS_HPP
+
+#include "SlotScheduler.hpp"
+#include "test_manager.hpp"
+#include "unity.h"
+#include <thread>
+#include <vector>
+
+void test_slot_scheduler_classes() {
+  using namespace std::chrono_literals;
+  auto any = [](SlotScheduler::Ticket) { return true; };
+
+  SlotScheduler slots{1};
+  TEST_ASSERT_TRUE(slots.tryAcquire(SlotClass::Nutrient));
+  const auto nutrient = slots.enqueue(SlotClass::Nutrient);
+  const auto manual = slots.enqueue(SlotClass::Manual);
+  const auto ph = slots.enqueue(SlotClass::Ph);
+  TEST_ASSERT_FALSE(slots.next(any));
+
+  // The pH waiter came last but goes first, a free slot isn't up for grabs
+  // while someone waits ahead
+  slots.release(SlotClass::Nutrient);
+  TEST_ASSERT_FALSE(slots.tryAcquire(SlotClass::Manual));
+  TEST_ASSERT_TRUE(slots.next(any) == ph);
+  slots.release(SlotClass::Ph);
+  TEST_ASSERT_TRUE(slots.next(any) == nutrient);
+  slots.release(SlotClass::Nutrient);
+  TEST_ASSERT_TRUE(slots.remove(manual));
+  TEST_ASSERT_FALSE(slots.remove(manual));
+
+  // Waiting ages a manual request past a fresh pH one
+  slots.setAgingStep(10ms);
+  TEST_ASSERT_TRUE(slots.tryAcquire(SlotClass::Ph));
+  const auto aged = slots.enqueue(SlotClass::Manual);
+  std::this_thread::sleep_for(25ms);
+  slots.enqueue(SlotClass::Ph);
+  slots.release(SlotClass::Ph);
+  TEST_ASSERT_TRUE(slots.next(any) == aged);
+
+  const auto &stats = slots.waitStats();
+  TEST_ASSERT_EQUAL(2, stats[size_t(SlotClass::Ph)].grants);
+  TEST_ASSERT_EQUAL(1, stats[size_t(SlotClass::Manual)].grants);
+  TEST_ASSERT_TRUE(stats[size_t(SlotClass::Manual)].max >= 25ms);
+}
+
+void test_slot_scheduler_limit() {
+  SlotScheduler slots{3};
+  slots.setLimit(SlotClass::Nutrient, 2);
+  TEST_ASSERT_TRUE(slots.tryAcquire(SlotClass::Nutrient));
+  TEST_ASSERT_TRUE(slots.tryAcquire(SlotClass::Nutrient));
+  TEST_ASSERT_FALSE(slots.tryAcquire(SlotClass::Nutrient));
+
+  // A waiter held back by its limit doesn't block the classes below it
+  slots.enqueue(SlotClass::Nutrient);
+  TEST_ASSERT_TRUE(slots.tryAcquire(SlotClass::Manual));
+}
+
+void test_manager_ph_ahead_of_nutrients() {
+  using namespace std::chrono_literals;
+  status.clear();
+  TestManager man{4, 1};
+
+  // Three nutrient doses of 30 ms saturate the only slot
+  std::vector<Doser> nutrients;
+  std::vector<std::pair<Doser *, float>> group;
+  for (int i = 0; i < 3; ++i) {
+    nutrients.push_back(std::move(*man.lendDoser(i, SlotClass::Nutrient)));
+  }
+  for (auto &doser : nutrients) {
+    group.emplace_back(&doser, 0.05f);
+  }
+  auto ph = man.lendDoser(3, SlotClass::Ph);
+
+  const auto start = Clock::now();
+  auto batch = man.submit(group, 100);
+  std::this_thread::sleep_for(5ms);
+  ph->dose(0.01f, 100).get();
+  const auto phDone = Clock::now() - start;
+  batch.wait();
+  const auto allDone = Clock::now() - start;
+
+  // pH waits for the running dose only
+  TEST_ASSERT_TRUE(phDone < 50ms);
+  TEST_ASSERT_TRUE(allDone >= 96ms);
+
+  const auto waits = man.slotWaitStats();
+  TEST_ASSERT_EQUAL(1, waits[size_t(SlotClass::Ph)].grants);
+  TEST_ASSERT_EQUAL(3, waits[size_t(SlotClass::Nutrient)].grants);
+  TEST_ASSERT_TRUE(waits[size_t(SlotClass::Ph)].max < 40ms);
+}
+
+#endif
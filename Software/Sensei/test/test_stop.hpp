@@ -0,0 +1,136 @@
+#ifndef TEST_STOP_HPP
+#define TEST_STOP_HPP
+
+#include "VirtualClock.hpp"
+#include "test_manager.hpp"
+#include "unity.h"
+#include <stop_token>
+#include <thread>
+#include <vector>
+
+void test_dose_cancel_token() {
+  using namespace std::chrono_literals;
+  status.clear();
+  TestManager man{2, 1};
+  auto running = man.lendDoser(0);
+  auto waiting = man.lendDoser(1);
+
+  // 1 s doses, the second one waits for the slot of the first
+  std::stop_source source;
+  auto first = running->dose(10, 600, {source.get_token()});
+  auto second = waiting->dose(10, 600, {source.get_token()});
+  std::this_thread::sleep_for(20ms);
+  TEST_ASSERT_EQUAL(600, status[0]);
+
+  const auto stoppedAt = Clock::now();
+  source.request_stop();
+  const float delivered = first.get();
+  TEST_ASSERT_TRUE(Clock::now() - stoppedAt < 10ms);
+  TEST_ASSERT_TRUE(delivered > 0 && delivered < 1);
+  TEST_ASSERT_EQUAL_FLOAT(0, second.get());
+  TEST_ASSERT_EQUAL(0, status[0]);
+  TEST_ASSERT_EQUAL(0, status[1]);
+
+  // A token stopped before the dose never starts it
+  auto late = running->dose(10, 600, {source.get_token()});
+  TEST_ASSERT_EQUAL_FLOAT(0, late.get());
+
+  // The slot is free again
+  TEST_ASSERT_TRUE(waiting->tryOn(60));
+}
+
+void test_dose_deadline() {
+  using namespace std::chrono_literals;
+  status.clear();
+  TestManager man{1, 1};
+  auto doser = man.lendDoser(0);
+
+  const auto start = Clock::now();
+  auto delivered = doser->dose(10, 600, {{}, start + 30ms});
+  const float volume = delivered.get();
+  const auto took = Clock::now() - start;
+  TEST_ASSERT_TRUE(took >= 30ms && took < 60ms);
+  TEST_ASSERT_TRUE(volume > 0.25f && volume < 0.6f);
+  TEST_ASSERT_EQUAL(0, status[0]);
+
+  // The deadline of an ended dose doesn't touch the next one
+  auto quick = doser->dose(0.1f, 600, {{}, Clock::now() + 20ms});
+  TEST_ASSERT_EQUAL_FLOAT(0.1f, quick.get());
+  auto next = doser->dose(0.3f, 600);
+  TEST_ASSERT_EQUAL_FLOAT(0.3f, next.get());
+}
+
+void test_stop_all() {
+  using namespace std::chrono_literals;
+  status.clear();
+  TestManager man{4, 2};
+  std::vector<Doser> dosers;
+  for (int i = 0; i < 4; ++i) {
+    dosers.push_back(std::move(*man.lendDoser(i)));
+  }
+
+  // Two long doses run, one waits and one doser was turned on by hand
+  auto a = dosers[0].dose(10, 600);
+  auto b = dosers[1].dose(10, 600);
+  std::this_thread::sleep_for(10ms);
+  auto c = dosers[2].dose(10, 600);
+  std::this_thread::sleep_for(20ms);
+
+  const auto start = Clock::now();
+  const auto stopped = man.stopAll(100ms);
+  TEST_ASSERT_TRUE(Clock::now() - start < 20ms);
+  TEST_ASSERT_EQUAL(0, status[0]);
+  TEST_ASSERT_EQUAL(0, status[1]);
+  TEST_ASSERT_EQUAL(0, status[2]);
+
+  TEST_ASSERT_EQUAL(3, stopped.size());
+  for (const auto &[id, delivered] : stopped) {
+    if (id == 2) {
+      TEST_ASSERT_EQUAL_FLOAT(0, delivered);
+    } else {
+      TEST_ASSERT_TRUE(delivered > 0.2f && delivered < 1);
+    }
+  }
+  TEST_ASSERT_EQUAL_FLOAT(0, c.get());
+  TEST_ASSERT_TRUE(a.get() > 0);
+  TEST_ASSERT_TRUE(b.get() > 0);
+
+  TEST_ASSERT_TRUE(dosers[3].tryOn(60));
+  std::this_thread::sleep_for(30ms);
+  const auto manual = man.stopAll(100ms);
+  TEST_ASSERT_EQUAL(1, manual.size());
+  TEST_ASSERT_EQUAL(3, manual[0].id);
+  TEST_ASSERT_TRUE(manual[0].delivered_mL > 0.02f);
+  TEST_ASSERT_EQUAL(0, status[3]);
+}
+
+// A doser on by hand that stopAll() switched off books what it pumped until
+// then, not the time until its owner turns it off
+void test_stop_all_late_release() {
+  using namespace std::chrono_literals;
+  status.clear();
+  VirtualClock clock;
+  TestManager man{2, 2};
+  auto doser = man.lendDoser(0);
+
+  doser->on(600);
+  Clock::sleepFor(60ms);
+  const auto stopped = man.stopAll(100ms);
+  TEST_ASSERT_EQUAL(1, stopped.size());
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 0.6f, stopped[0].delivered_mL);
+  Clock::sleepFor(1s);
+  doser->off();
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 0.6f, man.ledger().snapshot()[0].total_mL);
+
+  // Turned on again while it still holds the slot, the new run counts
+  doser->on(600);
+  Clock::sleepFor(60ms);
+  man.stopAll(100ms);
+  Clock::sleepFor(20ms);
+  doser->on(600);
+  Clock::sleepFor(20ms);
+  doser->off();
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 1.4f, man.ledger().snapshot()[0].total_mL);
+}
+
+#endif
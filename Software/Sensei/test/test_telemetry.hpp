@@ -0,0 +1,52 @@
+#ifndef TEST_TELEMETRY_HPP
+#define TEST_TELEMETRY_HPP
+
+#include "TelemetryTable.hpp"
+#include "unity.h"
+#include <atomic>
+#include <thread>
+
+void test_telemetry_table() {
+  TelemetryTable table{4};
+  TEST_ASSERT_FALSE(table.load(2).valid);
+
+  table.store(2, {true, true, false, false, true, 350, 1200});
+  const DoserTelemetry telemetry = table.load(2);
+  TEST_ASSERT_TRUE(telemetry.valid);
+  TEST_ASSERT_TRUE(telemetry.running);
+  TEST_ASSERT_FALSE(telemetry.fault);
+  TEST_ASSERT_TRUE(telemetry.dosing);
+  TEST_ASSERT_EQUAL(350, telemetry.current_mA);
+  TEST_ASSERT_EQUAL(1200, telemetry.runtime_s);
+
+  // Out of range ids are ignored
+  table.store(4, telemetry);
+  TEST_ASSERT_FALSE(table.load(4).valid);
+}
+
+// Readers never see the current of one store with the run time of another
+void test_telemetry_table_concurrent() {
+  TelemetryTable table{1};
+  std::atomic<bool> done{false};
+  std::atomic<int> torn{0};
+
+  std::thread reader([&] {
+    while (!done) {
+      const DoserTelemetry telemetry = table.load(0);
+      if (telemetry.current_mA != (telemetry.runtime_s & 0xFFFF)) {
+        ++torn;
+      }
+    }
+  });
+
+  for (uint32_t i = 0; i < 200'000; ++i) {
+    table.store(0, {true, true, false, false, false,
+                    static_cast<uint16_t>(i & 0xFFFF), i});
+  }
+  done = true;
+  reader.join();
+
+  TEST_ASSERT_EQUAL(0, torn.load());
+}
+
+#endif
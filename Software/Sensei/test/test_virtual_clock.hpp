@@ -0,0 +1,117 @@
+#ifndef TEST_VIRTUAL_CLOCK_HPP
+#define TEST_VIRTUAL_CLOCK_HPP
+
+#include "ControlScheduler.hpp"
+#include "DeltaTimer.hpp"
+#include "NutrientController.hpp"
+#include "VirtualClock.hpp"
+#include "test_manager.hpp"
+#include "unity.h"
+#include <chrono>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+void test_virtual_clock_timers() {
+  using namespace std::chrono_literals;
+  const auto wallStart = std::chrono::steady_clock::now();
+  VirtualClock clock;
+  const auto start = Clock::now();
+  DeltaTimer timer;
+
+  ControlScheduler scheduler;
+  std::vector<std::pair<int, Clock::duration>> log;
+  auto loop = [&](int task, Clock::duration interval) -> ControlTask {
+    for (;;) {
+      co_await sleepFor(interval);
+      log.emplace_back(task, Clock::now() - start);
+    }
+  };
+  scheduler.spawn(loop(1, 10min));
+  scheduler.spawn(loop(2, 25min));
+
+  // Time stands still until someone waits on it
+  TEST_ASSERT_TRUE(Clock::now() == start);
+  clock.runFor(24h);
+  TEST_ASSERT_TRUE(Clock::now() - start == 24h);
+  TEST_ASSERT_TRUE(timer.dt() == 24h);
+
+  TEST_ASSERT_EQUAL(144 + 57, log.size());
+  TEST_ASSERT_EQUAL(1, log[0].first);
+  TEST_ASSERT_TRUE(log[0].second == 10min);
+  TEST_ASSERT_EQUAL(2, log[2].first);
+  TEST_ASSERT_TRUE(log[2].second == 25min);
+  TEST_ASSERT_TRUE(std::chrono::steady_clock::now() - wallStart < 1s);
+}
+
+// A tank whose EC rises with the nutrients dosed into it and falls as the
+// plants take them up
+class Tank : public Sensor {
+public:
+  static constexpr float uptake_per_h = 0.02f;
+  static constexpr float ec_per_mL = 0.05f;
+
+  explicit Tank(Clock::time_point start) : start{start} {}
+
+  float reading() const override {
+    using Hours = std::chrono::duration<float, std::chrono::hours::period>;
+    const float ec = 1 + ec_per_mL * (status[0] + status[1]) -
+                     uptake_per_h * Hours(Clock::now() - start).count();
+    readings.emplace_back(Clock::now() - start, ec);
+    return ec;
+  }
+
+  mutable std::vector<std::pair<Clock::duration, float>> readings;
+
+private:
+  Clock::time_point start;
+};
+
+// A day of nutrient dosing every 10 minutes, readings of the tank in order
+static std::vector<std::pair<Clock::duration, float>> simulateDay() {
+  using namespace std::chrono_literals;
+  status.clear();
+  VirtualClock clock{Clock::time_point{} + 24h * 20000};
+  Tank tank{Clock::now()};
+  gDoserManager = std::make_unique<TestManager2>(2, 2);
+  {
+    NutrientController controller{tank};
+    ControlScheduler scheduler;
+    scheduler.spawn(controller.run());
+    controller.start({.target = 1.2f,
+                      .acceptedError = 0.05f,
+                      .flowRate = 60,
+                      .adjustInterval = 10min,
+                      .schedule = {{0, 1}, {1, 1}},
+                      .mode = NutrientController::Mode::Schedule});
+    clock.runFor(24h);
+    controller.stop();
+  }
+  gDoserManager.reset();
+  return tank.readings;
+}
+
+void test_virtual_clock_day_of_dosing() {
+  using namespace std::chrono_literals;
+  const auto wallStart = std::chrono::steady_clock::now();
+  const auto readings = simulateDay();
+  const auto wall = std::chrono::steady_clock::now() - wallStart;
+
+  // A reading every adjust interval, each dose of 1 mL takes a second
+  TEST_ASSERT_EQUAL(24 * 6 + 1, readings.size());
+  TEST_ASSERT_TRUE(readings.back().first > 23h);
+  const float doses = (status[0] + status[1]) / 2;
+  TEST_ASSERT_TRUE(doses >= 6 && doses <= 9);
+  for (size_t i = 4; i < readings.size(); ++i) {
+    TEST_ASSERT_TRUE(readings[i].second > 1.1f);
+  }
+  TEST_ASSERT_TRUE(wall < 1s);
+  std::printf("simulated day: %d doses, %zu readings in %.1f ms\n",
+              static_cast<int>(doses), readings.size(),
+              std::chrono::duration<double, std::milli>(wall).count());
+
+  // Same readings at the same virtual times every run
+  TEST_ASSERT_TRUE(simulateDay() == readings);
+}
+
+#endif
@@ -43,12 +43,17 @@ function Slider2({name, unit, value, onChange, min, max, step="1"}) {
   );
 }
 
-function Doser({index, maxFlowRate}) {
+function Doser({index, maxFlowRate, telemetry}) {
   const [flowRate, setFlowRate] = useState(60)
 
   return (
     <div>
       <h2>Doser {index}</h2>
+      {telemetry.current !== undefined && (
+        <p>
+          {telemetry.fault ? "Fault" : telemetry.running ? "Running" : "Stopped"}, {telemetry.current} mA, {telemetry.runtime} s run time
+        </p>
+      )}
       <div className="row">
         <Slider name="flow-rate" unit="mL/min" value={flowRate} onChange={setFlowRate} min={0} max={maxFlowRate}></Slider>
       </div>
@@ -358,7 +363,7 @@ function App() {
             {status.dosers.map((doser, index) => (
 
               <div key={index}>
-              <Doser index={index} maxFlowRate={doser.maxFlowRate}></Doser>
+              <Doser index={index} maxFlowRate={doser.maxFlowRate} telemetry={doser}></Doser>
               </div>
             ))}
             </div>